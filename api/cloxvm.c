@@ -0,0 +1,431 @@
+#include "cloxvm.h"
+#include "../compiler/compiler.h"
+#include "../memory/memory.h"
+#include "../object/object.h"
+#include "../output/dtoa.h"
+#include "../reload/reload.h"
+#include "../vm/vm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct CloxScript {
+    Chunk chunk;
+};
+
+struct CloxModule {
+    Program program;
+};
+
+static void *allocateVM(const CloxVMConfig *config);
+
+static int formatArray(const ObjArray *array, char *buffer, size_t size);
+
+static int appendText(char *buffer, size_t size, int offset, const char *text, int length);
+
+/**
+ * Fills a configuration with the defaults: the C allocator, errors printed to
+ * standard error, stack-format bytecode that is not optimized and a heap that
+ * may double between two garbage collections.
+ *
+ * @param config The configuration to initialize.
+ */
+void initCloxVMConfig(CloxVMConfig *config) {
+    config->reallocate = NULL;
+    config->allocatorData = NULL;
+    config->onError = NULL;
+    config->errorData = NULL;
+    config->registerFormat = false;
+    config->optimize = false;
+    config->heapGrowthFactor = GC_HEAP_GROW_FACTOR;
+}
+
+/**
+ * Creates a virtual machine.
+ *
+ * VMs are independent of each other and may be used from different threads,
+ * but a single VM must only be used by one thread at a time.
+ *
+ * The allocator, if given, receives every allocation the VM makes, including
+ * the VM itself. It follows the reallocate() contract: a new size of zero
+ * frees the pointer, and returning NULL for anything else ends the process.
+ *
+ * @param config The configuration, or NULL for the defaults.
+ * @return The new VM, or NULL if it could not be allocated.
+ */
+CloxVM *newCloxVM(const CloxVMConfig *config) {
+    CloxVMConfig defaults;
+    if (config == NULL) {
+        initCloxVMConfig(&defaults);
+        config = &defaults;
+    }
+
+    VM *machine = allocateVM(config);
+    if (machine == NULL) return NULL;
+
+    VM *previous = useVM(NULL);
+    initVM(machine, config);
+    useVM(previous);
+
+    return machine;
+}
+
+/**
+ * Frees a virtual machine. Scripts compiled by it must be freed first.
+ *
+ * @param machine The VM to free, or NULL.
+ */
+void freeCloxVM(CloxVM *machine) {
+    if (machine == NULL) return;
+
+    VM *previous = useVM(machine);
+    freeVM(machine);
+
+    const CloxReallocateFn allocator = machine->reallocate;
+    void *allocatorData = machine->allocatorData;
+    if (allocator != NULL) {
+        allocator(machine, sizeof(VM), 0, allocatorData);
+    } else {
+        free(machine);
+    }
+
+    useVM(previous == machine ? NULL : previous);
+}
+
+/**
+ * Compiles source code into a script that can be run any number of times.
+ *
+ * Compile errors are reported through the VM's error callback.
+ *
+ * @param machine The VM to compile for.
+ * @param source The source code to compile.
+ * @return The compiled script, or NULL if the source had errors.
+ */
+CloxScript *compileCloxScript(CloxVM *machine, const char *source) {
+    VM *previous = useVM(machine);
+
+    CloxScript *script = reallocate(NULL, 0, sizeof(CloxScript));
+    initChunk(&script->chunk);
+    script->chunk.format = vm->chunkFormat;
+
+    if (!compile(source, &script->chunk, vm->frontEnd)) {
+        freeChunk(&script->chunk);
+        reallocate(script, sizeof(CloxScript), 0);
+        script = NULL;
+    }
+
+    useVM(previous);
+    return script;
+}
+
+/**
+ * Runs a compiled script.
+ *
+ * Runtime errors are reported through the VM's error callback. A string
+ * result belongs to the VM's heap and stays valid until the VM compiles or
+ * runs the next script.
+ *
+ * @param machine The VM that compiled the script.
+ * @param script The script to run.
+ * @param result Receives the script's value if it ran successfully. May be NULL.
+ * @return INTERPRET_OK, INTERPRET_RUNTIME_ERROR, or INTERPRET_COMPILE_ERROR
+ *         if the body of a function called for the first time had errors.
+ */
+InterpretResult runCloxScript(CloxVM *machine, CloxScript *script, Value *result) {
+    VM *previous = useVM(machine);
+
+    const InterpretResult status = interpretChunk(&script->chunk);
+    if (status == INTERPRET_OK && result != NULL) *result = vm->result;
+
+    useVM(previous);
+    return status;
+}
+
+/**
+ * Frees a compiled script.
+ *
+ * @param machine The VM that compiled the script.
+ * @param script The script to free, or NULL.
+ */
+void freeCloxScript(CloxVM *machine, CloxScript *script) {
+    if (script == NULL) return;
+
+    VM *previous = useVM(machine);
+    freeChunk(&script->chunk);
+    reallocate(script, sizeof(CloxScript), 0);
+    useVM(previous);
+}
+
+/**
+ * Creates an empty module: a script that can be reloaded with new source
+ * while the VM keeps running it. It runs like an empty script until the
+ * first reloadCloxModule().
+ *
+ * @param machine The VM the module belongs to.
+ * @return The new module.
+ */
+CloxModule *newCloxModule(CloxVM *machine) {
+    VM *previous = useVM(machine);
+    CloxModule *module = reallocate(NULL, 0, sizeof(CloxModule));
+    initProgram(&module->program);
+    useVM(previous);
+    return module;
+}
+
+/**
+ * Replaces a module's source. Only the top-level declarations and
+ * statements that differ from the previous source are compiled again; the
+ * others keep their compiled code, including what their inline caches have
+ * learned and the function bodies compiled so far. Global variables are
+ * not touched until the module runs again.
+ *
+ * Compile errors are reported through the VM's error callback. The module
+ * is only changed if the whole new source compiled, so it can keep running
+ * the previous version after a bad edit.
+ *
+ * @param machine The VM the module belongs to.
+ * @param module The module to reload.
+ * @param source The new source code.
+ * @return false if the new source had errors.
+ */
+bool reloadCloxModule(CloxVM *machine, CloxModule *module, const char *source) {
+    VM *previous = useVM(machine);
+    const bool reloaded = reloadProgram(&module->program, source);
+    useVM(previous);
+    return reloaded;
+}
+
+/**
+ * Runs a module's current version from the top, like runCloxScript() runs
+ * a script.
+ *
+ * @param machine The VM the module belongs to.
+ * @param module The module to run.
+ * @param result Receives the module's value if it ran successfully. May be NULL.
+ * @return INTERPRET_OK, INTERPRET_RUNTIME_ERROR, or INTERPRET_COMPILE_ERROR
+ *         if the body of a function called for the first time had errors.
+ */
+InterpretResult runCloxModule(CloxVM *machine, CloxModule *module, Value *result) {
+    VM *previous = useVM(machine);
+
+    const InterpretResult status = runProgram(&module->program);
+    if (status == INTERPRET_OK && result != NULL) *result = vm->result;
+
+    useVM(previous);
+    return status;
+}
+
+/**
+ * Frees a module.
+ *
+ * @param machine The VM the module belongs to.
+ * @param module The module to free, or NULL.
+ */
+void freeCloxModule(CloxVM *machine, CloxModule *module) {
+    if (module == NULL) return;
+
+    VM *previous = useVM(machine);
+    freeProgram(&module->program);
+    reallocate(module, sizeof(CloxModule), 0);
+    useVM(previous);
+}
+
+/**
+ * Compiles and runs source code once.
+ *
+ * @param machine The VM to evaluate the source with.
+ * @param source The source code to evaluate.
+ * @param result Receives the value of the source if it ran successfully. May be NULL.
+ * @return The result of compiling and running the source.
+ */
+InterpretResult evaluateClox(CloxVM *machine, const char *source, Value *result) {
+    CloxScript *script = compileCloxScript(machine, source);
+    if (script == NULL) return INTERPRET_COMPILE_ERROR;
+
+    const InterpretResult status = runCloxScript(machine, script, result);
+    freeCloxScript(machine, script);
+    return status;
+}
+
+/**
+ * Undefines every global variable, so the next script starts from a clean
+ * slate; globals of a loaded image get the image's values back. Compiled
+ * scripts stay valid.
+ *
+ * @param machine The VM whose globals to reset.
+ */
+void resetCloxGlobals(CloxVM *machine) {
+    VM *previous = useVM(machine);
+    resetGlobals();
+    useVM(previous);
+}
+
+/**
+ * Writes the VM's global variables and the strings they refer to into a
+ * heap image, typically after running a prelude that sets them up.
+ *
+ * @param machine The VM to take the image of.
+ * @param path The path of the image file.
+ * @return false if the file could not be written.
+ */
+bool writeCloxSnapshot(CloxVM *machine, const char *path) {
+    VM *previous = useVM(machine);
+    const bool written = writeSnapshot(path);
+    useVM(previous);
+    return written;
+}
+
+/**
+ * Maps a heap image written by writeCloxSnapshot() into a new VM, which
+ * then starts out with the image's global variables as if it had run the
+ * prelude itself. The image is used in place rather than read, so this takes
+ * about as long for a large image as for a small one.
+ *
+ * This must be done before the VM compiles anything. The image stays mapped
+ * until the VM is freed; it does not go through the configured allocator.
+ *
+ * @param machine The VM to load the image into.
+ * @param path The path of the image file.
+ * @return false if the file is not an image of this build or the VM has
+ *         already compiled something.
+ */
+bool loadCloxSnapshot(CloxVM *machine, const char *path) {
+    VM *previous = useVM(machine);
+    const bool loaded = loadSnapshot(path);
+    useVM(previous);
+    return loaded;
+}
+
+/**
+ * Formats a value the way the command line interpreter prints it.
+ *
+ * Like snprintf(), the output is truncated to fit and always terminated if
+ * the buffer is not empty.
+ *
+ * @param value The value to format.
+ * @param buffer The buffer to write to.
+ * @param size The size of the buffer.
+ * @return The length of the full text, which may exceed size - 1.
+ */
+int formatCloxValue(const Value value, char *buffer, const size_t size) {
+    char digits[DTOA_BUFFER_SIZE];
+    const char *text = digits;
+    int length;
+
+    switch (value.type) {
+        case VAL_BOOL:
+            text = AS_BOOL(value) ? "true" : "false";
+            length = AS_BOOL(value) ? 4 : 5;
+            break;
+        case VAL_NIL:
+            text = "nil";
+            length = 3;
+            break;
+        case VAL_NUMBER:
+            length = formatDouble(AS_NUMBER(value), digits);
+            break;
+        case VAL_INT:
+            length = formatInt64(AS_INT(value), digits);
+            break;
+        case VAL_OBJ:
+            if (IS_BOUND_METHOD(value)) return formatCloxValue(AS_BOUND_METHOD(value)->method, buffer, size);
+            if (IS_FUNCTION(value) || IS_CLOSURE(value)) {
+                const ObjString *name = IS_CLOSURE(value) ? AS_CLOSURE(value)->function->name
+                                                          : AS_FUNCTION(value)->name;
+                return snprintf(buffer, size, "<fn %.*s>", name->length, name->chars);
+            }
+            if (IS_NATIVE(value)) {
+                const ObjString *name = AS_NATIVE(value)->name;
+                return snprintf(buffer, size, "<native %.*s>", name->length, name->chars);
+            }
+            if (IS_ARRAY(value)) return formatArray(AS_ARRAY(value), buffer, size);
+            if (IS_INSTANCE(value)) {
+                const ObjString *name = AS_INSTANCE(value)->klass->name;
+                return snprintf(buffer, size, "%.*s instance", name->length, name->chars);
+            }
+            const ObjString *string = IS_CLASS(value) ? AS_CLASS(value)->name : AS_STRING(value);
+            text = string->chars;
+            length = string->length;
+            break;
+        default:
+            length = 0;
+            break;
+    }
+
+    if (size > 0) {
+        const size_t copied = (size_t) length < size - 1 ? (size_t) length : size - 1;
+        memcpy(buffer, text, copied);
+        buffer[copied] = '\0';
+    }
+
+    return length;
+}
+
+/**
+ * Makes a C function callable from scripts as a global function. It is
+ * called with its arguments in place on the VM's stack and stores its
+ * result in args[-1], the slot that held the function; on error it calls
+ * cloxNativeError() and returns false. The function must not keep args
+ * beyond the call, as the stack may be reused.
+ *
+ * Registering a name again replaces the function, also for code that
+ * already refers to it, unless a script assigned the name something else.
+ *
+ * @param machine The VM to register the function with.
+ * @param name The global name. It is copied.
+ * @param arity The number of arguments, or -1 to accept any number.
+ * @param function The C function.
+ * @return true.
+ */
+bool defineCloxNative(CloxVM *machine, const char *name, const int arity, const CloxNativeFn function) {
+    VM *previous = useVM(machine);
+    defineNative(name, arity, function);
+    useVM(previous);
+    return true;
+}
+
+/**
+ * Reports a runtime error from a native function. The script is aborted
+ * once the native returns false.
+ *
+ * @param machine The VM that called the native.
+ * @param message The error message.
+ * @return false, for returning from the native.
+ */
+bool cloxNativeError(CloxVM *machine, const char *message) {
+    VM *previous = useVM(machine);
+    runtimeError("%s", message);
+    useVM(previous);
+    return false;
+}
+
+static void *allocateVM(const CloxVMConfig *config) {
+    if (config->reallocate != NULL) {
+        return config->reallocate(NULL, 0, sizeof(VM), config->allocatorData);
+    }
+    return malloc(sizeof(VM));
+}
+
+static int formatArray(const ObjArray *array, char *buffer, const size_t size) {
+    int length = appendText(buffer, size, 0, "[", 1);
+    for (int i = 0; i < array->count; i++) {
+        if (i > 0) length += appendText(buffer, size, length, ", ", 2);
+        char digits[DTOA_BUFFER_SIZE];
+        const int digitCount = formatDouble(array->values[i], digits);
+        length += appendText(buffer, size, length, digits, digitCount);
+    }
+    length += appendText(buffer, size, length, "]", 1);
+
+    if (size > 0) buffer[(size_t) length < size - 1 ? (size_t) length : size - 1] = '\0';
+    return length;
+}
+
+// Copies as much of text to buffer + offset as fits before the terminator.
+static int appendText(char *buffer, const size_t size, const int offset, const char *text, const int length) {
+    if ((size_t) offset + 1 < size) {
+        const size_t room = size - 1 - offset;
+        memcpy(buffer + offset, text, (size_t) length < room ? (size_t) length : room);
+    }
+    return length;
+}
@@ -0,0 +1,69 @@
+#ifndef CLOXVM_H
+#define CLOXVM_H
+
+#include <stddef.h>
+
+#include "../common.h"
+#include "../enums/interpretresult.h"
+#include "../value/value.h"
+
+typedef struct CloxVM CloxVM;
+
+typedef struct CloxScript CloxScript;
+
+typedef struct CloxModule CloxModule;
+
+typedef void *(*CloxReallocateFn)(void *pointer, size_t oldSize, size_t newSize, void *userData);
+
+typedef void (*CloxErrorFn)(InterpretResult kind, int line, const char *message, void *userData);
+
+typedef bool (*CloxNativeFn)(CloxVM *vm, int argCount, Value *args);
+
+typedef struct {
+    CloxReallocateFn reallocate;
+    void *allocatorData;
+    CloxErrorFn onError;
+    void *errorData;
+    // Experimental, like --register: only scripts that are arithmetic on
+    // literals compile to register bytecode, everything else to stack
+    // bytecode.
+    bool registerFormat;
+    bool optimize;
+    double heapGrowthFactor;
+} CloxVMConfig;
+
+CLOXVM_API void initCloxVMConfig(CloxVMConfig *config);
+
+CLOXVM_API CloxVM *newCloxVM(const CloxVMConfig *config);
+
+CLOXVM_API void freeCloxVM(CloxVM *vm);
+
+CLOXVM_API CloxScript *compileCloxScript(CloxVM *vm, const char *source);
+
+CLOXVM_API InterpretResult runCloxScript(CloxVM *vm, CloxScript *script, Value *result);
+
+CLOXVM_API void freeCloxScript(CloxVM *vm, CloxScript *script);
+
+CLOXVM_API CloxModule *newCloxModule(CloxVM *vm);
+
+CLOXVM_API bool reloadCloxModule(CloxVM *vm, CloxModule *module, const char *source);
+
+CLOXVM_API InterpretResult runCloxModule(CloxVM *vm, CloxModule *module, Value *result);
+
+CLOXVM_API void freeCloxModule(CloxVM *vm, CloxModule *module);
+
+CLOXVM_API InterpretResult evaluateClox(CloxVM *vm, const char *source, Value *result);
+
+CLOXVM_API void resetCloxGlobals(CloxVM *vm);
+
+CLOXVM_API bool writeCloxSnapshot(CloxVM *vm, const char *path);
+
+CLOXVM_API bool loadCloxSnapshot(CloxVM *vm, const char *path);
+
+CLOXVM_API int formatCloxValue(Value value, char *buffer, size_t size);
+
+CLOXVM_API bool defineCloxNative(CloxVM *vm, const char *name, int arity, CloxNativeFn function);
+
+CLOXVM_API bool cloxNativeError(CloxVM *vm, const char *message);
+
+#endif //CLOXVM_H
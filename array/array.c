@@ -0,0 +1,118 @@
+#include "array.h"
+#include "../mathlib/mathlib.h"
+#include "../native/native.h"
+#include "../object/object.h"
+#include "../vm/vm.h"
+
+#include <string.h>
+
+static bool elementwise(CloxVM *machine, Value *args, const char *message,
+                        void (*kernel)(const double *, const double *, double *, int));
+
+static bool arrayNative(CloxVM *machine, const int argCount, Value *args) {
+    (void) argCount;
+    if (!IS_INT(args[0]) || AS_INT(args[0]) < 0 || AS_INT(args[0]) > INT32_MAX) {
+        return cloxNativeError(machine, "array() expects a non-negative integer length.");
+    }
+    ObjArray *array = newArray((int) AS_INT(args[0]));
+    if (array->count > 0) memset(array->values, 0, sizeof(double) * array->count);
+    args[-1] = OBJ_VAL(array);
+    return true;
+}
+
+static bool lenNative(CloxVM *machine, const int argCount, Value *args) {
+    (void) argCount;
+    if (!IS_ARRAY(args[0])) return cloxNativeError(machine, "len() expects an array.");
+    args[-1] = INT_VAL(AS_ARRAY(args[0])->count);
+    return true;
+}
+
+static bool appendNative(CloxVM *machine, const int argCount, Value *args) {
+    (void) argCount;
+    if (!IS_ARRAY(args[0]) || !IS_NUMERIC(args[1])) return cloxNativeError(machine, "append() expects an array and a number.");
+    appendArray(AS_ARRAY(args[0]), AS_DOUBLE(args[1]));
+    args[-1] = args[0];
+    return true;
+}
+
+static bool sumNative(CloxVM *machine, const int argCount, Value *args) {
+    (void) argCount;
+    if (!IS_ARRAY(args[0])) return cloxNativeError(machine, "sum() expects an array.");
+    args[-1] = NUMBER_VAL(sumBatch(AS_ARRAY(args[0])->values, AS_ARRAY(args[0])->count));
+    return true;
+}
+
+static bool dotNative(CloxVM *machine, const int argCount, Value *args) {
+    (void) argCount;
+    if (!IS_ARRAY(args[0]) || !IS_ARRAY(args[1]) || AS_ARRAY(args[0])->count != AS_ARRAY(args[1])->count) {
+        return cloxNativeError(machine, "dot() expects two arrays of the same length.");
+    }
+    args[-1] = NUMBER_VAL(dotBatch(AS_ARRAY(args[0])->values, AS_ARRAY(args[1])->values, AS_ARRAY(args[0])->count));
+    return true;
+}
+
+static bool addNative(CloxVM *machine, const int argCount, Value *args) {
+    (void) argCount;
+    return elementwise(machine, args, "add() expects two arrays of the same length.", addBatch);
+}
+
+static bool mulNative(CloxVM *machine, const int argCount, Value *args) {
+    (void) argCount;
+    return elementwise(machine, args, "mul() expects two arrays of the same length.", mulBatch);
+}
+
+// Calls a native for every element. The native and the element are pushed
+// like for a call from a script, so the native finds the slot for its
+// result below its argument and everything stays reachable.
+static bool mapNative(CloxVM *machine, const int argCount, Value *args) {
+    (void) argCount;
+    if (!IS_ARRAY(args[0]) || !IS_NATIVE(args[1])) {
+        return cloxNativeError(machine, "map() expects an array and a native function.");
+    }
+    const ObjNative *native = AS_NATIVE(args[1]);
+    if (native->arity != 1 && native->arity != -1) {
+        return cloxNativeError(machine, "map() expects a function of one argument.");
+    }
+
+    const int count = AS_ARRAY(args[0])->count;
+    ObjArray *result = newArray(count);
+    args[-1] = OBJ_VAL(result);
+    for (int i = 0; i < count; i++) {
+        push(args[1]);
+        push(NUMBER_VAL(AS_ARRAY(args[0])->values[i]));
+        if (!native->function(machine, 1, vm->stackTop - 1)) return false;
+        pop();
+        const Value mapped = pop();
+        if (!IS_NUMERIC(mapped)) return cloxNativeError(machine, "map() expects the function to return numbers.");
+        result->values[i] = AS_DOUBLE(mapped);
+    }
+    return true;
+}
+
+/**
+ * Registers the array functions with the current VM: array, len, append,
+ * sum, dot, add, mul and map. The math library's sqrt, exp, log, abs,
+ * clamp, min and max accept arrays as well.
+ */
+void defineArrayNatives() {
+    defineNative("array", 1, arrayNative);
+    defineNative("len", 1, lenNative);
+    defineNative("append", 2, appendNative);
+    defineNative("sum", 1, sumNative);
+    defineNative("dot", 2, dotNative);
+    defineNative("add", 2, addNative);
+    defineNative("mul", 2, mulNative);
+    defineNative("map", 2, mapNative);
+}
+
+static bool elementwise(CloxVM *machine, Value *args, const char *message,
+                        void (*kernel)(const double *, const double *, double *, int)) {
+    if (!IS_ARRAY(args[0]) || !IS_ARRAY(args[1]) || AS_ARRAY(args[0])->count != AS_ARRAY(args[1])->count) {
+        return cloxNativeError(machine, message);
+    }
+    const int count = AS_ARRAY(args[0])->count;
+    ObjArray *result = newArray(count);
+    kernel(AS_ARRAY(args[0])->values, AS_ARRAY(args[1])->values, result->values, count);
+    args[-1] = OBJ_VAL(result);
+    return true;
+}
@@ -0,0 +1,8 @@
+#ifndef CLOXVM_ARRAY_H
+#define CLOXVM_ARRAY_H
+
+#include "../common.h"
+
+void defineArrayNatives();
+
+#endif //CLOXVM_ARRAY_H
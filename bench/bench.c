@@ -0,0 +1,182 @@
+#include "bench.h"
+#include "../compiler/compiler.h"
+#include "../profiler/profiler.h"
+#include "../vm/vm.h"
+
+#include <stdio.h>
+#include <time.h>
+
+static uint64_t nowNanos();
+
+static void discardOutput(const char *data, size_t length, void *userData);
+
+static void printJsonString(const char *string);
+
+/**
+ * Compiles and runs a script repeatedly and records how long each phase took.
+ *
+ * Every iteration compiles the source into a fresh chunk and runs it once.
+ * Whatever the script prints is discarded so that terminal output does not
+ * distort the measurement.
+ *
+ * When hardware events are requested, the performance counters run around
+ * each compile and each run separately. Runs are additionally sampled to
+ * break the events down by opcode category. If the counters cannot be
+ * opened, for example because the kernel forbids it, only timings are
+ * recorded.
+ *
+ * @param name A name identifying the benchmark in the report, usually the script path.
+ * @param source The source code to benchmark.
+ * @param iterations How often to compile and run the source.
+ * @param countEvents Whether to also count hardware events.
+ * @param result Receives the accumulated timings.
+ */
+void runBenchmark(const char *name, const char *source, const int iterations,
+                  const bool countEvents, BenchmarkResult *result) {
+    result->name = name;
+    result->iterations = 0;
+    result->result = INTERPRET_OK;
+    result->compileNanos = 0;
+    result->runNanos = 0;
+    result->minRunNanos = UINT64_MAX;
+    result->frontEnd = resolveFrontEnd(vm->frontEnd, source);
+    result->countersRequested = countEvents;
+    result->countersAvailable = countEvents && openPerfCounters(PERF_DEFAULT_SAMPLE_PERIOD);
+    initCounterValues(&result->compileCounters);
+    initCounterValues(&result->runCounters);
+
+    const bool counting = result->countersAvailable;
+
+    const OutputSink output = vm->output;
+    initCallbackSink(&vm->output, discardOutput, NULL);
+
+    for (int i = 0; i < iterations; i++) {
+        Chunk chunk;
+        initChunk(&chunk);
+        chunk.format = vm->chunkFormat;
+
+        if (counting) startPerfCounters();
+        const uint64_t compileStart = nowNanos();
+        const bool compiled = compile(source, &chunk, vm->frontEnd);
+        const uint64_t compileEnd = nowNanos();
+        if (counting) stopPerfCounters(&result->compileCounters);
+        result->compileNanos += compileEnd - compileStart;
+
+        if (!compiled) {
+            result->result = INTERPRET_COMPILE_ERROR;
+            freeChunk(&chunk);
+            break;
+        }
+
+        if (counting) startPerfCounters();
+        const uint64_t runStart = nowNanos();
+        const InterpretResult runResult = interpretChunk(&chunk);
+        const uint64_t runNanos = nowNanos() - runStart;
+        if (counting) stopPerfCounters(&result->runCounters);
+
+        result->runNanos += runNanos;
+        if (runNanos < result->minRunNanos) result->minRunNanos = runNanos;
+        result->iterations++;
+
+        resolveProfileSamples(name);
+        freeChunk(&chunk);
+
+        if (runResult != INTERPRET_OK) {
+            result->result = runResult;
+            break;
+        }
+    }
+
+    freeOutputSink(&vm->output);
+    vm->output = output;
+
+    if (counting) {
+        readCategoryCounts(&result->runCategories);
+        closePerfCounters();
+    }
+
+    if (result->iterations == 0) result->minRunNanos = 0;
+}
+
+/**
+ * Prints a benchmark result as a single line of JSON on standard output.
+ *
+ * Besides the timings, the report names the dispatch strategy the VM was
+ * built with, the bytecode format it ran and the front end that compiled it,
+ * so reports from differently configured builds can be compared side by
+ * side. If hardware events were
+ * requested, a "counters" object holds the totals for compiling and running
+ * and the per-category estimates of the runs, or null if the counters were
+ * unavailable.
+ *
+ * @param result The result to print.
+ */
+void printBenchmarkJson(const BenchmarkResult *result) {
+    static const char *resultNames[] = {
+        [INTERPRET_OK] = "ok",
+        [INTERPRET_COMPILE_ERROR] = "compile_error",
+        [INTERPRET_RUNTIME_ERROR] = "runtime_error",
+    };
+
+    const uint64_t iterations = result->iterations > 0 ? (uint64_t) result->iterations : 1;
+
+    printf("{\"benchmark\": ");
+    printJsonString(result->name);
+    printf(", \"dispatch\": \"%s\"", DISPATCH_STRATEGY);
+    printf(", \"format\": \"%s\"", vm->chunkFormat == CHUNK_REGISTER ? "register" : "stack");
+    printf(", \"optimized\": %s", vm->optimize ? "true" : "false");
+    printf(", \"front_end\": \"%s\"", frontEndName(result->frontEnd));
+    printf(", \"iterations\": %d", result->iterations);
+    printf(", \"result\": \"%s\"", resultNames[result->result]);
+    printf(", \"compile\": {\"total_ns\": %llu, \"mean_ns\": %llu}",
+           (unsigned long long) result->compileNanos,
+           (unsigned long long) (result->compileNanos / iterations));
+    printf(", \"run\": {\"total_ns\": %llu, \"mean_ns\": %llu, \"min_ns\": %llu}",
+           (unsigned long long) result->runNanos,
+           (unsigned long long) (result->runNanos / iterations),
+           (unsigned long long) result->minRunNanos);
+    if (result->countersRequested) {
+        printf(", \"counters\": ");
+        if (result->countersAvailable) {
+            printf("{\"compile\": ");
+            printCounterValuesJson(stdout, &result->compileCounters);
+            printf(", \"run\": ");
+            printCounterValuesJson(stdout, &result->runCounters);
+            printf(", \"run_by_category\": ");
+            printCategoryCountsJson(stdout, &result->runCategories);
+            printf("}");
+        } else {
+            printf("null");
+        }
+    }
+    printf("}\n");
+}
+
+static uint64_t nowNanos() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+static void discardOutput(const char *data, size_t length, void *userData) {
+    (void) data;
+    (void) length;
+    (void) userData;
+}
+
+static void printJsonString(const char *string) {
+    putchar('"');
+    for (const char *c = string; *c != '\0'; c++) {
+        switch (*c) {
+            case '"': printf("\\\""); break;
+            case '\\': printf("\\\\"); break;
+            case '\n': printf("\\n"); break;
+            case '\t': printf("\\t"); break;
+            default:
+                if ((unsigned char) *c < 0x20) printf("\\u%04x", *c);
+                else putchar(*c);
+                break;
+        }
+    }
+    putchar('"');
+}
@@ -0,0 +1,29 @@
+#ifndef CLOXVM_BENCH_H
+#define CLOXVM_BENCH_H
+
+#include "../common.h"
+#include "../compiler/compiler.h"
+#include "../enums/interpretresult.h"
+#include "../perf/perfcounters.h"
+
+typedef struct {
+    const char *name;
+    int iterations;
+    InterpretResult result;
+    uint64_t compileNanos;
+    uint64_t runNanos;
+    uint64_t minRunNanos;
+    FrontEnd frontEnd;
+    bool countersRequested;
+    bool countersAvailable;
+    CounterValues compileCounters;
+    CounterValues runCounters;
+    CategoryCounts runCategories;
+} BenchmarkResult;
+
+void runBenchmark(const char *name, const char *source, int iterations, bool countEvents,
+                  BenchmarkResult *result);
+
+void printBenchmarkJson(const BenchmarkResult *result);
+
+#endif //CLOXVM_BENCH_H
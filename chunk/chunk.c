@@ -4,8 +4,10 @@
 
 #include "../chunk/chunk.h"
 #include "../memory/memory.h"
+#include "../vm/vm.h"
 
 #include <stdint.h>
+#include <string.h>
 
 
 /**
@@ -13,16 +15,33 @@
  *
  * This function prepares a Chunk struct for use by setting its initial
  * count and capacity to zero and its code and lines pointers to NULL.
- * It also initializes the constants ValueArray of the Chunk.
+ * It also initializes the constants ValueArray of the Chunk. New chunks hold
+ * stack-format bytecode; callers that want the register format set the
+ * chunk's format before compiling into it.
  *
  * @param chunk A pointer to the Chunk struct to be initialized.
  */
 void initChunk(Chunk *chunk) {
+    chunk->format = CHUNK_STACK;
     chunk->count = 0;
     chunk->capacity = 0;
     chunk->code = NULL;
     chunk->lines = NULL;
+    chunk->lineStarts = NULL;
+    chunk->lineStartCount = 0;
     initValueArray(&chunk->constants);
+    chunk->caches = NULL;
+    chunk->cacheCount = 0;
+    chunk->cacheCapacity = 0;
+    chunk->registerCount = 0;
+    chunk->globalRefs = NULL;
+    chunk->globalRefCount = 0;
+    chunk->globalRefCapacity = 0;
+    chunk->block = NULL;
+    chunk->blockSize = 0;
+    chunk->isRoot = false;
+    chunk->previousRoot = NULL;
+    chunk->nextRoot = NULL;
 }
 
 
@@ -62,26 +81,170 @@ void writeChunk(Chunk *chunk, uint8_t byte, int line) {
  * Frees the memory allocated for the components of the given chunk.
  *
  * This function deallocates the memory associated with the code and lines arrays
- * of the chunk, as well as the values in the chunk's constants array. After
- * cleaning up, it reinitializes the chunk to its default state.
+ * of the chunk, as well as the values in the chunk's constants array, or the
+ * block holding all of them once the chunk is finalized. After cleaning up,
+ * it reinitializes the chunk to its default state. A chunk the garbage
+ * collector tracks stops being a root, and the global slots the chunk
+ * referred to may be reused.
  *
  * @param chunk A pointer to the Chunk struct whose memory will be freed.
  */
 void freeChunk(Chunk *chunk) {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
-    freeValueArray(&chunk->constants);
+    untrackChunk(chunk);
+    if (chunk->block != NULL) {
+        reallocate(chunk->block, chunk->blockSize, 0);
+    } else {
+        FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+        FREE_ARRAY(int, chunk->lines, chunk->capacity);
+        freeValueArray(&chunk->constants);
+    }
+    FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
+    for (int i = 0; i < chunk->globalRefCount; i++) {
+        vm->globalRefs[chunk->globalRefs[i]]--;
+    }
+    FREE_ARRAY(int, chunk->globalRefs, chunk->globalRefCapacity);
     initChunk(chunk);
 }
 
 /**
  * Adds a value to the constants array of the given chunk.
  *
+ * The value is kept on the VM stack while the array grows, so a collection
+ * triggered by growing it cannot free the object the value refers to. A
+ * function's chunk is not a root, and its function may already have been
+ * marked, so the value is grayed while the collector is marking.
+ *
  * @param chunk A pointer to the Chunk struct where the constant will be added.
  * @param value The Value to be added to the chunk's constants array.
  * @return The index of the added constant in the chunk's constants array.
  */
 int addConstant(Chunk *chunk, Value value) {
+    push(value);
     writeValueArray(&chunk->constants, value);
+    pop();
+    if (vm->gcPhase == GC_MARKING) markValue(value);
     return chunk->constants.count - 1;
 }
+
+/**
+ * Adds an empty inline cache for a property access to the given chunk.
+ *
+ * @param chunk A pointer to the Chunk struct the access is compiled into.
+ * @return The index of the new cache in the chunk's caches array.
+ */
+int addInlineCache(Chunk *chunk) {
+    if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+        const int oldCapacity = chunk->cacheCapacity;
+        chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, oldCapacity, chunk->cacheCapacity);
+    }
+
+    InlineCache *cache = &chunk->caches[chunk->cacheCount];
+    for (int i = 0; i < INLINE_CACHE_WAYS; i++) {
+        cache->entries[i].shape = NULL;
+    }
+    cache->count = 0;
+    return chunk->cacheCount++;
+}
+
+/**
+ * Records that the chunk contains an instruction for a global slot, so
+ * resetGlobals() keeps the slot for as long as the chunk exists.
+ *
+ * @param chunk A pointer to the Chunk struct the instruction is compiled into.
+ * @param slot The global slot.
+ */
+void addGlobalRef(Chunk *chunk, const int slot) {
+    if (chunk->globalRefCapacity < chunk->globalRefCount + 1) {
+        const int oldCapacity = chunk->globalRefCapacity;
+        chunk->globalRefCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->globalRefs = GROW_ARRAY(int, chunk->globalRefs, oldCapacity, chunk->globalRefCapacity);
+    }
+    chunk->globalRefs[chunk->globalRefCount++] = slot;
+    vm->globalRefs[slot]++;
+}
+
+/**
+ * Packs a compiled chunk into a single allocation that starts on a cache
+ * line: the constants, then the code right after them, then the line
+ * runs. Nothing in it is larger than needed, and the code and the
+ * constants it loads share cache lines and pages. The inline caches are
+ * shrunk to fit as well.
+ *
+ * The new block is allocated before the old arrays are copied and freed,
+ * so a collection it triggers still finds the constants where the chunk
+ * had them.
+ *
+ * @param chunk A pointer to the compiled Chunk struct. A chunk that is
+ *              already finalized is left as it is.
+ */
+void finalizeChunk(Chunk *chunk) {
+    if (chunk->block != NULL || chunk->code == NULL) return;
+
+    int runs = 0;
+    for (int i = 0; i < chunk->count; i++) {
+        if (i == 0 || chunk->lines[i] != chunk->lines[i - 1]) runs++;
+    }
+
+    const size_t constantBytes = sizeof(Value) * chunk->constants.count;
+    const size_t lineStartsAt = (constantBytes + chunk->count + _Alignof(LineStart) - 1) &
+                                ~(size_t) (_Alignof(LineStart) - 1);
+    const size_t blockSize = lineStartsAt + sizeof(LineStart) * runs + CHUNK_ALIGNMENT - 1;
+    char *block = reallocate(NULL, 0, blockSize);
+    char *start = (char *) (((uintptr_t) block + CHUNK_ALIGNMENT - 1) & ~(uintptr_t) (CHUNK_ALIGNMENT - 1));
+
+    Value *constants = (Value *) start;
+    uint8_t *code = (uint8_t *) start + constantBytes;
+    LineStart *lineStarts = (LineStart *) (start + lineStartsAt);
+    if (constantBytes > 0) memcpy(constants, chunk->constants.values, constantBytes);
+    memcpy(code, chunk->code, chunk->count);
+    int run = 0;
+    for (int i = 0; i < chunk->count; i++) {
+        if (i == 0 || chunk->lines[i] != chunk->lines[i - 1]) {
+            lineStarts[run++] = (LineStart){.offset = i, .line = chunk->lines[i]};
+        }
+    }
+
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    const int constantCount = chunk->constants.count;
+    freeValueArray(&chunk->constants);
+
+    chunk->code = code;
+    chunk->capacity = chunk->count;
+    chunk->lines = NULL;
+    chunk->lineStarts = lineStarts;
+    chunk->lineStartCount = runs;
+    chunk->constants.values = constants;
+    chunk->constants.count = constantCount;
+    chunk->constants.capacity = constantCount;
+    chunk->block = block;
+    chunk->blockSize = blockSize;
+
+    chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity, chunk->cacheCount);
+    chunk->cacheCapacity = chunk->cacheCount;
+}
+
+/**
+ * Finds the source line an instruction was compiled from.
+ *
+ * @param chunk A pointer to the Chunk struct, finalized or not.
+ * @param offset The offset of the instruction in the chunk's code.
+ * @return The line number.
+ */
+int getLine(const Chunk *chunk, const int offset) {
+    if (chunk->lines != NULL) return chunk->lines[offset];
+
+    int low = 0;
+    int high = chunk->lineStartCount - 1;
+    while (low < high) {
+        const int middle = low + (high - low + 1) / 2;
+        if (chunk->lineStarts[middle].offset <= offset) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return chunk->lineStarts[low].line;
+}
+
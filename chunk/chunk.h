@@ -8,13 +8,96 @@
 #include "../common.h"
 #include "../value/value.h"
 
+// Register-format operands: a byte with RK_CONSTANT set names the constant at
+// the index in its low bits, any other byte names a register.
+#define RK_CONSTANT 0x80
+#define REGISTER_MAX 128
 
+// Shapes an inline cache tells apart before it gives up on its call site.
+#define INLINE_CACHE_WAYS 4
+
+// Finalized chunks start on a cache line.
+#define CHUNK_ALIGNMENT 64
+
+/**
+ * What an inline cache knows about instances of one shape: the property is
+ * their field number field, or, if field is -1, method of their class. A
+ * property store that adds the field also remembers next, the shape the
+ * instance moves to; it is NULL for a store into an existing field.
+ */
+typedef struct {
+    const Shape *shape;
+    int field;
+    Value method;
+    Shape *next;
+} CacheEntry;
+
+/**
+ * The inline cache of one property access in a chunk. It starts out empty,
+ * is monomorphic once it has an entry and polymorphic with up to
+ * INLINE_CACHE_WAYS of them. A call site that sees more shapes than that is
+ * megamorphic: count becomes -1 and misses look the property up without
+ * being cached any more.
+ *
+ * Methods in entries are not roots. An entry can only be hit by an
+ * instance of its shape, which keeps its class and the methods alive.
+ */
 typedef struct {
+    CacheEntry entries[INLINE_CACHE_WAYS];
+    int count;
+} InlineCache;
+
+/**
+ * The first instruction of a run of instructions compiled from the same
+ * source line. A finalized chunk keeps one of these per run instead of a
+ * line number per byte.
+ */
+typedef struct {
+    int offset;
+    int line;
+} LineStart;
+
+typedef enum {
+    CHUNK_STACK,
+    CHUNK_REGISTER
+} ChunkFormat;
+
+/**
+ * A compiled script. registerCount is the number of registers a
+ * register-format chunk uses. caches holds the inline caches of the
+ * chunk's property accesses, which name them by index. While a chunk is tracked by the garbage
+ * collector (isRoot), its constants are roots and it sits in the VM's list
+ * of chunks through previousRoot and nextRoot.
+ *
+ * While a chunk is compiled, code, lines and constants grow separately.
+ * finalizeChunk() then moves them into block, a single allocation of
+ * blockSize bytes, and replaces lines by lineStarts. A finalized chunk
+ * cannot grow any more.
+ *
+ * globalRefs lists the global slot of every global instruction in the
+ * chunk. The VM does not reuse a slot while a chunk refers to it.
+ */
+typedef struct Chunk {
+    ChunkFormat format;
     int count;
     int capacity;
     uint8_t *code;
     int *lines;
+    LineStart *lineStarts;
+    int lineStartCount;
     ValueArray constants;
+    InlineCache *caches;
+    int cacheCount;
+    int cacheCapacity;
+    int registerCount;
+    int *globalRefs;
+    int globalRefCount;
+    int globalRefCapacity;
+    void *block;
+    size_t blockSize;
+    bool isRoot;
+    struct Chunk *previousRoot;
+    struct Chunk *nextRoot;
 } Chunk;
 
 void initChunk(Chunk *chunk);
@@ -25,4 +108,12 @@ void freeChunk(Chunk *chunk);
 
 int addConstant(Chunk *chunk, Value value);
 
+int addInlineCache(Chunk *chunk);
+
+void addGlobalRef(Chunk *chunk, int slot);
+
+void finalizeChunk(Chunk *chunk);
+
+int getLine(const Chunk *chunk, int offset);
+
 #endif //CLOXVM_CHUNK_H
@@ -9,7 +9,19 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#define DEBUG_PRINT_CODE
-#define DEBUG_TRACE_EXECUTION
+// DEBUG_PRINT_CODE, DEBUG_TRACE_EXECUTION and DEBUG_STRESS_GC are defined by
+// the CLOXVM_DEBUG_PRINT_CODE, CLOXVM_DEBUG_TRACE_EXECUTION and
+// CLOXVM_DEBUG_STRESS_GC CMake options.
+
+// Marks the functions the shared library exports; everything else is built
+// with hidden visibility.
+#if defined(__GNUC__)
+#define CLOXVM_API __attribute__((visibility("default")))
+#else
+#define CLOXVM_API
+#endif
+
+#define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
 
 #endif //CLOXVM_COMMON_H
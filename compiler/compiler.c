@@ -3,8 +3,16 @@
 #include "../compiler/compiler.h"
 
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
+#include "../memory/memory.h"
+#include "../object/object.h"
+#include "../optimizer/optimizer.h"
+#include "../vm/vm.h"
 #include "../scanner/scanner.h"
+#include "../scanner/tokenbuffer.h"
+#include "../scanner/tokenpipeline.h"
 #include "../enums/opcodes.h"
 
 #ifdef DEBUG_PRINT_CODE
@@ -16,6 +24,8 @@ typedef struct {
     Token current;
     bool hadError;
     bool panicMode;
+    bool hasResult;
+    int controlDepth;
 } Parser;
 
 typedef enum {
@@ -32,7 +42,7 @@ typedef enum {
     PRECEDENCE_PRIMARY,
 } Precedence;
 
-typedef void (*ParseFn)();
+typedef void (*ParseFn)(bool canAssign);
 
 typedef struct {
     ParseFn prefix;
@@ -40,126 +50,1583 @@ typedef struct {
     Precedence precedence;
 } ParseRule;
 
-static void grouping();
+static void grouping(bool canAssign);
 
-static void unary();
+static void unary(bool canAssign);
 
-static void binary();
+static void binary(bool canAssign);
 
-static void number();
+static void number(bool canAssign);
+
+static void literal(bool canAssign);
+
+static void string(bool canAssign);
+
+static void variable(bool canAssign);
+
+static void call(bool canAssign);
+
+static void dot(bool canAssign);
+
+static void array(bool canAssign);
+
+static void subscript(bool canAssign);
+
+static void this_(bool canAssign);
+
+static void and_(bool canAssign);
+
+static void or_(bool canAssign);
 
 ParseRule rules[] = {
-    [TOKEN_LEFT_PAREN]      = {grouping, NULL, PRECEDENCE_NONE},
+    [TOKEN_LEFT_PAREN]      = {grouping, call, PRECEDENCE_CALL},
     [TOKEN_RIGHT_PAREN]     = {NULL,NULL, PRECEDENCE_NONE},
     [TOKEN_LEFT_BRACE]      = {NULL,NULL, PRECEDENCE_NONE},
     [TOKEN_RIGHT_BRACE]     = {NULL,NULL, PRECEDENCE_NONE},
+    [TOKEN_LEFT_BRACKET]    = {array, subscript, PRECEDENCE_CALL},
+    [TOKEN_RIGHT_BRACKET]   = {NULL,NULL, PRECEDENCE_NONE},
+    [TOKEN_COLON]           = {NULL,NULL, PRECEDENCE_NONE},
     [TOKEN_COMMA]           = {NULL,NULL, PRECEDENCE_NONE},
-    [TOKEN_DOT]             = {NULL,NULL, PRECEDENCE_NONE},
+    [TOKEN_DOT]             = {NULL, dot, PRECEDENCE_CALL},
     [TOKEN_MINUS]           = {unary, binary, PRECEDENCE_TERM},
     [TOKEN_PLUS]            = {NULL, binary, PRECEDENCE_TERM},
     [TOKEN_SEMICOLON]       = {NULL,NULL},
     [TOKEN_SLASH]           = {NULL, binary, PRECEDENCE_FACTOR},
     [TOKEN_STAR]            = {NULL, binary, PRECEDENCE_FACTOR},
-    [TOKEN_BANG]            = {NULL,NULL, PRECEDENCE_NONE},
-    [TOKEN_BANG_EQUAL]      = {NULL,NULL, PRECEDENCE_NONE},
+    [TOKEN_BANG]            = {unary,NULL, PRECEDENCE_NONE},
+    [TOKEN_BANG_EQUAL]      = {NULL, binary, PRECEDENCE_EQUALITY},
     [TOKEN_EQUAL]           = {NULL,NULL, PRECEDENCE_NONE},
-    [TOKEN_EQUAL_EQUAL]     = {NULL,NULL, PRECEDENCE_NONE},
-    [TOKEN_GREATER]         = {NULL,NULL, PRECEDENCE_NONE},
-    [TOKEN_GREATER_EQUAL]   = {NULL,NULL, PRECEDENCE_NONE},
-    [TOKEN_LESS]            = {NULL,NULL, PRECEDENCE_NONE},
-    [TOKEN_LESS_EQUAL]      = {NULL,NULL, PRECEDENCE_NONE},
-    [TOKEN_IDENTIFIER]      = {NULL,NULL, PRECEDENCE_NONE},
-    [TOKEN_STRING]          = {NULL,NULL, PRECEDENCE_NONE},
+    [TOKEN_EQUAL_EQUAL]     = {NULL, binary, PRECEDENCE_EQUALITY},
+    [TOKEN_GREATER]         = {NULL, binary, PRECEDENCE_COMPARISON},
+    [TOKEN_GREATER_EQUAL]   = {NULL, binary, PRECEDENCE_COMPARISON},
+    [TOKEN_LESS]            = {NULL, binary, PRECEDENCE_COMPARISON},
+    [TOKEN_LESS_EQUAL]      = {NULL, binary, PRECEDENCE_COMPARISON},
+    [TOKEN_IDENTIFIER]      = {variable,NULL, PRECEDENCE_NONE},
+    [TOKEN_STRING]          = {string,NULL, PRECEDENCE_NONE},
     [TOKEN_NUMBER]          = {number,NULL, PRECEDENCE_NONE},
-    [TOKEN_AND]             = {NULL,NULL, PRECEDENCE_NONE},
+    [TOKEN_AND]             = {NULL, and_, PRECEDENCE_AND},
+    [TOKEN_CASE]            = {NULL,NULL, PRECEDENCE_NONE},
     [TOKEN_CLASS]           = {NULL,NULL, PRECEDENCE_NONE},
+    [TOKEN_DEFAULT]         = {NULL,NULL, PRECEDENCE_NONE},
     [TOKEN_ELSE]            = {NULL,NULL, PRECEDENCE_NONE},
-    [TOKEN_FALSE]           = {NULL,NULL, PRECEDENCE_NONE},
+    [TOKEN_FALSE]           = {literal,NULL, PRECEDENCE_NONE},
     [TOKEN_FOR]             = {NULL,NULL, PRECEDENCE_NONE},
     [TOKEN_FUN]             = {NULL,NULL, PRECEDENCE_NONE},
     [TOKEN_IF]              = {NULL,NULL, PRECEDENCE_NONE},
-    [TOKEN_NIL]             = {NULL,NULL, PRECEDENCE_NONE},
-    [TOKEN_OR]              = {NULL,NULL, PRECEDENCE_NONE},
+    [TOKEN_NIL]             = {literal,NULL, PRECEDENCE_NONE},
+    [TOKEN_OR]              = {NULL, or_, PRECEDENCE_OR},
     [TOKEN_PRINT]           = {NULL,NULL, PRECEDENCE_NONE},
     [TOKEN_RETURN]          = {NULL,NULL, PRECEDENCE_NONE},
     [TOKEN_SUPER]           = {NULL,NULL, PRECEDENCE_NONE},
-    [TOKEN_THIS]            = {NULL,NULL, PRECEDENCE_NONE},
-    [TOKEN_TRUE]            = {NULL,NULL, PRECEDENCE_NONE},
+    [TOKEN_SWITCH]          = {NULL,NULL, PRECEDENCE_NONE},
+    [TOKEN_THIS]            = {this_,NULL, PRECEDENCE_NONE},
+    [TOKEN_TRUE]            = {literal,NULL, PRECEDENCE_NONE},
     [TOKEN_VAR]             = {NULL,NULL, PRECEDENCE_NONE},
     [TOKEN_WHILE]           = {NULL,NULL, PRECEDENCE_NONE},
     [TOKEN_ERROR]           = {NULL,NULL, PRECEDENCE_NONE},
     [TOKEN_EOF]             = {NULL,NULL, PRECEDENCE_NONE},
 };
 
-Parser parser;
-Chunk *compilingChunk;
+/**
+ * Operand bookkeeping for register-format chunks.
+ *
+ * Every expression leaves an RK operand on the operand stack instead of a
+ * value on the VM stack. Temporaries are allocated from the lowest free
+ * register and freed in reverse order, so an expression needs as many
+ * registers as its deepest chain of pending operands.
+ */
+typedef struct {
+    uint8_t operands[REGISTER_MAX];
+    int operandCount;
+    int nextRegister;
+    bool unsupported;
+} RegisterState;
+
+/**
+ * Where the parser takes its tokens from: straight from the scanner, from a
+ * buffer filled before parsing, or from a scanner running on another thread.
+ */
+typedef struct {
+    FrontEnd frontEnd;
+    const TokenBuffer *buffer;
+    int nextIndex;
+    TokenPipeline *pipeline;
+    bool reachedEnd;
+    Token end;
+} TokenSource;
+
+/**
+ * A local variable. Its index in Scope.locals is the stack slot it lives
+ * in; depth is the block nesting it was declared at, or -1 while its
+ * initializer is being compiled.
+ *
+ * The rest is escape analysis. closure is the offset of the OP_CLOSURE that
+ * initializes a local function with captures, or -1. escapes is set once
+ * the local is used for anything but a direct call from its own frame or
+ * is captured itself; a closure that never escapes is turned into a plain
+ * function with stack captures when the local goes out of scope. captured
+ * is set if a closure that does escape captures the local, which then has
+ * to be closed instead of popped.
+ */
+typedef struct {
+    Token name;
+    int depth;
+    int closure;
+    bool escapes;
+    bool captured;
+} Local;
+
+/**
+ * The locals in scope at the current point of the script. Locals are
+ * resolved to stack slots while compiling, so the VM never looks them up by
+ * name.
+ */
+typedef struct {
+    Local locals[UINT8_COUNT];
+    int localCount;
+    int scopeDepth;
+} Scope;
+
+/**
+ * What the compiler knows about the end of the code when a condition is
+ * compiled. comparisonStart and comparisonEnd delimit the instructions of
+ * the last comparison binary() emitted, and fusedJump is the
+ * compare-and-branch instruction that jumps when that comparison is false.
+ * jumpTarget is the offset the last forward jump was patched to land on:
+ * a comparison that jump lands after must stay as it is.
+ */
+typedef struct {
+    int comparisonStart;
+    int comparisonEnd;
+    OpCode fusedJump;
+    int jumpTarget;
+} BranchState;
+
+// Compiler state is per thread so that VMs on different threads can compile
+// at the same time.
+_Thread_local Parser parser;
+_Thread_local Chunk *compilingChunk;
+_Thread_local RegisterState registers;
+_Thread_local TokenSource tokens;
+_Thread_local Scope scope;
+_Thread_local ObjFunction *compilingFunction;
+_Thread_local BranchState branches;
+
+
+static Chunk *currentChunk();
+
+static uint8_t makeConstant(Value value);
+
+static uint8_t identifierConstant(const Token *name);
+
+static void emitCache();
+
+static void emitConstant(Value value);
+
+static void emitByte(uint8_t byte);
+
+static void emitBytes(uint8_t byte1, uint8_t byte2);
+
+static void emitGlobal(OpCode op, int slot);
+
+static void emitReturn();
+
+static int emitJump(OpCode opCode);
+
+static void patchJump(int offset);
+
+static void emitLoop(int loopStart);
+
+static int emitConditionJump(bool *fused);
+
+static void emitComparison(OpCode opCode, bool negate, OpCode fusedJump);
+
+static void resetBranches();
+
+static bool registerMode();
+
+static void pushOperand(int operand);
+
+static uint8_t popOperand();
+
+static void freeOperand(uint8_t operand);
+
+static uint8_t allocateRegister();
+
+static void emitRegisterUnary(OpCode opCode);
+
+static void emitRegisterBinary(OpCode opCode);
+
+static void registerUnsupported();
+
+static bool compileScript(const char *source, int line, Chunk *chunk);
+
+static bool compileChunk(const char *source, int line, Chunk *chunk);
+
+static void openTokenSource(const char *source, int line);
+
+static void closeTokenSource();
+
+static Token nextToken();
+
+static void endCompiler();
+
+static void declaration();
+
+static void varDeclaration();
+
+static void funDeclaration();
+
+static void classDeclaration();
+
+static void method();
+
+static void skimFunction(const Token *name, int local, bool isMethod);
+
+static int skimCapture(Token *names, Capture *captures, int count);
+
+static void finishLocal(Local *local);
+
+static void emitPops(int count);
+
+static void returnStatement();
+
+static bool compilingInitializer();
+
+static uint8_t argumentList();
+
+static void statement();
+
+static void ifStatement();
+
+static void whileStatement();
+
+static void forStatement();
+
+static void switchStatement();
+
+static bool caseLabel(uint8_t *constant);
+
+static void emitSwitchDispatch(int slot, const uint8_t *labels, const int *bodies, int caseCount, int defaultBody);
+
+static void branchStatement();
+
+static void block();
+
+static void beginScope();
+
+static void endScope();
+
+static void declareLocal(const Token *name);
+
+static int resolveLocal(const Token *name);
+
+static int resolveCapture(const Token *name);
+
+static bool identifiersEqual(const Token *a, const Token *b);
+
+static void expressionStatement();
+
+static void expression();
+
+static int globalSlot(const Token *name);
+
+static Value numberValue(const Token *token);
+
+static void synchronize();
+
+static ParseRule* getRule(TokenType operationType);
+
+static void parsePrecedence(Precedence precedence);
+
+static void advance();
+
+static void consume(TokenType tokenType, const char *message);
+
+static bool check(TokenType tokenType);
+
+static bool match(TokenType tokenType);
+
+static void errorAtCurrent(const char *message);
+
+static void errorAtPrevious(const char *message);
+
+static void errorAt(const Token *token, const char *message);
+
+/**
+ * Compiles the given source code string into the provided chunk.
+ *
+ * The chunk's format selects the bytecode that is generated. If a
+ * register-format chunk turns out to need something the register encoding
+ * cannot express, it is recompiled in the stack format instead.
+ *
+ * The front end decides how scanning and parsing interleave. A pre-tokenized
+ * source is scanned only once even if it has to be compiled twice. If the VM
+ * has the optimizing tier enabled, a stack-format chunk is optimized before
+ * it is returned. A chunk that compiled is returned finalized.
+ *
+ * The nursery is emptied before compiling. Literals are interned through
+ * copyString(), which hands back a young string the running script built
+ * if one has the same text, and constants are no roots of minor
+ * collections, so a constant must never refer to a young string.
+ *
+ * @param source The source code to compile.
+ * @param chunk The chunk where the compiled bytecode will be stored.
+ * @param frontEnd How to feed tokens to the parser.
+ * @return true if compilation was successful, false if there were errors.
+ */
+bool compile(const char *source, Chunk *chunk, const FrontEnd frontEnd) {
+    TokenBuffer buffer;
+    initTokenBuffer(&buffer);
+
+    tokens.frontEnd = resolveFrontEnd(frontEnd, source);
+    tokens.buffer = &buffer;
+    if (tokens.frontEnd == FRONT_END_PRETOKENIZED) tokenizeSource(&buffer, source);
+
+    const bool success = compileScript(source, 1, chunk);
+
+    freeTokenBuffer(&buffer);
+    tokens.buffer = NULL;
+    return success;
+}
+
+/**
+ * Compiles a section of a larger script, such as one of its top-level
+ * declarations, like compile() compiles a whole one. Tokens are scanned as
+ * the parser needs them.
+ *
+ * @param source The section's source code.
+ * @param line The line the section starts on in the script, for errors and
+ *             line information.
+ * @param chunk The chunk where the compiled bytecode will be stored.
+ * @return true if compilation was successful, false if there were errors.
+ */
+bool compileSection(const char *source, const int line, Chunk *chunk) {
+    tokens.frontEnd = FRONT_END_STREAMING;
+    tokens.buffer = NULL;
+    return compileScript(source, line, chunk);
+}
+
+/**
+ * Picks the front end for a source. Automatic selection overlaps scanning
+ * with parsing on another thread once the source is large enough to pay for
+ * starting it and a second processor is online to run it. Otherwise the
+ * parser pulls tokens straight from the scanner: both loops are small enough
+ * to share the instruction cache, so buffering tokens first only adds
+ * memory traffic.
+ *
+ * @param frontEnd The requested front end.
+ * @param source The source code to compile.
+ * @return The front end compile() uses for the source.
+ */
+FrontEnd resolveFrontEnd(const FrontEnd frontEnd, const char *source) {
+    if (frontEnd != FRONT_END_AUTO) return frontEnd;
+    if (strlen(source) >= PIPELINE_MIN_SOURCE && sysconf(_SC_NPROCESSORS_ONLN) > 1) {
+        return FRONT_END_PIPELINED;
+    }
+    return FRONT_END_STREAMING;
+}
+
+const char *frontEndName(const FrontEnd frontEnd) {
+    switch (frontEnd) {
+        case FRONT_END_AUTO: return "auto";
+        case FRONT_END_STREAMING: return "streaming";
+        case FRONT_END_PRETOKENIZED: return "pretokenized";
+        case FRONT_END_PIPELINED: return "pipelined";
+    }
+    return "unknown";
+}
+
+static bool compileScript(const char *source, const int line, Chunk *chunk) {
+    bool success = compileChunk(source, line, chunk);
+    if (success && registers.unsupported) {
+        freeChunk(chunk);
+        success = compileChunk(source, line, chunk);
+    }
+    if (success && vm->optimize) optimizeChunk(chunk, 0);
+    if (success) finalizeChunk(chunk);
+    return success;
+}
+
+static bool compileChunk(const char *source, const int line, Chunk *chunk) {
+    collectNursery();
+    openTokenSource(source, line);
+    compilingChunk = chunk;
+    trackChunk(chunk);
+
+    parser.panicMode = false;
+    parser.hadError = false;
+
+    registers.operandCount = 0;
+    registers.nextRegister = 0;
+    registers.unsupported = false;
+
+    parser.hasResult = false;
+    parser.controlDepth = 0;
+    resetBranches();
+
+    scope.localCount = 0;
+    scope.scopeDepth = 0;
+    compilingFunction = NULL;
+
+    advance();
+    while (!match(TOKEN_EOF)) {
+        declaration();
+    }
+
+    endCompiler();
+    closeTokenSource();
+    return !parser.hadError;
+}
+
+/**
+ * Compiles the body of a function that compile() only skimmed. The VM calls
+ * this when the function is called for the first time.
+ *
+ * The function's text is scanned again from its parameter list, starting at
+ * the line it had in the script, so errors point at the right lines. Slot 0
+ * of the function's frame holds the function itself and its parameters
+ * follow. Function bodies are always compiled to the stack format,
+ * optimized if the VM has the optimizing tier enabled, and finalized.
+ *
+ * Like compile(), this empties the nursery first, so it may only be called
+ * where every young object is in a root.
+ *
+ * @param function The function to compile. It must be reachable from the
+ *                 VM stack.
+ * @return true if the body compiled. On errors the function's chunk is left
+ *         empty, so the next call tries again and reports them again.
+ */
+bool compileFunction(ObjFunction *function) {
+    collectNursery();
+    tokens.frontEnd = FRONT_END_STREAMING;
+    tokens.buffer = NULL;
+    tokens.pipeline = NULL;
+    initScannerAt(function->source, function->line);
+    compilingChunk = &function->chunk;
+    compilingFunction = function;
+
+    parser.panicMode = false;
+    parser.hadError = false;
+    parser.hasResult = false;
+    parser.controlDepth = 0;
+    resetBranches();
+    registers.unsupported = false;
+
+    // Slot 0 holds the function itself, which has no name in the body, or
+    // a method's receiver.
+    Local *callee = &scope.locals[0];
+    callee->name.start = function->isMethod ? "this" : "";
+    callee->name.length = function->isMethod ? 4 : 0;
+    callee->depth = 0;
+    callee->closure = -1;
+    callee->escapes = true;
+    callee->captured = false;
+    scope.localCount = 1;
+    scope.scopeDepth = 1;
+
+    advance();
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after function name");
+    if (!check(TOKEN_RIGHT_PAREN)) {
+        do {
+            consume(TOKEN_IDENTIFIER, "Expect parameter name");
+            declareLocal(&parser.previous);
+            scope.locals[scope.localCount - 1].depth = scope.scopeDepth;
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters");
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before function body");
+    block();
+
+    // The return drops the body's outermost locals without an endScope().
+    for (int i = scope.localCount - 1; i > 0; i--) {
+        finishLocal(&scope.locals[i]);
+    }
+    endCompiler();
+
+    compilingFunction = NULL;
+    if (parser.hadError) {
+        freeChunk(&function->chunk);
+        return false;
+    }
+    if (vm->optimize) optimizeChunk(&function->chunk, function->arity + 1);
+    finalizeChunk(&function->chunk);
+    return true;
+}
+
+// Only the streaming front end can start at a line other than 1.
+static void openTokenSource(const char *source, const int line) {
+    tokens.nextIndex = 0;
+    tokens.reachedEnd = false;
+
+    if (tokens.frontEnd == FRONT_END_PIPELINED) {
+        tokens.pipeline = reallocate(NULL, 0, sizeof(TokenPipeline));
+        if (startTokenPipeline(tokens.pipeline, source)) return;
+
+        reallocate(tokens.pipeline, sizeof(TokenPipeline), 0);
+        tokens.pipeline = NULL;
+        tokens.frontEnd = FRONT_END_STREAMING;
+    }
+
+    if (tokens.frontEnd == FRONT_END_STREAMING) initScannerAt(source, line);
+}
+
+static void closeTokenSource() {
+    if (tokens.pipeline == NULL) return;
+
+    stopTokenPipeline(tokens.pipeline);
+    reallocate(tokens.pipeline, sizeof(TokenPipeline), 0);
+    tokens.pipeline = NULL;
+}
+
+static Token nextToken() {
+    switch (tokens.frontEnd) {
+        case FRONT_END_PRETOKENIZED: {
+            const Token token = tokenAt(tokens.buffer, tokens.nextIndex);
+            if (tokens.nextIndex < tokens.buffer->count - 1) tokens.nextIndex++;
+            return token;
+        }
+        case FRONT_END_PIPELINED:
+            if (tokens.reachedEnd) return tokens.end;
+            tokens.end = nextPipelineToken(tokens.pipeline);
+            tokens.reachedEnd = tokens.end.type == TOKEN_EOF;
+            return tokens.end;
+        default:
+            return scanToken();
+    }
+}
+
+static void declaration() {
+    if (match(TOKEN_CLASS)) {
+        classDeclaration();
+    } else if (match(TOKEN_FUN)) {
+        funDeclaration();
+    } else if (match(TOKEN_VAR)) {
+        varDeclaration();
+    } else {
+        statement();
+    }
+
+    if (parser.panicMode) synchronize();
+}
+
+/**
+ * Compiles a variable declaration. Inside a block the variable is a local
+ * whose value simply stays in the stack slot the initializer left it in;
+ * at the top level it is a global.
+ */
+static void varDeclaration() {
+    consume(TOKEN_IDENTIFIER, "Expect variable name");
+    const Token name = parser.previous;
+
+    int slot = 0;
+    if (scope.scopeDepth > 0) {
+        declareLocal(&name);
+    } else {
+        slot = globalSlot(&name);
+    }
+
+    if (match(TOKEN_EQUAL)) {
+        expression();
+    } else {
+        emitByte(OP_NIL);
+    }
+    consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration");
+
+    if (scope.scopeDepth > 0) {
+        scope.locals[scope.localCount - 1].depth = scope.scopeDepth;
+        return;
+    }
+    emitGlobal(OP_DEFINE_GLOBAL, slot);
+}
+
+/**
+ * Compiles a function declaration. Like a variable, the function is a local
+ * inside a block and a global at the top level.
+ */
+static void funDeclaration() {
+    // Register-format code has no instructions for calls.
+    if (registerMode()) registerUnsupported();
+
+    consume(TOKEN_IDENTIFIER, "Expect function name");
+    const Token name = parser.previous;
+
+    int slot = 0;
+    if (scope.scopeDepth > 0) {
+        declareLocal(&name);
+        scope.locals[scope.localCount - 1].depth = scope.scopeDepth;
+    } else {
+        slot = globalSlot(&name);
+    }
+
+    skimFunction(&name, scope.scopeDepth > 0 ? scope.localCount - 1 : -1, false);
+
+    if (scope.scopeDepth == 0) emitGlobal(OP_DEFINE_GLOBAL, slot);
+}
+
+/**
+ * Compiles a class declaration. The class stays on the stack while its
+ * methods are added to it one by one, and then becomes a local or a global
+ * like a variable.
+ */
+static void classDeclaration() {
+    // Register-format code has no instructions for classes.
+    if (registerMode()) registerUnsupported();
+
+    consume(TOKEN_IDENTIFIER, "Expect class name");
+    const Token name = parser.previous;
+    const uint8_t nameConstant = identifierConstant(&name);
+
+    int slot = 0;
+    if (scope.scopeDepth > 0) {
+        declareLocal(&name);
+        scope.locals[scope.localCount - 1].depth = scope.scopeDepth;
+    } else {
+        slot = globalSlot(&name);
+    }
+
+    emitBytes(OP_CLASS, nameConstant);
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before class body");
+    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+        method();
+    }
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body");
+
+    if (scope.scopeDepth == 0) emitGlobal(OP_DEFINE_GLOBAL, slot);
+}
+
+/**
+ * Compiles a method. Its body is skimmed like a function's.
+ */
+static void method() {
+    consume(TOKEN_IDENTIFIER, "Expect method name");
+    const Token name = parser.previous;
+    const uint8_t nameConstant = identifierConstant(&name);
+
+    skimFunction(&name, -1, true);
+    emitBytes(OP_METHOD, nameConstant);
+}
+
+/**
+ * Checks a function's parameter list and skips over its body by matching
+ * braces, without parsing the statements in it. The function's text is
+ * copied into a new function object, which the first call compiles with
+ * compileFunction(). Errors in the body are therefore only reported once
+ * the function is called, and never for a function that is not.
+ *
+ * Every identifier in the body that names a variable of the enclosing
+ * function becomes one of the function's captures, whether the body ends
+ * up using it or declares a variable of its own with that name. A function
+ * with captures is created by OP_CLOSURE, and its local is a candidate for
+ * stack captures unless it has nested functions or classes, whose methods
+ * are nested functions too, or reaches through to captures of the
+ * enclosing function, none of which could work without a closure. Methods always escape: they are called from wherever their
+ * instances are used. A this in a method's body is its own receiver, not a
+ * capture.
+ *
+ * @param name The function's name.
+ * @param local The local the function is stored in, or -1 for a global or
+ *              a method.
+ * @param isMethod Whether the function is a method of a class.
+ */
+static void skimFunction(const Token *name, const int local, const bool isMethod) {
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after function name");
+    const Token start = parser.previous;
+
+    int arity = 0;
+    if (!check(TOKEN_RIGHT_PAREN)) {
+        do {
+            if (++arity > 255) errorAtCurrent("Can't have more than 255 parameters");
+            consume(TOKEN_IDENTIFIER, "Expect parameter name");
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters");
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before function body");
+    if (parser.panicMode) return;
+
+    Token names[UINT8_COUNT];
+    Capture captures[UINT8_COUNT];
+    int captureCount = 0;
+    bool stackCaptures = true;
+
+    int depth = 1;
+    while (depth > 0 && !check(TOKEN_EOF)) {
+        if (check(TOKEN_LEFT_BRACE)) depth++;
+        if (check(TOKEN_RIGHT_BRACE)) depth--;
+        if (check(TOKEN_FUN) || check(TOKEN_CLASS)) stackCaptures = false;
+        if (check(TOKEN_IDENTIFIER) || (check(TOKEN_THIS) && !isMethod)) {
+            captureCount = skimCapture(names, captures, captureCount);
+        }
+        advance();
+    }
+    if (depth > 0) {
+        errorAtCurrent("Expect '}' after function body");
+        return;
+    }
+
+    const int length = (int) (parser.previous.start + parser.previous.length - start.start);
+    ObjString *functionName = copyString(name->start, name->length);
+    ObjFunction *function = newFunction(functionName, start.start, length, start.line, arity);
+    function->isMethod = isMethod;
+    if (captureCount == 0) {
+        emitConstant(OBJ_VAL(function));
+        return;
+    }
+
+    push(OBJ_VAL(function));
+    function->captures = GROW_ARRAY(Capture, NULL, 0, captureCount);
+    for (int i = 0; i < captureCount; i++) {
+        captures[i].name = copyString(names[i].start, names[i].length);
+        // The function is black if a collection is marking.
+        if (vm->gcPhase == GC_MARKING) markObject(&captures[i].name->obj);
+        function->captures[i] = captures[i];
+        function->captureCount++;
+        if (!captures[i].isLocal) stackCaptures = false;
+    }
+    pop();
+
+    if (local < 0) {
+        for (int i = 0; i < captureCount; i++) {
+            if (captures[i].isLocal) scope.locals[captures[i].index].captured = true;
+        }
+    } else {
+        Local *holder = &scope.locals[local];
+        holder->closure = currentChunk()->count;
+        if (!stackCaptures) holder->escapes = true;
+    }
+    emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+}
+
+/**
+ * Records the identifier at the current token as a capture if it names a
+ * local or a capture of the function being compiled. A local captured this
+ * way escapes: it can now be used from another frame.
+ *
+ * @return The new number of captures.
+ */
+static int skimCapture(Token *names, Capture *captures, const int count) {
+    const Token *name = &parser.current;
+    if (parser.previous.type == TOKEN_DOT) return count;
+    for (int i = 0; i < count; i++) {
+        if (identifiersEqual(name, &names[i])) return count;
+    }
+
+    Capture capture;
+    int index = -1;
+    for (int i = scope.localCount - 1; i >= 0; i--) {
+        if (identifiersEqual(name, &scope.locals[i].name)) {
+            index = i;
+            break;
+        }
+    }
+    if (index >= 0) {
+        scope.locals[index].escapes = true;
+        capture.isLocal = true;
+    } else {
+        index = resolveCapture(name);
+        capture.isLocal = false;
+    }
+    if (index < 0) return count;
+
+    if (count == UINT8_COUNT) {
+        errorAtCurrent("Too many closure variables in function");
+        return count;
+    }
+    capture.name = NULL;
+    capture.index = (uint8_t) index;
+    names[count] = *name;
+    captures[count] = capture;
+    return count + 1;
+}
+
+/**
+ * Settles the escape analysis for a local that goes out of scope, before
+ * any of the code that could call the closure it holds has run. A closure
+ * that never escaped is created as a plain function that reads its
+ * captures from the stack; one that did makes the locals it captures
+ * closed upvalues.
+ */
+static void finishLocal(Local *local) {
+    if (local->closure < 0) return;
+
+    Chunk *chunk = currentChunk();
+    const Value constant = chunk->constants.values[chunk->code[local->closure + 1]];
+    if (!IS_FUNCTION(constant)) return;
+    ObjFunction *function = AS_FUNCTION(constant);
+
+    if (!local->escapes) {
+        chunk->code[local->closure] = OP_CONSTANT;
+        function->stackCaptures = true;
+        return;
+    }
+
+    for (int i = 0; i < function->captureCount; i++) {
+        const Capture *capture = &function->captures[i];
+        if (capture->isLocal) scope.locals[capture->index].captured = true;
+    }
+}
+
+static void statement() {
+    if (match(TOKEN_RETURN)) {
+        returnStatement();
+    } else if (match(TOKEN_IF)) {
+        ifStatement();
+    } else if (match(TOKEN_WHILE)) {
+        whileStatement();
+    } else if (match(TOKEN_FOR)) {
+        forStatement();
+    } else if (match(TOKEN_SWITCH)) {
+        switchStatement();
+    } else if (match(TOKEN_LEFT_BRACE)) {
+        beginScope();
+        block();
+        endScope();
+    } else {
+        expressionStatement();
+    }
+}
+
+/**
+ * Compiles an if statement. A condition that ends in a comparison jumps to
+ * the else branch with a single compare-and-branch instruction, which
+ * leaves nothing on the stack to pop; any other condition is tested with
+ * OP_JUMP_IF_FALSE and popped on both paths.
+ */
+static void ifStatement() {
+    // Register-format code has no jumps.
+    if (registerMode()) registerUnsupported();
+
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'");
+    expression();
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition");
+
+    bool fused;
+    const int thenJump = emitConditionJump(&fused);
+    if (!fused) emitByte(OP_POP);
+    branchStatement();
+
+    if (fused && !check(TOKEN_ELSE)) {
+        patchJump(thenJump);
+        return;
+    }
+
+    const int elseJump = emitJump(OP_JUMP);
+    patchJump(thenJump);
+    if (!fused) emitByte(OP_POP);
+    if (match(TOKEN_ELSE)) branchStatement();
+    patchJump(elseJump);
+}
+
+static void whileStatement() {
+    if (registerMode()) registerUnsupported();
+
+    const int loopStart = currentChunk()->count;
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'");
+    expression();
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition");
+
+    bool fused;
+    const int exitJump = emitConditionJump(&fused);
+    if (!fused) emitByte(OP_POP);
+    branchStatement();
+    emitLoop(loopStart);
+
+    patchJump(exitJump);
+    if (!fused) emitByte(OP_POP);
+}
+
+/**
+ * Compiles a for statement. The increment clause comes before the body in
+ * the source but runs after it, so the body jumps back to it and it loops
+ * back to the condition.
+ */
+static void forStatement() {
+    beginScope();
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'");
+    if (match(TOKEN_SEMICOLON)) {
+        // No initializer.
+    } else if (match(TOKEN_VAR)) {
+        varDeclaration();
+    } else {
+        parser.controlDepth++;
+        expressionStatement();
+        parser.controlDepth--;
+    }
+
+    int loopStart = currentChunk()->count;
+    int exitJump = -1;
+    bool fused = false;
+    if (!match(TOKEN_SEMICOLON)) {
+        expression();
+        consume(TOKEN_SEMICOLON, "Expect ';' after loop condition");
+        exitJump = emitConditionJump(&fused);
+        if (!fused) emitByte(OP_POP);
+    }
+
+    if (!match(TOKEN_RIGHT_PAREN)) {
+        const int bodyJump = emitJump(OP_JUMP);
+        const int incrementStart = currentChunk()->count;
+        expression();
+        emitByte(OP_POP);
+        consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses");
+
+        emitLoop(loopStart);
+        loopStart = incrementStart;
+        patchJump(bodyJump);
+    }
+
+    branchStatement();
+    emitLoop(loopStart);
+
+    if (exitJump != -1) {
+        patchJump(exitJump);
+        if (!fused) emitByte(OP_POP);
+    }
+    endScope();
+}
+
+/**
+ * Compiles a switch statement. Its value is kept in a hidden local while
+ * the cases run, each in a scope of its own and without falling through to
+ * the next. The bodies come first and the dispatch code after them, where
+ * all their offsets are known: a dense set of integer labels becomes a
+ * single OP_JUMP_TABLE, anything else a chain of compare-and-branch
+ * instructions.
+ */
+static void switchStatement() {
+    beginScope();
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'switch'");
+    expression();
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after value");
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before switch cases");
+
+    const int slot = scope.localCount;
+    const Token hidden = {.start = "", .length = 0, .line = parser.previous.line};
+    declareLocal(&hidden);
+    if (scope.localCount > slot) scope.locals[slot].depth = scope.scopeDepth;
+
+    const int dispatchJump = emitJump(OP_JUMP);
+
+    uint8_t labels[SWITCH_MAX_CASES];
+    int bodies[SWITCH_MAX_CASES];
+    int endJumps[SWITCH_MAX_CASES + 1];
+    int caseCount = 0;
+    int endCount = 0;
+    int defaultBody = -1;
+
+    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+        if (match(TOKEN_CASE)) {
+            uint8_t constant;
+            if (!caseLabel(&constant)) break;
+            if (caseCount == SWITCH_MAX_CASES) {
+                errorAtPrevious("Too many cases in switch");
+                break;
+            }
+            labels[caseCount] = constant;
+            bodies[caseCount++] = currentChunk()->count;
+        } else if (match(TOKEN_DEFAULT)) {
+            if (defaultBody != -1) errorAtPrevious("Switch already has a default case");
+            defaultBody = currentChunk()->count;
+        } else {
+            errorAtCurrent("Expect 'case' or 'default'");
+            break;
+        }
+        consume(TOKEN_COLON, "Expect ':' after case");
+
+        scope.scopeDepth++;
+        parser.controlDepth++;
+        while (!check(TOKEN_CASE) && !check(TOKEN_DEFAULT) && !check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+            declaration();
+        }
+        parser.controlDepth--;
+        endScope();
+        if (endCount <= SWITCH_MAX_CASES) endJumps[endCount++] = emitJump(OP_JUMP);
+    }
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after switch cases");
+
+    patchJump(dispatchJump);
+    emitSwitchDispatch(slot, labels, bodies, caseCount, defaultBody);
+    for (int i = 0; i < endCount; i++) {
+        patchJump(endJumps[i]);
+    }
+    endScope();
+}
+
+/**
+ * Parses a case label, which has to be a literal: a number, a string,
+ * true, false or nil.
+ *
+ * @param constant Receives the index of the constant holding the label.
+ * @return false if the label is not a literal.
+ */
+static bool caseLabel(uint8_t *constant) {
+    Value label;
+    if (match(TOKEN_MINUS)) {
+        consume(TOKEN_NUMBER, "Expect a number after '-'");
+        label = numberValue(&parser.previous);
+        label = IS_INT(label) ? INT_VAL(-AS_INT(label)) : NUMBER_VAL(-AS_NUMBER(label));
+    } else if (match(TOKEN_NUMBER)) {
+        label = numberValue(&parser.previous);
+    } else if (match(TOKEN_STRING)) {
+        label = OBJ_VAL(copyString(parser.previous.start, parser.previous.length));
+    } else if (match(TOKEN_TRUE)) {
+        label = BOOL_VAL(true);
+    } else if (match(TOKEN_FALSE)) {
+        label = BOOL_VAL(false);
+    } else if (match(TOKEN_NIL)) {
+        label = NIL_VAL;
+    } else {
+        errorAtCurrent("Expect a literal as case label");
+        return false;
+    }
+
+    const ValueArray *constants = &currentChunk()->constants;
+    for (int i = 0; i < constants->count && i <= UINT8_MAX; i++) {
+        if (constants->values[i].type == label.type && valuesEqual(constants->values[i], label)) {
+            *constant = (uint8_t) i;
+            return true;
+        }
+    }
+    *constant = makeConstant(label);
+    return true;
+}
+
+/**
+ * Emits the code that picks a switch's case. It reads the value from its
+ * hidden local, so the stack looks the same to every case.
+ *
+ * A table is used for at least SWITCH_TABLE_MIN_CASES integer labels that
+ * cover no more than twice as many values as there are cases. Its gaps and
+ * any value outside it go to the default case, or to the end of the
+ * switch, which is right after the table.
+ *
+ * @param slot The hidden local's slot.
+ * @param labels The constants holding the case labels.
+ * @param bodies The offset of each case's code.
+ * @param caseCount The number of cases.
+ * @param defaultBody The offset of the default case, or -1.
+ */
+static void emitSwitchDispatch(const int slot, const uint8_t *labels, const int *bodies, const int caseCount,
+                               const int defaultBody) {
+    Chunk *chunk = currentChunk();
+    const Value *constants = chunk->constants.values;
+    for (int i = 0; i < caseCount; i++) {
+        for (int j = 0; j < i; j++) {
+            if (valuesEqual(constants[labels[i]], constants[labels[j]])) {
+                errorAtPrevious("Duplicate case label");
+                return;
+            }
+        }
+    }
+
+    bool dense = caseCount >= SWITCH_TABLE_MIN_CASES;
+    int64_t low = INT64_MAX;
+    int64_t high = INT64_MIN;
+    for (int i = 0; i < caseCount && dense; i++) {
+        const Value label = constants[labels[i]];
+        if (!IS_INT(label) || AS_INT(label) < INT32_MIN || AS_INT(label) > INT32_MAX) {
+            dense = false;
+            continue;
+        }
+        if (AS_INT(label) < low) low = AS_INT(label);
+        if (AS_INT(label) > high) high = AS_INT(label);
+    }
+    dense = dense && high - low < 2 * (int64_t) caseCount;
+
+    if (!dense) {
+        // Each test skips the loop back to its case when it fails.
+        for (int i = 0; i < caseCount; i++) {
+            emitBytes(OP_GET_LOCAL, (uint8_t) slot);
+            emitBytes(OP_CONSTANT, labels[i]);
+            emitByte(OP_JUMP_IF_NOT_EQUAL);
+            emitBytes(0, 3);
+            emitLoop(bodies[i]);
+        }
+        if (defaultBody != -1) emitLoop(defaultBody);
+        return;
+    }
+
+    const int count = (int) (high - low) + 1;
+    emitBytes(OP_GET_LOCAL, (uint8_t) slot);
+    emitBytes(OP_JUMP_TABLE, makeConstant(INT_VAL(low)));
+    emitBytes((uint8_t) (count >> 8), (uint8_t) count);
+    const int tableEnd = chunk->count + 2 * (count + 1);
+    if (tableEnd - (defaultBody == -1 ? tableEnd : defaultBody) > INT16_MAX ||
+        (caseCount > 0 && tableEnd - bodies[0] > INT16_MAX)) {
+        errorAtPrevious("Too much code to jump over");
+    }
+
+    const int missing = defaultBody == -1 ? 0 : defaultBody - tableEnd;
+    int offsets[2 * SWITCH_MAX_CASES];
+    for (int i = 0; i < count; i++) {
+        offsets[i] = missing;
+    }
+    // makeConstant() may have moved the constants.
+    for (int i = 0; i < caseCount; i++) {
+        offsets[AS_INT(chunk->constants.values[labels[i]]) - low] = bodies[i] - tableEnd;
+    }
+
+    emitBytes((uint8_t) ((missing >> 8) & 0xff), (uint8_t) (missing & 0xff));
+    for (int i = 0; i < count; i++) {
+        emitBytes((uint8_t) ((offsets[i] >> 8) & 0xff), (uint8_t) (offsets[i] & 0xff));
+    }
+}
+
+/**
+ * Compiles the branch of an if or the body of a loop.
+ */
+static void branchStatement() {
+    parser.controlDepth++;
+    statement();
+    parser.controlDepth--;
+}
+
+/**
+ * Compiles a return statement. The frame's locals are dropped by the return
+ * itself, so nothing needs to be popped first. An initializer always
+ * returns its receiver.
+ */
+static void returnStatement() {
+    if (compilingFunction == NULL) {
+        errorAtPrevious("Can't return from top-level code");
+    }
+
+    if (match(TOKEN_SEMICOLON)) {
+        if (compilingInitializer()) {
+            emitBytes(OP_GET_LOCAL, 0);
+            emitByte(OP_RETURN);
+        } else {
+            emitBytes(OP_NIL, OP_RETURN);
+        }
+        return;
+    }
 
+    if (compilingInitializer()) {
+        errorAtPrevious("Can't return a value from an initializer");
+    }
 
-static Chunk *currentChunk();
+    expression();
+    consume(TOKEN_SEMICOLON, "Expect ';' after return value");
+    emitByte(OP_RETURN);
+}
 
-static uint8_t makeConstant(Value value);
+static bool compilingInitializer() {
+    const ObjFunction *function = compilingFunction;
+    return function != NULL && function->isMethod && function->name->length == 4 &&
+           memcmp(function->name->chars, "init", 4) == 0;
+}
 
-static void emitConstant(Value value);
+static void block() {
+    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+        declaration();
+    }
 
-static void emitByte(uint8_t byte);
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after block");
+}
 
-static void emitBytes(uint8_t byte1, uint8_t byte2);
+static void beginScope() {
+    // Register-format code has no instructions for locals.
+    if (registerMode()) registerUnsupported();
+    scope.scopeDepth++;
+}
 
-static void emitReturn();
+/**
+ * Leaves a block, dropping the locals declared in it from the stack with a
+ * single instruction. Locals that escaping closures captured are closed one
+ * at a time instead.
+ */
+static void endScope() {
+    scope.scopeDepth--;
+
+    int count = 0;
+    while (scope.localCount > 0 && scope.locals[scope.localCount - 1].depth > scope.scopeDepth) {
+        Local *local = &scope.locals[--scope.localCount];
+        finishLocal(local);
+        if (local->captured) {
+            emitPops(count);
+            count = 0;
+            emitByte(OP_CLOSE_UPVALUE);
+        } else {
+            count++;
+        }
+    }
+    emitPops(count);
+}
 
-static void endCompiler();
+static void emitPops(const int count) {
+    if (count == 1) {
+        emitByte(OP_POP);
+    } else if (count > 1) {
+        emitBytes(OP_POPN, (uint8_t) count);
+    }
+}
 
-static void expression();
+static void declareLocal(const Token *name) {
+    for (int i = scope.localCount - 1; i >= 0; i--) {
+        const Local *local = &scope.locals[i];
+        if (local->depth != -1 && local->depth < scope.scopeDepth) break;
 
-static ParseRule* getRule(TokenType operationType);
+        if (identifiersEqual(name, &local->name)) {
+            errorAtPrevious("Already a variable with this name in this scope");
+        }
+    }
 
-static void parsePrecedence(Precedence precedence);
+    if (scope.localCount == UINT8_COUNT) {
+        errorAtPrevious("Too many local variables");
+        return;
+    }
 
-static void advance();
+    Local *local = &scope.locals[scope.localCount++];
+    local->name = *name;
+    local->depth = -1;
+    local->closure = -1;
+    local->escapes = false;
+    local->captured = false;
+}
 
-static void consume(TokenType tokenType, const char *message);
+/**
+ * Finds the innermost local with the given name.
+ *
+ * @return Its stack slot, or -1 if the name refers to a global.
+ */
+static int resolveLocal(const Token *name) {
+    for (int i = scope.localCount - 1; i >= 0; i--) {
+        const Local *local = &scope.locals[i];
+        if (identifiersEqual(name, &local->name)) {
+            if (local->depth == -1) {
+                errorAtPrevious("Can't read local variable in its own initializer");
+            }
+            return i;
+        }
+    }
+    return -1;
+}
 
-static void errorAtCurrent(const char *message);
+static bool identifiersEqual(const Token *a, const Token *b) {
+    return a->length == b->length && memcmp(a->start, b->start, a->length) == 0;
+}
 
-static void errorAtPrevious(const char *message);
+/**
+ * Compiles an expression statement.
+ *
+ * The last statement of a script, if it is an expression statement, gives
+ * the script its result: its value stays on the stack for the return and
+ * its semicolon may be left out, so a bare expression is a valid script.
+ * That does not hold for a statement that is the branch of an if or the
+ * body of a loop.
+ */
+static void expressionStatement() {
+    expression();
 
-static void errorAt(const Token *token, const char *message);
+    if (!match(TOKEN_SEMICOLON) && (!check(TOKEN_EOF) || parser.controlDepth > 0)) {
+        errorAtCurrent("Expect ';' after expression");
+        return;
+    }
+
+    if (check(TOKEN_EOF) && parser.controlDepth == 0) {
+        parser.hasResult = true;
+        return;
+    }
+
+    if (registerMode()) {
+        freeOperand(popOperand());
+    } else {
+        emitByte(OP_POP);
+    }
+}
+
+static void expression() {
+    parsePrecedence(PRECEDENCE_ASSIGNMENT);
+}
 
 /**
- * Compiles the given source code string into the provided chunk.
+ * Compiles a use of or an assignment to a variable. The name is resolved to
+ * a stack slot, a capture or a global slot now, so the VM never looks it up
+ * at runtime. A local that is used other than by calling it escapes.
+ */
+static void variable(const bool canAssign) {
+    const Token name = parser.previous;
+    uint8_t getOp = OP_GET_LOCAL;
+    uint8_t setOp = OP_SET_LOCAL;
+    int slot = resolveLocal(&name);
+    if (slot < 0 && (slot = resolveCapture(&name)) >= 0) {
+        if (compilingFunction->stackCaptures) {
+            getOp = OP_GET_UPVALUE_STACK;
+            setOp = OP_SET_UPVALUE_STACK;
+            slot = compilingFunction->captures[slot].index;
+        } else {
+            getOp = OP_GET_UPVALUE;
+            setOp = OP_SET_UPVALUE;
+        }
+    } else if (slot < 0) {
+        getOp = OP_GET_GLOBAL;
+        setOp = OP_SET_GLOBAL;
+        slot = globalSlot(&name);
+    }
+
+    const bool assign = canAssign && match(TOKEN_EQUAL);
+    if (getOp == OP_GET_LOCAL && (assign || !check(TOKEN_LEFT_PAREN))) {
+        scope.locals[slot].escapes = true;
+    }
+
+    if (assign) expression();
+    if (getOp == OP_GET_GLOBAL) {
+        emitGlobal(assign ? setOp : getOp, slot);
+    } else {
+        emitBytes(assign ? setOp : getOp, (uint8_t) slot);
+    }
+}
+
+/**
+ * Finds a capture of the function being compiled by name.
  *
- * @param source The source code to compile.
- * @param chunk The chunk where the compiled bytecode will be stored.
- * @return true if compilation was successful, false if there were errors.
+ * @return Its index, or -1 if the name is not captured.
  */
-bool compile(const char *source, Chunk *chunk) {
-    initScanner(source);
-    compilingChunk = chunk;
+static int resolveCapture(const Token *name) {
+    if (compilingFunction == NULL) return -1;
 
-    parser.panicMode = false;
-    parser.hadError = false;
+    for (int i = 0; i < compilingFunction->captureCount; i++) {
+        const ObjString *captured = compilingFunction->captures[i].name;
+        if (captured->length == name->length && memcmp(captured->chars, name->start, name->length) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Compiles a call. The callee is already on the stack; the arguments are
+ * pushed above it and OP_CALL finds the callee below them.
+ */
+static void call(bool canAssign) {
+    // Register-format code has no instructions for calls.
+    if (registerMode()) registerUnsupported();
+
+    const uint8_t argCount = argumentList();
+    emitBytes(OP_CALL, argCount);
+}
+
+/**
+ * Compiles a property access after a dot: a store if it is assigned to, a
+ * method call if it is called right away, a load otherwise. Every access
+ * gets an inline cache of its own.
+ */
+static void dot(const bool canAssign) {
+    // Register-format code has no instructions for properties.
+    if (registerMode()) registerUnsupported();
+
+    consume(TOKEN_IDENTIFIER, "Expect property name after '.'");
+    const uint8_t name = identifierConstant(&parser.previous);
+
+    if (canAssign && match(TOKEN_EQUAL)) {
+        expression();
+        emitBytes(OP_SET_PROPERTY, name);
+    } else if (match(TOKEN_LEFT_PAREN)) {
+        const uint8_t argCount = argumentList();
+        emitBytes(OP_INVOKE, name);
+        emitByte(argCount);
+    } else {
+        emitBytes(OP_GET_PROPERTY, name);
+    }
+    emitCache();
+}
+
+/**
+ * Compiles an array literal. The elements are pushed in order and
+ * OP_ARRAY packs them into a new array.
+ */
+static void array(bool canAssign) {
+    // Register-format code has no instructions for arrays.
+    if (registerMode()) registerUnsupported();
+
+    int count = 0;
+    if (!check(TOKEN_RIGHT_BRACKET)) {
+        do {
+            expression();
+            if (count == 255) errorAtPrevious("Can't have more than 255 elements in an array literal");
+            count++;
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after array elements");
+    emitBytes(OP_ARRAY, (uint8_t) count);
+}
+
+/**
+ * Compiles an index into an array: a store if it is assigned to, a load
+ * otherwise. The array is already on the stack.
+ */
+static void subscript(const bool canAssign) {
+    if (registerMode()) registerUnsupported();
 
-    advance();
     expression();
-    consume(TOKEN_EOF, "Expect end of expression");
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index");
+    if (canAssign && match(TOKEN_EQUAL)) {
+        expression();
+        emitByte(OP_SET_INDEX);
+    } else {
+        emitByte(OP_GET_INDEX);
+    }
+}
 
-    endCompiler();
-    return !parser.hadError;
+/**
+ * Compiles this, which is slot 0 of a method or a capture of a function
+ * declared in one.
+ */
+static void this_(bool canAssign) {
+    if (resolveLocal(&parser.previous) < 0 && resolveCapture(&parser.previous) < 0) {
+        errorAtPrevious("Can't use 'this' outside of a class");
+        return;
+    }
+    variable(false);
 }
 
-static void expression() {
-    parsePrecedence(PRECEDENCE_ASSIGNMENT);
+static uint8_t argumentList() {
+    int argCount = 0;
+    if (!check(TOKEN_RIGHT_PAREN)) {
+        do {
+            expression();
+            if (argCount == 255) errorAtPrevious("Can't have more than 255 arguments");
+            argCount++;
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments");
+    return (uint8_t) argCount;
+}
+
+/**
+ * Resolves a global variable's name to its slot. Register-format code has
+ * no instructions for globals, so the chunk falls back to the stack format.
+ */
+static int globalSlot(const Token *name) {
+    if (registerMode()) registerUnsupported();
+
+    const int slot = resolveGlobal(copyString(name->start, name->length));
+    if (slot < 0) {
+        errorAtPrevious("Too many global variables");
+        return 0;
+    }
+    return slot;
+}
+
+/**
+ * Skips tokens after a compile error until the start of the next
+ * statement, so one mistake is reported once instead of cascading.
+ */
+static void synchronize() {
+    parser.panicMode = false;
+
+    while (parser.current.type != TOKEN_EOF) {
+        if (parser.previous.type == TOKEN_SEMICOLON) return;
+        switch (parser.current.type) {
+            case TOKEN_CLASS:
+            case TOKEN_FUN:
+            case TOKEN_VAR:
+            case TOKEN_FOR:
+            case TOKEN_IF:
+            case TOKEN_WHILE:
+            case TOKEN_SWITCH:
+            case TOKEN_PRINT:
+            case TOKEN_RETURN:
+                return;
+            default:
+                break;
+        }
+
+        advance();
+    }
+}
+
+/**
+ * Compiles a number literal.
+ *
+ * Literals without a fractional part become integer constants as long as
+ * they fit into an int64_t; everything else becomes a double constant.
+ */
+static void number(bool canAssign) {
+    emitConstant(numberValue(&parser.previous));
+}
+
+static Value numberValue(const Token *token) {
+    const char *start = token->start;
+    const char *end = start + token->length;
+
+    int64_t integer = 0;
+    const char *cursor = start;
+    for (; cursor < end && *cursor != '.'; cursor++) {
+        if (__builtin_mul_overflow(integer, 10, &integer) ||
+            __builtin_add_overflow(integer, *cursor - '0', &integer)) {
+            break;
+        }
+    }
+
+    if (cursor == end) return INT_VAL(integer);
+    return NUMBER_VAL(strtod(start, NULL));
+}
+
+static void literal(bool canAssign) {
+    if (registerMode()) {
+        switch (parser.previous.type) {
+            case TOKEN_FALSE: emitConstant(BOOL_VAL(false)); break;
+            case TOKEN_NIL: emitConstant(NIL_VAL); break;
+            case TOKEN_TRUE: emitConstant(BOOL_VAL(true)); break;
+            default: break;
+        }
+        return;
+    }
+
+    switch (parser.previous.type) {
+        case TOKEN_FALSE: emitByte(OP_FALSE); break;
+        case TOKEN_NIL: emitByte(OP_NIL); break;
+        case TOKEN_TRUE: emitByte(OP_TRUE); break;
+        default: break;
+    }
 }
 
-static void number() {
-    const double value = strtod(parser.previous.start, NULL);
-    emitConstant(value);
+static void string(bool canAssign) {
+    emitConstant(OBJ_VAL(copyString(parser.previous.start, parser.previous.length)));
 }
 
 static void emitConstant(Value value) {
+    if (registerMode()) {
+        const int constIdx = addConstant(compilingChunk, value);
+        if (constIdx >= RK_CONSTANT) {
+            registerUnsupported();
+            return;
+        }
+        pushOperand(RK_CONSTANT | constIdx);
+        return;
+    }
+
     emitBytes(OP_CONSTANT, makeConstant(value));
 }
 
+/**
+ * Returns the constant holding an identifier as a string, reusing an
+ * existing one so that a chunk full of property accesses does not run out
+ * of constants.
+ */
+static uint8_t identifierConstant(const Token *name) {
+    const ObjString *string = copyString(name->start, name->length);
+    const ValueArray *constants = &currentChunk()->constants;
+    for (int i = 0; i < constants->count && i <= UINT8_MAX; i++) {
+        if (IS_OBJ(constants->values[i]) && AS_OBJ(constants->values[i]) == &string->obj) return (uint8_t) i;
+    }
+    return makeConstant(OBJ_VAL(string));
+}
+
+/**
+ * Adds an inline cache for the property access just emitted and writes its
+ * index as the access's last operand.
+ */
+static void emitCache() {
+    const int cache = addInlineCache(currentChunk());
+    if (cache > UINT16_MAX) {
+        errorAtPrevious("Too many property accesses");
+        return;
+    }
+    emitBytes((uint8_t) (cache >> 8), (uint8_t) cache);
+}
+
 static uint8_t makeConstant(const Value value) {
     const int consIdx = addConstant(compilingChunk, value);
     if (consIdx > UINT8_MAX) {
@@ -170,38 +1637,93 @@ static uint8_t makeConstant(const Value value) {
     return consIdx;
 }
 
-static void grouping() {
+static void grouping(bool canAssign) {
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expected ')' after expression");
 }
 
-static void unary() {
+static void unary(bool canAssign) {
     const TokenType operationType = parser.previous.type;
 
     parsePrecedence(PRECEDENCE_UNARY);
 
+    if (registerMode()) {
+        switch (operationType) {
+            case TOKEN_MINUS: emitRegisterUnary(OP_R_NEGATE); break;
+            default: registerUnsupported(); break;
+        }
+        return;
+    }
+
     switch (operationType) {
         case TOKEN_MINUS: emitByte(OP_NEGATE);
             break;
+        case TOKEN_BANG: emitByte(OP_NOT); break;
         default: break;
     }
 }
 
-static void binary() {
+static void binary(bool canAssign) {
     TokenType operationType = parser.previous.type;
 
     const ParseRule *rule = getRule(operationType);
     parsePrecedence(rule->precedence+1);
 
+    if (registerMode()) {
+        switch (operationType) {
+            case TOKEN_PLUS: emitRegisterBinary(OP_R_ADD); break;
+            case TOKEN_MINUS: emitRegisterBinary(OP_R_SUBTRACT); break;
+            case TOKEN_STAR: emitRegisterBinary(OP_R_MULTIPLY); break;
+            case TOKEN_SLASH: emitRegisterBinary(OP_R_DIVIDE); break;
+            default: registerUnsupported(); break;
+        }
+        return;
+    }
+
     switch (operationType) {
         case TOKEN_PLUS: emitByte(OP_ADD); break;
         case TOKEN_MINUS: emitByte(OP_SUBTRACT); break;
         case TOKEN_STAR: emitByte(OP_MULTIPLY); break;
         case TOKEN_SLASH: emitByte(OP_DIVIDE); break;
+        case TOKEN_EQUAL_EQUAL: emitComparison(OP_EQUAL, false, OP_JUMP_IF_NOT_EQUAL); break;
+        case TOKEN_BANG_EQUAL: emitComparison(OP_EQUAL, true, OP_JUMP_IF_EQUAL); break;
+        case TOKEN_LESS: emitComparison(OP_LESS, false, OP_JUMP_IF_NOT_LESS); break;
+        case TOKEN_LESS_EQUAL: emitComparison(OP_GREATER, true, OP_JUMP_IF_GREATER); break;
+        case TOKEN_GREATER: emitComparison(OP_GREATER, false, OP_JUMP_IF_NOT_GREATER); break;
+        case TOKEN_GREATER_EQUAL: emitComparison(OP_LESS, true, OP_JUMP_IF_LESS); break;
         default: break;
     }
 }
 
+/**
+ * Compiles `and`. If the left operand is false, it is the result and the
+ * right operand is skipped; otherwise it is popped and the right operand
+ * is the result.
+ */
+static void and_(bool canAssign) {
+    if (registerMode()) registerUnsupported();
+
+    const int endJump = emitJump(OP_JUMP_IF_FALSE);
+    emitByte(OP_POP);
+    parsePrecedence(PRECEDENCE_AND);
+    patchJump(endJump);
+}
+
+/**
+ * Compiles `or`: a true left operand is the result, a false one is popped
+ * and the right operand evaluated instead.
+ */
+static void or_(bool canAssign) {
+    if (registerMode()) registerUnsupported();
+
+    const int elseJump = emitJump(OP_JUMP_IF_FALSE);
+    const int endJump = emitJump(OP_JUMP);
+    patchJump(elseJump);
+    emitByte(OP_POP);
+    parsePrecedence(PRECEDENCE_OR);
+    patchJump(endJump);
+}
+
 static void parsePrecedence(const Precedence precedence) {
     advance();
     const ParseFn prefixRule = getRule(parser.previous.type)->prefix;
@@ -211,12 +1733,17 @@ static void parsePrecedence(const Precedence precedence) {
         return;
     }
 
-    prefixRule();
+    const bool canAssign = precedence <= PRECEDENCE_ASSIGNMENT;
+    prefixRule(canAssign);
 
     while (precedence <= getRule(parser.current.type)->precedence) {
         advance();
         const ParseFn infixRule = getRule(parser.previous.type)->infix;
-        infixRule();
+        infixRule(canAssign);
+    }
+
+    if (canAssign && match(TOKEN_EQUAL)) {
+        errorAtPrevious("Invalid assignment target");
     }
 }
 
@@ -225,18 +1752,109 @@ static ParseRule* getRule(const TokenType operationType) {
 }
 
 static void endCompiler() {
+    if (compilingInitializer()) {
+        emitBytes(OP_GET_LOCAL, 0);
+    } else if (!parser.hasResult) {
+        if (registerMode()) {
+            emitConstant(NIL_VAL);
+        } else {
+            emitByte(OP_NIL);
+        }
+    }
     emitReturn();
 }
 
 static void emitReturn() {
-    emitByte(OP_RETURN);
+    if (registerMode()) {
+        emitBytes(OP_R_RETURN, popOperand());
+    } else {
+        emitByte(OP_RETURN);
+    }
 #ifdef DEBUG_PRINT_CODE
-    if (!parser.hadError) {
+    if (!parser.hadError && !registers.unsupported) {
         disassembleChunk(currentChunk(), "code");
     }
 #endif
 }
 
+/**
+ * Emits a forward jump with a placeholder offset for patchJump().
+ *
+ * @return The offset of the jump's operand.
+ */
+static int emitJump(const OpCode opCode) {
+    emitByte(opCode);
+    emitBytes(0xff, 0xff);
+    return currentChunk()->count - 2;
+}
+
+/**
+ * Makes the jump whose operand is at offset land on the next instruction
+ * to be emitted.
+ */
+static void patchJump(const int offset) {
+    Chunk *chunk = currentChunk();
+    const int jump = chunk->count - offset - 2;
+    if (jump > UINT16_MAX) {
+        errorAtPrevious("Too much code to jump over");
+    }
+
+    chunk->code[offset] = (jump >> 8) & 0xff;
+    chunk->code[offset + 1] = jump & 0xff;
+    branches.jumpTarget = chunk->count;
+}
+
+static void emitLoop(const int loopStart) {
+    emitByte(OP_LOOP);
+
+    const int offset = currentChunk()->count - loopStart + 2;
+    if (offset > UINT16_MAX) errorAtPrevious("Loop body too large");
+
+    emitBytes((offset >> 8) & 0xff, offset & 0xff);
+}
+
+/**
+ * Emits the jump taken when the condition just compiled is false. If the
+ * condition ended in a comparison that no jump lands in the middle of, the
+ * comparison is replaced by the compare-and-branch instruction that does
+ * both, which also pops its operands.
+ *
+ * @param fused Receives whether the jump was fused with a comparison. If
+ *              not, the condition is still on the stack on both paths.
+ * @return The offset of the jump's operand.
+ */
+static int emitConditionJump(bool *fused) {
+    Chunk *chunk = currentChunk();
+    *fused = branches.comparisonEnd == chunk->count && branches.jumpTarget <= branches.comparisonStart;
+    branches.comparisonEnd = -1;
+    if (!*fused) return emitJump(OP_JUMP_IF_FALSE);
+
+    chunk->count = branches.comparisonStart;
+    return emitJump(branches.fusedJump);
+}
+
+/**
+ * Emits a comparison and remembers it for emitConditionJump().
+ *
+ * @param opCode The comparison.
+ * @param negate Whether its result is negated.
+ * @param fusedJump The instruction that compares and jumps when the result
+ *                  is false.
+ */
+static void emitComparison(const OpCode opCode, const bool negate, const OpCode fusedJump) {
+    branches.comparisonStart = currentChunk()->count;
+    emitByte(opCode);
+    if (negate) emitByte(OP_NOT);
+    branches.comparisonEnd = currentChunk()->count;
+    branches.fusedJump = fusedJump;
+}
+
+static void resetBranches() {
+    branches.comparisonStart = 0;
+    branches.comparisonEnd = -1;
+    branches.jumpTarget = -1;
+}
+
 static void emitBytes(uint8_t byte1, uint8_t byte2) {
     emitByte(byte1);
     emitByte(byte2);
@@ -246,22 +1864,95 @@ static void emitByte(uint8_t byte) {
     writeChunk(currentChunk(), byte, parser.previous.line);
 }
 
+// Emits a global instruction, in its wide form if the slot needs two bytes.
+static void emitGlobal(const OpCode op, const int slot) {
+    if (slot > UINT8_MAX) {
+        emitByte(op + (OP_DEFINE_GLOBAL_LONG - OP_DEFINE_GLOBAL));
+        emitBytes((uint8_t) (slot >> 8), (uint8_t) slot);
+    } else {
+        emitBytes(op, (uint8_t) slot);
+    }
+    addGlobalRef(currentChunk(), slot);
+}
+
 static Chunk *currentChunk() {
     return compilingChunk;
 }
 
+static bool registerMode() {
+    return compilingChunk->format == CHUNK_REGISTER && !registers.unsupported;
+}
+
+static void pushOperand(const int operand) {
+    if (registers.operandCount == REGISTER_MAX) {
+        registerUnsupported();
+        return;
+    }
+    registers.operands[registers.operandCount++] = (uint8_t) operand;
+}
+
+static uint8_t popOperand() {
+    // After a parse error an expression may not have left its operand.
+    if (registers.operandCount == 0) return RK_CONSTANT;
+    return registers.operands[--registers.operandCount];
+}
+
+static void freeOperand(const uint8_t operand) {
+    if (operand & RK_CONSTANT) return;
+    registers.nextRegister = operand;
+}
+
+static uint8_t allocateRegister() {
+    if (registers.nextRegister == REGISTER_MAX) {
+        registerUnsupported();
+        return 0;
+    }
+    const uint8_t reg = (uint8_t) registers.nextRegister++;
+    if (registers.nextRegister > compilingChunk->registerCount) {
+        compilingChunk->registerCount = registers.nextRegister;
+    }
+    return reg;
+}
+
+static void emitRegisterUnary(const OpCode opCode) {
+    const uint8_t operand = popOperand();
+    freeOperand(operand);
+    const uint8_t destination = allocateRegister();
+
+    emitBytes(opCode, destination);
+    emitByte(operand);
+    pushOperand(destination);
+}
+
+static void emitRegisterBinary(const OpCode opCode) {
+    const uint8_t right = popOperand();
+    const uint8_t left = popOperand();
+    freeOperand(right);
+    freeOperand(left);
+    const uint8_t destination = allocateRegister();
+
+    emitBytes(opCode, destination);
+    emitBytes(left, right);
+    pushOperand(destination);
+}
+
+/**
+ * Marks the chunk being compiled as not expressible in the register format.
+ * compile() then starts over and produces stack-format bytecode.
+ */
+static void registerUnsupported() {
+    registers.unsupported = true;
+}
+
 static void advance() {
     parser.previous = parser.current;
 
     for (;;) {
-        parser.current = scanToken();
+        parser.current = nextToken();
 
-        if (parser.current.type == TOKEN_EOF) return;
+        if (parser.current.type != TOKEN_ERROR) break;
 
-        if (parser.current.type == TOKEN_ERROR) {
-            errorAtCurrent(parser.current.start);
-            return;
-        }
+        errorAtCurrent(parser.current.start);
     }
 }
 
@@ -274,6 +1965,16 @@ static void consume(const TokenType tokenType, const char *message) {
     errorAtCurrent(message);
 }
 
+static bool check(const TokenType tokenType) {
+    return parser.current.type == tokenType;
+}
+
+static bool match(const TokenType tokenType) {
+    if (!check(tokenType)) return false;
+    advance();
+    return true;
+}
+
 static void errorAtCurrent(const char *message) {
     errorAt(&parser.current, message);
 }
@@ -285,19 +1986,23 @@ static void errorAtPrevious(const char *message) {
 static void errorAt(const Token *token, const char *message) {
     if (parser.panicMode) return;
     parser.panicMode = true;
+    parser.hadError = true;
 
-    fprintf(stderr, "[line %d] Error", token->line);
-
+    char report[256];
     switch (token->type) {
         case TOKEN_EOF: {
-            fprintf(stderr, " end of file");
+            snprintf(report, sizeof(report), "Error end of file: %s", message);
+        }
+        break;
+        case TOKEN_ERROR: {
+            snprintf(report, sizeof(report), "Error: %s", message);
         }
         break;
-        case TOKEN_ERROR:
-            break;
         default: {
-            fprintf(stderr, " at '%.*s'", token->length, token->start);
+            snprintf(report, sizeof(report), "Error at '%.*s': %s", token->length, token->start, message);
         }
         break;
     }
+
+    reportError(INTERPRET_COMPILE_ERROR, token->line, report);
 }
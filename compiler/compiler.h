@@ -3,7 +3,30 @@
 
 #include "../chunk/chunk.h"
 #include "../common.h"
+#include "../value/value.h"
 
-bool compile(const char *source, Chunk *chunk);
+#define PIPELINE_MIN_SOURCE (256 * 1024)
+
+// A switch with at least this many cases, all of them integers no further
+// apart than twice their number, dispatches through a jump table.
+#define SWITCH_TABLE_MIN_CASES 3
+#define SWITCH_MAX_CASES 256
+
+typedef enum {
+    FRONT_END_AUTO,
+    FRONT_END_STREAMING,
+    FRONT_END_PRETOKENIZED,
+    FRONT_END_PIPELINED,
+} FrontEnd;
+
+bool compile(const char *source, Chunk *chunk, FrontEnd frontEnd);
+
+bool compileSection(const char *source, int line, Chunk *chunk);
+
+bool compileFunction(ObjFunction *function);
+
+FrontEnd resolveFrontEnd(FrontEnd frontEnd, const char *source);
+
+const char *frontEndName(FrontEnd frontEnd);
 
 #endif
\ No newline at end of file
@@ -5,11 +5,27 @@
 #include <stdio.h>
 #include "debug.h"
 #include "../enums/opcodes.h"
+#include "../object/object.h"
+#include "../output/dtoa.h"
 
 int simpleInstruction(const char *name, int offset);
 
 int constantInstruction(const char *name, Chunk *chunk, int offset);
 
+int registerInstruction(const char *name, Chunk *chunk, int offset, int sourceCount);
+
+int byteInstruction(const char *name, Chunk *chunk, int offset);
+
+int shortInstruction(const char *name, Chunk *chunk, int offset);
+
+int propertyInstruction(const char *name, Chunk *chunk, int offset, bool hasArgCount);
+
+int jumpInstruction(const char *name, int sign, Chunk *chunk, int offset);
+
+int jumpTableInstruction(Chunk *chunk, int offset);
+
+void printOperand(Chunk *chunk, uint8_t operand);
+
 
 /**
  * Disassembles a given chunk of bytecode, printing a human-readable version.
@@ -44,10 +60,10 @@ void disassembleChunk(Chunk *chunk, const char *name) {
 int disassembleInstruction(Chunk *chunk, const int offset) {
     printf("%04d ", offset);
 
-    if (offset > 0 && chunk->lines[offset - 1] == chunk->lines[offset])
+    if (offset > 0 && getLine(chunk, offset - 1) == getLine(chunk, offset))
         printf("    | ");
     else
-        printf("%4d ", chunk->lines[offset]);
+        printf("%4d ", getLine(chunk, offset));
 
     uint8_t instruction = chunk->code[offset];
 
@@ -66,6 +82,128 @@ int disassembleInstruction(Chunk *chunk, const int offset) {
             return simpleInstruction("OP_DIVIDE", offset);
         case OP_CONSTANT:
             return constantInstruction("OP_CONSTANT", chunk, offset);
+        case OP_NIL:
+            return simpleInstruction("OP_NIL", offset);
+        case OP_TRUE:
+            return simpleInstruction("OP_TRUE", offset);
+        case OP_FALSE:
+            return simpleInstruction("OP_FALSE", offset);
+        case OP_EQUAL:
+            return simpleInstruction("OP_EQUAL", offset);
+        case OP_GREATER:
+            return simpleInstruction("OP_GREATER", offset);
+        case OP_LESS:
+            return simpleInstruction("OP_LESS", offset);
+        case OP_NOT:
+            return simpleInstruction("OP_NOT", offset);
+        case OP_POP:
+            return simpleInstruction("OP_POP", offset);
+        case OP_POPN:
+            return byteInstruction("OP_POPN", chunk, offset);
+        case OP_GET_LOCAL:
+            return byteInstruction("OP_GET_LOCAL", chunk, offset);
+        case OP_SET_LOCAL:
+            return byteInstruction("OP_SET_LOCAL", chunk, offset);
+        case OP_DEFINE_GLOBAL:
+            return byteInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+        case OP_GET_GLOBAL:
+            return byteInstruction("OP_GET_GLOBAL", chunk, offset);
+        case OP_SET_GLOBAL:
+            return byteInstruction("OP_SET_GLOBAL", chunk, offset);
+        case OP_DEFINE_GLOBAL_LONG:
+            return shortInstruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
+        case OP_GET_GLOBAL_LONG:
+            return shortInstruction("OP_GET_GLOBAL_LONG", chunk, offset);
+        case OP_SET_GLOBAL_LONG:
+            return shortInstruction("OP_SET_GLOBAL_LONG", chunk, offset);
+        case OP_GET_UPVALUE:
+            return byteInstruction("OP_GET_UPVALUE", chunk, offset);
+        case OP_SET_UPVALUE:
+            return byteInstruction("OP_SET_UPVALUE", chunk, offset);
+        case OP_GET_UPVALUE_STACK:
+            return byteInstruction("OP_GET_UPVALUE_STACK", chunk, offset);
+        case OP_SET_UPVALUE_STACK:
+            return byteInstruction("OP_SET_UPVALUE_STACK", chunk, offset);
+        case OP_CLOSURE:
+            return constantInstruction("OP_CLOSURE", chunk, offset);
+        case OP_CLOSE_UPVALUE:
+            return simpleInstruction("OP_CLOSE_UPVALUE", offset);
+        case OP_CALL:
+            return byteInstruction("OP_CALL", chunk, offset);
+        case OP_CLASS:
+            return constantInstruction("OP_CLASS", chunk, offset);
+        case OP_METHOD:
+            return constantInstruction("OP_METHOD", chunk, offset);
+        case OP_GET_PROPERTY:
+            return propertyInstruction("OP_GET_PROPERTY", chunk, offset, false);
+        case OP_SET_PROPERTY:
+            return propertyInstruction("OP_SET_PROPERTY", chunk, offset, false);
+        case OP_INVOKE:
+            return propertyInstruction("OP_INVOKE", chunk, offset, true);
+        case OP_ARRAY:
+            return byteInstruction("OP_ARRAY", chunk, offset);
+        case OP_GET_INDEX:
+            return simpleInstruction("OP_GET_INDEX", offset);
+        case OP_SET_INDEX:
+            return simpleInstruction("OP_SET_INDEX", offset);
+        case OP_JUMP:
+            return jumpInstruction("OP_JUMP", 1, chunk, offset);
+        case OP_JUMP_IF_FALSE:
+            return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_LOOP:
+            return jumpInstruction("OP_LOOP", -1, chunk, offset);
+        case OP_JUMP_IF_LESS:
+            return jumpInstruction("OP_JUMP_IF_LESS", 1, chunk, offset);
+        case OP_JUMP_IF_NOT_LESS:
+            return jumpInstruction("OP_JUMP_IF_NOT_LESS", 1, chunk, offset);
+        case OP_JUMP_IF_GREATER:
+            return jumpInstruction("OP_JUMP_IF_GREATER", 1, chunk, offset);
+        case OP_JUMP_IF_NOT_GREATER:
+            return jumpInstruction("OP_JUMP_IF_NOT_GREATER", 1, chunk, offset);
+        case OP_JUMP_IF_EQUAL:
+            return jumpInstruction("OP_JUMP_IF_EQUAL", 1, chunk, offset);
+        case OP_JUMP_IF_NOT_EQUAL:
+            return jumpInstruction("OP_JUMP_IF_NOT_EQUAL", 1, chunk, offset);
+        case OP_JUMP_TABLE:
+            return jumpTableInstruction(chunk, offset);
+        case OP_NEGATE_NUM:
+            return simpleInstruction("OP_NEGATE_NUM", offset);
+        case OP_ADD_NUM:
+            return simpleInstruction("OP_ADD_NUM", offset);
+        case OP_SUBTRACT_NUM:
+            return simpleInstruction("OP_SUBTRACT_NUM", offset);
+        case OP_MULTIPLY_NUM:
+            return simpleInstruction("OP_MULTIPLY_NUM", offset);
+        case OP_DIVIDE_NUM:
+            return simpleInstruction("OP_DIVIDE_NUM", offset);
+        case OP_NEGATE_INT:
+            return simpleInstruction("OP_NEGATE_INT", offset);
+        case OP_ADD_INT:
+            return simpleInstruction("OP_ADD_INT", offset);
+        case OP_SUBTRACT_INT:
+            return simpleInstruction("OP_SUBTRACT_INT", offset);
+        case OP_MULTIPLY_INT:
+            return simpleInstruction("OP_MULTIPLY_INT", offset);
+        case OP_DIVIDE_INT:
+            return simpleInstruction("OP_DIVIDE_INT", offset);
+        case OP_CALL_NATIVE:
+            return byteInstruction("OP_CALL_NATIVE", chunk, offset);
+        case OP_R_NEGATE:
+            return registerInstruction("OP_R_NEGATE", chunk, offset, 1);
+        case OP_R_ADD:
+            return registerInstruction("OP_R_ADD", chunk, offset, 2);
+        case OP_R_SUBTRACT:
+            return registerInstruction("OP_R_SUBTRACT", chunk, offset, 2);
+        case OP_R_MULTIPLY:
+            return registerInstruction("OP_R_MULTIPLY", chunk, offset, 2);
+        case OP_R_DIVIDE:
+            return registerInstruction("OP_R_DIVIDE", chunk, offset, 2);
+        case OP_R_RETURN: {
+            printf("%-16s ", "OP_R_RETURN");
+            printOperand(chunk, chunk->code[offset + 1]);
+            printf("\n");
+            return offset + 2;
+        }
         default:
             printf("Unknown instruction %d\n", instruction);
             return offset + 1;
@@ -115,22 +253,214 @@ int negateInstruction(const char *name, int offset) {
  */
 int constantInstruction(const char *name, Chunk *chunk, int offset) {
     uint8_t constantIdx = chunk->code[offset + 1];
-    printf("%-16s %4d", name, constantIdx);
+    printf("%-16s %4d '", name, constantIdx);
     printValue(chunk->constants.values[constantIdx]);
-    printf("\n");
+    printf("'\n");
 
     return offset + 2;
 }
 
+/**
+ * Disassembles an instruction with a single byte operand, such as the slot
+ * of a variable or a count of values.
+ *
+ * @param name The name of the instruction to be disassembled.
+ * @param chunk The chunk of bytecode containing the instruction.
+ * @param offset The current offset in the bytecode where the instruction starts.
+ * @return The new offset in the bytecode after the instruction.
+ */
+int byteInstruction(const char *name, Chunk *chunk, int offset) {
+    printf("%-16s %4d\n", name, chunk->code[offset + 1]);
+    return offset + 2;
+}
+
+/**
+ * Disassembles an instruction with a two-byte operand, such as the slot of
+ * a wide global instruction.
+ *
+ * @param name The name of the instruction to be disassembled.
+ * @param chunk The chunk of bytecode containing the instruction.
+ * @param offset The current offset in the bytecode where the instruction starts.
+ * @return The new offset in the bytecode after the instruction.
+ */
+int shortInstruction(const char *name, Chunk *chunk, int offset) {
+    printf("%-16s %4d\n", name, chunk->code[offset + 1] << 8 | chunk->code[offset + 2]);
+    return offset + 3;
+}
+
+/**
+ * Disassembles a property access: the property's name, for OP_INVOKE the
+ * argument count, and the index of the access's inline cache, for example
+ * "OP_INVOKE 2 'area' (1 args) cache 0".
+ *
+ * @param name The name of the instruction to be disassembled.
+ * @param chunk The chunk of bytecode containing the instruction.
+ * @param offset The offset in the chunk where the instruction begins.
+ * @param hasArgCount Whether an argument count follows the name.
+ * @return The offset of the next instruction.
+ */
+int propertyInstruction(const char *name, Chunk *chunk, int offset, const bool hasArgCount) {
+    const uint8_t constantIdx = chunk->code[++offset];
+    printf("%-16s %4d '", name, constantIdx);
+    printValue(chunk->constants.values[constantIdx]);
+    printf("'");
+    if (hasArgCount) printf(" (%d args)", chunk->code[++offset]);
+    const int cache = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    printf(" cache %d\n", cache);
+    return offset + 3;
+}
+
+/**
+ * Disassembles a register-format instruction.
+ *
+ * Prints the instruction name, its destination register and its
+ * register-or-constant source operands, for example
+ * "OP_R_ADD r0, r1, k2 '5'".
+ *
+ * @param name The name of the instruction to be disassembled.
+ * @param chunk The chunk of bytecode containing the instruction.
+ * @param offset The current offset in the bytecode where the instruction starts.
+ * @param sourceCount The number of RK source operands following the destination.
+ * @return The new offset in the bytecode after the instruction.
+ */
+int registerInstruction(const char *name, Chunk *chunk, int offset, int sourceCount) {
+    printf("%-16s r%d", name, chunk->code[offset + 1]);
+    for (int i = 0; i < sourceCount; i++) {
+        printf(", ");
+        printOperand(chunk, chunk->code[offset + 2 + i]);
+    }
+    printf("\n");
+
+    return offset + 2 + sourceCount;
+}
+
+/**
+ * Prints a register-or-constant operand as "rN" or "kN 'value'".
+ *
+ * @param chunk The chunk whose constants the operand may refer to.
+ * @param operand The encoded operand.
+ */
+void printOperand(Chunk *chunk, uint8_t operand) {
+    if (!(operand & RK_CONSTANT)) {
+        printf("r%d", operand);
+        return;
+    }
+
+    const uint8_t constantIdx = operand & ~RK_CONSTANT;
+    printf("k%d '", constantIdx);
+    printValue(chunk->constants.values[constantIdx]);
+    printf("'");
+}
+
 /**
  * Prints the given value to standard output in a formatted manner.
  *
- * This function uses the printf function to print a double value according to
- * the "%g" format specifier.
+ * Numbers are formatted with the same shortest round-trip formatter the VM's
+ * output sink uses, so disassembly and traces show exactly the values a
+ * program prints.
  *
- * @param value The value of type double to be printed.
+ * @param value The value to be printed.
  */
 void printValue(Value value) {
-    printf("%g", value);
+    switch (value.type) {
+        case VAL_BOOL:
+            printf(AS_BOOL(value) ? "true" : "false");
+            break;
+        case VAL_NIL:
+            printf("nil");
+            break;
+        case VAL_UNDEFINED:
+            printf("<undefined>");
+            break;
+        case VAL_NUMBER: {
+            char buffer[DTOA_BUFFER_SIZE];
+            const int length = formatDouble(AS_NUMBER(value), buffer);
+            printf("%.*s", length, buffer);
+            break;
+        }
+        case VAL_INT: {
+            char buffer[DTOA_BUFFER_SIZE];
+            const int length = formatInt64(AS_INT(value), buffer);
+            printf("%.*s", length, buffer);
+            break;
+        }
+        case VAL_OBJ:
+            switch (OBJ_TYPE(value)) {
+                case OBJ_STRING:
+                    printf("%s", AS_CSTRING(value));
+                    break;
+                case OBJ_FUNCTION:
+                    printf("<fn %s>", AS_FUNCTION(value)->name->chars);
+                    break;
+                case OBJ_CLOSURE:
+                    printf("<fn %s>", AS_CLOSURE(value)->function->name->chars);
+                    break;
+                case OBJ_UPVALUE:
+                    printf("upvalue");
+                    break;
+                case OBJ_CLASS:
+                    printf("%s", AS_CLASS(value)->name->chars);
+                    break;
+                case OBJ_INSTANCE:
+                    printf("%s instance", AS_INSTANCE(value)->klass->name->chars);
+                    break;
+                case OBJ_BOUND_METHOD:
+                    printValue(AS_BOUND_METHOD(value)->method);
+                    break;
+                case OBJ_NATIVE:
+                    printf("<native %s>", AS_NATIVE(value)->name->chars);
+                    break;
+                case OBJ_ARRAY:
+                    printf("[");
+                    for (int i = 0; i < AS_ARRAY(value)->count; i++) {
+                        if (i > 0) printf(", ");
+                        printValue(NUMBER_VAL(AS_ARRAY(value)->values[i]));
+                    }
+                    printf("]");
+                    break;
+            }
+            break;
+    }
+}
+
+/**
+ * Disassembles a jump, printing its offset and the offset it jumps to, for
+ * example "OP_JUMP 4 -> 12".
+ *
+ * @param name The name of the instruction to be disassembled.
+ * @param sign 1 for a forward jump, -1 for a backward one.
+ * @param chunk The chunk of bytecode containing the instruction.
+ * @param offset The offset in the chunk where the instruction begins.
+ * @return The offset of the next instruction.
+ */
+int jumpInstruction(const char *name, const int sign, Chunk *chunk, const int offset) {
+    const int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
+    return offset + 3;
 }
 
+/**
+ * Disassembles a jump table: its first case, then one line per entry with
+ * the value it matches and the offset it jumps to. The default entry is
+ * printed first.
+ *
+ * @param chunk The chunk of bytecode containing the instruction.
+ * @param offset The offset in the chunk where the instruction begins.
+ * @return The offset of the next instruction.
+ */
+int jumpTableInstruction(Chunk *chunk, const int offset) {
+    const Value first = chunk->constants.values[chunk->code[offset + 1]];
+    const int count = (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+    const int end = offset + 6 + 2 * count;
+    printf("%-16s %4d cases from %lld\n", "OP_JUMP_TABLE", count, (long long) AS_INT(first));
+    for (int entry = 0; entry <= count; entry++) {
+        const uint8_t *bytes = &chunk->code[offset + 4 + 2 * entry];
+        const int target = end + (int16_t) ((bytes[0] << 8) | bytes[1]);
+        if (entry == 0) {
+            printf("     |   default -> %d\n", target);
+        } else {
+            printf("     | %8lld -> %d\n", (long long) (AS_INT(first) + entry - 1), target);
+        }
+    }
+    return end;
+}
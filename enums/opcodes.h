@@ -12,7 +12,89 @@ typedef enum {
     OP_SUBTRACT,
     OP_MULTIPLY,
     OP_DIVIDE,
-    OP_CONSTANT
+    OP_CONSTANT,
+    OP_NIL,
+    OP_TRUE,
+    OP_FALSE,
+    OP_EQUAL,
+    OP_GREATER,
+    OP_LESS,
+    OP_NOT,
+    OP_POP,
+    OP_POPN,
+    OP_GET_LOCAL,
+    OP_SET_LOCAL,
+    OP_DEFINE_GLOBAL,
+    OP_GET_GLOBAL,
+    OP_SET_GLOBAL,
+    // Wide forms of the global instructions, in the same order, followed by
+    // a two-byte slot. The compiler emits them for slots past 255.
+    OP_DEFINE_GLOBAL_LONG,
+    OP_GET_GLOBAL_LONG,
+    OP_SET_GLOBAL_LONG,
+    OP_GET_UPVALUE,
+    OP_SET_UPVALUE,
+    OP_GET_UPVALUE_STACK,
+    OP_SET_UPVALUE_STACK,
+    OP_CLOSURE,
+    OP_CLOSE_UPVALUE,
+    OP_CALL,
+    OP_CLASS,
+    OP_METHOD,
+    // Property accesses are followed by the name's constant, for OP_INVOKE
+    // the argument count, and the two-byte index of their inline cache.
+    OP_GET_PROPERTY,
+    OP_SET_PROPERTY,
+    OP_INVOKE,
+    // OP_ARRAY is followed by the number of elements on the stack.
+    OP_ARRAY,
+    OP_GET_INDEX,
+    OP_SET_INDEX,
+    // Jumps are followed by a two-byte offset, forward from the end of the
+    // instruction except for OP_LOOP, which jumps back. OP_JUMP_IF_FALSE
+    // leaves the condition on the stack.
+    OP_JUMP,
+    OP_JUMP_IF_FALSE,
+    OP_LOOP,
+    // Fused compare-and-branch: pop two operands, compare them like
+    // OP_LESS, OP_GREATER or OP_EQUAL and jump forward if the result is the
+    // one in the name.
+    OP_JUMP_IF_LESS,
+    OP_JUMP_IF_NOT_LESS,
+    OP_JUMP_IF_GREATER,
+    OP_JUMP_IF_NOT_GREATER,
+    OP_JUMP_IF_EQUAL,
+    OP_JUMP_IF_NOT_EQUAL,
+    // OP_JUMP_TABLE pops an integer and jumps through a table. It is followed
+    // by the constant holding the first case, the two-byte number of cases
+    // and one signed two-byte offset for values outside the table followed
+    // by one per case, all relative to the end of the instruction.
+    OP_JUMP_TABLE,
+
+    // Quickened forms. The VM rewrites a generic instruction into one of
+    // these after it has executed once with double (_NUM) or integer (_INT)
+    // operands, and rewrites it back when the guard on the operand types fails.
+    // OP_CALL becomes OP_CALL_NATIVE the same way once it has called a native.
+    OP_NEGATE_NUM,
+    OP_ADD_NUM,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_NUM,
+    OP_DIVIDE_NUM,
+    OP_NEGATE_INT,
+    OP_ADD_INT,
+    OP_SUBTRACT_INT,
+    OP_MULTIPLY_INT,
+    OP_DIVIDE_INT,
+    OP_CALL_NATIVE,
+
+    // Register format. Operands are a destination register followed by
+    // register-or-constant (RK) sources.
+    OP_R_NEGATE,
+    OP_R_ADD,
+    OP_R_SUBTRACT,
+    OP_R_MULTIPLY,
+    OP_R_DIVIDE,
+    OP_R_RETURN
 } OpCode;
 
 #endif //CLOXVM_OPCODES_H
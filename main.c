@@ -1,9 +1,272 @@
 #include "vm/vm.h"
+#include "bench/bench.h"
+#include "profiler/profiler.h"
+#include "server/server.h"
 
-int main(void) {
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
-    initVM();
-    interpret("-3 + 5 * 6");
+static void repl();
 
+static int runFile(const char *path);
+
+static int snapshotFile(const char *path, const char *imagePath);
+
+static void benchmarkFile(const char *path, int iterations, bool countEvents);
+
+static char *readFile(const char *path);
+
+static void writeProfile(const char *path);
+
+static FrontEnd parseFrontEnd(const char *name);
+
+static void usage();
+
+static VM machine;
+
+int main(const int argc, const char *argv[]) {
+    initVM(&machine, NULL);
+
+    int benchIterations = 0;
+    bool countEvents = false;
+    const char *profilePath = NULL;
+    const char *socketPath = NULL;
+    int workers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    const char *snapshotPath = NULL;
+    const char *outputPath = NULL;
+    const char *imagePath = NULL;
+    const char *path = NULL;
+    int status = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--register") == 0) {
+            vm->chunkFormat = CHUNK_REGISTER;
+        } else if (strcmp(argv[i], "--optimize") == 0) {
+            vm->optimize = true;
+        } else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+            benchIterations = atoi(argv[++i]);
+            if (benchIterations <= 0) usage();
+        } else if (strcmp(argv[i], "--front-end") == 0 && i + 1 < argc) {
+            vm->frontEnd = parseFrontEnd(argv[++i]);
+        } else if (strcmp(argv[i], "--counters") == 0) {
+            countEvents = true;
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            socketPath = argv[++i];
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            workers = atoi(argv[++i]);
+            if (workers <= 0) usage();
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profilePath = argv[++i];
+        } else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) {
+            snapshotPath = argv[++i];
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            outputPath = argv[++i];
+        } else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+            imagePath = argv[++i];
+        } else if (argv[i][0] == '-' || path != NULL) {
+            usage();
+        } else {
+            path = argv[i];
+        }
+    }
+
+    if ((snapshotPath == NULL) != (outputPath == NULL)) usage();
+
+    if (imagePath != NULL && !loadSnapshot(imagePath)) {
+        fprintf(stderr, "Could not load image \"%s\".\n", imagePath);
+        freeVM(&machine);
+        exit(74);
+    }
+
+    if (profilePath != NULL && !startProfiler(PROFILER_DEFAULT_HZ)) {
+        fprintf(stderr, "Could not start the profiler.\n");
+        exit(71);
+    }
+
+    if (snapshotPath != NULL) {
+        if (path != NULL || socketPath != NULL || benchIterations > 0 || countEvents) usage();
+        status = snapshotFile(snapshotPath, outputPath);
+    } else if (socketPath != NULL) {
+        if (path != NULL || benchIterations > 0 || imagePath != NULL) usage();
+        const ServerConfig config = {socketPath, workers, vm->chunkFormat == CHUNK_REGISTER, vm->optimize};
+        if (!serve(&config)) {
+            freeVM(&machine);
+            exit(71);
+        }
+    } else if (benchIterations > 0) {
+        if (path == NULL) usage();
+        benchmarkFile(path, benchIterations, countEvents);
+    } else if (countEvents) {
+        usage();
+    } else if (path == NULL) {
+        repl();
+    } else {
+        status = runFile(path);
+    }
+
+    if (profilePath != NULL) writeProfile(profilePath);
+
+    freeVM(&machine);
+    return status;
+}
+
+/**
+ * Reads expressions line by line from standard input and evaluates each one.
+ */
+static void repl() {
+    char line[1024];
+
+    for (;;) {
+        printf("> ");
+        fflush(stdout);
+
+        if (!fgets(line, sizeof(line), stdin)) {
+            printf("\n");
+            break;
+        }
+
+        interpret(line);
+        flushOutput(&vm->output);
+    }
+}
+
+/**
+ * Evaluates the script at the given path.
+ *
+ * @param path The path of the script to run.
+ * @return The status to exit with: 0, or 65 after a compile error and 70
+ *         after a runtime error.
+ */
+static int runFile(const char *path) {
+    char *source = readFile(path);
+    const InterpretResult result = interpret(source);
+    free(source);
+
+    if (result == INTERPRET_COMPILE_ERROR) return 65;
+    if (result == INTERPRET_RUNTIME_ERROR) return 70;
     return 0;
 }
+
+/**
+ * Runs a prelude script and writes the global variables it leaves behind to
+ * a heap image that --image loads. The script's result is not printed.
+ *
+ * @param path The path of the prelude script.
+ * @param imagePath The path of the image to write.
+ * @return The status to exit with: 0, 65 after a compile error, 70 after a
+ *         runtime error and 74 if the image could not be written.
+ */
+static int snapshotFile(const char *path, const char *imagePath) {
+    char *source = readFile(path);
+    const InterpretResult result = evaluateClox(&machine, source, NULL);
+    free(source);
+
+    if (result == INTERPRET_COMPILE_ERROR) return 65;
+    if (result == INTERPRET_RUNTIME_ERROR) return 70;
+    if (!writeSnapshot(imagePath)) {
+        fprintf(stderr, "Could not write image \"%s\".\n", imagePath);
+        return 74;
+    }
+    return 0;
+}
+
+/**
+ * Benchmarks the script at the given path and prints the timings as JSON.
+ *
+ * @param path The path of the script to benchmark.
+ * @param iterations How often the script is compiled and run.
+ * @param countEvents Whether to add hardware performance counters to the report.
+ */
+static void benchmarkFile(const char *path, const int iterations, const bool countEvents) {
+    char *source = readFile(path);
+
+    BenchmarkResult result;
+    runBenchmark(path, source, iterations, countEvents, &result);
+    printBenchmarkJson(&result);
+
+    free(source);
+}
+
+/**
+ * Stops the profiler, writes the sampled stacks in folded format to the
+ * given path and prints the per-line hit table to standard error.
+ *
+ * @param path The path of the folded stacks file.
+ */
+static void writeProfile(const char *path) {
+    stopProfiler();
+
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Could not write profile \"%s\".\n", path);
+    } else {
+        writeProfileFolded(file);
+        fclose(file);
+    }
+
+    writeProfileLineTable(stderr);
+    freeProfiler();
+}
+
+/**
+ * Reads a whole file into a newly allocated, NUL-terminated buffer.
+ *
+ * Exits the process if the file cannot be read.
+ *
+ * @param path The path of the file to read.
+ * @return The file's contents. The caller frees the buffer.
+ */
+static char *readFile(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        exit(74);
+    }
+
+    fseek(file, 0L, SEEK_END);
+    const size_t fileSize = ftell(file);
+    rewind(file);
+
+    char *buffer = malloc(fileSize + 1);
+    if (buffer == NULL) {
+        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
+        exit(74);
+    }
+
+    const size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
+    if (bytesRead < fileSize) {
+        fprintf(stderr, "Could not read file \"%s\".\n", path);
+        exit(74);
+    }
+
+    buffer[bytesRead] = '\0';
+
+    fclose(file);
+    return buffer;
+}
+
+static FrontEnd parseFrontEnd(const char *name) {
+    static const FrontEnd frontEnds[] = {
+        FRONT_END_AUTO, FRONT_END_STREAMING, FRONT_END_PRETOKENIZED, FRONT_END_PIPELINED,
+    };
+
+    for (size_t i = 0; i < sizeof(frontEnds) / sizeof(frontEnds[0]); i++) {
+        if (strcmp(name, frontEndName(frontEnds[i])) == 0) return frontEnds[i];
+    }
+
+    usage();
+    return FRONT_END_AUTO;
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: cloxvm [--register] [--optimize] [--front-end name] [--image in.img] [--bench iterations [--counters]] [--profile out.folded] [path]\n"
+                    "       cloxvm [--register] [--optimize] [--image in.img] --snapshot prelude.lox -o out.img\n"
+                    "       cloxvm [--register] [--optimize] --serve socket [--workers count]\n"
+                    "\n"
+                    "--register is experimental: it only covers scripts that are arithmetic on\n"
+                    "literals. Anything else, such as variables, blocks, functions, classes or\n"
+                    "control flow, runs as stack bytecode.\n");
+    exit(64);
+}
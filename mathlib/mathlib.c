@@ -0,0 +1,405 @@
+#include "mathlib.h"
+#include "../native/native.h"
+#include "../object/object.h"
+
+#include <math.h>
+
+// The batch kernels are plain loops annotated for the vectorizer.
+// CMakeLists.txt builds this file with optimizations, OpenMP SIMD pragmas
+// and without errno for math functions. VECTORIZE marks a loop whose
+// iterations are independent, which also holds when a kernel writes its
+// results over its input. REDUCE additionally lets the compiler reorder a
+// reduction, so sums and dot products are split across vector lanes and
+// may round differently than a sequential loop would.
+#if defined(__GNUC__)
+#define PRAGMA(text) _Pragma(#text)
+#define VECTORIZE PRAGMA(omp simd)
+#define REDUCE(clause) PRAGMA(omp simd reduction(clause))
+#else
+#define VECTORIZE
+#define REDUCE(clause)
+#endif
+
+// On x86-64 Linux every kernel is compiled twice, for SSE2 and for AVX2,
+// and the dynamic loader picks the version the processor supports.
+#if defined(__x86_64__) && defined(__linux__) && defined(__has_attribute)
+#if __has_attribute(target_clones)
+#define KERNEL __attribute__((target_clones("avx2", "default")))
+#endif
+#endif
+#ifndef KERNEL
+#define KERNEL
+#endif
+
+static bool batchNative(Value *args, void (*kernel)(const double *, double *, int));
+
+static void sqrtKernel(const double *in, double *out, int count);
+
+static void absKernel(const double *in, double *out, int count);
+
+static void clampKernel(const double *in, double *out, int count, double low, double high);
+
+static void addKernel(const double *a, const double *b, double *out, int count);
+
+static void mulKernel(const double *a, const double *b, double *out, int count);
+
+static double sumKernel(const double *in, int count);
+
+static double dotKernel(const double *a, const double *b, int count);
+
+static double minKernel(const double *in, int count);
+
+static double maxKernel(const double *in, int count);
+
+#define UNARY_NATIVE(name, function)                                        \
+    static bool name##Native(CloxVM *machine, const int argCount, Value *args) { \
+        (void) argCount;                                                    \
+        if (!IS_NUMERIC(args[0])) return cloxNativeError(machine, #name "() expects a number."); \
+        args[-1] = NUMBER_VAL(function(AS_DOUBLE(args[0])));               \
+        return true;                                                        \
+    }
+
+// Like UNARY_NATIVE, but an array argument is mapped to a new array with
+// a batch kernel.
+#define BATCH_NATIVE(name, function, kernel)                                \
+    static bool name##Native(CloxVM *machine, const int argCount, Value *args) { \
+        (void) argCount;                                                    \
+        if (IS_ARRAY(args[0])) return batchNative(args, kernel);            \
+        if (!IS_NUMERIC(args[0])) return cloxNativeError(machine, #name "() expects a number or an array."); \
+        args[-1] = NUMBER_VAL(function(AS_DOUBLE(args[0])));               \
+        return true;                                                        \
+    }
+
+BATCH_NATIVE(sqrt, sqrt, sqrtBatch)
+BATCH_NATIVE(exp, exp, expBatch)
+BATCH_NATIVE(log, log, logBatch)
+UNARY_NATIVE(sin, sin)
+UNARY_NATIVE(cos, cos)
+
+static bool floorNative(CloxVM *machine, const int argCount, Value *args) {
+    (void) argCount;
+    if (!IS_NUMERIC(args[0])) return cloxNativeError(machine, "floor() expects a number.");
+    if (IS_NUMBER(args[0])) args[-1] = NUMBER_VAL(floor(AS_NUMBER(args[0])));
+    else args[-1] = args[0];
+    return true;
+}
+
+static bool ceilNative(CloxVM *machine, const int argCount, Value *args) {
+    (void) argCount;
+    if (!IS_NUMERIC(args[0])) return cloxNativeError(machine, "ceil() expects a number.");
+    if (IS_NUMBER(args[0])) args[-1] = NUMBER_VAL(ceil(AS_NUMBER(args[0])));
+    else args[-1] = args[0];
+    return true;
+}
+
+static bool absNative(CloxVM *machine, const int argCount, Value *args) {
+    (void) argCount;
+    const Value x = args[0];
+    if (IS_INT(x)) {
+        if (AS_INT(x) >= 0) args[-1] = x;
+        else if (AS_INT(x) == INT64_MIN) args[-1] = NUMBER_VAL(-(double) AS_INT(x));
+        else args[-1] = INT_VAL(-AS_INT(x));
+        return true;
+    }
+    if (IS_ARRAY(x)) return batchNative(args, absBatch);
+    if (!IS_NUMBER(x)) return cloxNativeError(machine, "abs() expects a number or an array.");
+    args[-1] = NUMBER_VAL(fabs(AS_NUMBER(x)));
+    return true;
+}
+
+static bool powNative(CloxVM *machine, const int argCount, Value *args) {
+    (void) argCount;
+    if (!IS_NUMERIC(args[0]) || !IS_NUMERIC(args[1])) return cloxNativeError(machine, "pow() expects numbers.");
+    args[-1] = NUMBER_VAL(pow(AS_DOUBLE(args[0]), AS_DOUBLE(args[1])));
+    return true;
+}
+
+// min(), max() and clamp() return one of their arguments unchanged, so
+// integers stay integers. Given a single array, min() and max() reduce it.
+static bool minNative(CloxVM *machine, const int argCount, Value *args) {
+    if (argCount == 1 && IS_ARRAY(args[0])) {
+        const ObjArray *array = AS_ARRAY(args[0]);
+        if (array->count == 0) return cloxNativeError(machine, "min() of an empty array.");
+        args[-1] = NUMBER_VAL(minBatch(array->values, array->count));
+        return true;
+    }
+    if (argCount != 2 || !IS_NUMERIC(args[0]) || !IS_NUMERIC(args[1])) {
+        return cloxNativeError(machine, "min() expects two numbers or an array.");
+    }
+    args[-1] = AS_DOUBLE(args[1]) < AS_DOUBLE(args[0]) ? args[1] : args[0];
+    return true;
+}
+
+static bool maxNative(CloxVM *machine, const int argCount, Value *args) {
+    if (argCount == 1 && IS_ARRAY(args[0])) {
+        const ObjArray *array = AS_ARRAY(args[0]);
+        if (array->count == 0) return cloxNativeError(machine, "max() of an empty array.");
+        args[-1] = NUMBER_VAL(maxBatch(array->values, array->count));
+        return true;
+    }
+    if (argCount != 2 || !IS_NUMERIC(args[0]) || !IS_NUMERIC(args[1])) {
+        return cloxNativeError(machine, "max() expects two numbers or an array.");
+    }
+    args[-1] = AS_DOUBLE(args[1]) > AS_DOUBLE(args[0]) ? args[1] : args[0];
+    return true;
+}
+
+static bool clampNative(CloxVM *machine, const int argCount, Value *args) {
+    (void) argCount;
+    if (!IS_NUMERIC(args[1]) || !IS_NUMERIC(args[2])) return cloxNativeError(machine, "clamp() expects numbers.");
+    if (IS_ARRAY(args[0])) {
+        const int count = AS_ARRAY(args[0])->count;
+        ObjArray *result = newArray(count);
+        clampBatch(AS_ARRAY(args[0])->values, result->values, count, AS_DOUBLE(args[1]), AS_DOUBLE(args[2]));
+        args[-1] = OBJ_VAL(result);
+        return true;
+    }
+    if (!IS_NUMERIC(args[0])) return cloxNativeError(machine, "clamp() expects numbers.");
+
+    const double x = AS_DOUBLE(args[0]);
+    if (x < AS_DOUBLE(args[1])) args[-1] = args[1];
+    else if (x > AS_DOUBLE(args[2])) args[-1] = args[2];
+    else args[-1] = args[0];
+    return true;
+}
+
+/**
+ * Registers the math library with the current VM: sqrt, exp, log, sin,
+ * cos, floor, ceil, abs, pow, min, max and clamp.
+ */
+void defineMathNatives() {
+    defineNative("sqrt", 1, sqrtNative);
+    defineNative("exp", 1, expNative);
+    defineNative("log", 1, logNative);
+    defineNative("sin", 1, sinNative);
+    defineNative("cos", 1, cosNative);
+    defineNative("floor", 1, floorNative);
+    defineNative("ceil", 1, ceilNative);
+    defineNative("abs", 1, absNative);
+    defineNative("pow", 2, powNative);
+    defineNative("min", -1, minNative);
+    defineNative("max", -1, maxNative);
+    defineNative("clamp", 3, clampNative);
+}
+
+/**
+ * Computes the square roots of an array of doubles. This and the other
+ * elementwise kernels may write their results over an input.
+ *
+ * @param in The input.
+ * @param out Receives the results. Either in itself or an array that does
+ *            not overlap it.
+ * @param count The number of elements.
+ */
+void sqrtBatch(const double *in, double *out, const int count) {
+    sqrtKernel(in, out, count);
+}
+
+/**
+ * Computes the absolute values of an array of doubles.
+ *
+ * @param in The input.
+ * @param out Receives the results.
+ * @param count The number of elements.
+ */
+void absBatch(const double *in, double *out, const int count) {
+    absKernel(in, out, count);
+}
+
+/**
+ * Clamps an array of doubles to a range. The comparisons are written so
+ * that they map onto vector minimum and maximum instructions.
+ *
+ * @param in The input.
+ * @param out Receives the results.
+ * @param count The number of elements.
+ * @param low The lower bound.
+ * @param high The upper bound.
+ */
+void clampBatch(const double *in, double *out, const int count, const double low, const double high) {
+    clampKernel(in, out, count, low, high);
+}
+
+/**
+ * Adds two arrays of doubles elementwise.
+ *
+ * @param a The first summands.
+ * @param b The second summands.
+ * @param out Receives the sums.
+ * @param count The number of elements.
+ */
+void addBatch(const double *a, const double *b, double *out, const int count) {
+    addKernel(a, b, out, count);
+}
+
+/**
+ * Multiplies two arrays of doubles elementwise.
+ *
+ * @param a The first factors.
+ * @param b The second factors.
+ * @param out Receives the products.
+ * @param count The number of elements.
+ */
+void mulBatch(const double *a, const double *b, double *out, const int count) {
+    mulKernel(a, b, out, count);
+}
+
+/**
+ * Adds up an array of doubles.
+ *
+ * @param in The summands.
+ * @param count The number of elements.
+ * @return The sum, 0 for no elements.
+ */
+double sumBatch(const double *in, const int count) {
+    return sumKernel(in, count);
+}
+
+/**
+ * Computes the dot product of two arrays of doubles.
+ *
+ * @param a The first vector.
+ * @param b The second vector.
+ * @param count The number of elements of each.
+ * @return The dot product, 0 for no elements.
+ */
+double dotBatch(const double *a, const double *b, const int count) {
+    return dotKernel(a, b, count);
+}
+
+/**
+ * Finds the smallest element of an array of doubles.
+ *
+ * @param in The elements.
+ * @param count The number of elements, at least 1.
+ * @return The smallest element.
+ */
+double minBatch(const double *in, const int count) {
+    return minKernel(in, count);
+}
+
+/**
+ * Finds the largest element of an array of doubles.
+ *
+ * @param in The elements.
+ * @param count The number of elements, at least 1.
+ * @return The largest element.
+ */
+double maxBatch(const double *in, const int count) {
+    return maxKernel(in, count);
+}
+
+/**
+ * Computes e to the power of each element of an array. Unlike the other
+ * kernels this calls the C library once per element; it only saves the
+ * interpreter's per-call overhead.
+ *
+ * @param in The input.
+ * @param out Receives the results.
+ * @param count The number of elements.
+ */
+void expBatch(const double *in, double *out, const int count) {
+    for (int i = 0; i < count; i++) {
+        out[i] = exp(in[i]);
+    }
+}
+
+/**
+ * Computes the natural logarithm of each element of an array, one C
+ * library call per element like expBatch().
+ *
+ * @param in The input.
+ * @param out Receives the results.
+ * @param count The number of elements.
+ */
+void logBatch(const double *in, double *out, const int count) {
+    for (int i = 0; i < count; i++) {
+        out[i] = log(in[i]);
+    }
+}
+
+// Applies an elementwise kernel to the array in args[0], returning a new
+// array. The argument keeps the input reachable while the result is
+// allocated.
+static bool batchNative(Value *args, void (*kernel)(const double *, double *, int)) {
+    const int count = AS_ARRAY(args[0])->count;
+    ObjArray *result = newArray(count);
+    kernel(AS_ARRAY(args[0])->values, result->values, count);
+    args[-1] = OBJ_VAL(result);
+    return true;
+}
+
+// The vector loops behind the batch functions above. They are static
+// because GCC exports the resolver that picks a clone of any other function,
+// whatever its visibility.
+static KERNEL void sqrtKernel(const double *in, double *out, const int count) {
+    VECTORIZE
+    for (int i = 0; i < count; i++) {
+        out[i] = sqrt(in[i]);
+    }
+}
+
+static KERNEL void absKernel(const double *in, double *out, const int count) {
+    VECTORIZE
+    for (int i = 0; i < count; i++) {
+        out[i] = fabs(in[i]);
+    }
+}
+
+static KERNEL void clampKernel(const double *in, double *out, const int count, const double low, const double high) {
+    VECTORIZE
+    for (int i = 0; i < count; i++) {
+        const double x = in[i] < low ? low : in[i];
+        out[i] = x > high ? high : x;
+    }
+}
+
+static KERNEL void addKernel(const double *a, const double *b, double *out, const int count) {
+    VECTORIZE
+    for (int i = 0; i < count; i++) {
+        out[i] = a[i] + b[i];
+    }
+}
+
+static KERNEL void mulKernel(const double *a, const double *b, double *out, const int count) {
+    VECTORIZE
+    for (int i = 0; i < count; i++) {
+        out[i] = a[i] * b[i];
+    }
+}
+
+static KERNEL double sumKernel(const double *in, const int count) {
+    double sum = 0;
+    REDUCE(+:sum)
+    for (int i = 0; i < count; i++) {
+        sum += in[i];
+    }
+    return sum;
+}
+
+static KERNEL double dotKernel(const double *a, const double *b, const int count) {
+    double sum = 0;
+    REDUCE(+:sum)
+    for (int i = 0; i < count; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+static KERNEL double minKernel(const double *in, const int count) {
+    double low = in[0];
+    REDUCE(min:low)
+    for (int i = 1; i < count; i++) {
+        low = in[i] < low ? in[i] : low;
+    }
+    return low;
+}
+
+static KERNEL double maxKernel(const double *in, const int count) {
+    double high = in[0];
+    REDUCE(max:high)
+    for (int i = 1; i < count; i++) {
+        high = in[i] > high ? in[i] : high;
+    }
+    return high;
+}
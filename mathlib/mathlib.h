@@ -0,0 +1,30 @@
+#ifndef CLOXVM_MATHLIB_H
+#define CLOXVM_MATHLIB_H
+
+#include "../common.h"
+
+void defineMathNatives();
+
+void sqrtBatch(const double *in, double *out, int count);
+
+void absBatch(const double *in, double *out, int count);
+
+void clampBatch(const double *in, double *out, int count, double low, double high);
+
+void addBatch(const double *a, const double *b, double *out, int count);
+
+void mulBatch(const double *a, const double *b, double *out, int count);
+
+double sumBatch(const double *in, int count);
+
+double dotBatch(const double *a, const double *b, int count);
+
+double minBatch(const double *in, int count);
+
+double maxBatch(const double *in, int count);
+
+void expBatch(const double *in, double *out, int count);
+
+void logBatch(const double *in, double *out, int count);
+
+#endif //CLOXVM_MATHLIB_H
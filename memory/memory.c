@@ -2,24 +2,638 @@
 // Created by sascha-roggatz on 25.10.24.
 //
 
+#include <limits.h>
 #include <stdlib.h>
+#include <string.h>
 #include "memory.h"
+#include "../object/object.h"
+#include "../native/native.h"
+#include "../shape/shape.h"
+#include "../table/table.h"
+#include "../vm/vm.h"
+
+static void *allocate(void *pointer, size_t oldSize, size_t newSize);
+
+static void collectGarbageStep();
+
+static void beginCycle();
+
+static void finishCycle();
+
+static void markRoots();
+
+static int traceReferences(int work);
+
+static void blackenObject(Obj *object);
+
+static void finishMarking();
+
+static int sweep(int work);
+
+static void forwardValue(Value *value);
+
+static Obj *promote(Obj *object);
+
+static void forwardReferences(Obj *object);
+
+static void sweepNursery();
 
 /**
  * Reallocates memory for a given pointer to a new size.
  *
+ * Goes through the current VM's allocator if the embedder installed one.
+ * Running out of memory is fatal either way.
+ *
+ * This is also where the garbage collector runs. Every allocation counts
+ * towards the VM's heap size; once it passes the threshold a collection
+ * starts, and from then on each allocation does one bounded step of it
+ * until it is done. Callers must therefore keep every object they still
+ * need reachable from a root, typically by pushing it onto the VM stack,
+ * before allocating.
+ *
  * @param pointer    The original memory block pointer.
  * @param oldSize    The size of the original memory block.
  * @param newSize    The size of the new memory block.
  * @return           A pointer to the newly allocated memory block, or NULL if newSize is 0.
  */
 void* reallocate(void *pointer, size_t oldSize, size_t newSize) {
+    if (vm != NULL) {
+        vm->bytesAllocated += newSize - oldSize;
+
+        if (newSize > oldSize && !vm->collecting) {
+#ifdef DEBUG_STRESS_GC
+            collectGarbage();
+#else
+            if (vm->gcPhase != GC_IDLE || vm->bytesAllocated > vm->nextGC) collectGarbageStep();
+#endif
+        }
+    }
+
+    return allocate(pointer, oldSize, newSize);
+}
+
+/**
+ * Runs a complete collection. A collection already in progress is finished
+ * first, so that objects it had to keep because they were allocated while
+ * it ran are reconsidered too.
+ */
+void collectGarbage() {
+    vm->collecting = true;
+
+    if (vm->gcPhase != GC_IDLE) finishCycle();
+    beginCycle();
+    finishCycle();
+
+    vm->collecting = false;
+}
+
+/**
+ * Marks an object as reachable and queues it for tracing its references.
+ *
+ * @param object The object to mark, or NULL.
+ */
+void markObject(Obj *object) {
+    if (object == NULL || isMarked(object)) return;
+    object->isMarked = vm->markBit;
+
+    if (vm->grayCount == vm->grayCapacity) {
+        const int oldCapacity = vm->grayCapacity;
+        vm->grayCapacity = GROW_CAPACITY(oldCapacity);
+        vm->grayStack = allocate(vm->grayStack, sizeof(Obj *) * oldCapacity,
+                                 sizeof(Obj *) * vm->grayCapacity);
+    }
+    vm->grayStack[vm->grayCount++] = object;
+}
+
+/**
+ * Marks the object a value refers to, if any. The undefined sentinel of a
+ * global slot refers to the variable's name.
+ *
+ * @param value The value to mark.
+ */
+void markValue(const Value value) {
+    if (IS_OBJ(value) || IS_UNDEFINED(value)) markObject(AS_OBJ(value));
+}
+
+/**
+ * Tells whether an object has been reached by the current collection.
+ *
+ * Instead of clearing every mark after a collection, the meaning of the
+ * mark bit flips with each collection, which makes all surviving objects
+ * unmarked at once. New objects get the current bit, so objects allocated
+ * while a collection runs survive it.
+ *
+ * @param object The object to test.
+ * @return true if the object is marked.
+ */
+bool isMarked(const Obj *object) {
+    return object->isMarked == vm->markBit;
+}
+
+/**
+ * Makes a chunk's constants roots of the current VM until the chunk is
+ * freed. Does nothing for a chunk that is already tracked.
+ *
+ * @param chunk The chunk to track.
+ */
+void trackChunk(Chunk *chunk) {
+    if (chunk->isRoot) return;
+
+    chunk->isRoot = true;
+    chunk->previousRoot = NULL;
+    chunk->nextRoot = vm->chunks;
+    if (vm->chunks != NULL) vm->chunks->previousRoot = chunk;
+    vm->chunks = chunk;
+}
+
+/**
+ * Stops treating a chunk's constants as roots.
+ *
+ * @param chunk The chunk to untrack. Untracked chunks are ignored.
+ */
+void untrackChunk(Chunk *chunk) {
+    if (!chunk->isRoot) return;
+
+    if (chunk->previousRoot != NULL) {
+        chunk->previousRoot->nextRoot = chunk->nextRoot;
+    } else {
+        vm->chunks = chunk->nextRoot;
+    }
+    if (chunk->nextRoot != NULL) chunk->nextRoot->previousRoot = chunk->previousRoot;
+    chunk->isRoot = false;
+}
+
+/**
+ * Frees the current VM's gray stack.
+ */
+void freeGrayStack() {
+    allocate(vm->grayStack, sizeof(Obj *) * vm->grayCapacity, 0);
+    vm->grayStack = NULL;
+    vm->grayCount = 0;
+    vm->grayCapacity = 0;
+}
+
+/**
+ * Frees the current VM's list of remembered objects.
+ */
+void freeRememberedObjects() {
+    allocate(vm->rememberedObjects, sizeof(Obj *) * vm->rememberedObjectCapacity, 0);
+    vm->rememberedObjects = NULL;
+    vm->rememberedObjectCount = 0;
+    vm->rememberedObjectCapacity = 0;
+}
+
+/**
+ * Frees the current VM's nursery, along with the field arrays of the
+ * instances still in it.
+ */
+void freeNursery() {
+    for (char *cursor = vm->nursery.start; cursor < vm->nursery.top;) {
+        Obj *object = (Obj *) cursor;
+        cursor += ALIGN_OBJECT(objectSize(object));
+        if (object->type == OBJ_INSTANCE) freeFields((ObjInstance *) object);
+    }
+    FREE_ARRAY(char, vm->nursery.start, NURSERY_SIZE);
+    vm->nursery.start = NULL;
+    vm->nursery.top = NULL;
+    vm->nursery.end = NULL;
+}
+
+/**
+ * Bump-allocates a young object in the nursery.
+ *
+ * Allocating never moves objects, so callers may hold object pointers
+ * across it. When the nursery has no room left, the allocation fails and a
+ * minor collection is requested instead; the interpreter runs it with
+ * collectNursery() at the next point where every live object is in a root.
+ *
+ * @param size The size of the object.
+ * @return The uninitialized object, or NULL if it must go to the old generation.
+ */
+void *allocateYoung(const size_t size) {
+    const size_t aligned = ALIGN_OBJECT(size);
+    if (aligned > NURSERY_MAX_OBJECT) return NULL;
+
+    if ((size_t) (vm->nursery.end - vm->nursery.top) < aligned) {
+        vm->nurseryFull = true;
+        return NULL;
+    }
+
+    void *object = vm->nursery.top;
+    vm->nursery.top += aligned;
+#ifdef DEBUG_STRESS_GC
+    vm->nurseryFull = true;
+#endif
+    return object;
+}
+
+/**
+ * Gives back the most recent young allocation.
+ *
+ * @param object The object allocateYoung() returned last.
+ * @param size The size it was allocated with.
+ */
+void releaseYoung(void *object, const size_t size) {
+    if (vm->nursery.top - ALIGN_OBJECT(size) == (char *) object) vm->nursery.top = object;
+}
+
+/**
+ * Runs a minor collection: every young object reachable from the roots is
+ * copied into the old generation and the nursery is emptied.
+ *
+ * Only live young objects are copied. The roots are the value stack, the
+ * last result, the global slots and objects the write barriers remembered
+ * as holding a young object and, while a major collection is
+ * marking, its gray stack. Old-generation objects never refer to young ones
+ * except through those remembered places, so the rest of the heap is not
+ * looked at.
+ *
+ * Objects move, so this must only run when no C code holds pointers to
+ * young objects.
+ */
+void collectNursery() {
+    vm->collecting = true;
+    Obj *scanned = vm->objects;
+
+    for (Value *slot = vm->stack; slot < vm->stackTop; slot++) {
+        forwardValue(slot);
+    }
+    for (int i = 0; i < vm->rememberedCount; i++) {
+        const int slot = vm->rememberedGlobals[i];
+        forwardValue(&vm->globals.values[slot]);
+        vm->globalRemembered[slot] = false;
+    }
+    vm->rememberedCount = 0;
+    for (int i = 0; i < vm->rememberedObjectCount; i++) {
+        Obj *object = vm->rememberedObjects[i];
+        forwardReferences(object);
+        object->isRemembered = false;
+    }
+    vm->rememberedObjectCount = 0;
+    forwardValue(&vm->result);
+    for (int i = 0; i < vm->grayCount; i++) {
+        Obj *object = vm->grayStack[i];
+        if (isYoungObject(vm, object)) vm->grayStack[i] = promote(object);
+    }
+
+    // Promoted objects are put in front of the object list. Each pass
+    // forwards the references of the objects the previous pass promoted.
+    while (vm->objects != scanned) {
+        Obj *first = vm->objects;
+        for (Obj *object = first; object != scanned; object = object->next) {
+            forwardReferences(object);
+        }
+        scanned = first;
+    }
+
+    sweepNursery();
+    vm->nursery.top = vm->nursery.start;
+    vm->nurseryFull = false;
+    vm->collecting = false;
+}
+
+/**
+ * The write barrier for global variables. The globals array is old
+ * storage: a young object stored into it is only found by the next minor
+ * collection if its slot is remembered.
+ *
+ * @param slot The global slot that now holds a young object.
+ */
+void rememberGlobal(const int slot) {
+    if (vm->globalRemembered[slot]) return;
+    vm->globalRemembered[slot] = true;
+    vm->rememberedGlobals[vm->rememberedCount++] = slot;
+}
+
+/**
+ * The write barrier for objects, to be called after a value was stored into
+ * a closed upvalue or an instance's field. A young value in an old object
+ * is only found by the next minor collection if the object is remembered,
+ * and while a collection is marking, the value is grayed in case the
+ * object has been traced already. Remembered objects are kept alive until
+ * that minor collection.
+ *
+ * @param object The object that was written.
+ * @param value The value stored into it.
+ */
+void writeBarrier(Obj *object, const Value value) {
+    if (vm->gcPhase == GC_MARKING) markValue(value);
+    if (object->isRemembered || !isYoungValue(vm, value) || isYoungObject(vm, object)) return;
+
+    if (vm->rememberedObjectCount == vm->rememberedObjectCapacity) {
+        const int oldCapacity = vm->rememberedObjectCapacity;
+        vm->rememberedObjectCapacity = GROW_CAPACITY(oldCapacity);
+        vm->rememberedObjects = allocate(vm->rememberedObjects, sizeof(Obj *) * oldCapacity,
+                                         sizeof(Obj *) * vm->rememberedObjectCapacity);
+    }
+    object->isRemembered = true;
+    vm->rememberedObjects[vm->rememberedObjectCount++] = object;
+}
+
+/**
+ * Allocates without counting towards the heap size or collecting. The
+ * collector itself allocates its gray stack this way.
+ */
+static void *allocate(void *pointer, const size_t oldSize, const size_t newSize) {
+    if (vm != NULL && vm->reallocate != NULL) {
+        void *result = vm->reallocate(pointer, oldSize, newSize, vm->allocatorData);
+        if (result == NULL && newSize != 0) exit(1);
+        return newSize == 0 ? NULL : result;
+    }
     if (newSize == 0) {
         free(pointer);
         return NULL;
     }
-
     void *result = realloc(pointer, newSize);
     if (result == NULL) exit(1);
     return result;
 }
+
+/**
+ * Does a bounded amount of collection work: starts a collection if none is
+ * running, then marks and sweeps up to GC_STEP_WORK objects.
+ */
+static void collectGarbageStep() {
+    vm->collecting = true;
+
+    if (vm->gcPhase == GC_IDLE) beginCycle();
+
+    int work = GC_STEP_WORK;
+    if (vm->gcPhase == GC_MARKING) {
+        work = traceReferences(work);
+        if (vm->grayCount == 0) finishMarking();
+    }
+    if (vm->gcPhase == GC_SWEEPING && work > 0) sweep(work);
+
+    vm->collecting = false;
+}
+
+/**
+ * Starts a collection by flipping the mark bit, which turns every object
+ * white, and graying the roots.
+ */
+static void beginCycle() {
+    vm->markBit = !vm->markBit;
+    vm->gcPhase = GC_MARKING;
+    markRoots();
+}
+
+/**
+ * Runs the rest of the current collection without a work budget.
+ */
+static void finishCycle() {
+    if (vm->gcPhase == GC_MARKING) {
+        traceReferences(INT_MAX);
+        finishMarking();
+    }
+    sweep(INT_MAX);
+}
+
+/**
+ * Grays everything the VM reaches directly: the value stack, the closures
+ * of the running calls, the open upvalues and the remembered objects, the
+ * global variables with their names, the registered natives, the
+ * constants of every compiled chunk that has not been freed yet and the
+ * result of the last run. Interned strings are not roots; the intern table
+ * only refers to them weakly.
+ */
+static void markRoots() {
+    for (const Value *slot = vm->stack; slot < vm->stackTop; slot++) {
+        markValue(*slot);
+    }
+
+    for (int i = 0; i < vm->frameCount; i++) {
+        markObject((Obj *) vm->frames[i].callee);
+    }
+
+    for (ObjUpvalue *upvalue = vm->openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+        markObject(&upvalue->obj);
+    }
+    for (int i = 0; i < vm->rememberedObjectCount; i++) {
+        markObject(vm->rememberedObjects[i]);
+    }
+
+    for (int i = 0; i < vm->globals.count; i++) {
+        markValue(vm->globals.values[i]);
+    }
+    markTable(&vm->globalSlots);
+    markNatives();
+
+    for (const Chunk *chunk = vm->chunks; chunk != NULL; chunk = chunk->nextRoot) {
+        for (int i = 0; i < chunk->constants.count; i++) {
+            markValue(chunk->constants.values[i]);
+        }
+    }
+
+    markValue(vm->result);
+}
+
+/**
+ * Blackens gray objects until none are left or the work budget is spent.
+ *
+ * @return The work left over.
+ */
+static int traceReferences(int work) {
+    while (vm->grayCount > 0 && work > 0) {
+        blackenObject(vm->grayStack[--vm->grayCount]);
+        work--;
+    }
+    return work;
+}
+
+/**
+ * Marks everything an object refers to. The roots are rescanned when
+ * marking finishes, but objects are not, so every store of a reference into
+ * an object needs a write barrier that grays the stored object while the
+ * collector is marking. A function's constants only grow while its body is
+ * compiled, and addConstant() is their barrier; writeBarrier() is the one
+ * for closed upvalues, fields and methods. An open upvalue's value is on
+ * the stack.
+ */
+static void blackenObject(Obj *object) {
+    switch (object->type) {
+        case OBJ_STRING:
+            break;
+        case OBJ_FUNCTION: {
+            const ObjFunction *function = (ObjFunction *) object;
+            markObject(&function->name->obj);
+            for (int i = 0; i < function->captureCount; i++) {
+                markObject(&function->captures[i].name->obj);
+            }
+            for (int i = 0; i < function->chunk.constants.count; i++) {
+                markValue(function->chunk.constants.values[i]);
+            }
+            break;
+        }
+        case OBJ_CLOSURE: {
+            ObjClosure *closure = (ObjClosure *) object;
+            markObject(&closure->function->obj);
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                markObject((Obj *) closure->upvalues[i]);
+            }
+            break;
+        }
+        case OBJ_UPVALUE:
+            markValue(((ObjUpvalue *) object)->closed);
+            break;
+        case OBJ_CLASS: {
+            const ObjClass *klass = (ObjClass *) object;
+            markObject(&klass->name->obj);
+            markTable(&klass->methods);
+            markValue(klass->initializer);
+            markShapeTree(klass->shape);
+            break;
+        }
+        case OBJ_INSTANCE: {
+            const ObjInstance *instance = (ObjInstance *) object;
+            markObject(&instance->klass->obj);
+            for (int i = 0; i < instance->shape->fieldCount; i++) {
+                markValue(instance->fields[i]);
+            }
+            break;
+        }
+        case OBJ_BOUND_METHOD: {
+            const ObjBoundMethod *bound = (ObjBoundMethod *) object;
+            markValue(bound->receiver);
+            markValue(bound->method);
+            break;
+        }
+        case OBJ_NATIVE:
+            markObject(&((ObjNative *) object)->name->obj);
+            break;
+        case OBJ_ARRAY:
+            break;
+    }
+}
+
+/**
+ * Ends marking. The roots are marked again, since the program went on
+ * running between steps and may have moved objects into them, and what
+ * they reach is traced to the end. Interned strings that are still white
+ * are dead and leave the intern table before sweeping frees them.
+ */
+static void finishMarking() {
+    markRoots();
+    traceReferences(INT_MAX);
+    tableRemoveWhite(&vm->strings);
+
+    vm->gcPhase = GC_SWEEPING;
+    vm->sweep = &vm->objects;
+}
+
+/**
+ * Frees unmarked objects until the end of the object list or until the work
+ * budget is spent. Objects allocated during the sweep are put in front of
+ * the list and are not visited. Finishing the sweep ends the collection and
+ * sets the heap size that starts the next one.
+ *
+ * @return The work left over.
+ */
+static int sweep(int work) {
+    while (*vm->sweep != NULL && work > 0) {
+        Obj *object = *vm->sweep;
+        if (isMarked(object)) {
+            vm->sweep = &object->next;
+        } else {
+            *vm->sweep = object->next;
+            freeObject(object);
+        }
+        work--;
+    }
+
+    if (*vm->sweep == NULL) {
+        vm->gcPhase = GC_IDLE;
+        vm->sweep = NULL;
+        sweepShapes();
+        // The intern table only refers to strings weakly, so its entries
+        // are not scaled like live data. Otherwise a table that grew while
+        // dead strings waited to be collected raises the next threshold,
+        // which lets even more of them pile up.
+        const size_t internBytes = sizeof(Entry) * vm->strings.capacity;
+        vm->nextGC = (size_t) ((double) (vm->bytesAllocated - internBytes) * vm->heapGrowthFactor);
+        if (vm->nextGC < GC_INITIAL_THRESHOLD) vm->nextGC = GC_INITIAL_THRESHOLD;
+        vm->nextGC += internBytes;
+    }
+    return work;
+}
+
+static void forwardValue(Value *value) {
+    if ((IS_OBJ(*value) || IS_UNDEFINED(*value)) && isYoungObject(vm, AS_OBJ(*value))) {
+        value->as.obj = promote(AS_OBJ(*value));
+    }
+}
+
+/**
+ * Copies a young object into the old generation, once. The young copy's
+ * next field, unused while it is young, points to the old copy from then on.
+ * Inline fields move along with their instance.
+ */
+static Obj *promote(Obj *object) {
+    if (object->next != NULL) return object->next;
+
+    const size_t size = objectSize(object);
+    Obj *copy = reallocate(NULL, 0, size);
+    memcpy(copy, object, size);
+    copy->isMarked = vm->markBit;
+    copy->next = vm->objects;
+    vm->objects = copy;
+    if (copy->type == OBJ_INSTANCE) {
+        ObjInstance *instance = (ObjInstance *) copy;
+        if (instance->fields == ((ObjInstance *) object)->inlineFields) instance->fields = instance->inlineFields;
+    }
+
+    object->next = copy;
+    return copy;
+}
+
+/**
+ * Promotes the young objects an object refers to. Strings, instances and
+ * bound methods are young; functions, closures, upvalues, classes, natives
+ * and arrays are allocated old and only refer to old objects, except for
+ * closed upvalues the write barrier remembered.
+ */
+static void forwardReferences(Obj *object) {
+    switch (object->type) {
+        case OBJ_UPVALUE:
+            forwardValue(&((ObjUpvalue *) object)->closed);
+            break;
+        case OBJ_INSTANCE: {
+            const ObjInstance *instance = (ObjInstance *) object;
+            for (int i = 0; i < instance->shape->fieldCount; i++) {
+                forwardValue(&instance->fields[i]);
+            }
+            break;
+        }
+        case OBJ_BOUND_METHOD:
+            forwardValue(&((ObjBoundMethod *) object)->receiver);
+            break;
+        case OBJ_STRING:
+        case OBJ_FUNCTION:
+        case OBJ_CLOSURE:
+        case OBJ_CLASS:
+        case OBJ_NATIVE:
+        case OBJ_ARRAY:
+            break;
+    }
+}
+
+/**
+ * Walks the nursery and brings the intern table up to date: promoted
+ * strings are re-keyed to their old copy and dead ones are dropped. Dead
+ * instances free the field arrays they own; a promoted one passed its array
+ * on to its copy.
+ */
+static void sweepNursery() {
+    for (char *cursor = vm->nursery.start; cursor < vm->nursery.top;) {
+        Obj *object = (Obj *) cursor;
+        cursor += ALIGN_OBJECT(objectSize(object));
+
+        if (object->type == OBJ_INSTANCE && object->next == NULL) freeFields((ObjInstance *) object);
+        if (object->type != OBJ_STRING) continue;
+        if (object->next != NULL) {
+            tableReplaceKey(&vm->strings, (ObjString *) object, (ObjString *) object->next);
+        } else {
+            tableDelete(&vm->strings, (ObjString *) object);
+        }
+    }
+}
@@ -6,6 +6,8 @@
 #define CLOXVM_MEMORY_H
 
 #include "../common.h"
+#include "../chunk/chunk.h"
+#include "../value/value.h"
 
 #define GROW_CAPACITY(capacity) \
     ((capacity) < 8 ? 8 : (capacity * 2))
@@ -16,8 +18,66 @@
 #define FREE_ARRAY(type, pointer, capacity) \
     reallocate(pointer, sizeof(type) * capacity, 0)
 
+// Heap size that starts the first collection, and the factor the heap may
+// grow by after a collection before the next one starts.
+#define GC_INITIAL_THRESHOLD (1024 * 1024)
+#define GC_HEAP_GROW_FACTOR 2.0
+
+// Objects marked or swept per collection step. Bounds the pause an
+// allocation can take while a collection is in progress.
+#define GC_STEP_WORK 256
+
+// Size of the nursery young objects are bump-allocated in, and the largest
+// object that is allocated there; bigger ones go to the old generation.
+#define NURSERY_SIZE (256 * 1024)
+#define NURSERY_MAX_OBJECT (NURSERY_SIZE / 8)
+
+#define ALIGN_OBJECT(size) (((size) + 7) & ~(size_t) 7)
+
+typedef enum {
+    GC_IDLE,
+    GC_MARKING,
+    GC_SWEEPING
+} GCPhase;
+
+/**
+ * The young generation: one block that objects are allocated from by
+ * bumping top towards end.
+ */
+typedef struct {
+    char *start;
+    char *top;
+    char *end;
+} Nursery;
 
 void *reallocate(void *pointer, size_t oldSize, size_t newSize);
 
+void collectGarbage();
+
+void markObject(Obj *object);
+
+void markValue(Value value);
+
+bool isMarked(const Obj *object);
+
+void trackChunk(Chunk *chunk);
+
+void untrackChunk(Chunk *chunk);
+
+void freeGrayStack();
+
+void freeRememberedObjects();
+
+void freeNursery();
+
+void *allocateYoung(size_t size);
+
+void releaseYoung(void *object, size_t size);
+
+void collectNursery();
+
+void rememberGlobal(int slot);
+
+void writeBarrier(Obj *object, Value value);
 
 #endif //CLOXVM_MEMORY_H
@@ -0,0 +1,100 @@
+#include "native.h"
+#include "../memory/memory.h"
+#include "../object/object.h"
+#include "../vm/vm.h"
+
+#include <string.h>
+
+static NativeEntry *findNative(const char *name, int length);
+
+/**
+ * Registers a native function under a global name. Scripts see it like a
+ * global variable that is defined from the start: it survives
+ * resetGlobals(), and a script may assign the name something else. A name
+ * that is registered again gets the new function.
+ *
+ * @param name The global name, NUL-terminated. It is copied.
+ * @param arity The number of arguments, or -1 for any number.
+ * @param function The C function.
+ */
+void defineNative(const char *name, const int arity, const CloxNativeFn function) {
+    const int length = (int) strlen(name);
+    NativeEntry *entry = findNative(name, length);
+    if (entry == NULL) {
+        char *copy = GROW_ARRAY(char, NULL, 0, length + 1);
+        memcpy(copy, name, length + 1);
+        if (vm->nativeCount == vm->nativeCapacity) {
+            const int oldCapacity = vm->nativeCapacity;
+            vm->nativeCapacity = GROW_CAPACITY(oldCapacity);
+            vm->natives = GROW_ARRAY(NativeEntry, vm->natives, oldCapacity, vm->nativeCapacity);
+        }
+        entry = &vm->natives[vm->nativeCount++];
+        entry->name = copy;
+        entry->length = length;
+        entry->object = NULL;
+    }
+    entry->arity = arity;
+    entry->function = function;
+    if (entry->object != NULL) {
+        ObjNative *native = (ObjNative *) entry->object;
+        native->arity = arity;
+        native->function = function;
+    }
+
+    // Code compiled earlier may already refer to the name.
+    for (int i = 0; i < vm->globalSlots.capacity; i++) {
+        ObjString *key = vm->globalSlots.entries[i].key;
+        if (key == NULL || key->length != length || memcmp(key->chars, name, length) != 0) continue;
+
+        const int slot = (int) AS_INT(vm->globalSlots.entries[i].value);
+        if (IS_UNDEFINED(vm->globals.values[slot])) vm->globals.values[slot] = nativeGlobal(key);
+        break;
+    }
+}
+
+/**
+ * Returns what a global variable holds before the script assigns it: the
+ * native registered under its name, or the undefined sentinel. The name
+ * must be reachable, as the native's object is created on first use.
+ *
+ * @param name The variable's name.
+ * @return The native, or UNDEFINED_VAL(name).
+ */
+Value nativeGlobal(ObjString *name) {
+    NativeEntry *entry = findNative(name->chars, name->length);
+    if (entry == NULL) return UNDEFINED_VAL(name);
+
+    if (entry->object == NULL) entry->object = &newNative(name, entry->arity, entry->function)->obj;
+    return OBJ_VAL(entry->object);
+}
+
+/**
+ * Marks the natives of the current VM that have objects.
+ */
+void markNatives() {
+    for (int i = 0; i < vm->nativeCount; i++) {
+        markObject(vm->natives[i].object);
+    }
+}
+
+/**
+ * Frees the current VM's native registry. The natives' objects go with the
+ * rest of the heap.
+ */
+void freeNatives() {
+    for (int i = 0; i < vm->nativeCount; i++) {
+        FREE_ARRAY(char, vm->natives[i].name, vm->natives[i].length + 1);
+    }
+    FREE_ARRAY(NativeEntry, vm->natives, vm->nativeCapacity);
+    vm->natives = NULL;
+    vm->nativeCount = 0;
+    vm->nativeCapacity = 0;
+}
+
+static NativeEntry *findNative(const char *name, const int length) {
+    for (int i = 0; i < vm->nativeCount; i++) {
+        NativeEntry *entry = &vm->natives[i];
+        if (entry->length == length && memcmp(entry->name, name, length) == 0) return entry;
+    }
+    return NULL;
+}
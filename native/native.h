@@ -0,0 +1,29 @@
+#ifndef CLOXVM_NATIVE_H
+#define CLOXVM_NATIVE_H
+
+#include "../common.h"
+#include "../api/cloxvm.h"
+#include "../value/value.h"
+
+/**
+ * A registered native function. Its object is only created once a script
+ * refers to the name, so registering natives allocates nothing on the heap
+ * and a fresh VM stays fresh.
+ */
+typedef struct {
+    char *name;
+    int length;
+    int arity;
+    CloxNativeFn function;
+    Obj *object;
+} NativeEntry;
+
+void defineNative(const char *name, int arity, CloxNativeFn function);
+
+Value nativeGlobal(ObjString *name);
+
+void markNatives();
+
+void freeNatives();
+
+#endif //CLOXVM_NATIVE_H
@@ -0,0 +1,500 @@
+#include "object.h"
+#include "../memory/memory.h"
+#include "../profiler/profiler.h"
+#include "../shape/shape.h"
+#include "../table/table.h"
+#include "../vm/vm.h"
+
+#include <string.h>
+
+static ObjString *allocateString(int length, bool young);
+
+static ObjString *internString(ObjString *string);
+
+static ObjString *findInterned(const char *chars, int length, uint32_t hash);
+
+/**
+ * Creates a function whose body has not been compiled yet.
+ *
+ * Functions are allocated in the old generation: they usually live as long
+ * as the script that declares them.
+ *
+ * @param name The function's name.
+ * @param source The function's text, starting at its parameter list. It is copied.
+ * @param length The length of the text.
+ * @param line The line the text starts on.
+ * @param arity The number of parameters.
+ * @return The new function.
+ */
+ObjFunction *newFunction(ObjString *name, const char *source, const int length, const int line, const int arity) {
+    push(OBJ_VAL(name));
+    char *copy = GROW_ARRAY(char, NULL, 0, length + 1);
+    memcpy(copy, source, length);
+    copy[length] = '\0';
+    ObjFunction *function = reallocate(NULL, 0, sizeof(ObjFunction));
+    pop();
+
+    function->obj.type = OBJ_FUNCTION;
+    function->obj.isMarked = vm->markBit;
+    function->obj.isRemembered = false;
+    function->obj.next = vm->objects;
+    vm->objects = &function->obj;
+
+    function->arity = arity;
+    function->line = line;
+    function->sourceLength = length;
+    function->source = copy;
+    function->name = name;
+    function->captureCount = 0;
+    function->captures = NULL;
+    function->stackCaptures = false;
+    function->isMethod = false;
+    initChunk(&function->chunk);
+    return function;
+}
+
+/**
+ * Creates a closure for a function with captures. Its upvalues start out
+ * empty; the caller fills them in, keeping the closure reachable while it
+ * allocates them.
+ *
+ * Closures and upvalues are allocated in the old generation, so the
+ * collector only has to watch stores into closed upvalues.
+ *
+ * @param function The function.
+ * @return The new closure.
+ */
+ObjClosure *newClosure(ObjFunction *function) {
+    const int count = function->captureCount;
+    ObjClosure *closure = reallocate(NULL, 0, sizeof(ObjClosure) + sizeof(ObjUpvalue *) * count);
+    closure->obj.type = OBJ_CLOSURE;
+    closure->obj.isMarked = vm->markBit;
+    closure->obj.isRemembered = false;
+    closure->obj.next = vm->objects;
+    vm->objects = &closure->obj;
+
+    closure->function = function;
+    closure->upvalueCount = count;
+    for (int i = 0; i < count; i++) {
+        closure->upvalues[i] = NULL;
+    }
+    return closure;
+}
+
+/**
+ * Creates an open upvalue for a stack slot.
+ *
+ * @param slot The captured variable's stack slot.
+ * @return The new upvalue.
+ */
+ObjUpvalue *newUpvalue(Value *slot) {
+    ObjUpvalue *upvalue = reallocate(NULL, 0, sizeof(ObjUpvalue));
+    upvalue->obj.type = OBJ_UPVALUE;
+    upvalue->obj.isMarked = vm->markBit;
+    upvalue->obj.isRemembered = false;
+    upvalue->obj.next = vm->objects;
+    vm->objects = &upvalue->obj;
+
+    upvalue->location = slot;
+    upvalue->closed = NIL_VAL;
+    upvalue->next = NULL;
+    return upvalue;
+}
+
+/**
+ * Creates a class without methods, along with the root shape of its
+ * instances. Classes are allocated in the old generation.
+ *
+ * @param name The class's name.
+ * @return The new class.
+ */
+ObjClass *newClass(ObjString *name) {
+    push(OBJ_VAL(name));
+    Shape *shape = newRootShape();
+    ObjClass *klass = reallocate(NULL, 0, sizeof(ObjClass));
+    pop();
+
+    klass->obj.type = OBJ_CLASS;
+    klass->obj.isMarked = vm->markBit;
+    klass->obj.isRemembered = false;
+    klass->obj.next = vm->objects;
+    vm->objects = &klass->obj;
+
+    klass->name = name;
+    initTable(&klass->methods);
+    klass->initializer = NIL_VAL;
+    klass->shape = shape;
+    klass->fieldHint = INSTANCE_INITIAL_FIELDS;
+    return klass;
+}
+
+/**
+ * Creates an instance without fields, with room for as many inline fields
+ * as its class suggests.
+ *
+ * Instances are young. If the nursery is full the instance goes to the old
+ * generation and the caller has to run collectNursery() once it is stored
+ * in a root; the class must be reachable while this allocates.
+ *
+ * @param klass The instance's class.
+ * @return The new instance.
+ */
+ObjInstance *newInstance(ObjClass *klass) {
+    const int capacity = klass->fieldHint;
+    const size_t size = sizeof(ObjInstance) + sizeof(Value) * capacity;
+    ObjInstance *instance = allocateYoung(size);
+    if (instance == NULL) {
+        instance = reallocate(NULL, 0, size);
+        instance->obj.next = vm->objects;
+        vm->objects = &instance->obj;
+    } else {
+        instance->obj.next = NULL;
+    }
+
+    instance->obj.type = OBJ_INSTANCE;
+    instance->obj.isMarked = vm->markBit;
+    instance->obj.isRemembered = false;
+    instance->klass = klass;
+    instance->shape = klass->shape;
+    instance->fields = instance->inlineFields;
+    instance->capacity = capacity;
+    instance->inlineCapacity = capacity;
+    return instance;
+}
+
+/**
+ * Makes room for one more field by moving an instance's fields to a larger
+ * array. Later instances of its class get that much room inline, up to
+ * INSTANCE_INLINE_MAX fields. The instance must be reachable while this
+ * allocates.
+ *
+ * @param instance The instance whose fields are full.
+ */
+void growFields(ObjInstance *instance) {
+    const int oldCapacity = instance->capacity;
+    const int capacity = GROW_CAPACITY(oldCapacity);
+    Value *fields = GROW_ARRAY(Value, NULL, 0, capacity);
+    memcpy(fields, instance->fields, sizeof(Value) * instance->shape->fieldCount);
+    if (instance->fields != instance->inlineFields) FREE_ARRAY(Value, instance->fields, oldCapacity);
+    instance->fields = fields;
+    instance->capacity = capacity;
+
+    ObjClass *klass = instance->klass;
+    const int needed = instance->shape->fieldCount + 1;
+    if (klass->fieldHint < needed) {
+        klass->fieldHint = needed < INSTANCE_INLINE_MAX ? needed : INSTANCE_INLINE_MAX;
+    }
+}
+
+/**
+ * Creates a bound method. Bound methods are young, like instances; both
+ * values must be reachable while this allocates.
+ *
+ * @param receiver The instance the method was read from.
+ * @param method The method, a function or a closure.
+ * @return The new bound method.
+ */
+ObjBoundMethod *newBoundMethod(const Value receiver, const Value method) {
+    ObjBoundMethod *bound = allocateYoung(sizeof(ObjBoundMethod));
+    if (bound == NULL) {
+        bound = reallocate(NULL, 0, sizeof(ObjBoundMethod));
+        bound->obj.next = vm->objects;
+        vm->objects = &bound->obj;
+    } else {
+        bound->obj.next = NULL;
+    }
+
+    bound->obj.type = OBJ_BOUND_METHOD;
+    bound->obj.isMarked = vm->markBit;
+    bound->obj.isRemembered = false;
+    bound->receiver = receiver;
+    bound->method = method;
+    return bound;
+}
+
+/**
+ * Creates a native function. Natives are allocated in the old generation.
+ *
+ * @param name The name scripts call the native by.
+ * @param arity The number of arguments, or -1 for any number.
+ * @param function The C function.
+ * @return The new native.
+ */
+ObjNative *newNative(ObjString *name, const int arity, const CloxNativeFn function) {
+    push(OBJ_VAL(name));
+    ObjNative *native = reallocate(NULL, 0, sizeof(ObjNative));
+    pop();
+
+    native->obj.type = OBJ_NATIVE;
+    native->obj.isMarked = vm->markBit;
+    native->obj.isRemembered = false;
+    native->obj.next = vm->objects;
+    vm->objects = &native->obj;
+
+    native->function = function;
+    native->name = name;
+    native->arity = arity;
+    return native;
+}
+
+/**
+ * Creates an array of count values, which the caller has to fill in.
+ * Arrays are allocated in the old generation: they hold no references, so
+ * they never need the write barrier, and a large one would not fit in the
+ * nursery anyway.
+ *
+ * @param count The number of values.
+ * @return The new array.
+ */
+ObjArray *newArray(const int count) {
+    double *values = GROW_ARRAY(double, NULL, 0, count);
+    ObjArray *array = reallocate(NULL, 0, sizeof(ObjArray));
+
+    array->obj.type = OBJ_ARRAY;
+    array->obj.isMarked = vm->markBit;
+    array->obj.isRemembered = false;
+    array->obj.next = vm->objects;
+    vm->objects = &array->obj;
+
+    array->values = values;
+    array->count = count;
+    array->capacity = count;
+    return array;
+}
+
+/**
+ * Adds a value to the end of an array, growing it as needed. The array
+ * must be reachable while this allocates.
+ *
+ * @param array The array.
+ * @param value The value to add.
+ */
+void appendArray(ObjArray *array, const double value) {
+    if (array->count == array->capacity) {
+        const int oldCapacity = array->capacity;
+        array->capacity = GROW_CAPACITY(oldCapacity);
+        array->values = GROW_ARRAY(double, array->values, oldCapacity, array->capacity);
+    }
+    array->values[array->count++] = value;
+}
+
+/**
+ * Returns the interned string with the given contents, creating it if it
+ * does not exist yet.
+ *
+ * New strings go straight to the old generation: this is how the compiler
+ * makes literals and variable names, which live as long as their chunk.
+ * An existing string is returned as it is, even a young one; compile()
+ * empties the nursery first so that the compiler never gets one.
+ *
+ * @param chars The characters to copy. They need not be NUL-terminated.
+ * @param length The number of characters.
+ * @return The interned string.
+ */
+ObjString *copyString(const char *chars, const int length) {
+    const uint32_t hash = hashString(chars, length);
+    ObjString *interned = findInterned(chars, length, hash);
+    if (interned != NULL) return interned;
+
+    ObjString *string = allocateString(length, false);
+    memcpy(string->chars, chars, length);
+    string->chars[length] = '\0';
+    string->hash = hash;
+    return internString(string);
+}
+
+/**
+ * Returns the interned concatenation of two strings.
+ *
+ * The result is assembled in place in a new string object; if an equal
+ * string already exists, the new one is dropped again before anything else
+ * can see it. New strings are young. If the nursery is full the string goes
+ * to the old generation and the caller has to run collectNursery() once the
+ * result is stored in a root. The caller makes sure that the combined
+ * length fits in an int.
+ *
+ * @param a The first string.
+ * @param b The second string.
+ * @return The interned string holding a followed by b.
+ */
+ObjString *concatenateStrings(const ObjString *a, const ObjString *b) {
+    const int length = a->length + b->length;
+    ObjString *string = allocateString(length, true);
+    memcpy(string->chars, a->chars, a->length);
+    memcpy(string->chars + a->length, b->chars, b->length);
+    string->chars[length] = '\0';
+    string->hash = hashString(string->chars, length);
+
+    ObjString *interned = findInterned(string->chars, length, string->hash);
+    if (interned != NULL) {
+        if (isYoungObject(vm, &string->obj)) {
+            releaseYoung(string, sizeof(ObjString) + length + 1);
+        } else {
+            reallocate(string, sizeof(ObjString) + length + 1, 0);
+        }
+        return interned;
+    }
+
+    return internString(string);
+}
+
+/**
+ * Hashes characters with 32-bit FNV-1a.
+ *
+ * @param chars The characters to hash.
+ * @param length The number of characters.
+ * @return The hash.
+ */
+uint32_t hashString(const char *chars, const int length) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++) {
+        hash ^= (uint8_t) chars[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+/**
+ * Frees every object the current VM allocated.
+ */
+void freeObjects() {
+    Obj *object = vm->objects;
+    while (object != NULL) {
+        Obj *next = object->next;
+        freeObject(object);
+        object = next;
+    }
+    vm->objects = NULL;
+}
+
+/**
+ * Returns the size of an object, header included.
+ *
+ * @param object The object.
+ * @return Its size in bytes.
+ */
+size_t objectSize(const Obj *object) {
+    switch (object->type) {
+        case OBJ_STRING:
+            return sizeof(ObjString) + ((const ObjString *) object)->length + 1;
+        case OBJ_FUNCTION:
+            return sizeof(ObjFunction);
+        case OBJ_CLOSURE:
+            return sizeof(ObjClosure) + sizeof(ObjUpvalue *) * ((const ObjClosure *) object)->upvalueCount;
+        case OBJ_UPVALUE:
+            return sizeof(ObjUpvalue);
+        case OBJ_CLASS:
+            return sizeof(ObjClass);
+        case OBJ_INSTANCE:
+            return sizeof(ObjInstance) + sizeof(Value) * ((const ObjInstance *) object)->inlineCapacity;
+        case OBJ_BOUND_METHOD:
+            return sizeof(ObjBoundMethod);
+        case OBJ_NATIVE:
+            return sizeof(ObjNative);
+        case OBJ_ARRAY:
+            return sizeof(ObjArray);
+    }
+    return sizeof(Obj);
+}
+
+static ObjString *allocateString(const int length, const bool young) {
+    const size_t size = sizeof(ObjString) + length + 1;
+    ObjString *string = young ? allocateYoung(size) : NULL;
+    if (string == NULL) string = reallocate(NULL, 0, size);
+
+    string->obj.type = OBJ_STRING;
+    string->obj.isMarked = vm->markBit;
+    string->obj.isRemembered = false;
+    string->obj.next = NULL;
+    string->length = length;
+    return string;
+}
+
+/**
+ * Makes a freshly built string known to the VM: an old string joins the
+ * list of objects, and either kind becomes the canonical string with its
+ * contents. The string stays on the VM stack while the intern table grows,
+ * so a collection triggered by growing it sees the string as reachable.
+ */
+static ObjString *internString(ObjString *string) {
+    if (!isYoungObject(vm, &string->obj)) {
+        string->obj.next = vm->objects;
+        vm->objects = &string->obj;
+    }
+
+    push(OBJ_VAL(string));
+    tableSet(&vm->strings, string, NIL_VAL);
+    pop();
+    return string;
+}
+
+/**
+ * Looks up the canonical string with the given contents: an interned one,
+ * or else one from the VM's heap image.
+ */
+static ObjString *findInterned(const char *chars, const int length, const uint32_t hash) {
+    ObjString *interned = tableFindString(&vm->strings, chars, length, hash);
+    if (interned == NULL && vm->snapshot.base != NULL) interned = findSnapshotString(chars, length, hash);
+    return interned;
+}
+
+/**
+ * Frees a single object. Only the garbage collector and freeObjects() call
+ * this; the object must already be unlinked from the VM's object list or
+ * about to be dropped with it.
+ *
+ * @param object The object to free.
+ */
+void freeObject(Obj *object) {
+    switch (object->type) {
+        case OBJ_STRING: {
+            const ObjString *string = (ObjString *) object;
+            reallocate(object, sizeof(ObjString) + string->length + 1, 0);
+            break;
+        }
+        case OBJ_FUNCTION: {
+            ObjFunction *function = (ObjFunction *) object;
+            forgetProfileSamples(&function->chunk);
+            freeChunk(&function->chunk);
+            FREE_ARRAY(char, function->source, function->sourceLength + 1);
+            FREE_ARRAY(Capture, function->captures, function->captureCount);
+            reallocate(object, sizeof(ObjFunction), 0);
+            break;
+        }
+        case OBJ_CLASS:
+            releaseShapeTree(((ObjClass *) object)->shape);
+            freeTable(&((ObjClass *) object)->methods);
+            reallocate(object, sizeof(ObjClass), 0);
+            break;
+        case OBJ_INSTANCE:
+            freeFields((ObjInstance *) object);
+            reallocate(object, objectSize(object), 0);
+            break;
+        case OBJ_ARRAY: {
+            const ObjArray *array = (ObjArray *) object;
+            FREE_ARRAY(double, array->values, array->capacity);
+            reallocate(object, sizeof(ObjArray), 0);
+            break;
+        }
+        case OBJ_CLOSURE:
+        case OBJ_UPVALUE:
+        case OBJ_BOUND_METHOD:
+        case OBJ_NATIVE:
+            reallocate(object, objectSize(object), 0);
+            break;
+    }
+}
+
+/**
+ * Frees the array an instance's fields moved to, if they did. Young
+ * instances that die in the nursery are not freed one by one, so the
+ * nursery sweep calls this for them.
+ *
+ * @param instance The instance.
+ */
+void freeFields(ObjInstance *instance) {
+    if (instance->fields != instance->inlineFields) {
+        FREE_ARRAY(Value, instance->fields, instance->capacity);
+        instance->fields = instance->inlineFields;
+    }
+}
@@ -0,0 +1,241 @@
+#ifndef CLOXVM_OBJECT_H
+#define CLOXVM_OBJECT_H
+
+#include "../common.h"
+#include "../api/cloxvm.h"
+#include "../chunk/chunk.h"
+#include "../table/table.h"
+#include "../value/value.h"
+
+// Inline fields of the first instances of a class, and the most inline
+// fields an instance gets however many its class needs.
+#define INSTANCE_INITIAL_FIELDS 4
+#define INSTANCE_INLINE_MAX 64
+
+#define OBJ_TYPE(value)   (AS_OBJ(value)->type)
+
+#define IS_ARRAY(value)   isObjType(value, OBJ_ARRAY)
+#define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
+#define IS_CLASS(value)   isObjType(value, OBJ_CLASS)
+#define IS_CLOSURE(value) isObjType(value, OBJ_CLOSURE)
+#define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
+#define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
+#define IS_NATIVE(value)  isObjType(value, OBJ_NATIVE)
+#define IS_STRING(value)  isObjType(value, OBJ_STRING)
+
+#define AS_ARRAY(value)   ((ObjArray *) AS_OBJ(value))
+#define AS_BOUND_METHOD(value) ((ObjBoundMethod *) AS_OBJ(value))
+#define AS_CLASS(value)   ((ObjClass *) AS_OBJ(value))
+#define AS_CLOSURE(value) ((ObjClosure *) AS_OBJ(value))
+#define AS_FUNCTION(value) ((ObjFunction *) AS_OBJ(value))
+#define AS_INSTANCE(value) ((ObjInstance *) AS_OBJ(value))
+#define AS_NATIVE(value)  ((ObjNative *) AS_OBJ(value))
+#define AS_STRING(value)  ((ObjString *) AS_OBJ(value))
+#define AS_CSTRING(value) (((ObjString *) AS_OBJ(value))->chars)
+
+typedef enum {
+    OBJ_STRING,
+    OBJ_FUNCTION,
+    OBJ_CLOSURE,
+    OBJ_UPVALUE,
+    OBJ_CLASS,
+    OBJ_INSTANCE,
+    OBJ_BOUND_METHOD,
+    OBJ_NATIVE,
+    OBJ_ARRAY,
+} ObjType;
+
+/**
+ * The header every heap object starts with. next links all old-generation
+ * objects of a VM for the garbage collector's sweep. A young object is not
+ * linked; its next is NULL until a minor collection promotes it and then
+ * points to the promoted copy. isMarked is the collector's mark bit, see
+ * isMarked() for what it means. isRemembered is set while an old object is
+ * in the nursery's remembered set, see writeBarrier().
+ */
+struct Obj {
+    ObjType type;
+    bool isMarked;
+    bool isRemembered;
+    struct Obj *next;
+};
+
+/**
+ * A string, stored inline after its header so that reading it touches a
+ * single allocation. The characters are NUL-terminated.
+ */
+struct ObjString {
+    Obj obj;
+    int length;
+    uint32_t hash;
+    char chars[];
+};
+
+/**
+ * A variable of an enclosing function that a function body refers to: the
+ * local in slot index of the function the declaration runs in, or, if
+ * isLocal is false, that function's own capture number index.
+ */
+typedef struct {
+    ObjString *name;
+    uint8_t index;
+    bool isLocal;
+} Capture;
+
+/**
+ * A function declared with fun. The compiler only skims the body and keeps
+ * the function's text, from its parameter list to its closing brace, in
+ * source; line is the line that text starts on. The first call compiles the
+ * body into chunk, so chunk.code is NULL until then.
+ *
+ * Skimming also finds the enclosing variables the body may refer to, in
+ * captures. A function with captures is normally wrapped in an ObjClosure
+ * that holds them as upvalues. If stackCaptures is set, the compiler has
+ * proven that the function never leaves the frame it is declared in and is
+ * only ever called from there; it then runs without a closure and reaches
+ * its captures directly in its caller's stack slots.
+ *
+ * isMethod is set for the methods of a class, whose slot 0 holds the
+ * receiver, this, instead of the function itself.
+ */
+struct ObjFunction {
+    Obj obj;
+    int arity;
+    int line;
+    int sourceLength;
+    char *source;
+    ObjString *name;
+    int captureCount;
+    Capture *captures;
+    bool stackCaptures;
+    bool isMethod;
+    Chunk chunk;
+};
+
+/**
+ * A captured variable. While the variable is still on the stack, the
+ * upvalue is open: location points to its stack slot and next links it
+ * into the VM's list of open upvalues. Closing copies the value into closed
+ * and points location there.
+ */
+struct ObjUpvalue {
+    Obj obj;
+    Value *location;
+    Value closed;
+    ObjUpvalue *next;
+};
+
+/**
+ * A function together with the upvalues of its captures, in the order of
+ * the function's captures.
+ */
+struct ObjClosure {
+    Obj obj;
+    ObjFunction *function;
+    int upvalueCount;
+    ObjUpvalue *upvalues[];
+};
+
+/**
+ * A class: its methods by name, initializer being the one named init or
+ * nil. Instances start out with shape, the class's root shape, and get
+ * room for fieldHint fields inline, the most fields an instance of the
+ * class has needed so far.
+ */
+typedef struct {
+    Obj obj;
+    ObjString *name;
+    Table methods;
+    Value initializer;
+    Shape *shape;
+    int fieldHint;
+} ObjClass;
+
+/**
+ * An instance of a class. Its shape says which field is where; the values
+ * are in fields. They start out inline, after the header, in room for
+ * inlineCapacity fields, and move to a separately allocated array of
+ * capacity fields once an instance outgrows that.
+ */
+typedef struct {
+    Obj obj;
+    ObjClass *klass;
+    Shape *shape;
+    Value *fields;
+    int capacity;
+    int inlineCapacity;
+    Value inlineFields[];
+} ObjInstance;
+
+/**
+ * A method read from an instance without calling it right away, together
+ * with the instance it was read from.
+ */
+typedef struct {
+    Obj obj;
+    Value receiver;
+    Value method;
+} ObjBoundMethod;
+
+/**
+ * A function implemented in C, see defineCloxNative(). arity is -1 for a
+ * native that takes any number of arguments.
+ */
+typedef struct {
+    Obj obj;
+    CloxNativeFn function;
+    ObjString *name;
+    int arity;
+} ObjNative;
+
+/**
+ * An array of numbers, stored unboxed and contiguously in values so that
+ * bulk operations run over plain doubles. Its first count values are in
+ * use; capacity is the size of the allocation.
+ */
+typedef struct {
+    Obj obj;
+    double *values;
+    int count;
+    int capacity;
+} ObjArray;
+
+ObjFunction *newFunction(ObjString *name, const char *source, int length, int line, int arity);
+
+ObjClosure *newClosure(ObjFunction *function);
+
+ObjUpvalue *newUpvalue(Value *slot);
+
+ObjClass *newClass(ObjString *name);
+
+ObjInstance *newInstance(ObjClass *klass);
+
+void growFields(ObjInstance *instance);
+
+void freeFields(ObjInstance *instance);
+
+ObjBoundMethod *newBoundMethod(Value receiver, Value method);
+
+ObjNative *newNative(ObjString *name, int arity, CloxNativeFn function);
+
+ObjArray *newArray(int count);
+
+void appendArray(ObjArray *array, double value);
+
+ObjString *copyString(const char *chars, int length);
+
+ObjString *concatenateStrings(const ObjString *a, const ObjString *b);
+
+uint32_t hashString(const char *chars, int length);
+
+size_t objectSize(const Obj *object);
+
+void freeObject(Obj *object);
+
+void freeObjects();
+
+static inline bool isObjType(const Value value, const ObjType type) {
+    return IS_OBJ(value) && AS_OBJ(value)->type == type;
+}
+
+#endif //CLOXVM_OBJECT_H
@@ -0,0 +1,944 @@
+#include "optimizer.h"
+#include "../debug/debug.h"
+#include "../enums/opcodes.h"
+#include "../memory/memory.h"
+#include "../object/object.h"
+#include "../vm/vm.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * The kinds of values in the optimizer's SSA form. Constants, unary and
+ * binary operations and global loads are pure: two nodes with the same
+ * operation and inputs are the same node, so a value computed twice is
+ * recognized as one. A global load also carries the epoch it was read in,
+ * which changes with every instruction that may assign a global. Opaque
+ * nodes are values the optimizer knows nothing about, like parameters and
+ * the results of calls; each of them is distinct.
+ */
+typedef enum {
+    NODE_CONSTANT,
+    NODE_UNARY,
+    NODE_BINARY,
+    NODE_GLOBAL,
+    NODE_OPAQUE,
+} NodeKind;
+
+/**
+ * A value. Constants the optimizer can compute with have isConstant set;
+ * object constants are only told apart by their index in the constants
+ * array (left). isNumeric is set if the value is known to be a number,
+ * which makes arithmetic on it unable to fail.
+ */
+typedef struct {
+    NodeKind kind;
+    uint8_t op;
+    int left;
+    int right;
+    int epoch;
+    Value constant;
+    bool isConstant;
+    bool isNumeric;
+} Node;
+
+/**
+ * A slot of the simulated value stack: the node it holds and the range of
+ * code [start, end) that pushed it. The range is removable if it has no
+ * side effects and safe if it cannot fail. store is the assignment to a
+ * local the range ends with, if any; the range including that assignment
+ * may be removed if storeRemovable is set and the store is dead. For the
+ * slot of a local, definition is the store that last assigned it.
+ */
+typedef struct {
+    int node;
+    int start;
+    int end;
+    bool removable;
+    bool safe;
+    int store;
+    bool storeRemovable;
+    int definition;
+} StackEntry;
+
+/**
+ * A rewrite of the code [start, end). A replacement (length > 0) is the
+ * bytes in code; if loadsConstant is set, it loads constant and code[1]
+ * is only filled in when the chunk is rebuilt. A deletion that removes an
+ * assignment only applies if its store is dead.
+ */
+typedef struct {
+    int start;
+    int end;
+    uint8_t code[2];
+    int length;
+    Value constant;
+    bool loadsConstant;
+    int store;
+} Edit;
+
+typedef struct {
+    Chunk *chunk;
+    Node *nodes;
+    int nodeCount;
+    int nodeCapacity;
+    int *table;
+    int tableCount;
+    int tableCapacity;
+    StackEntry *stack;
+    int stackCount;
+    int stackCapacity;
+    Edit *edits;
+    int editCount;
+    int editCapacity;
+    bool *liveStores;
+    int storeCount;
+    int storeCapacity;
+    int *blockHeights;
+    int blockHeightCount;
+    bool hasBranches;
+    bool captured[UINT8_MAX + 1];
+    int epoch;
+} Optimizer;
+
+static bool lift(Optimizer *optimizer, int slotCount);
+
+static void lower(Optimizer *optimizer);
+
+static void freeOptimizer(Optimizer *optimizer);
+
+/**
+ * Optimizes a stack-format chunk in place. The chunk is lifted into SSA
+ * form by simulating its value stack, which turns every stack slot,
+ * including those of locals, into a named value. On that form the
+ * optimizer
+ *
+ *   - folds operations on constants and propagates constants through
+ *     locals (constant propagation),
+ *   - replaces an expression whose value already sits in a stack slot by a
+ *     load of that slot (common-subexpression elimination), and
+ *   - removes expression statements without effect, stores to locals that
+ *     are never read again and code after the first return (dead-code
+ *     elimination),
+ *
+ * and lowers the result back to bytecode by rewriting only the code ranges
+ * that changed. The stack layout is left as it was, so slot numbers used
+ * by nested functions stay valid.
+ *
+ * Jumps split the code into basic blocks, which are optimized one at a
+ * time: at the start of a block the optimizer forgets what it knew about
+ * the values on the stack, and stores to locals that are still on the
+ * stack when a block ends count as read. Code after a return is removed up
+ * to the next jump target. The jumps are retargeted when the code is
+ * lowered. A chunk with an instruction the optimizer does not model is
+ * left untouched. Errors are preserved: code that may fail is only removed
+ * where an identical computation has already succeeded.
+ *
+ * @param chunk The chunk, compiled and not yet run.
+ * @param slotCount The number of slots the frame starts with: 0 for a
+ *                  script, the arity plus one for a function.
+ */
+void optimizeChunk(Chunk *chunk, const int slotCount) {
+    if (chunk->format != CHUNK_STACK || chunk->count == 0) return;
+
+    Optimizer optimizer;
+    memset(&optimizer, 0, sizeof(optimizer));
+    optimizer.chunk = chunk;
+
+    // Locals of this chunk that functions declared in it capture may
+    // change whenever something is called.
+    for (int i = 0; i < chunk->constants.count; i++) {
+        if (!IS_FUNCTION(chunk->constants.values[i])) continue;
+        const ObjFunction *function = AS_FUNCTION(chunk->constants.values[i]);
+        for (int j = 0; j < function->captureCount; j++) {
+            if (function->captures[j].isLocal) optimizer.captured[function->captures[j].index] = true;
+        }
+    }
+
+    if (lift(&optimizer, slotCount)) lower(&optimizer);
+    freeOptimizer(&optimizer);
+}
+
+// Bytes an instruction takes, or 0 for one the optimizer does not model.
+static int instructionLength(const Chunk *chunk, const int offset) {
+    switch (chunk->code[offset]) {
+        case OP_RETURN:
+        case OP_NEGATE:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_NOT:
+        case OP_POP:
+        case OP_CLOSE_UPVALUE:
+        case OP_GET_INDEX:
+        case OP_SET_INDEX:
+            return 1;
+        case OP_CONSTANT:
+        case OP_POPN:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_UPVALUE_STACK:
+        case OP_SET_UPVALUE_STACK:
+        case OP_CLOSURE:
+        case OP_CALL:
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_ARRAY:
+            return 2;
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_GET_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG:
+            return 3;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_JUMP_IF_LESS:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_GREATER:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL:
+            return 3;
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+            return 4;
+        case OP_INVOKE:
+            return 5;
+        case OP_JUMP_TABLE:
+            if (offset + 4 > chunk->count) return 0;
+            return 4 + 2 * ((chunk->code[offset + 2] << 8 | chunk->code[offset + 3]) + 1);
+        default:
+            return 0;
+    }
+}
+
+// The number of places an instruction may jump to: one for a jump, one
+// per entry for a jump table and none for anything else.
+static int branchCount(const Chunk *chunk, const int offset) {
+    switch (chunk->code[offset]) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_JUMP_IF_LESS:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_GREATER:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL:
+            return 1;
+        case OP_JUMP_TABLE:
+            return (chunk->code[offset + 2] << 8 | chunk->code[offset + 3]) + 1;
+        default:
+            return 0;
+    }
+}
+
+// Where the operand of an instruction's branch-th jump offset sits.
+static int branchOperand(const Chunk *chunk, const int offset, const int branch) {
+    return chunk->code[offset] == OP_JUMP_TABLE ? offset + 4 + 2 * branch : offset + 1;
+}
+
+// The offset an instruction's branch-th jump goes to.
+static int branchTarget(const Chunk *chunk, const int offset, const int branch) {
+    const uint8_t *operand = &chunk->code[branchOperand(chunk, offset, branch)];
+    const int distance = operand[0] << 8 | operand[1];
+    const int end = offset + instructionLength(chunk, offset);
+    switch (chunk->code[offset]) {
+        case OP_LOOP: return end - distance;
+        case OP_JUMP_TABLE: return end + (int16_t) distance;
+        default: return end + distance;
+    }
+}
+
+// The bits that tell constants of the same type apart.
+static uint64_t constantBits(const Value value) {
+    switch (value.type) {
+        case VAL_BOOL: return AS_BOOL(value);
+        case VAL_INT: return (uint64_t) AS_INT(value);
+        case VAL_NUMBER: {
+            uint64_t bits;
+            memcpy(&bits, &value.as.number, sizeof(bits));
+            return bits;
+        }
+        default: return 0;
+    }
+}
+
+static bool sameConstant(const Value a, const Value b) {
+    return a.type == b.type && constantBits(a) == constantBits(b);
+}
+
+static bool sameNode(const Node *a, const Node *b) {
+    return a->kind == b->kind && a->op == b->op && a->left == b->left && a->right == b->right &&
+           a->epoch == b->epoch && a->isConstant == b->isConstant &&
+           (!a->isConstant || sameConstant(a->constant, b->constant));
+}
+
+static uint32_t hashNode(const Node *node) {
+    uint64_t hash = 14695981039346656037u;
+    const uint64_t parts[] = {
+        node->kind, node->op, (uint32_t) node->left, (uint32_t) node->right, (uint32_t) node->epoch,
+        node->isConstant ? node->constant.type : 0, node->isConstant ? constantBits(node->constant) : 0
+    };
+    for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+        hash = (hash ^ parts[i]) * 1099511628211u;
+    }
+    return (uint32_t) (hash ^ hash >> 32);
+}
+
+static int appendNode(Optimizer *optimizer, const Node *node) {
+    if (optimizer->nodeCount == optimizer->nodeCapacity) {
+        const int oldCapacity = optimizer->nodeCapacity;
+        optimizer->nodeCapacity = GROW_CAPACITY(oldCapacity);
+        optimizer->nodes = GROW_ARRAY(Node, optimizer->nodes, oldCapacity, optimizer->nodeCapacity);
+    }
+    optimizer->nodes[optimizer->nodeCount] = *node;
+    return optimizer->nodeCount++;
+}
+
+static void insertNode(int *table, const int capacity, const Node *nodes, const int index) {
+    uint32_t slot = hashNode(&nodes[index]) & (capacity - 1);
+    while (table[slot] != -1) slot = (slot + 1) & (capacity - 1);
+    table[slot] = index;
+}
+
+// Value numbering: returns the node equal to the given one, adding it if
+// there is none yet.
+static int findNode(Optimizer *optimizer, const Node *node) {
+    if (optimizer->tableCapacity > 0) {
+        uint32_t slot = hashNode(node) & (optimizer->tableCapacity - 1);
+        while (optimizer->table[slot] != -1) {
+            if (sameNode(&optimizer->nodes[optimizer->table[slot]], node)) return optimizer->table[slot];
+            slot = (slot + 1) & (optimizer->tableCapacity - 1);
+        }
+    }
+
+    if ((optimizer->tableCount + 1) * 4 > optimizer->tableCapacity * 3) {
+        const int oldCapacity = optimizer->tableCapacity;
+        const int capacity = oldCapacity < 16 ? 16 : oldCapacity * 2;
+        int *table = GROW_ARRAY(int, NULL, 0, capacity);
+        for (int i = 0; i < capacity; i++) table[i] = -1;
+        for (int i = 0; i < oldCapacity; i++) {
+            if (optimizer->table[i] != -1) insertNode(table, capacity, optimizer->nodes, optimizer->table[i]);
+        }
+        FREE_ARRAY(int, optimizer->table, oldCapacity);
+        optimizer->table = table;
+        optimizer->tableCapacity = capacity;
+    }
+
+    const int index = appendNode(optimizer, node);
+    insertNode(optimizer->table, optimizer->tableCapacity, optimizer->nodes, index);
+    optimizer->tableCount++;
+    return index;
+}
+
+static int opaqueNode(Optimizer *optimizer, const bool isNumeric) {
+    Node node = {.kind = NODE_OPAQUE, .isNumeric = isNumeric};
+    return appendNode(optimizer, &node);
+}
+
+static int constantNode(Optimizer *optimizer, const Value value, const int index) {
+    Node node = {.kind = NODE_CONSTANT, .left = -1, .right = -1};
+    if (IS_OBJ(value) || IS_UNDEFINED(value)) {
+        node.left = index;
+    } else {
+        node.constant = value;
+        node.isConstant = true;
+        node.isNumeric = IS_NUMERIC(value);
+    }
+    return findNode(optimizer, &node);
+}
+
+static int newStore(Optimizer *optimizer, const bool live) {
+    if (optimizer->storeCount == optimizer->storeCapacity) {
+        const int oldCapacity = optimizer->storeCapacity;
+        optimizer->storeCapacity = GROW_CAPACITY(oldCapacity);
+        optimizer->liveStores = GROW_ARRAY(bool, optimizer->liveStores, oldCapacity, optimizer->storeCapacity);
+    }
+    optimizer->liveStores[optimizer->storeCount] = live;
+    return optimizer->storeCount++;
+}
+
+static void markLive(Optimizer *optimizer, const int store) {
+    if (store >= 0) optimizer->liveStores[store] = true;
+}
+
+static void pushEntry(Optimizer *optimizer, const StackEntry entry) {
+    if (optimizer->stackCount == optimizer->stackCapacity) {
+        const int oldCapacity = optimizer->stackCapacity;
+        optimizer->stackCapacity = GROW_CAPACITY(oldCapacity);
+        optimizer->stack = GROW_ARRAY(StackEntry, optimizer->stack, oldCapacity, optimizer->stackCapacity);
+    }
+    optimizer->stack[optimizer->stackCount++] = entry;
+}
+
+// An entry for code with side effects, which is never removed.
+static StackEntry fixedEntry(const int node, const int start, const int end) {
+    return (StackEntry){node, start, end, false, false, -1, false, -1};
+}
+
+static void addEdit(Optimizer *optimizer, const Edit edit) {
+    if (optimizer->editCount == optimizer->editCapacity) {
+        const int oldCapacity = optimizer->editCapacity;
+        optimizer->editCapacity = GROW_CAPACITY(oldCapacity);
+        optimizer->edits = GROW_ARRAY(Edit, optimizer->edits, oldCapacity, optimizer->editCapacity);
+    }
+    optimizer->edits[optimizer->editCount++] = edit;
+}
+
+static void addDeletion(Optimizer *optimizer, const int start, const int end, const int store) {
+    addEdit(optimizer, (Edit){.start = start, .end = end, .store = store});
+}
+
+// Mirrors the VM's arithmetic: integers stay integers unless the result
+// overflows, anything else is computed in doubles.
+static bool foldArithmetic(const uint8_t op, const Value a, const Value b, Value *result) {
+    if (!IS_NUMERIC(a) || !IS_NUMERIC(b)) return false;
+    if (op == OP_DIVIDE) {
+        *result = NUMBER_VAL(AS_DOUBLE(a) / AS_DOUBLE(b));
+        return true;
+    }
+
+    if (IS_INT(a) && IS_INT(b)) {
+        int64_t value;
+        bool overflow;
+        switch (op) {
+            case OP_ADD: overflow = __builtin_add_overflow(AS_INT(a), AS_INT(b), &value); break;
+            case OP_SUBTRACT: overflow = __builtin_sub_overflow(AS_INT(a), AS_INT(b), &value); break;
+            default: overflow = __builtin_mul_overflow(AS_INT(a), AS_INT(b), &value); break;
+        }
+        if (!overflow) {
+            *result = INT_VAL(value);
+            return true;
+        }
+    }
+
+    switch (op) {
+        case OP_ADD: *result = NUMBER_VAL(AS_DOUBLE(a) + AS_DOUBLE(b)); break;
+        case OP_SUBTRACT: *result = NUMBER_VAL(AS_DOUBLE(a) - AS_DOUBLE(b)); break;
+        default: *result = NUMBER_VAL(AS_DOUBLE(a) * AS_DOUBLE(b)); break;
+    }
+    return true;
+}
+
+static int unaryNode(Optimizer *optimizer, const uint8_t op, const int operand) {
+    const Node *input = &optimizer->nodes[operand];
+    Node node = {.kind = NODE_UNARY, .op = op, .left = operand, .right = -1};
+    if (op == OP_NOT) {
+        if (input->isConstant) {
+            const Value value = input->constant;
+            node = (Node){.kind = NODE_CONSTANT, .left = -1, .right = -1, .isConstant = true,
+                          .constant = BOOL_VAL(IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value)))};
+        }
+    } else if (input->isConstant && IS_INT(input->constant)) {
+        const int64_t value = AS_INT(input->constant);
+        node = (Node){.kind = NODE_CONSTANT, .left = -1, .right = -1, .isConstant = true, .isNumeric = true,
+                      .constant = value == INT64_MIN ? NUMBER_VAL(-(double) value) : INT_VAL(-value)};
+    } else if (input->isConstant && IS_NUMBER(input->constant)) {
+        node = (Node){.kind = NODE_CONSTANT, .left = -1, .right = -1, .isConstant = true, .isNumeric = true,
+                      .constant = NUMBER_VAL(-AS_NUMBER(input->constant))};
+    } else {
+        node.isNumeric = input->isNumeric;
+    }
+    return findNode(optimizer, &node);
+}
+
+static int binaryNode(Optimizer *optimizer, const uint8_t op, const int left, const int right) {
+    const Node *a = &optimizer->nodes[left];
+    const Node *b = &optimizer->nodes[right];
+    Node node = {.kind = NODE_BINARY, .op = op, .left = left, .right = right};
+    if (a->isConstant && b->isConstant) {
+        Value result;
+        if (op == OP_EQUAL) {
+            result = BOOL_VAL(valuesEqual(a->constant, b->constant));
+        } else if (op == OP_LESS || op == OP_GREATER) {
+            if (!IS_NUMERIC(a->constant) || !IS_NUMERIC(b->constant)) return findNode(optimizer, &node);
+            const Value left = op == OP_LESS ? a->constant : b->constant;
+            const Value right = op == OP_LESS ? b->constant : a->constant;
+            result = BOOL_VAL(IS_INT(left) && IS_INT(right) ? AS_INT(left) < AS_INT(right)
+                                                            : AS_DOUBLE(left) < AS_DOUBLE(right));
+        } else if (!foldArithmetic(op, a->constant, b->constant, &result)) {
+            return findNode(optimizer, &node);
+        }
+        node = (Node){.kind = NODE_CONSTANT, .left = -1, .right = -1, .isConstant = true,
+                      .isNumeric = IS_NUMERIC(result), .constant = result};
+        return findNode(optimizer, &node);
+    }
+    node.isNumeric = op != OP_EQUAL && op != OP_LESS && op != OP_GREATER && a->isNumeric && b->isNumeric;
+    return findNode(optimizer, &node);
+}
+
+// Looks for a cheaper way to compute the value the topmost entry pushes:
+// a constant load, or a copy of a stack slot that holds the same value.
+static void improveTop(Optimizer *optimizer) {
+    const StackEntry *top = &optimizer->stack[optimizer->stackCount - 1];
+    if (!top->removable || top->start < 0) return;
+
+    const Node *node = &optimizer->nodes[top->node];
+    const int length = top->end - top->start;
+    if (node->isConstant) {
+        Edit edit = {.start = top->start, .end = top->end, .length = 1, .store = -1};
+        if (IS_NIL(node->constant)) {
+            edit.code[0] = OP_NIL;
+        } else if (IS_BOOL(node->constant)) {
+            edit.code[0] = AS_BOOL(node->constant) ? OP_TRUE : OP_FALSE;
+        } else {
+            edit.code[0] = OP_CONSTANT;
+            edit.length = 2;
+            edit.constant = node->constant;
+            edit.loadsConstant = true;
+        }
+        if (length > edit.length) addEdit(optimizer, edit);
+        return;
+    }
+
+    if (length <= 2) return;
+    for (int slot = optimizer->stackCount - 2; slot >= 0; slot--) {
+        if (optimizer->stack[slot].node != top->node) continue;
+        if (slot > UINT8_MAX) return;
+        markLive(optimizer, optimizer->stack[slot].definition);
+        addEdit(optimizer, (Edit){.start = top->start, .end = top->end, .code = {OP_GET_LOCAL, (uint8_t) slot},
+                                  .length = 2, .store = -1});
+        return;
+    }
+}
+
+// Something was called, which may have assigned globals and captured locals.
+static void clobber(Optimizer *optimizer) {
+    optimizer->epoch++;
+    for (int i = 0; i < optimizer->stackCount && i <= UINT8_MAX; i++) {
+        if (optimizer->captured[i]) optimizer->stack[i].node = opaqueNode(optimizer, false);
+    }
+}
+
+// Marks where basic blocks start: at every jump target and after every
+// jump. blockHeights holds -1 for those offsets until the height of the
+// stack there is known, and -2 everywhere else. Returns false if the chunk
+// has code the optimizer does not model.
+static bool findBlocks(Optimizer *optimizer) {
+    const Chunk *chunk = optimizer->chunk;
+    optimizer->blockHeightCount = chunk->count + 1;
+    optimizer->blockHeights = GROW_ARRAY(int, NULL, 0, optimizer->blockHeightCount);
+    for (int i = 0; i < optimizer->blockHeightCount; i++) optimizer->blockHeights[i] = -2;
+
+    int offset = 0;
+    while (offset < chunk->count) {
+        const int length = instructionLength(chunk, offset);
+        if (length == 0 || offset + length > chunk->count) return false;
+        const int branches = branchCount(chunk, offset);
+        for (int i = 0; i < branches; i++) {
+            const int target = branchTarget(chunk, offset, i);
+            if (target < 0 || target > chunk->count) return false;
+            optimizer->blockHeights[target] = -1;
+        }
+        if (branches > 0) {
+            optimizer->blockHeights[offset + length] = -1;
+            optimizer->hasBranches = true;
+        }
+        offset += length;
+    }
+    return true;
+}
+
+// Records the stack height a jump to target leaves, which has to agree
+// with every other way into the block. The locals on the stack may be read
+// after the jump, so their stores are live.
+static bool leaveBlock(Optimizer *optimizer, const int target) {
+    for (int i = 0; i < optimizer->stackCount; i++) {
+        markLive(optimizer, optimizer->stack[i].definition);
+    }
+    int *height = &optimizer->blockHeights[target];
+    if (*height >= 0 && *height != optimizer->stackCount) return false;
+    *height = optimizer->stackCount;
+    return true;
+}
+
+// Starts the basic block at offset. Control may come from elsewhere, so
+// every slot gets a value nothing is known about, and globals may have
+// changed. A block that is only reached by a jump starts with the height
+// the jump left; one that is not reached by any jump seen so far is
+// assumed to start with the height the code before it ended with, which
+// later jumps to it are checked against.
+static bool enterBlock(Optimizer *optimizer, const int offset, const bool fallsThrough) {
+    if (fallsThrough && !leaveBlock(optimizer, offset)) return false;
+    if (optimizer->blockHeights[offset] < 0) optimizer->blockHeights[offset] = optimizer->stackCount;
+
+    const int height = optimizer->blockHeights[offset];
+    optimizer->stackCount = 0;
+    for (int i = 0; i < height; i++) {
+        pushEntry(optimizer, fixedEntry(opaqueNode(optimizer, false), -1, -1));
+    }
+    optimizer->epoch++;
+    return true;
+}
+
+// Leaves the current block through every jump of the instruction at
+// offset.
+static bool leaveThroughBranches(Optimizer *optimizer, const int offset) {
+    const int branches = branchCount(optimizer->chunk, offset);
+    for (int i = 0; i < branches; i++) {
+        if (!leaveBlock(optimizer, branchTarget(optimizer->chunk, offset, i))) return false;
+    }
+    return true;
+}
+
+// The offset of the first block that starts at or after offset, or the end
+// of the chunk.
+static int nextBlock(const Optimizer *optimizer, int offset) {
+    while (offset < optimizer->chunk->count && optimizer->blockHeights[offset] == -2) offset++;
+    return offset;
+}
+
+// Lifts the chunk into SSA form and collects the edits. Returns false if
+// the chunk has code the optimizer does not model.
+static bool lift(Optimizer *optimizer, const int slotCount) {
+    const Chunk *chunk = optimizer->chunk;
+    if (!findBlocks(optimizer)) return false;
+    for (int i = 0; i < slotCount; i++) {
+        pushEntry(optimizer, fixedEntry(opaqueNode(optimizer, false), -1, -1));
+    }
+
+    int offset = 0;
+    bool fallsThrough = true;
+    while (offset < chunk->count) {
+        if (optimizer->blockHeights[offset] != -2 && !enterBlock(optimizer, offset, fallsThrough)) return false;
+        fallsThrough = true;
+        const uint8_t instruction = chunk->code[offset];
+        const int length = instructionLength(chunk, offset);
+        const int end = offset + length;
+        const uint8_t operand = length > 1 ? chunk->code[offset + 1] : 0;
+        const int wideOperand = length > 2 ? operand << 8 | chunk->code[offset + 2] : operand;
+        StackEntry *stack = optimizer->stack;
+        const int count = optimizer->stackCount;
+
+        switch (instruction) {
+            case OP_CONSTANT: {
+                if (operand >= chunk->constants.count) return false;
+                const int node = constantNode(optimizer, chunk->constants.values[operand], operand);
+                pushEntry(optimizer, (StackEntry){node, offset, end, true, true, -1, false, -1});
+                break;
+            }
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE: {
+                const Value value = instruction == OP_NIL ? NIL_VAL : BOOL_VAL(instruction == OP_TRUE);
+                pushEntry(optimizer, (StackEntry){constantNode(optimizer, value, -1), offset, end, true, true, -1, false, -1});
+                break;
+            }
+            case OP_NEGATE:
+            case OP_NOT: {
+                if (count < 1) return false;
+                const StackEntry a = stack[count - 1];
+                const bool numeric = optimizer->nodes[a.node].isNumeric;
+                const int node = unaryNode(optimizer, instruction, a.node);
+                optimizer->stack[count - 1] = (StackEntry){
+                    node, a.start, end, a.removable, a.safe && (instruction == OP_NOT || numeric), -1, false, -1
+                };
+                improveTop(optimizer);
+                break;
+            }
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+            case OP_EQUAL:
+            case OP_GREATER:
+            case OP_LESS: {
+                if (count < 2) return false;
+                const StackEntry a = stack[count - 2];
+                const StackEntry b = stack[count - 1];
+                const bool numeric = optimizer->nodes[a.node].isNumeric && optimizer->nodes[b.node].isNumeric;
+                const int node = binaryNode(optimizer, instruction, a.node, b.node);
+                optimizer->stackCount--;
+                optimizer->stack[count - 2] = (StackEntry){
+                    node, a.start, end, a.removable && b.removable,
+                    a.safe && b.safe && (instruction == OP_EQUAL || numeric), -1, false, -1
+                };
+                improveTop(optimizer);
+                break;
+            }
+            case OP_POP: {
+                if (count < 1) return false;
+                const StackEntry *a = &stack[count - 1];
+                if (a->start >= 0 && a->end == offset && a->safe) {
+                    if (a->removable) addDeletion(optimizer, a->start, end, -1);
+                    else if (a->store >= 0 && a->storeRemovable) addDeletion(optimizer, a->start, end, a->store);
+                }
+                optimizer->stackCount--;
+                break;
+            }
+            case OP_POPN:
+                if (count < operand) return false;
+                optimizer->stackCount -= operand;
+                break;
+            case OP_GET_LOCAL: {
+                if (operand >= count) return false;
+                markLive(optimizer, stack[operand].definition);
+                pushEntry(optimizer, (StackEntry){stack[operand].node, offset, end, true, true, -1, false, -1});
+                improveTop(optimizer);
+                break;
+            }
+            case OP_SET_LOCAL: {
+                if (count < 1 || operand >= count) return false;
+                const StackEntry a = stack[count - 1];
+                const int store = newStore(optimizer, optimizer->captured[operand]);
+                optimizer->stack[count - 1] = (StackEntry){a.node, a.start, end, false, a.safe, store, a.removable, -1};
+                optimizer->stack[operand].node = a.node;
+                optimizer->stack[operand].definition = store;
+                break;
+            }
+            case OP_DEFINE_GLOBAL:
+            case OP_DEFINE_GLOBAL_LONG:
+                if (count < 1) return false;
+                optimizer->stackCount--;
+                optimizer->epoch++;
+                break;
+            case OP_GET_GLOBAL:
+            case OP_GET_GLOBAL_LONG: {
+                Node global = {.kind = NODE_GLOBAL, .left = wideOperand, .right = -1, .epoch = optimizer->epoch};
+                pushEntry(optimizer, (StackEntry){findNode(optimizer, &global), offset, end, true, false, -1, false, -1});
+                improveTop(optimizer);
+                break;
+            }
+            case OP_SET_GLOBAL:
+            case OP_SET_GLOBAL_LONG:
+            case OP_SET_UPVALUE:
+            case OP_SET_UPVALUE_STACK:
+                if (count < 1) return false;
+                optimizer->stack[count - 1] = fixedEntry(stack[count - 1].node, stack[count - 1].start, end);
+                if (instruction == OP_SET_GLOBAL || instruction == OP_SET_GLOBAL_LONG) optimizer->epoch++;
+                break;
+            case OP_GET_UPVALUE:
+            case OP_GET_UPVALUE_STACK:
+                pushEntry(optimizer, (StackEntry){opaqueNode(optimizer, false), offset, end, true, true, -1, false, -1});
+                break;
+            case OP_CLOSURE:
+            case OP_CLASS:
+                pushEntry(optimizer, fixedEntry(opaqueNode(optimizer, false), offset, end));
+                break;
+            case OP_METHOD:
+                if (count < 2) return false;
+                optimizer->stackCount--;
+                optimizer->stack[count - 2].end = end;
+                break;
+            case OP_CLOSE_UPVALUE:
+                if (count < 1) return false;
+                optimizer->stackCount--;
+                break;
+            case OP_GET_PROPERTY:
+                if (count < 1) return false;
+                optimizer->stack[count - 1] = fixedEntry(opaqueNode(optimizer, false), stack[count - 1].start, end);
+                break;
+            case OP_SET_PROPERTY:
+                if (count < 2) return false;
+                optimizer->stackCount--;
+                optimizer->stack[count - 2] = fixedEntry(stack[count - 1].node, stack[count - 2].start, end);
+                break;
+            case OP_GET_INDEX:
+                if (count < 2) return false;
+                optimizer->stackCount--;
+                optimizer->stack[count - 2] = fixedEntry(opaqueNode(optimizer, true), stack[count - 2].start, end);
+                break;
+            case OP_SET_INDEX:
+                if (count < 3) return false;
+                optimizer->stackCount -= 2;
+                optimizer->stack[count - 3] = fixedEntry(stack[count - 1].node, stack[count - 3].start, end);
+                break;
+            case OP_ARRAY:
+                if (count < operand) return false;
+                optimizer->stackCount -= operand;
+                pushEntry(optimizer, fixedEntry(opaqueNode(optimizer, false),
+                                                operand > 0 ? stack[count - operand].start : offset, end));
+                break;
+            case OP_CALL:
+            case OP_INVOKE: {
+                const int argCount = instruction == OP_CALL ? operand : chunk->code[offset + 2];
+                if (count < argCount + 1) return false;
+                const int start = stack[count - argCount - 1].start;
+                optimizer->stackCount -= argCount + 1;
+                pushEntry(optimizer, fixedEntry(opaqueNode(optimizer, false), start, end));
+                clobber(optimizer);
+                break;
+            }
+            case OP_JUMP:
+            case OP_LOOP:
+                if (!leaveThroughBranches(optimizer, offset)) return false;
+                fallsThrough = false;
+                break;
+            case OP_JUMP_IF_FALSE:
+                if (count < 1 || !leaveThroughBranches(optimizer, offset)) return false;
+                break;
+            case OP_JUMP_IF_LESS:
+            case OP_JUMP_IF_NOT_LESS:
+            case OP_JUMP_IF_GREATER:
+            case OP_JUMP_IF_NOT_GREATER:
+            case OP_JUMP_IF_EQUAL:
+            case OP_JUMP_IF_NOT_EQUAL:
+                if (count < 2) return false;
+                optimizer->stackCount -= 2;
+                if (!leaveThroughBranches(optimizer, offset)) return false;
+                break;
+            case OP_JUMP_TABLE:
+                if (count < 1) return false;
+                optimizer->stackCount--;
+                if (!leaveThroughBranches(optimizer, offset)) return false;
+                fallsThrough = false;
+                break;
+            case OP_RETURN: {
+                if (count < 1) return false;
+                const int next = nextBlock(optimizer, end);
+                if (next > end) addDeletion(optimizer, end, next, -1);
+                if (next == chunk->count) return true;
+                offset = next;
+                fallsThrough = false;
+                continue;
+            }
+            default:
+                return false;
+        }
+        offset = end;
+    }
+    return false;
+}
+
+static int compareEdits(const void *a, const void *b) {
+    const Edit *left = a;
+    const Edit *right = b;
+    if (left->start != right->start) return left->start < right->start ? -1 : 1;
+    if (left->end != right->end) return left->end > right->end ? -1 : 1;
+    return 0;
+}
+
+// Finds or adds the constant an edit loads. Returns false if the constant
+// would not fit in a one-byte operand.
+static bool resolveConstant(Chunk *chunk, Edit *edit) {
+    for (int i = 0; i < chunk->constants.count && i <= UINT8_MAX; i++) {
+        if (sameConstant(chunk->constants.values[i], edit->constant)) {
+            edit->code[1] = (uint8_t) i;
+            return true;
+        }
+    }
+    if (chunk->constants.count > UINT8_MAX) return false;
+    edit->code[1] = (uint8_t) addConstant(chunk, edit->constant);
+    return true;
+}
+
+// Rewrites the jumps in the new code so that they reach the instructions
+// they did in the old one. Edits only ever shrink the code, so the new
+// distances fit in their operands.
+static void retarget(const Chunk *chunk, uint8_t *code, const int *moved) {
+    int offset = 0;
+    while (offset < chunk->count) {
+        const int length = instructionLength(chunk, offset);
+        const int at = moved[offset];
+        if (at >= 0) {
+            const int end = at + length;
+            const int branches = branchCount(chunk, offset);
+            for (int i = 0; i < branches; i++) {
+                const int to = moved[branchTarget(chunk, offset, i)];
+                const int target = to >= 0 ? to : -2 - to;
+                const int distance = chunk->code[offset] == OP_LOOP ? end - target : target - end;
+                uint8_t *operand = &code[at + branchOperand(chunk, offset, i) - offset];
+                operand[0] = (uint8_t) ((distance >> 8) & 0xff);
+                operand[1] = (uint8_t) (distance & 0xff);
+            }
+        }
+        offset += length;
+    }
+}
+
+// Applies the edits that hold up: deletions of live stores are dropped,
+// and of overlapping edits the outermost one wins.
+static void lower(Optimizer *optimizer) {
+    Chunk *chunk = optimizer->chunk;
+    int kept = 0;
+    for (int i = 0; i < optimizer->editCount; i++) {
+        const Edit *edit = &optimizer->edits[i];
+        if (edit->store >= 0 && optimizer->liveStores[edit->store]) continue;
+        optimizer->edits[kept++] = *edit;
+    }
+    if (kept == 0) return;
+    qsort(optimizer->edits, kept, sizeof(Edit), compareEdits);
+
+    int applied = 0;
+    int covered = 0;
+    for (int i = 0; i < kept; i++) {
+        Edit *edit = &optimizer->edits[i];
+        if (edit->start < covered) continue;
+        if (edit->loadsConstant && !resolveConstant(chunk, edit)) continue;
+        optimizer->edits[applied++] = *edit;
+        covered = edit->end;
+    }
+    if (applied == 0) return;
+
+    const int capacity = chunk->count;
+    uint8_t *code = GROW_ARRAY(uint8_t, NULL, 0, capacity);
+    int *lines = GROW_ARRAY(int, NULL, 0, capacity);
+    // Where each old instruction starts in the new code. The first byte an
+    // edit replaces holds -2 minus where the replacement starts, the others
+    // -1. Jumps only go to block starts, and no edit spans one, so every
+    // target is either kept or the start of an edit.
+    const int moves = chunk->count + 1;
+    int *moved = optimizer->hasBranches ? GROW_ARRAY(int, NULL, 0, moves) : NULL;
+    int count = 0;
+    int offset = 0;
+    for (int i = 0; i <= applied; i++) {
+        const int until = i < applied ? optimizer->edits[i].start : chunk->count;
+        memcpy(code + count, chunk->code + offset, until - offset);
+        memcpy(lines + count, chunk->lines + offset, sizeof(int) * (until - offset));
+        if (moved != NULL) {
+            for (int j = offset; j < until; j++) moved[j] = count + j - offset;
+        }
+        count += until - offset;
+        if (i == applied) break;
+
+        const Edit *edit = &optimizer->edits[i];
+        if (moved != NULL) {
+            for (int j = edit->start; j < edit->end; j++) moved[j] = -1;
+            moved[edit->start] = -2 - count;
+        }
+        for (int j = 0; j < edit->length; j++) {
+            code[count] = edit->code[j];
+            lines[count++] = chunk->lines[edit->end - 1];
+        }
+        offset = edit->end;
+    }
+
+    if (moved != NULL) {
+        moved[chunk->count] = count;
+        retarget(chunk, code, moved);
+        FREE_ARRAY(int, moved, moves);
+    }
+
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    chunk->code = code;
+    chunk->lines = lines;
+    chunk->count = count;
+    chunk->capacity = capacity;
+
+#ifdef DEBUG_PRINT_CODE
+    disassembleChunk(chunk, "optimized");
+#endif
+}
+
+static void freeOptimizer(Optimizer *optimizer) {
+    FREE_ARRAY(Node, optimizer->nodes, optimizer->nodeCapacity);
+    FREE_ARRAY(int, optimizer->table, optimizer->tableCapacity);
+    FREE_ARRAY(StackEntry, optimizer->stack, optimizer->stackCapacity);
+    FREE_ARRAY(Edit, optimizer->edits, optimizer->editCapacity);
+    FREE_ARRAY(bool, optimizer->liveStores, optimizer->storeCapacity);
+    FREE_ARRAY(int, optimizer->blockHeights, optimizer->blockHeightCount);
+}
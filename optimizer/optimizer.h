@@ -0,0 +1,9 @@
+#ifndef CLOXVM_OPTIMIZER_H
+#define CLOXVM_OPTIMIZER_H
+
+#include "../chunk/chunk.h"
+#include "../common.h"
+
+void optimizeChunk(Chunk *chunk, int slotCount);
+
+#endif //CLOXVM_OPTIMIZER_H
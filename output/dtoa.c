@@ -0,0 +1,385 @@
+#include "dtoa.h"
+
+#include <string.h>
+
+/*
+ * Shortest round-trip double formatting based on Florian Loitsch's Grisu2
+ * ("Printing Floating-Point Numbers Quickly and Accurately with Integers",
+ * PLDI 2010). The produced digits always parse back to the same double and
+ * are the shortest such representation for all but a tiny fraction of inputs.
+ */
+
+#define DP_SIGNIFICAND_MASK 0x000FFFFFFFFFFFFFULL
+#define DP_EXPONENT_MASK    0x7FF0000000000000ULL
+#define DP_HIDDEN_BIT       0x0010000000000000ULL
+#define DP_SIGNIFICAND_SIZE 52
+#define DP_EXPONENT_BIAS    (0x3FF + DP_SIGNIFICAND_SIZE)
+#define DP_MIN_EXPONENT     (-DP_EXPONENT_BIAS)
+#define DIY_SIGNIFICAND_SIZE 64
+
+typedef struct {
+    uint64_t f;
+    int e;
+} DiyFp;
+
+static const uint64_t cachedPowersF[] = {
+    0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL,
+    0xcf42894a5dce35eaULL, 0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL,
+    0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL, 0xbe5691ef416bd60cULL,
+    0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+    0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL,
+    0xc21094364dfb5637ULL, 0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL,
+    0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL, 0xb23867fb2a35b28eULL,
+    0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+    0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL,
+    0xb5b5ada8aaff80b8ULL, 0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL,
+    0x964e858c91ba2655ULL, 0xdff9772470297ebdULL, 0xa6dfbd9fb8e5b88fULL,
+    0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+    0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL,
+    0xaa242499697392d3ULL, 0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL,
+    0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL, 0x9c40000000000000ULL,
+    0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+    0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL,
+    0x9f4f2726179a2245ULL, 0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL,
+    0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL, 0x924d692ca61be758ULL,
+    0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+    0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL,
+    0x952ab45cfa97a0b3ULL, 0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL,
+    0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL, 0x88fcf317f22241e2ULL,
+    0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+    0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL,
+    0x8bab8eefb6409c1aULL, 0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL,
+    0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL, 0x80444b5e7aa7cf85ULL,
+    0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+    0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL,};
+
+static const int16_t cachedPowersE[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980, -954,
+    -927, -901, -874, -847, -821, -794, -768, -741, -715, -688, -661,
+    -635, -608, -582, -555, -529, -502, -475, -449, -422, -396, -369,
+    -343, -316, -289, -263, -236, -210, -183, -157, -130, -103, -77,
+    -50, -24, 3, 30, 56, 83, 109, 136, 162, 189, 216,
+    242, 269, 295, 322, 348, 375, 402, 428, 455, 481, 508,
+    534, 561, 588, 614, 641, 667, 694, 720, 747, 774, 800,
+    827, 853, 880, 907, 933, 960, 986, 1013, 1039, 1066,};
+
+static const uint64_t powersOfTen[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+    10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+    100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL,
+    10000000000000000000ULL,
+};
+
+static DiyFp makeDiyFp(uint64_t f, int e);
+
+static DiyFp diyFpFromDouble(uint64_t bits);
+
+static DiyFp multiplyDiyFp(DiyFp x, DiyFp y);
+
+static DiyFp normalizeDiyFp(DiyFp x);
+
+static DiyFp normalizeBoundary(DiyFp x);
+
+static DiyFp cachedPower(int e, int *k);
+
+static void grisuRound(char *buffer, int length, uint64_t delta, uint64_t rest,
+                       uint64_t tenKappa, uint64_t distance);
+
+static void digitGen(DiyFp w, DiyFp mp, uint64_t delta, char *buffer,
+                     int *length, int *k);
+
+static int grisu2(uint64_t bits, char *buffer, int *k);
+
+static int prettify(char *buffer, int length, int k);
+
+/**
+ * Formats a double as the shortest decimal string that parses back to the
+ * same value.
+ *
+ * Values whose decimal point falls within 21 digits are written in plain
+ * positional notation ("0.1", "1234567", "-0.000001"); anything else uses
+ * exponent notation ("1e+21", "5e-324"). Non-finite values are written as
+ * "nan", "inf" and "-inf", matching what printf("%g") produced before.
+ *
+ * @param value The value to format.
+ * @param buffer Destination with room for at least DTOA_BUFFER_SIZE bytes.
+ *               The result is not NUL terminated.
+ * @return The number of characters written.
+ */
+int formatDouble(const double value, char *buffer) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    char *out = buffer;
+    if (bits >> 63) *out++ = '-';
+    bits &= ~(1ULL << 63);
+
+    if ((bits & DP_EXPONENT_MASK) == DP_EXPONENT_MASK) {
+        if (bits & DP_SIGNIFICAND_MASK) {
+            memcpy(buffer, "nan", 3);
+            return 3;
+        }
+        memcpy(out, "inf", 3);
+        return (int) (out - buffer) + 3;
+    }
+
+    if (bits == 0) {
+        *out = '0';
+        return (int) (out - buffer) + 1;
+    }
+
+    int k;
+    const int length = grisu2(bits, out, &k);
+    return (int) (out - buffer) + prettify(out, length, k);
+}
+
+/**
+ * Formats a signed 64-bit integer in decimal.
+ *
+ * Digits are produced two at a time from a lookup table, which avoids half of
+ * the divisions a naive loop needs.
+ *
+ * @param value The value to format.
+ * @param buffer Destination with room for at least DTOA_BUFFER_SIZE bytes.
+ *               The result is not NUL terminated.
+ * @return The number of characters written.
+ */
+int formatInt64(const int64_t value, char *buffer) {
+    static const char digitPairs[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233"
+        "34353637383940414243444546474849505152535455565758596061626364656667"
+        "68697071727374757677787980818283848586878889909192939495969798"
+        "99";
+
+    char scratch[DTOA_BUFFER_SIZE];
+    char *end = scratch + sizeof(scratch);
+    char *cursor = end;
+
+    uint64_t magnitude = value < 0 ? 0 - (uint64_t) value : (uint64_t) value;
+
+    while (magnitude >= 100) {
+        const unsigned pair = (unsigned) (magnitude % 100) * 2;
+        magnitude /= 100;
+        *--cursor = digitPairs[pair + 1];
+        *--cursor = digitPairs[pair];
+    }
+
+    if (magnitude >= 10) {
+        const unsigned pair = (unsigned) magnitude * 2;
+        *--cursor = digitPairs[pair + 1];
+        *--cursor = digitPairs[pair];
+    } else {
+        *--cursor = (char) ('0' + magnitude);
+    }
+
+    if (value < 0) *--cursor = '-';
+
+    const int length = (int) (end - cursor);
+    memcpy(buffer, cursor, length);
+    return length;
+}
+
+static DiyFp makeDiyFp(const uint64_t f, const int e) {
+    DiyFp result;
+    result.f = f;
+    result.e = e;
+    return result;
+}
+
+static DiyFp diyFpFromDouble(const uint64_t bits) {
+    const int biasedExponent = (int) ((bits & DP_EXPONENT_MASK) >> DP_SIGNIFICAND_SIZE);
+    const uint64_t significand = bits & DP_SIGNIFICAND_MASK;
+
+    if (biasedExponent != 0) {
+        return makeDiyFp(significand + DP_HIDDEN_BIT, biasedExponent - DP_EXPONENT_BIAS);
+    }
+
+    return makeDiyFp(significand, DP_MIN_EXPONENT + 1);
+}
+
+static DiyFp multiplyDiyFp(const DiyFp x, const DiyFp y) {
+    const uint64_t mask32 = 0xFFFFFFFFULL;
+    const uint64_t a = x.f >> 32;
+    const uint64_t b = x.f & mask32;
+    const uint64_t c = y.f >> 32;
+    const uint64_t d = y.f & mask32;
+    const uint64_t ac = a * c;
+    const uint64_t bc = b * c;
+    const uint64_t ad = a * d;
+    const uint64_t bd = b * d;
+
+    uint64_t tmp = (bd >> 32) + (ad & mask32) + (bc & mask32);
+    tmp += 1ULL << 31;
+
+    return makeDiyFp(ac + (ad >> 32) + (bc >> 32) + (tmp >> 32), x.e + y.e + 64);
+}
+
+static DiyFp normalizeDiyFp(DiyFp x) {
+    while (!(x.f & (1ULL << 63))) {
+        x.f <<= 1;
+        x.e--;
+    }
+    return x;
+}
+
+static DiyFp normalizeBoundary(DiyFp x) {
+    while (!(x.f & (DP_HIDDEN_BIT << 1))) {
+        x.f <<= 1;
+        x.e--;
+    }
+
+    const int shift = DIY_SIGNIFICAND_SIZE - DP_SIGNIFICAND_SIZE - 2;
+    x.f <<= shift;
+    x.e -= shift;
+    return x;
+}
+
+static DiyFp cachedPower(const int e, int *k) {
+    const double dk = (-61 - e) * 0.30102999566398114 + 347;
+    int rounded = (int) dk;
+    if (dk - rounded > 0.0) rounded++;
+
+    const unsigned index = (unsigned) ((rounded >> 3) + 1);
+    *k = -(-348 + (int) index * 8);
+
+    return makeDiyFp(cachedPowersF[index], cachedPowersE[index]);
+}
+
+static void grisuRound(char *buffer, const int length, const uint64_t delta,
+                       uint64_t rest, const uint64_t tenKappa,
+                       const uint64_t distance) {
+    while (rest < distance && delta - rest >= tenKappa &&
+           (rest + tenKappa < distance ||
+            distance - rest > rest + tenKappa - distance)) {
+        buffer[length - 1]--;
+        rest += tenKappa;
+    }
+}
+
+static void digitGen(const DiyFp w, const DiyFp mp, uint64_t delta,
+                     char *buffer, int *length, int *k) {
+    const DiyFp one = makeDiyFp(1ULL << -mp.e, mp.e);
+    const uint64_t distance = mp.f - w.f;
+
+    uint32_t p1 = (uint32_t) (mp.f >> -one.e);
+    uint64_t p2 = mp.f & (one.f - 1);
+
+    int kappa = 1;
+    while (kappa < 10 && p1 >= powersOfTen[kappa]) kappa++;
+
+    *length = 0;
+
+    while (kappa > 0) {
+        const uint32_t divisor = (uint32_t) powersOfTen[kappa - 1];
+        const uint32_t digit = p1 / divisor;
+        p1 %= divisor;
+
+        if (digit || *length) buffer[(*length)++] = (char) ('0' + digit);
+        kappa--;
+
+        const uint64_t rest = ((uint64_t) p1 << -one.e) + p2;
+        if (rest <= delta) {
+            *k += kappa;
+            grisuRound(buffer, *length, delta, rest,
+                       powersOfTen[kappa] << -one.e, distance);
+            return;
+        }
+    }
+
+    for (;;) {
+        p2 *= 10;
+        delta *= 10;
+
+        const char digit = (char) (p2 >> -one.e);
+        if (digit || *length) buffer[(*length)++] = (char) ('0' + digit);
+        p2 &= one.f - 1;
+        kappa--;
+
+        if (p2 < delta) {
+            *k += kappa;
+            const int index = -kappa;
+            grisuRound(buffer, *length, delta, p2, one.f,
+                       distance * (index < 20 ? powersOfTen[index] : 0));
+            return;
+        }
+    }
+}
+
+static int grisu2(const uint64_t bits, char *buffer, int *k) {
+    const DiyFp v = diyFpFromDouble(bits);
+
+    DiyFp plus = normalizeBoundary(makeDiyFp((v.f << 1) + 1, v.e - 1));
+    DiyFp minus = v.f == DP_HIDDEN_BIT
+                      ? makeDiyFp((v.f << 2) - 1, v.e - 2)
+                      : makeDiyFp((v.f << 1) - 1, v.e - 1);
+    minus.f <<= minus.e - plus.e;
+    minus.e = plus.e;
+
+    const DiyFp cached = cachedPower(plus.e, k);
+    const DiyFp w = multiplyDiyFp(normalizeDiyFp(v), cached);
+    DiyFp upper = multiplyDiyFp(plus, cached);
+    DiyFp lower = multiplyDiyFp(minus, cached);
+    lower.f++;
+    upper.f--;
+
+    int length;
+    digitGen(w, upper, upper.f - lower.f, buffer, &length, k);
+    return length;
+}
+
+/**
+ * Lays out the digits produced by grisu2 (value = digits * 10^k) in either
+ * positional or exponent notation.
+ */
+static int prettify(char *buffer, const int length, const int k) {
+    const int decimalPoint = length + k;
+
+    if (k >= 0 && decimalPoint <= 21) {
+        memset(buffer + length, '0', k);
+        return decimalPoint;
+    }
+
+    if (decimalPoint > 0 && decimalPoint <= 21) {
+        memmove(buffer + decimalPoint + 1, buffer + decimalPoint, length - decimalPoint);
+        buffer[decimalPoint] = '.';
+        return length + 1;
+    }
+
+    if (decimalPoint > -6 && decimalPoint <= 0) {
+        const int offset = 2 - decimalPoint;
+        memmove(buffer + offset, buffer, length);
+        buffer[0] = '0';
+        buffer[1] = '.';
+        memset(buffer + 2, '0', offset - 2);
+        return length + offset;
+    }
+
+    int cursor = 1;
+    if (length > 1) {
+        memmove(buffer + 2, buffer + 1, length - 1);
+        buffer[1] = '.';
+        cursor = length + 1;
+    }
+
+    int exponent = decimalPoint - 1;
+    buffer[cursor++] = 'e';
+    if (exponent < 0) {
+        buffer[cursor++] = '-';
+        exponent = -exponent;
+    } else {
+        buffer[cursor++] = '+';
+    }
+
+    if (exponent >= 100) {
+        buffer[cursor++] = (char) ('0' + exponent / 100);
+        exponent %= 100;
+        buffer[cursor++] = (char) ('0' + exponent / 10);
+    } else if (exponent >= 10) {
+        buffer[cursor++] = (char) ('0' + exponent / 10);
+    }
+    buffer[cursor++] = (char) ('0' + exponent % 10);
+
+    return cursor;
+}
@@ -0,0 +1,12 @@
+#ifndef CLOXVM_DTOA_H
+#define CLOXVM_DTOA_H
+
+#include "../common.h"
+
+#define DTOA_BUFFER_SIZE 32
+
+int formatDouble(double value, char *buffer);
+
+int formatInt64(int64_t value, char *buffer);
+
+#endif //CLOXVM_DTOA_H
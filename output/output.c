@@ -0,0 +1,270 @@
+#include "output.h"
+#include "dtoa.h"
+#include "../memory/memory.h"
+#include "../object/object.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+static void initSink(OutputSink *sink, OutputSinkType type);
+
+static void reserveOutput(OutputSink *sink, size_t length);
+
+/**
+ * Initializes a sink that writes to a file descriptor.
+ *
+ * Output is collected in a block of OUTPUT_BLOCK_SIZE bytes and handed to
+ * write(2) only when the block is full or the sink is flushed, so printing
+ * many small values costs one system call per block instead of one stdio
+ * call per value.
+ *
+ * @param sink The sink to initialize.
+ * @param fd The file descriptor the sink writes to. It is not closed by the sink.
+ */
+void initFdSink(OutputSink *sink, const int fd) {
+    initSink(sink, OUTPUT_FD);
+    sink->fd = fd;
+    sink->capacity = OUTPUT_BLOCK_SIZE;
+    sink->buffer = GROW_ARRAY(char, NULL, 0, sink->capacity);
+}
+
+/**
+ * Initializes a sink that keeps everything written to it in memory.
+ *
+ * The buffer grows as needed and is never flushed; the collected output is
+ * available through the sink's buffer and count fields.
+ *
+ * @param sink The sink to initialize.
+ */
+void initBufferSink(OutputSink *sink) {
+    initSink(sink, OUTPUT_BUFFER);
+}
+
+/**
+ * Initializes a sink that hands blocks of output to a user callback.
+ *
+ * Like the file descriptor sink, output is collected in a block of
+ * OUTPUT_BLOCK_SIZE bytes and passed on when the block is full or the sink
+ * is flushed.
+ *
+ * @param sink The sink to initialize.
+ * @param callback The function receiving each block of output.
+ * @param userData An opaque pointer passed through to the callback.
+ */
+void initCallbackSink(OutputSink *sink, const OutputCallback callback, void *userData) {
+    initSink(sink, OUTPUT_CALLBACK);
+    sink->callback = callback;
+    sink->userData = userData;
+    sink->capacity = OUTPUT_BLOCK_SIZE;
+    sink->buffer = GROW_ARRAY(char, NULL, 0, sink->capacity);
+}
+
+/**
+ * Flushes any pending output and releases the memory held by the sink.
+ *
+ * @param sink The sink to free.
+ */
+void freeOutputSink(OutputSink *sink) {
+    flushOutput(sink);
+    FREE_ARRAY(char, sink->buffer, sink->capacity);
+    initSink(sink, sink->type);
+}
+
+/**
+ * Appends raw bytes to the sink.
+ *
+ * @param sink The sink to write to.
+ * @param data The bytes to write.
+ * @param length The number of bytes to write.
+ */
+void writeOutput(OutputSink *sink, const char *data, const size_t length) {
+    reserveOutput(sink, length);
+
+    if (sink->capacity - sink->count < length) {
+        // A single write larger than the block bypasses the buffer.
+        const OutputSinkType type = sink->type;
+        if (type == OUTPUT_FD) {
+            const char *cursor = data;
+            size_t remaining = length;
+            while (remaining > 0) {
+                const ssize_t written = write(sink->fd, cursor, remaining);
+                if (written < 0) {
+                    if (errno == EINTR) continue;
+                    return;
+                }
+                cursor += written;
+                remaining -= (size_t) written;
+            }
+        } else {
+            sink->callback(data, length, sink->userData);
+        }
+        return;
+    }
+
+    memcpy(sink->buffer + sink->count, data, length);
+    sink->count += length;
+}
+
+/**
+ * Appends a single character to the sink.
+ *
+ * @param sink The sink to write to.
+ * @param c The character to write.
+ */
+void writeOutputChar(OutputSink *sink, const char c) {
+    if (sink->count == sink->capacity) reserveOutput(sink, 1);
+    sink->buffer[sink->count++] = c;
+}
+
+/**
+ * Formats a value and appends it to the sink.
+ *
+ * Doubles are written as the shortest decimal string that round-trips to the
+ * same value and integers as plain decimal digits, both formatted directly
+ * into the sink's buffer.
+ *
+ * @param sink The sink to write to.
+ * @param value The value to write.
+ */
+void writeValue(OutputSink *sink, const Value value) {
+    switch (value.type) {
+        case VAL_BOOL:
+            if (AS_BOOL(value)) writeOutput(sink, "true", 4);
+            else writeOutput(sink, "false", 5);
+            break;
+        case VAL_NIL:
+            writeOutput(sink, "nil", 3);
+            break;
+        case VAL_UNDEFINED:
+            writeOutput(sink, "<undefined>", 11);
+            break;
+        case VAL_NUMBER:
+            reserveOutput(sink, DTOA_BUFFER_SIZE);
+            sink->count += formatDouble(AS_NUMBER(value), sink->buffer + sink->count);
+            break;
+        case VAL_INT:
+            reserveOutput(sink, DTOA_BUFFER_SIZE);
+            sink->count += formatInt64(AS_INT(value), sink->buffer + sink->count);
+            break;
+        case VAL_OBJ:
+            switch (OBJ_TYPE(value)) {
+                case OBJ_STRING:
+                    writeOutput(sink, AS_CSTRING(value), AS_STRING(value)->length);
+                    break;
+                case OBJ_FUNCTION:
+                case OBJ_CLOSURE: {
+                    const ObjString *name = IS_CLOSURE(value) ? AS_CLOSURE(value)->function->name
+                                                              : AS_FUNCTION(value)->name;
+                    writeOutput(sink, "<fn ", 4);
+                    writeOutput(sink, name->chars, name->length);
+                    writeOutput(sink, ">", 1);
+                    break;
+                }
+                case OBJ_UPVALUE:
+                    writeOutput(sink, "upvalue", 7);
+                    break;
+                case OBJ_CLASS:
+                    writeOutput(sink, AS_CLASS(value)->name->chars, AS_CLASS(value)->name->length);
+                    break;
+                case OBJ_INSTANCE: {
+                    const ObjString *name = AS_INSTANCE(value)->klass->name;
+                    writeOutput(sink, name->chars, name->length);
+                    writeOutput(sink, " instance", 9);
+                    break;
+                }
+                case OBJ_BOUND_METHOD:
+                    writeValue(sink, AS_BOUND_METHOD(value)->method);
+                    break;
+                case OBJ_NATIVE: {
+                    const ObjString *name = AS_NATIVE(value)->name;
+                    writeOutput(sink, "<native ", 8);
+                    writeOutput(sink, name->chars, name->length);
+                    writeOutput(sink, ">", 1);
+                    break;
+                }
+                case OBJ_ARRAY: {
+                    const ObjArray *array = AS_ARRAY(value);
+                    writeOutput(sink, "[", 1);
+                    for (int i = 0; i < array->count; i++) {
+                        if (i > 0) writeOutput(sink, ", ", 2);
+                        writeValue(sink, NUMBER_VAL(array->values[i]));
+                    }
+                    writeOutput(sink, "]", 1);
+                    break;
+                }
+            }
+            break;
+    }
+}
+
+/**
+ * Passes all buffered output on to the sink's destination.
+ *
+ * For a file descriptor sink on standard output, stdio's own buffer is
+ * flushed first so that anything printed through printf (such as debug
+ * traces) keeps its place relative to the sink's output. Buffer sinks keep
+ * their contents.
+ *
+ * @param sink The sink to flush.
+ */
+void flushOutput(OutputSink *sink) {
+    if (sink->count == 0) return;
+
+    switch (sink->type) {
+        case OUTPUT_FD: {
+            if (sink->fd == STDOUT_FILENO) fflush(stdout);
+
+            const char *cursor = sink->buffer;
+            size_t remaining = sink->count;
+            while (remaining > 0) {
+                const ssize_t written = write(sink->fd, cursor, remaining);
+                if (written < 0) {
+                    if (errno == EINTR) continue;
+                    break;
+                }
+                cursor += written;
+                remaining -= (size_t) written;
+            }
+            sink->count = 0;
+            break;
+        }
+        case OUTPUT_CALLBACK:
+            sink->callback(sink->buffer, sink->count, sink->userData);
+            sink->count = 0;
+            break;
+        case OUTPUT_BUFFER:
+            break;
+    }
+}
+
+static void initSink(OutputSink *sink, const OutputSinkType type) {
+    sink->type = type;
+    sink->buffer = NULL;
+    sink->count = 0;
+    sink->capacity = 0;
+    sink->fd = -1;
+    sink->callback = NULL;
+    sink->userData = NULL;
+}
+
+/**
+ * Makes room for at least length more bytes in the sink's buffer.
+ *
+ * Buffer sinks grow; block sinks flush. A block sink may still have less
+ * room than requested afterwards if length exceeds the block size.
+ */
+static void reserveOutput(OutputSink *sink, const size_t length) {
+    if (sink->capacity - sink->count >= length) return;
+
+    if (sink->type == OUTPUT_BUFFER) {
+        size_t newCapacity = sink->capacity;
+        while (newCapacity - sink->count < length) newCapacity = GROW_CAPACITY(newCapacity);
+        sink->buffer = GROW_ARRAY(char, sink->buffer, sink->capacity, newCapacity);
+        sink->capacity = newCapacity;
+        return;
+    }
+
+    flushOutput(sink);
+}
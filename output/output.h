@@ -0,0 +1,43 @@
+#ifndef CLOXVM_OUTPUT_H
+#define CLOXVM_OUTPUT_H
+
+#include "../common.h"
+#include "../value/value.h"
+
+#define OUTPUT_BLOCK_SIZE (64 * 1024)
+
+typedef enum {
+    OUTPUT_FD,
+    OUTPUT_BUFFER,
+    OUTPUT_CALLBACK
+} OutputSinkType;
+
+typedef void (*OutputCallback)(const char *data, size_t length, void *userData);
+
+typedef struct {
+    OutputSinkType type;
+    char *buffer;
+    size_t count;
+    size_t capacity;
+    int fd;
+    OutputCallback callback;
+    void *userData;
+} OutputSink;
+
+void initFdSink(OutputSink *sink, int fd);
+
+void initBufferSink(OutputSink *sink);
+
+void initCallbackSink(OutputSink *sink, OutputCallback callback, void *userData);
+
+void freeOutputSink(OutputSink *sink);
+
+void writeOutput(OutputSink *sink, const char *data, size_t length);
+
+void writeOutputChar(OutputSink *sink, char c);
+
+void writeValue(OutputSink *sink, Value value);
+
+void flushOutput(OutputSink *sink);
+
+#endif //CLOXVM_OUTPUT_H
@@ -0,0 +1,341 @@
+#define _GNU_SOURCE
+
+#include "perfcounters.h"
+#include "../enums/opcodes.h"
+#include "../vm/vm.h"
+
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+typedef struct {
+    int fds[COUNTER_COUNT];
+    uint64_t samplePeriod;
+    volatile bool running;
+    volatile uint64_t samples[COUNTER_COUNT][CATEGORY_COUNT];
+    struct sigaction previousAction;
+} PerfCounters;
+
+typedef struct {
+    uint64_t value;
+    uint64_t timeEnabled;
+    uint64_t timeRunning;
+} CounterReading;
+
+static const char *counterNames[COUNTER_COUNT] = {
+    [COUNTER_CYCLES] = "cycles",
+    [COUNTER_INSTRUCTIONS] = "instructions",
+    [COUNTER_BRANCH_MISSES] = "branch_misses",
+    [COUNTER_L1D_MISSES] = "l1d_misses",
+    [COUNTER_LLC_MISSES] = "llc_misses",
+};
+
+static const char *categoryNames[CATEGORY_COUNT] = {
+    [CATEGORY_LOAD] = "load",
+    [CATEGORY_ARITHMETIC] = "arithmetic",
+    [CATEGORY_QUICKENED] = "quickened",
+    [CATEGORY_REGISTER] = "register",
+    [CATEGORY_BRANCH] = "branch",
+    [CATEGORY_RETURN] = "return",
+    [CATEGORY_OTHER] = "other",
+};
+
+static PerfCounters counters = {
+    .fds = {-1, -1, -1, -1, -1},
+};
+
+static int openCounter(uint32_t type, uint64_t config, uint64_t samplePeriod);
+
+static void handleOverflowSignal(int signal, siginfo_t *info, void *context);
+
+static OpcodeCategory opcodeCategory(uint8_t opcode);
+
+/**
+ * Opens the hardware performance counters for the calling process.
+ *
+ * Counts are taken in user space only, so the usual perf_event_paranoid
+ * setting of 2 suffices. Counters the CPU or kernel does not offer are
+ * reported as unavailable instead of failing the whole set.
+ *
+ * With a non-zero sample period every counter also raises a signal each
+ * time it advances by that many events. The handler charges the event to
+ * the category of the instruction the VM published last, which gives a
+ * statistical breakdown of, for example, branch misses per opcode category.
+ *
+ * @param samplePeriod Events between two category samples, or 0 for no sampling.
+ * @return true if at least one counter could be opened.
+ */
+bool openPerfCounters(const uint64_t samplePeriod) {
+    static const struct {
+        uint32_t type;
+        uint64_t config;
+    } events[COUNTER_COUNT] = {
+        [COUNTER_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        [COUNTER_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        [COUNTER_BRANCH_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        [COUNTER_L1D_MISSES] = {
+            PERF_TYPE_HW_CACHE,
+            PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+            PERF_COUNT_HW_CACHE_RESULT_MISS << 16
+        },
+        [COUNTER_LLC_MISSES] = {
+            PERF_TYPE_HW_CACHE,
+            PERF_COUNT_HW_CACHE_LL | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+            PERF_COUNT_HW_CACHE_RESULT_MISS << 16
+        },
+    };
+
+    memset((void *) counters.samples, 0, sizeof(counters.samples));
+    counters.samplePeriod = samplePeriod;
+    counters.running = false;
+
+    if (samplePeriod > 0) {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = handleOverflowSignal;
+        action.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGIO, &action, &counters.previousAction);
+    }
+
+    bool anyOpen = false;
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        counters.fds[i] = openCounter(events[i].type, events[i].config, samplePeriod);
+        if (counters.fds[i] >= 0) anyOpen = true;
+    }
+
+    if (!anyOpen) closePerfCounters();
+    return anyOpen;
+}
+
+/**
+ * Resets the open counters to zero and starts counting.
+ */
+void startPerfCounters() {
+    counters.running = true;
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        if (counters.fds[i] < 0) continue;
+        ioctl(counters.fds[i], PERF_EVENT_IOC_RESET, 0);
+        if (counters.samplePeriod > 0) {
+            ioctl(counters.fds[i], PERF_EVENT_IOC_REFRESH, 1);
+        } else {
+            ioctl(counters.fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+/**
+ * Stops counting and adds the counts since startPerfCounters() to the given
+ * values.
+ *
+ * When the kernel had to multiplex counters, the raw count is scaled by the
+ * fraction of time the counter was actually scheduled.
+ *
+ * @param accumulated The values to add the counts to.
+ */
+void stopPerfCounters(CounterValues *accumulated) {
+    counters.running = false;
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        if (counters.fds[i] < 0) continue;
+        ioctl(counters.fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        if (counters.fds[i] < 0) continue;
+
+        CounterReading reading;
+        if (read(counters.fds[i], &reading, sizeof(reading)) != sizeof(reading)) continue;
+
+        uint64_t value = reading.value;
+        if (reading.timeRunning > 0 && reading.timeRunning < reading.timeEnabled) {
+            value = (uint64_t) ((double) value * reading.timeEnabled / reading.timeRunning);
+        }
+
+        accumulated->available[i] = true;
+        accumulated->values[i] += value;
+    }
+}
+
+/**
+ * Copies the per-category samples taken since the counters were opened.
+ *
+ * @param counts Receives the samples and the period they were taken with.
+ */
+void readCategoryCounts(CategoryCounts *counts) {
+    counts->samplePeriod = counters.samplePeriod;
+    memcpy(counts->samples, (const void *) counters.samples, sizeof(counts->samples));
+}
+
+/**
+ * Closes all counters and restores the previous overflow signal handler.
+ */
+void closePerfCounters() {
+    counters.running = false;
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        if (counters.fds[i] >= 0) close(counters.fds[i]);
+        counters.fds[i] = -1;
+    }
+
+    if (counters.samplePeriod > 0) {
+        sigaction(SIGIO, &counters.previousAction, NULL);
+        counters.samplePeriod = 0;
+    }
+}
+
+/**
+ * Marks all counters as unavailable with a count of zero.
+ *
+ * @param values The values to initialize.
+ */
+void initCounterValues(CounterValues *values) {
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        values->available[i] = false;
+        values->values[i] = 0;
+    }
+}
+
+/**
+ * Prints counter values as a JSON object. Unavailable counters are null.
+ *
+ * @param file The file to print to.
+ * @param values The values to print.
+ */
+void printCounterValuesJson(FILE *file, const CounterValues *values) {
+    fprintf(file, "{");
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        fprintf(file, "%s\"%s\": ", i > 0 ? ", " : "", counterNames[i]);
+        if (values->available[i]) {
+            fprintf(file, "%llu", (unsigned long long) values->values[i]);
+        } else {
+            fprintf(file, "null");
+        }
+    }
+    fprintf(file, "}");
+}
+
+/**
+ * Prints the estimated events per opcode category as a JSON object mapping
+ * each category to its counters. Estimates are samples times the sample
+ * period.
+ *
+ * @param file The file to print to.
+ * @param counts The samples to print.
+ */
+void printCategoryCountsJson(FILE *file, const CategoryCounts *counts) {
+    fprintf(file, "{");
+    for (int category = 0; category < CATEGORY_COUNT; category++) {
+        fprintf(file, "%s\"%s\": {", category > 0 ? ", " : "", categoryNames[category]);
+        for (int counter = 0; counter < COUNTER_COUNT; counter++) {
+            fprintf(file, "%s\"%s\": %llu", counter > 0 ? ", " : "", counterNames[counter],
+                    (unsigned long long) (counts->samples[counter][category] * counts->samplePeriod));
+        }
+        fprintf(file, "}");
+    }
+    fprintf(file, "}");
+}
+
+static int openCounter(const uint32_t type, const uint64_t config, const uint64_t samplePeriod) {
+    struct perf_event_attr attributes;
+    memset(&attributes, 0, sizeof(attributes));
+    attributes.type = type;
+    attributes.size = sizeof(attributes);
+    attributes.config = config;
+    attributes.disabled = 1;
+    attributes.exclude_kernel = 1;
+    attributes.exclude_hv = 1;
+    attributes.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    if (samplePeriod > 0) {
+        attributes.sample_period = samplePeriod;
+        attributes.wakeup_events = 1;
+    }
+
+    const int fd = (int) syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0);
+    if (fd < 0 || samplePeriod == 0) return fd;
+
+    if (fcntl(fd, F_SETFL, O_ASYNC) != 0 ||
+        fcntl(fd, F_SETSIG, SIGIO) != 0 ||
+        fcntl(fd, F_SETOWN, getpid()) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * Charges one sample period of a counter to the category of the instruction
+ * the VM is executing, then re-arms the counter for its next overflow.
+ */
+static void handleOverflowSignal(const int signal, siginfo_t *info, void *context) {
+    (void) signal;
+    (void) context;
+
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        if (counters.fds[i] != info->si_fd) continue;
+
+        const VM *machine = vm;
+        if (machine != NULL && machine->chunk != NULL && machine->ip != NULL) {
+            counters.samples[i][opcodeCategory(*machine->ip)]++;
+        }
+
+        if (counters.running) ioctl(counters.fds[i], PERF_EVENT_IOC_REFRESH, 1);
+        return;
+    }
+}
+
+static OpcodeCategory opcodeCategory(const uint8_t opcode) {
+    switch (opcode) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG:
+        case OP_GET_LOCAL:
+            return CATEGORY_LOAD;
+        case OP_NEGATE:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            return CATEGORY_ARITHMETIC;
+        case OP_NEGATE_NUM:
+        case OP_ADD_NUM:
+        case OP_SUBTRACT_NUM:
+        case OP_MULTIPLY_NUM:
+        case OP_DIVIDE_NUM:
+        case OP_NEGATE_INT:
+        case OP_ADD_INT:
+        case OP_SUBTRACT_INT:
+        case OP_MULTIPLY_INT:
+        case OP_DIVIDE_INT:
+            return CATEGORY_QUICKENED;
+        case OP_R_NEGATE:
+        case OP_R_ADD:
+        case OP_R_SUBTRACT:
+        case OP_R_MULTIPLY:
+        case OP_R_DIVIDE:
+        case OP_R_RETURN:
+            return CATEGORY_REGISTER;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_JUMP_IF_LESS:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_GREATER:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_TABLE:
+            return CATEGORY_BRANCH;
+        case OP_RETURN:
+            return CATEGORY_RETURN;
+        default:
+            return CATEGORY_OTHER;
+    }
+}
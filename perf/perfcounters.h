@@ -0,0 +1,56 @@
+#ifndef CLOXVM_PERFCOUNTERS_H
+#define CLOXVM_PERFCOUNTERS_H
+
+#include <stdio.h>
+
+#include "../common.h"
+
+#define PERF_DEFAULT_SAMPLE_PERIOD 10007
+
+typedef enum {
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_BRANCH_MISSES,
+    COUNTER_L1D_MISSES,
+    COUNTER_LLC_MISSES,
+    COUNTER_COUNT
+} CounterKind;
+
+typedef enum {
+    CATEGORY_LOAD,
+    CATEGORY_ARITHMETIC,
+    CATEGORY_QUICKENED,
+    CATEGORY_REGISTER,
+    CATEGORY_BRANCH,
+    CATEGORY_RETURN,
+    CATEGORY_OTHER,
+    CATEGORY_COUNT
+} OpcodeCategory;
+
+typedef struct {
+    bool available[COUNTER_COUNT];
+    uint64_t values[COUNTER_COUNT];
+} CounterValues;
+
+typedef struct {
+    uint64_t samplePeriod;
+    uint64_t samples[COUNTER_COUNT][CATEGORY_COUNT];
+} CategoryCounts;
+
+bool openPerfCounters(uint64_t samplePeriod);
+
+void startPerfCounters();
+
+void stopPerfCounters(CounterValues *accumulated);
+
+void readCategoryCounts(CategoryCounts *counts);
+
+void closePerfCounters();
+
+void initCounterValues(CounterValues *values);
+
+void printCounterValuesJson(FILE *file, const CounterValues *values);
+
+void printCategoryCountsJson(FILE *file, const CategoryCounts *counts);
+
+#endif //CLOXVM_PERFCOUNTERS_H
@@ -0,0 +1,470 @@
+#include "profiler.h"
+#include "../memory/memory.h"
+#include "../object/object.h"
+#include "../vm/vm.h"
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Raw samples are aggregated by call stack in a fixed-size, open-addressed
+// table so the signal handler never allocates.
+#define SAMPLE_TABLE_SIZE 4096
+#define SAMPLE_TABLE_MAX_PROBES 32
+
+// Frames a sample holds. Deeper stacks keep their innermost frames.
+#define SAMPLE_MAX_DEPTH 32
+
+/**
+ * Where one frame of a sampled stack was: the chunk it ran and its
+ * instruction pointer, which for the frames below the innermost one is the
+ * address their call returns to.
+ */
+typedef struct {
+    const Chunk *chunk;
+    const uint8_t *ip;
+} SampledFrame;
+
+/**
+ * A call stack and how often it was sampled, outermost frame first. depth
+ * is 0 for an entry that was never used and -1 for one whose chunk was
+ * freed, which the next new stack probing past it takes over.
+ */
+typedef struct {
+    uint64_t count;
+    uint32_t hash;
+    int depth;
+    bool truncated;
+    SampledFrame frames[SAMPLE_MAX_DEPTH];
+} StackSamples;
+
+typedef struct {
+    const char *name;
+    int line;
+} ResolvedFrame;
+
+typedef struct {
+    ResolvedFrame *frames;
+    int depth;
+    bool truncated;
+    uint64_t count;
+} ResolvedStack;
+
+typedef struct {
+    const char *name;
+    int line;
+    uint64_t count;
+} LineSamples;
+
+typedef struct {
+    bool running;
+    timer_t timer;
+    struct sigaction previousAction;
+    StackSamples samples[SAMPLE_TABLE_SIZE];
+    int used[SAMPLE_TABLE_SIZE];
+    volatile int usedCount;
+    volatile uint64_t total;
+    volatile uint64_t outside;
+    volatile uint64_t dropped;
+    ResolvedStack *stacks;
+    int stackCount;
+    int stackCapacity;
+    LineSamples *lines;
+    int lineCount;
+    int lineCapacity;
+    char **names;
+    int nameCount;
+    int nameCapacity;
+} Profiler;
+
+static Profiler profiler;
+
+static void handleProfileSignal(int signal);
+
+static bool resolveFrame(const SampledFrame *sampled, bool isCaller, const char *root, ResolvedFrame *frame);
+
+static const char *internName(const char *name);
+
+static void addStackSamples(const ResolvedFrame *frames, int depth, bool truncated, uint64_t count);
+
+static void addLineSamples(const char *name, int line, uint64_t count);
+
+static int compareLineSamples(const void *a, const void *b);
+
+/**
+ * Starts sampling the interpreter.
+ *
+ * A CPU-time timer delivers SIGPROF at the given frequency. The handler
+ * records the chunk and instruction pointer the VM published last along
+ * with the return addresses of the call frames below it, so the
+ * interpreter itself pays nothing but one store per dispatched instruction.
+ *
+ * @param frequencyHz How many samples to take per second of CPU time.
+ * @return true if the profiler is running, false if the timer could not be set up.
+ */
+bool startProfiler(const int frequencyHz) {
+    if (profiler.running) return true;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handleProfileSignal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, &profiler.previousAction) != 0) return false;
+
+    struct sigevent event;
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_SIGNAL;
+    event.sigev_signo = SIGPROF;
+    if (timer_create(CLOCK_PROCESS_CPUTIME_ID, &event, &profiler.timer) != 0) {
+        sigaction(SIGPROF, &profiler.previousAction, NULL);
+        return false;
+    }
+
+    const long intervalNanos = 1000000000L / (frequencyHz > 0 ? frequencyHz : PROFILER_DEFAULT_HZ);
+    struct itimerspec interval;
+    interval.it_interval.tv_sec = intervalNanos / 1000000000L;
+    interval.it_interval.tv_nsec = intervalNanos % 1000000000L;
+    interval.it_value = interval.it_interval;
+    if (timer_settime(profiler.timer, 0, &interval, NULL) != 0) {
+        timer_delete(profiler.timer);
+        sigaction(SIGPROF, &profiler.previousAction, NULL);
+        return false;
+    }
+
+    profiler.running = true;
+    return true;
+}
+
+/**
+ * Stops taking samples. Samples already taken stay available for reporting.
+ */
+void stopProfiler() {
+    if (!profiler.running) return;
+
+    timer_delete(profiler.timer);
+    sigaction(SIGPROF, &profiler.previousAction, NULL);
+    profiler.running = false;
+}
+
+/**
+ * Maps the raw samples taken while running a chunk, and the functions it
+ * called, to source lines.
+ *
+ * Must be called before the chunk is freed, since samples refer to its code
+ * by address. Every frame of a sampled stack is looked up in the line
+ * table of the chunk it ran, which turns the stack into a path of function
+ * names and lines; the innermost frame's line is also counted in the line
+ * table. The raw sample table is cleared afterwards. Function bodies carry
+ * the lines of the script they were declared in, so their samples are
+ * reported under the same name. Functions freed earlier have had their
+ * samples dropped by forgetProfileSamples().
+ *
+ * @param name The name the chunk is reported under, as the outermost frame.
+ */
+void resolveProfileSamples(const char *name) {
+    if (profiler.usedCount == 0) return;
+
+    sigset_t blocked;
+    sigset_t previous;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGPROF);
+    sigprocmask(SIG_BLOCK, &blocked, &previous);
+
+    const char *root = internName(name);
+    for (int i = 0; i < profiler.usedCount; i++) {
+        StackSamples *samples = &profiler.samples[profiler.used[i]];
+        if (samples->depth <= 0) continue;
+
+        ResolvedFrame frames[SAMPLE_MAX_DEPTH];
+        bool resolved = true;
+        for (int j = 0; j < samples->depth && resolved; j++) {
+            resolved = resolveFrame(&samples->frames[j], j < samples->depth - 1, root, &frames[j]);
+        }
+        if (!resolved) {
+            // Caught between switching frames.
+            profiler.outside += samples->count;
+            continue;
+        }
+
+        addStackSamples(frames, samples->depth, samples->truncated, samples->count);
+        addLineSamples(root, frames[samples->depth - 1].line, samples->count);
+    }
+
+    for (int i = 0; i < profiler.usedCount; i++) {
+        memset(&profiler.samples[profiler.used[i]], 0, sizeof(StackSamples));
+    }
+    profiler.usedCount = 0;
+
+    sigprocmask(SIG_SETMASK, &previous, NULL);
+}
+
+/**
+ * Drops the raw samples of stacks running a chunk that is about to be
+ * freed, counting them as outside the VM. Their entries are left for new
+ * stacks to take over. Does nothing unless samples have been taken.
+ *
+ * @param chunk The chunk being freed.
+ */
+void forgetProfileSamples(const Chunk *chunk) {
+    if (profiler.usedCount == 0) return;
+
+    sigset_t blocked;
+    sigset_t previous;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGPROF);
+    sigprocmask(SIG_BLOCK, &blocked, &previous);
+
+    // Entries keep a nonzero depth so that probe sequences running through
+    // them are not cut short.
+    for (int i = 0; i < profiler.usedCount; i++) {
+        StackSamples *samples = &profiler.samples[profiler.used[i]];
+        for (int j = 0; j < samples->depth; j++) {
+            if (samples->frames[j].chunk != chunk) continue;
+            profiler.outside += samples->count;
+            samples->depth = -1;
+            samples->count = 0;
+            break;
+        }
+    }
+
+    sigprocmask(SIG_SETMASK, &previous, NULL);
+}
+
+/**
+ * Writes the resolved samples in the folded stack format read by flame graph
+ * tools: one "frame;frame count" line per distinct stack. Each call frame
+ * contributes its function's name and the line it was at, the outermost one
+ * the name of the script. Stacks deeper than a sample holds start with
+ * "(truncated)".
+ *
+ * @param file The file to write to.
+ */
+void writeProfileFolded(FILE *file) {
+    for (int i = 0; i < profiler.stackCount; i++) {
+        const ResolvedStack *stack = &profiler.stacks[i];
+        if (stack->truncated) fprintf(file, "(truncated);");
+        for (int j = 0; j < stack->depth; j++) {
+            fprintf(file, "%s%s;line %d", j > 0 ? ";" : "", stack->frames[j].name, stack->frames[j].line);
+        }
+        fprintf(file, " %llu\n", (unsigned long long) stack->count);
+    }
+
+    if (profiler.outside > 0) {
+        fprintf(file, "(outside VM) %llu\n", (unsigned long long) profiler.outside);
+    }
+}
+
+/**
+ * Writes a table of source lines ordered by how many samples hit them.
+ *
+ * @param file The file to write to.
+ */
+void writeProfileLineTable(FILE *file) {
+    LineSamples *sorted = GROW_ARRAY(LineSamples, NULL, 0, profiler.lineCount);
+    memcpy(sorted, profiler.lines, sizeof(LineSamples) * profiler.lineCount);
+    qsort(sorted, profiler.lineCount, sizeof(LineSamples), compareLineSamples);
+
+    const uint64_t total = profiler.total > 0 ? profiler.total : 1;
+
+    fprintf(file, "%-16s %6s %10s %8s\n", "chunk", "line", "samples", "percent");
+    for (int i = 0; i < profiler.lineCount; i++) {
+        fprintf(file, "%-16s %6d %10llu %7.2f%%\n", sorted[i].name, sorted[i].line,
+                (unsigned long long) sorted[i].count, 100.0 * sorted[i].count / total);
+    }
+    fprintf(file, "%-16s %6s %10llu %7.2f%%\n", "(outside VM)", "",
+            (unsigned long long) profiler.outside, 100.0 * profiler.outside / total);
+    if (profiler.dropped > 0) {
+        fprintf(file, "%llu samples dropped\n", (unsigned long long) profiler.dropped);
+    }
+
+    FREE_ARRAY(LineSamples, sorted, profiler.lineCount);
+}
+
+/**
+ * Stops the profiler and discards all samples.
+ */
+void freeProfiler() {
+    stopProfiler();
+    for (int i = 0; i < profiler.stackCount; i++) {
+        FREE_ARRAY(ResolvedFrame, profiler.stacks[i].frames, profiler.stacks[i].depth);
+    }
+    FREE_ARRAY(ResolvedStack, profiler.stacks, profiler.stackCapacity);
+    FREE_ARRAY(LineSamples, profiler.lines, profiler.lineCapacity);
+    for (int i = 0; i < profiler.nameCount; i++) {
+        FREE_ARRAY(char, profiler.names[i], strlen(profiler.names[i]) + 1);
+    }
+    FREE_ARRAY(char *, profiler.names, profiler.nameCapacity);
+    memset(&profiler, 0, sizeof(profiler));
+}
+
+/**
+ * Records one sample of the VM's call stack: the position it published
+ * last and the return addresses of the frames below it.
+ *
+ * Runs in signal context: it only reads the VM and updates the preallocated
+ * sample table. The VM fills in a call frame before it counts it, so every
+ * frame below frameCount is complete. Samples taken while no chunk is
+ * executing (for example during compilation) are counted separately.
+ */
+static void handleProfileSignal(int signal) {
+    (void) signal;
+
+    const VM *machine = vm;
+    const Chunk *chunk = machine != NULL ? machine->chunk : NULL;
+    const uint8_t *ip = machine != NULL ? machine->ip : NULL;
+    profiler.total++;
+
+    if (chunk == NULL || ip == NULL) {
+        profiler.outside++;
+        return;
+    }
+
+    const int frameCount = machine->frameCount;
+    const int callers = frameCount < SAMPLE_MAX_DEPTH ? frameCount : SAMPLE_MAX_DEPTH - 1;
+    const int depth = callers + 1;
+    const bool truncated = callers < frameCount;
+    SampledFrame frames[SAMPLE_MAX_DEPTH];
+    uint64_t hash = 14695981039346656037u ^ (uint64_t) truncated;
+    for (int i = 0; i < depth; i++) {
+        if (i < callers) {
+            const CallFrame *frame = &machine->frames[frameCount - callers + i];
+            frames[i] = (SampledFrame){frame->chunk, frame->ip};
+        } else {
+            frames[i] = (SampledFrame){chunk, ip};
+        }
+        hash = (hash ^ (uintptr_t) frames[i].ip) * 1099511628211u;
+    }
+    const uint32_t stackHash = (uint32_t) (hash ^ hash >> 32);
+
+    // A stack is looked for until the first entry that was never used; the
+    // first entry on the way that is free again takes it if it is new.
+    StackSamples *free = NULL;
+    size_t index = stackHash & (SAMPLE_TABLE_SIZE - 1);
+    for (int probe = 0; probe < SAMPLE_TABLE_MAX_PROBES; probe++) {
+        StackSamples *samples = &profiler.samples[index];
+        if (samples->depth == 0) {
+            if (free == NULL) {
+                free = samples;
+                profiler.used[profiler.usedCount++] = (int) index;
+            }
+            break;
+        }
+        if (samples->depth < 0) {
+            if (free == NULL) free = samples;
+        } else if (samples->hash == stackHash && samples->depth == depth && samples->truncated == truncated &&
+                   memcmp(samples->frames, frames, sizeof(SampledFrame) * depth) == 0) {
+            samples->count++;
+            return;
+        }
+        index = (index + 1) & (SAMPLE_TABLE_SIZE - 1);
+    }
+
+    if (free == NULL) {
+        profiler.dropped++;
+        return;
+    }
+    memcpy(free->frames, frames, sizeof(SampledFrame) * depth);
+    free->hash = stackHash;
+    free->truncated = truncated;
+    free->count = 1;
+    free->depth = depth;
+}
+
+// Looks up the function name and line of one sampled frame. A caller's
+// instruction pointer is the address its call returns to, so the line is
+// the one of the byte before. Scripts are tracked by the collector and
+// reported under root; every other chunk belongs to a function. Returns false if the frame was sampled in the middle of a call
+// or return, when the VM had switched chunks but not yet published the
+// instruction pointer.
+static bool resolveFrame(const SampledFrame *sampled, const bool isCaller, const char *root,
+                         ResolvedFrame *frame) {
+    const Chunk *chunk = sampled->chunk;
+    const ptrdiff_t offset = sampled->ip - chunk->code - (isCaller ? 1 : 0);
+    if (offset < 0 || offset >= chunk->count) return false;
+
+    if (chunk->isRoot) {
+        frame->name = root;
+    } else {
+        const ObjFunction *function = (const ObjFunction *) ((const char *) chunk - offsetof(ObjFunction, chunk));
+        frame->name = internName(function->name->chars);
+    }
+    frame->line = getLine(chunk, (int) offset);
+    return true;
+}
+
+// Returns a copy of a name that the profiler owns, since function names
+// may be collected before the profile is written. Equal names share one
+// copy, so frames can compare their names by address.
+static const char *internName(const char *name) {
+    for (int i = 0; i < profiler.nameCount; i++) {
+        if (strcmp(profiler.names[i], name) == 0) return profiler.names[i];
+    }
+
+    if (profiler.nameCapacity < profiler.nameCount + 1) {
+        const int oldCapacity = profiler.nameCapacity;
+        profiler.nameCapacity = GROW_CAPACITY(oldCapacity);
+        profiler.names = GROW_ARRAY(char *, profiler.names, oldCapacity, profiler.nameCapacity);
+    }
+
+    const size_t length = strlen(name);
+    char *copy = GROW_ARRAY(char, NULL, 0, length + 1);
+    memcpy(copy, name, length + 1);
+    profiler.names[profiler.nameCount++] = copy;
+    return copy;
+}
+
+static void addStackSamples(const ResolvedFrame *frames, const int depth, const bool truncated,
+                            const uint64_t count) {
+    for (int i = 0; i < profiler.stackCount; i++) {
+        ResolvedStack *existing = &profiler.stacks[i];
+        if (existing->depth == depth && existing->truncated == truncated &&
+            memcmp(existing->frames, frames, sizeof(ResolvedFrame) * depth) == 0) {
+            existing->count += count;
+            return;
+        }
+    }
+
+    if (profiler.stackCapacity < profiler.stackCount + 1) {
+        const int oldCapacity = profiler.stackCapacity;
+        profiler.stackCapacity = GROW_CAPACITY(oldCapacity);
+        profiler.stacks = GROW_ARRAY(ResolvedStack, profiler.stacks, oldCapacity,
+                                     profiler.stackCapacity);
+    }
+
+    ResolvedStack *stack = &profiler.stacks[profiler.stackCount++];
+    stack->frames = GROW_ARRAY(ResolvedFrame, NULL, 0, depth);
+    memcpy(stack->frames, frames, sizeof(ResolvedFrame) * depth);
+    stack->depth = depth;
+    stack->truncated = truncated;
+    stack->count = count;
+}
+
+static void addLineSamples(const char *name, const int line, const uint64_t count) {
+    for (int i = 0; i < profiler.lineCount; i++) {
+        LineSamples *existing = &profiler.lines[i];
+        if (existing->line == line && strcmp(existing->name, name) == 0) {
+            existing->count += count;
+            return;
+        }
+    }
+
+    if (profiler.lineCapacity < profiler.lineCount + 1) {
+        const int oldCapacity = profiler.lineCapacity;
+        profiler.lineCapacity = GROW_CAPACITY(oldCapacity);
+        profiler.lines = GROW_ARRAY(LineSamples, profiler.lines, oldCapacity,
+                                    profiler.lineCapacity);
+    }
+
+    LineSamples *samples = &profiler.lines[profiler.lineCount++];
+    samples->name = name;
+    samples->line = line;
+    samples->count = count;
+}
+
+static int compareLineSamples(const void *a, const void *b) {
+    const uint64_t countA = ((const LineSamples *) a)->count;
+    const uint64_t countB = ((const LineSamples *) b)->count;
+    return (countA < countB) - (countA > countB);
+}
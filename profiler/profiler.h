@@ -0,0 +1,25 @@
+#ifndef CLOXVM_PROFILER_H
+#define CLOXVM_PROFILER_H
+
+#include <stdio.h>
+
+#include "../common.h"
+#include "../chunk/chunk.h"
+
+#define PROFILER_DEFAULT_HZ 997
+
+bool startProfiler(int frequencyHz);
+
+void stopProfiler();
+
+void resolveProfileSamples(const char *name);
+
+void forgetProfileSamples(const Chunk *chunk);
+
+void writeProfileFolded(FILE *file);
+
+void writeProfileLineTable(FILE *file);
+
+void freeProfiler();
+
+#endif //CLOXVM_PROFILER_H
@@ -0,0 +1,288 @@
+#include "reload.h"
+#include "../compiler/compiler.h"
+#include "../memory/memory.h"
+#include "../object/object.h"
+#include "../scanner/scanner.h"
+#include "../vm/vm.h"
+
+#include <string.h>
+
+static int commonPrefix(const char *a, const char *b, int length);
+
+static int commonSuffix(const char *aEnd, const char *bEnd, int length);
+
+static int firstRegionAfter(const Region *regions, int from, int to, int offset, bool byEnd);
+
+static int regionEnd(const char *source, int from);
+
+static int countLines(const char *text, int length);
+
+static bool compileRegion(const char *source, Region *region);
+
+static void appendRegion(Region **regions, int *count, int *capacity, Region region);
+
+static void shiftLines(Chunk *chunk, int delta);
+
+static void freeRegion(Region *region);
+
+/**
+ * Initializes an empty program, which runs like an empty script.
+ *
+ * @param program The program to initialize.
+ */
+void initProgram(Program *program) {
+    program->source = NULL;
+    program->length = 0;
+    program->regions = NULL;
+    program->count = 0;
+    program->capacity = 0;
+}
+
+/**
+ * Replaces a program's source, recompiling only what changed.
+ *
+ * The old and the new source are compared from both ends. Regions before
+ * the first difference are kept, except the last of them: where a region
+ * ends depends on the token after it, which may be part of the edit.
+ * Scanning for regions starts after the kept ones and compiles each region
+ * it finds until one ends where an old region after the last difference
+ * now starts. That region and the ones after it are kept as well, with
+ * their line information moved if the edit added or removed lines. Apart
+ * from comparing the sources, the work therefore grows with the size of
+ * the edit, not of the program. Kept regions keep their chunks, with the
+ * inline caches, quickened instructions and compiled function bodies they
+ * have accumulated.
+ *
+ * If any region fails to compile, its errors are reported and the program
+ * is left as it was.
+ *
+ * @param program The program to reload.
+ * @param source The new source.
+ * @return false if the new source had compile errors.
+ */
+bool reloadProgram(Program *program, const char *source) {
+    const int length = (int) strlen(source);
+    const int oldLength = program->length;
+    const char *old = program->source;
+    const int shorter = length < oldLength ? length : oldLength;
+
+    const int prefix = commonPrefix(old, source, shorter);
+    if (old != NULL && prefix == length && length == oldLength) return true;
+    const int suffix = old == NULL ? 0 : commonSuffix(old + oldLength, source + length, shorter - prefix);
+
+    const Region *oldRegions = program->regions;
+    const int head = firstRegionAfter(oldRegions, 1, program->count, prefix, true) - 1;
+    int kept = firstRegionAfter(oldRegions, head, program->count, oldLength - suffix, false);
+
+    // Most reloads end up with about as many regions as before.
+    int capacity = program->count < 8 ? 8 : program->count;
+    Region *regions = GROW_ARRAY(Region, NULL, 0, capacity);
+    int count = head;
+    if (head > 0) memcpy(regions, oldRegions, sizeof(Region) * head);
+
+    const int shift = length - oldLength;
+    int offset = head > 0 ? regions[head - 1].start + regions[head - 1].length : 0;
+    int line = head > 0 ? regions[head - 1].line + regions[head - 1].lineCount : 1;
+    bool success = true;
+    for (;;) {
+        while (kept < program->count && oldRegions[kept].start + shift < offset) kept++;
+        if (kept < program->count && oldRegions[kept].start + shift == offset) break;
+
+        const int end = regionEnd(source, offset);
+        if (end < 0) break;
+
+        Region region = {.start = offset, .length = end - offset, .line = line};
+        region.lineCount = countLines(source + offset, region.length);
+        if (!compileRegion(source, &region)) success = false;
+        appendRegion(&regions, &count, &capacity, region);
+        offset = end;
+        line += region.lineCount;
+    }
+
+    if (!success) {
+        for (int i = head; i < count; i++) {
+            freeRegion(&regions[i]);
+        }
+        FREE_ARRAY(Region, regions, capacity);
+        return false;
+    }
+
+    const int delta = kept < program->count ? line - oldRegions[kept].line : 0;
+    for (int i = kept; i < program->count; i++) {
+        Region region = oldRegions[i];
+        region.start += shift;
+        region.line += delta;
+        if (delta != 0) shiftLines(region.chunk, delta);
+        appendRegion(&regions, &count, &capacity, region);
+    }
+
+    for (int i = head; i < kept; i++) {
+        freeRegion(&program->regions[i]);
+    }
+    FREE_ARRAY(Region, program->regions, program->capacity);
+    FREE_ARRAY(char, program->source, (program->source == NULL ? 0 : program->length + 1));
+
+    program->source = GROW_ARRAY(char, NULL, 0, length + 1);
+    memcpy(program->source, source, length + 1);
+    program->length = length;
+    program->regions = regions;
+    program->count = count;
+    program->capacity = capacity;
+    return true;
+}
+
+/**
+ * Runs a program's regions in order, like interpretChunk() runs a script.
+ * The program's result is the last region's.
+ *
+ * @param program The program to run.
+ * @return INTERPRET_OK, or the status of the first region that failed.
+ */
+InterpretResult runProgram(Program *program) {
+    vm->result = NIL_VAL;
+    for (int i = 0; i < program->count; i++) {
+        const InterpretResult result = interpretChunk(program->regions[i].chunk);
+        if (result != INTERPRET_OK) return result;
+    }
+    return INTERPRET_OK;
+}
+
+/**
+ * Frees a program's chunks and its copy of the source and leaves it empty.
+ *
+ * @param program The program to free.
+ */
+void freeProgram(Program *program) {
+    for (int i = 0; i < program->count; i++) {
+        freeRegion(&program->regions[i]);
+    }
+    FREE_ARRAY(Region, program->regions, program->capacity);
+    FREE_ARRAY(char, program->source, (program->source == NULL ? 0 : program->length + 1));
+    initProgram(program);
+}
+
+// Compares whole blocks with memcmp() before narrowing down to the byte,
+// which is what keeps reloading a large program with a small edit cheap.
+#define COMPARE_BLOCK 256
+
+static int commonPrefix(const char *a, const char *b, const int length) {
+    int prefix = 0;
+    while (prefix + COMPARE_BLOCK <= length && memcmp(a + prefix, b + prefix, COMPARE_BLOCK) == 0) {
+        prefix += COMPARE_BLOCK;
+    }
+    while (prefix < length && a[prefix] == b[prefix]) prefix++;
+    return prefix;
+}
+
+static int commonSuffix(const char *aEnd, const char *bEnd, const int length) {
+    int suffix = 0;
+    while (suffix + COMPARE_BLOCK <= length &&
+           memcmp(aEnd - suffix - COMPARE_BLOCK, bEnd - suffix - COMPARE_BLOCK, COMPARE_BLOCK) == 0) {
+        suffix += COMPARE_BLOCK;
+    }
+    while (suffix < length && aEnd[-1 - suffix] == bEnd[-1 - suffix]) suffix++;
+    return suffix;
+}
+
+// Binary searches regions[from, to) for the first region that ends (byEnd)
+// or starts after offset. Regions are sorted, so everything from there on
+// lies after offset too.
+static int firstRegionAfter(const Region *regions, int from, int to, const int offset, const bool byEnd) {
+    while (from < to) {
+        const int middle = from + (to - from) / 2;
+        const int position = regions[middle].start + (byEnd ? regions[middle].length : 0);
+        if (byEnd ? position <= offset : position < offset) {
+            from = middle + 1;
+        } else {
+            to = middle;
+        }
+    }
+    return from;
+}
+
+// Finds where the region that starts at from ends: after a semicolon or a
+// closing brace outside of any brackets, unless an else follows. Returns
+// -1 if only whitespace is left.
+static int regionEnd(const char *source, const int from) {
+    initScanner(source + from);
+    int depth = 0;
+    bool empty = true;
+    for (;;) {
+        const Token token = scanToken();
+        switch (token.type) {
+            case TOKEN_EOF:
+                return empty ? -1 : (int) (token.start - source);
+            case TOKEN_LEFT_PAREN:
+            case TOKEN_LEFT_BRACE:
+            case TOKEN_LEFT_BRACKET:
+                depth++;
+                break;
+            case TOKEN_RIGHT_PAREN:
+            case TOKEN_RIGHT_BRACE:
+            case TOKEN_RIGHT_BRACKET:
+                if (depth > 0) depth--;
+                break;
+            default:
+                break;
+        }
+        empty = false;
+
+        if (depth == 0 && (token.type == TOKEN_SEMICOLON || token.type == TOKEN_RIGHT_BRACE)) {
+            const int end = (int) (token.start + token.length - source);
+            if (scanToken().type != TOKEN_ELSE) return end;
+        }
+    }
+}
+
+static int countLines(const char *text, const int length) {
+    int lines = 0;
+    for (int i = 0; i < length; i++) {
+        if (text[i] == '\n') lines++;
+    }
+    return lines;
+}
+
+// Compiles a region on its own, with the lines it has in the program. The
+// compiler keeps no pointers into the text it compiles.
+static bool compileRegion(const char *source, Region *region) {
+    char *text = GROW_ARRAY(char, NULL, 0, region->length + 1);
+    memcpy(text, source + region->start, region->length);
+    text[region->length] = '\0';
+
+    region->chunk = reallocate(NULL, 0, sizeof(Chunk));
+    initChunk(region->chunk);
+    region->chunk->format = vm->chunkFormat;
+    const bool compiled = compileSection(text, region->line, region->chunk);
+
+    FREE_ARRAY(char, text, region->length + 1);
+    return compiled;
+}
+
+static void appendRegion(Region **regions, int *count, int *capacity, const Region region) {
+    if (*capacity < *count + 1) {
+        const int oldCapacity = *capacity;
+        *capacity = GROW_CAPACITY(oldCapacity);
+        *regions = GROW_ARRAY(Region, *regions, oldCapacity, *capacity);
+    }
+    (*regions)[(*count)++] = region;
+}
+
+// Moves the line information of a chunk down by delta lines, along with
+// the functions declared in it and the bodies compiled for them so far.
+static void shiftLines(Chunk *chunk, const int delta) {
+    for (int i = 0; i < chunk->lineStartCount; i++) {
+        chunk->lineStarts[i].line += delta;
+    }
+    for (int i = 0; i < chunk->constants.count; i++) {
+        if (!IS_FUNCTION(chunk->constants.values[i])) continue;
+        ObjFunction *function = AS_FUNCTION(chunk->constants.values[i]);
+        function->line += delta;
+        if (function->chunk.code != NULL) shiftLines(&function->chunk, delta);
+    }
+}
+
+static void freeRegion(Region *region) {
+    freeChunk(region->chunk);
+    reallocate(region->chunk, sizeof(Chunk), 0);
+    region->chunk = NULL;
+}
@@ -0,0 +1,43 @@
+#ifndef CLOXVM_RELOAD_H
+#define CLOXVM_RELOAD_H
+
+#include "../chunk/chunk.h"
+#include "../common.h"
+#include "../enums/interpretresult.h"
+
+/**
+ * One top-level statement or declaration of a program, with the whitespace
+ * before it: length bytes of the source from start, beginning on line line
+ * and spanning lineCount line breaks. Its chunk has a fixed address, since
+ * the garbage collector links tracked chunks together.
+ */
+typedef struct {
+    int start;
+    int length;
+    int line;
+    int lineCount;
+    Chunk *chunk;
+} Region;
+
+/**
+ * A script that can be reloaded. It keeps a copy of its current source and
+ * runs as the sequence of its regions, each compiled into a chunk of its
+ * own.
+ */
+typedef struct {
+    char *source;
+    int length;
+    Region *regions;
+    int count;
+    int capacity;
+} Program;
+
+void initProgram(Program *program);
+
+bool reloadProgram(Program *program, const char *source);
+
+InterpretResult runProgram(Program *program);
+
+void freeProgram(Program *program);
+
+#endif //CLOXVM_RELOAD_H
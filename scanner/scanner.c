@@ -7,7 +7,7 @@
 #include <ctype.h>
 #include <string.h>
 
-Scanner scanner;
+_Thread_local Scanner scanner;
 
 Token makeToken(TokenType type);
 
@@ -43,9 +43,20 @@ static char peek();
  * @param source The source code to be scanned.
  */
 void initScanner(const char *source) {
+    initScannerAt(source, 1);
+}
+
+/**
+ * Initializes the scanner to scan a piece of a larger source, such as the
+ * text of a function, so that its tokens carry the lines they had there.
+ *
+ * @param source The source code to be scanned.
+ * @param line The line the source starts on.
+ */
+void initScannerAt(const char *source, const int line) {
     scanner.current = source;
     scanner.start = source;
-    scanner.line = 1;
+    scanner.line = line;
 }
 
 /**
@@ -73,7 +84,10 @@ Token scanToken() {
         case ')': return makeToken(TOKEN_RIGHT_PAREN);
         case '{': return makeToken(TOKEN_LEFT_BRACE);
         case '}': return makeToken(TOKEN_RIGHT_BRACE);
+        case '[': return makeToken(TOKEN_LEFT_BRACKET);
+        case ']': return makeToken(TOKEN_RIGHT_BRACKET);
         case ';': return makeToken(TOKEN_SEMICOLON);
+        case ':': return makeToken(TOKEN_COLON);
         case ',': return makeToken(TOKEN_COMMA);
         case '.': return makeToken(TOKEN_DOT);
         case '-': return makeToken(TOKEN_MINUS);
@@ -149,7 +163,7 @@ Token makeStringToken(TokenType type, const char *startIdx,
 Token errorToken(const char *message) {
     Token token;
     token.type = TOKEN_ERROR;
-    token.start = scanner.start;
+    token.start = message;
     token.line = scanner.line;
     token.length = (int) strlen(message);
     return token;
@@ -188,14 +202,13 @@ Token readString() {
 /**
  * Reads an identifier from the source code.
  *
- * This function advances through characters, as long as they satisfy the
- * condition of being alphabetic (a-z, A-Z) and the end of the source code
- * has not been reached.
+ * This function advances through characters, as long as they are letters,
+ * digits or underscores and the end of the source code has not been reached.
  *
  * @return A token representing the identifier.
  */
 Token readIdentifier() {
-    while (isalpha(peek()) && !isAtEnd()) advance();
+    while ((isalnum(peek()) || peek() == '_') && !isAtEnd()) advance();
     return makeToken(identifierType());
 }
 
@@ -214,7 +227,16 @@ static TokenType identifierType() {
 
     switch (c) {
         case 'a': return checkKeyword(1, 2, "nd", TOKEN_AND);
-        case 'c': return checkKeyword(1, 4, "lass", TOKEN_CLASS);
+        case 'c': {
+            if (scanner.current - scanner.start >= 2) {
+                switch (scanner.start[1]) {
+                    case 'a': return checkKeyword(2, 2, "se", TOKEN_CASE);
+                    case 'l': return checkKeyword(2, 3, "ass", TOKEN_CLASS);
+                }
+            }
+            break;
+        }
+        case 'd': return checkKeyword(1, 6, "efault", TOKEN_DEFAULT);
         case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
         case 'f': {
             if (scanner.current - scanner.start >= 2) {
@@ -228,10 +250,18 @@ static TokenType identifierType() {
         }
         case 'i': return checkKeyword(1, 1, "f", TOKEN_IF);
         case 'n': return checkKeyword(1, 2, "il", TOKEN_NIL);
-        case 'o': return checkKeyword(1, 1, "o", TOKEN_OR);
+        case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
         case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
         case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-        case 's': return checkKeyword(1, 4, "uper", TOKEN_SUPER);
+        case 's': {
+            if (scanner.current - scanner.start >= 2) {
+                switch (scanner.start[1]) {
+                    case 'u': return checkKeyword(2, 3, "per", TOKEN_SUPER);
+                    case 'w': return checkKeyword(2, 4, "itch", TOKEN_SWITCH);
+                }
+            }
+            break;
+        }
         case 't': {
             if (scanner.current - scanner.start >= 2) {
                 switch (scanner.start[1]) {
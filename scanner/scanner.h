@@ -5,7 +5,8 @@
 
 typedef enum {
     TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN, TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
-    TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS, TOKEN_SLASH,
+    TOKEN_LEFT_BRACKET, TOKEN_RIGHT_BRACKET,
+    TOKEN_COLON, TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS, TOKEN_SLASH,
     TOKEN_SEMICOLON, TOKEN_STAR,
 
     TOKEN_BANG, TOKEN_BANG_EQUAL, TOKEN_EQUAL, TOKEN_EQUAL_EQUAL,
@@ -14,9 +15,10 @@ typedef enum {
 
     TOKEN_IDENTIFIER, TOKEN_STRING, TOKEN_NUMBER,
 
-    TOKEN_AND, TOKEN_CLASS, TOKEN_ELSE, TOKEN_FALSE, TOKEN_FUN, TOKEN_FOR,
-    TOKEN_IF, TOKEN_NIL, TOKEN_OR, TOKEN_PRINT, TOKEN_RETURN, TOKEN_SUPER,
-    TOKEN_THIS, TOKEN_TRUE, TOKEN_VAR, TOKEN_WHILE,
+    TOKEN_AND, TOKEN_CASE, TOKEN_CLASS, TOKEN_DEFAULT, TOKEN_ELSE, TOKEN_FALSE,
+    TOKEN_FUN, TOKEN_FOR, TOKEN_IF, TOKEN_NIL, TOKEN_OR, TOKEN_PRINT,
+    TOKEN_RETURN, TOKEN_SUPER, TOKEN_SWITCH, TOKEN_THIS, TOKEN_TRUE, TOKEN_VAR,
+    TOKEN_WHILE,
 
     TOKEN_ERROR,
     TOKEN_EOF
@@ -38,6 +40,7 @@ typedef struct {
 
 
 void initScanner(const char *source);
+void initScannerAt(const char *source, int line);
 Token scanToken();
 
 #endif
\ No newline at end of file
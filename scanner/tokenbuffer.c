@@ -0,0 +1,105 @@
+#include "tokenbuffer.h"
+#include "../memory/memory.h"
+
+static void writeToken(TokenBuffer *buffer, const Token *token);
+
+/**
+ * Initializes an empty token buffer.
+ *
+ * @param buffer The buffer to initialize.
+ */
+void initTokenBuffer(TokenBuffer *buffer) {
+    buffer->source = NULL;
+    buffer->count = 0;
+    buffer->capacity = 0;
+    buffer->types = NULL;
+    buffer->offsets = NULL;
+    buffer->lengths = NULL;
+    buffer->lines = NULL;
+    buffer->messageCount = 0;
+    buffer->messageCapacity = 0;
+    buffer->messages = NULL;
+}
+
+/**
+ * Frees the buffer's arrays and leaves it empty.
+ *
+ * @param buffer The buffer to free.
+ */
+void freeTokenBuffer(TokenBuffer *buffer) {
+    FREE_ARRAY(uint8_t, buffer->types, buffer->capacity);
+    FREE_ARRAY(int32_t, buffer->offsets, buffer->capacity);
+    FREE_ARRAY(int32_t, buffer->lengths, buffer->capacity);
+    FREE_ARRAY(int32_t, buffer->lines, buffer->capacity);
+    FREE_ARRAY(const char *, buffer->messages, buffer->messageCapacity);
+    initTokenBuffer(buffer);
+}
+
+/**
+ * Scans the whole source into the buffer, up to and including the EOF token.
+ *
+ * Scanning everything in one tight loop before parsing keeps the scanner's
+ * code and data hot instead of alternating with the parser for every token.
+ *
+ * @param buffer An empty buffer that receives the tokens.
+ * @param source The source code to scan.
+ */
+void tokenizeSource(TokenBuffer *buffer, const char *source) {
+    buffer->source = source;
+    initScanner(source);
+
+    for (;;) {
+        const Token token = scanToken();
+        writeToken(buffer, &token);
+        if (token.type == TOKEN_EOF) break;
+    }
+}
+
+/**
+ * Reassembles the token at the given index.
+ *
+ * @param buffer The buffer holding the token.
+ * @param index The token's index, which must be less than the buffer's count.
+ * @return The token.
+ */
+Token tokenAt(const TokenBuffer *buffer, const int index) {
+    Token token;
+    token.type = (TokenType) buffer->types[index];
+    token.length = buffer->lengths[index];
+    token.line = buffer->lines[index];
+    token.start = token.type == TOKEN_ERROR
+                      ? buffer->messages[buffer->offsets[index]]
+                      : buffer->source + buffer->offsets[index];
+    return token;
+}
+
+static void writeToken(TokenBuffer *buffer, const Token *token) {
+    if (buffer->capacity < buffer->count + 1) {
+        const int oldCapacity = buffer->capacity;
+        buffer->capacity = GROW_CAPACITY(oldCapacity);
+        buffer->types = GROW_ARRAY(uint8_t, buffer->types, oldCapacity, buffer->capacity);
+        buffer->offsets = GROW_ARRAY(int32_t, buffer->offsets, oldCapacity, buffer->capacity);
+        buffer->lengths = GROW_ARRAY(int32_t, buffer->lengths, oldCapacity, buffer->capacity);
+        buffer->lines = GROW_ARRAY(int32_t, buffer->lines, oldCapacity, buffer->capacity);
+    }
+
+    int32_t offset;
+    if (token->type == TOKEN_ERROR) {
+        if (buffer->messageCapacity < buffer->messageCount + 1) {
+            const int oldCapacity = buffer->messageCapacity;
+            buffer->messageCapacity = GROW_CAPACITY(oldCapacity);
+            buffer->messages = GROW_ARRAY(const char *, buffer->messages, oldCapacity,
+                                          buffer->messageCapacity);
+        }
+        offset = buffer->messageCount;
+        buffer->messages[buffer->messageCount++] = token->start;
+    } else {
+        offset = (int32_t) (token->start - buffer->source);
+    }
+
+    buffer->types[buffer->count] = (uint8_t) token->type;
+    buffer->offsets[buffer->count] = offset;
+    buffer->lengths[buffer->count] = token->length;
+    buffer->lines[buffer->count] = token->line;
+    buffer->count++;
+}
@@ -0,0 +1,34 @@
+#ifndef CLOXVM_TOKENBUFFER_H
+#define CLOXVM_TOKENBUFFER_H
+
+#include "scanner.h"
+#include "../common.h"
+
+/**
+ * The tokens of a whole source, stored as parallel arrays.
+ *
+ * Tokens refer to the source by offset. Error tokens carry their message
+ * instead: their offset indexes the messages array.
+ */
+typedef struct {
+    const char *source;
+    int count;
+    int capacity;
+    uint8_t *types;
+    int32_t *offsets;
+    int32_t *lengths;
+    int32_t *lines;
+    int messageCount;
+    int messageCapacity;
+    const char **messages;
+} TokenBuffer;
+
+void initTokenBuffer(TokenBuffer *buffer);
+
+void freeTokenBuffer(TokenBuffer *buffer);
+
+void tokenizeSource(TokenBuffer *buffer, const char *source);
+
+Token tokenAt(const TokenBuffer *buffer, int index);
+
+#endif //CLOXVM_TOKENBUFFER_H
@@ -0,0 +1,122 @@
+#include "tokenpipeline.h"
+
+#include <sched.h>
+
+static void *scanSource(void *argument);
+
+static bool waitForSpace(TokenPipeline *pipeline);
+
+/**
+ * Starts scanning the source on a new thread.
+ *
+ * @param pipeline The pipeline to start.
+ * @param source The source code to scan. It must outlive the pipeline.
+ * @return false if the thread could not be created.
+ */
+bool startTokenPipeline(TokenPipeline *pipeline, const char *source) {
+    pipeline->source = source;
+    atomic_init(&pipeline->cancelled, false);
+    atomic_init(&pipeline->head, 0);
+    atomic_init(&pipeline->tail, 0);
+    pipeline->consumerHead = 0;
+    pipeline->cachedTail = 0;
+    pipeline->producerTail = 0;
+    pipeline->cachedHead = 0;
+
+    return pthread_create(&pipeline->thread, NULL, scanSource, pipeline) == 0;
+}
+
+/**
+ * Takes the next token from the pipeline, waiting for the scanner if it has
+ * not produced one yet.
+ *
+ * Must not be called again after it returned the EOF token.
+ *
+ * @param pipeline The pipeline to read from.
+ * @return The next token.
+ */
+Token nextPipelineToken(TokenPipeline *pipeline) {
+    const size_t head = pipeline->consumerHead;
+
+    if (head == pipeline->cachedTail) {
+        atomic_store_explicit(&pipeline->head, head, memory_order_release);
+        while ((pipeline->cachedTail = atomic_load_explicit(&pipeline->tail, memory_order_acquire)) == head) {
+            sched_yield();
+        }
+    }
+
+    const size_t slot = head & (TOKEN_RING_SIZE - 1);
+    Token token;
+    token.type = (TokenType) pipeline->types[slot];
+    token.length = pipeline->lengths[slot];
+    token.line = pipeline->lines[slot];
+    token.start = token.type == TOKEN_ERROR
+                      ? pipeline->messages[slot]
+                      : pipeline->source + pipeline->offsets[slot];
+
+    pipeline->consumerHead = head + 1;
+    if (pipeline->consumerHead % TOKEN_RING_BATCH == 0) {
+        atomic_store_explicit(&pipeline->head, pipeline->consumerHead, memory_order_release);
+    }
+
+    return token;
+}
+
+/**
+ * Stops the scanner thread and waits for it to exit. The consumer may stop
+ * early, for example after a compile error, even if tokens are left.
+ *
+ * @param pipeline The pipeline to stop.
+ */
+void stopTokenPipeline(TokenPipeline *pipeline) {
+    atomic_store_explicit(&pipeline->cancelled, true, memory_order_relaxed);
+    pthread_join(pipeline->thread, NULL);
+}
+
+static void *scanSource(void *argument) {
+    TokenPipeline *pipeline = argument;
+    initScanner(pipeline->source);
+
+    for (;;) {
+        const Token token = scanToken();
+
+        if (pipeline->producerTail - pipeline->cachedHead == TOKEN_RING_SIZE &&
+            !waitForSpace(pipeline)) {
+            return NULL;
+        }
+
+        const size_t slot = pipeline->producerTail & (TOKEN_RING_SIZE - 1);
+        pipeline->types[slot] = (uint8_t) token.type;
+        pipeline->lengths[slot] = token.length;
+        pipeline->lines[slot] = token.line;
+        if (token.type == TOKEN_ERROR) {
+            pipeline->messages[slot] = token.start;
+        } else {
+            pipeline->offsets[slot] = (int32_t) (token.start - pipeline->source);
+        }
+        pipeline->producerTail++;
+
+        if (token.type == TOKEN_EOF || pipeline->producerTail % TOKEN_RING_BATCH == 0) {
+            atomic_store_explicit(&pipeline->tail, pipeline->producerTail, memory_order_release);
+        }
+
+        if (token.type == TOKEN_EOF) return NULL;
+    }
+}
+
+/**
+ * Publishes everything written so far and waits until the consumer frees a
+ * slot.
+ *
+ * @return false if the pipeline was stopped while waiting.
+ */
+static bool waitForSpace(TokenPipeline *pipeline) {
+    atomic_store_explicit(&pipeline->tail, pipeline->producerTail, memory_order_release);
+
+    for (;;) {
+        pipeline->cachedHead = atomic_load_explicit(&pipeline->head, memory_order_acquire);
+        if (pipeline->producerTail - pipeline->cachedHead < TOKEN_RING_SIZE) return true;
+        if (atomic_load_explicit(&pipeline->cancelled, memory_order_relaxed)) return false;
+        sched_yield();
+    }
+}
@@ -0,0 +1,48 @@
+#ifndef CLOXVM_TOKENPIPELINE_H
+#define CLOXVM_TOKENPIPELINE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "scanner.h"
+#include "../common.h"
+
+#define TOKEN_RING_SIZE 4096
+#define TOKEN_RING_BATCH 64
+
+/**
+ * A scanner running on its own thread, handing tokens to a single consumer
+ * through a lock-free ring buffer.
+ *
+ * The ring stores tokens as parallel arrays like a TokenBuffer. Only the
+ * producer advances tail and only the consumer advances head; each side
+ * publishes its position in batches and keeps a cached copy of the other
+ * side's position so that the shared cache lines are touched rarely.
+ */
+typedef struct {
+    uint8_t types[TOKEN_RING_SIZE];
+    int32_t offsets[TOKEN_RING_SIZE];
+    int32_t lengths[TOKEN_RING_SIZE];
+    int32_t lines[TOKEN_RING_SIZE];
+    const char *messages[TOKEN_RING_SIZE];
+
+    const char *source;
+    pthread_t thread;
+    atomic_bool cancelled;
+
+    _Alignas(64) atomic_size_t head;
+    size_t consumerHead;
+    size_t cachedTail;
+
+    _Alignas(64) atomic_size_t tail;
+    size_t producerTail;
+    size_t cachedHead;
+} TokenPipeline;
+
+bool startTokenPipeline(TokenPipeline *pipeline, const char *source);
+
+Token nextPipelineToken(TokenPipeline *pipeline);
+
+void stopTokenPipeline(TokenPipeline *pipeline);
+
+#endif //CLOXVM_TOKENPIPELINE_H
@@ -0,0 +1,702 @@
+#define _GNU_SOURCE
+
+#include "server.h"
+#include "../api/cloxvm.h"
+#include "../memory/memory.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define FRAME_HEADER_SIZE 4
+#define EPOLL_BATCH 64
+
+typedef struct Connection Connection;
+
+/**
+ * One request on its way from a connection to a worker and back.
+ */
+typedef struct Job {
+    struct Job *next;
+    Connection *connection;
+    uint64_t sequence;
+    char *source;
+    size_t sourceLength;
+    InterpretResult status;
+    char *reply;
+    size_t replyLength;
+} Job;
+
+typedef struct {
+    Job *head;
+    Job *tail;
+} JobQueue;
+
+/**
+ * A client connection. Only the event loop thread touches connections;
+ * workers see them as opaque tags on jobs.
+ *
+ * Requests are numbered as they arrive. Workers may finish them in any
+ * order, so finished jobs wait in the sorted list until every earlier one
+ * has been answered.
+ */
+struct Connection {
+    int fd;
+    char *input;
+    size_t inputCount;
+    size_t inputCapacity;
+    char *output;
+    size_t outputCount;
+    size_t outputCapacity;
+    size_t outputSent;
+    uint64_t nextSequence;
+    uint64_t nextReply;
+    Job *finished;
+    int inFlight;
+    bool peerDone;
+    bool failed;
+    uint32_t events;
+    Connection *nextReleased;
+};
+
+typedef struct {
+    uint64_t hash;
+    char *source;
+    size_t length;
+    CloxScript *script;
+} CachedScript;
+
+typedef struct Server Server;
+
+typedef struct {
+    Server *server;
+    pthread_t thread;
+    CloxVM *vm;
+    char error[512];
+    size_t errorLength;
+    CachedScript cache[SERVER_SCRIPT_CACHE_SIZE];
+} Worker;
+
+struct Server {
+    int listenFd;
+    int epollFd;
+    int wakeFd;
+    int signalFd;
+    bool stopping;
+    Connection *released;
+
+    pthread_mutex_t lock;
+    pthread_cond_t jobsAvailable;
+    JobQueue pending;
+    JobQueue done;
+
+    Worker *workers;
+    int workerCount;
+};
+
+static bool openServer(Server *server, const ServerConfig *config);
+
+static void closeServer(Server *server, const ServerConfig *config);
+
+static void runEventLoop(Server *server);
+
+static void acceptConnections(Server *server);
+
+static void handleConnection(Server *server, Connection *connection, uint32_t events);
+
+static void readRequests(Server *server, Connection *connection);
+
+static void submitRequests(Server *server, Connection *connection);
+
+static void deliverReplies(Server *server);
+
+static void queueReply(Connection *connection, Job *job);
+
+static void flushConnection(Connection *connection);
+
+static void updateInterest(Server *server, Connection *connection);
+
+static void releaseConnection(Server *server, Connection *connection);
+
+static void freeReleasedConnections(Server *server);
+
+static void *runWorker(void *argument);
+
+static void evaluateJob(Worker *worker, Job *job);
+
+static CloxScript *lookupScript(Worker *worker, const char *source, size_t length);
+
+static void captureError(InterpretResult kind, int line, const char *message, void *userData);
+
+static void pushJob(JobQueue *queue, Job *job);
+
+static void freeJob(Job *job);
+
+static void appendBytes(char **buffer, size_t *count, size_t *capacity, const char *data, size_t length);
+
+static uint64_t hashSource(const char *source, size_t length);
+
+static void *resizeMemory(void *pointer, size_t newSize);
+
+/**
+ * Runs an evaluation server on a Unix domain socket until SIGINT or SIGTERM.
+ *
+ * Clients send requests framed as a four-byte big-endian length followed by
+ * that many bytes of source code. Each reply is a four-byte big-endian
+ * length, then one status byte (an InterpretResult) and the formatted result
+ * or the error message. A client may send any number of requests without
+ * waiting; replies come back in request order.
+ *
+ * The event loop runs on the calling thread and only moves bytes. Requests
+ * are evaluated by a pool of worker threads, each with its own VM that stays
+ * alive for the lifetime of the server, and each keeping a cache of the
+ * scripts it compiled so that repeated requests skip the compiler.
+ *
+ * @param config Where to listen and how many workers to run.
+ * @return false if the server could not be started.
+ */
+bool serve(const ServerConfig *config) {
+    Server server;
+    if (!openServer(&server, config)) return false;
+
+    runEventLoop(&server);
+
+    closeServer(&server, config);
+    return true;
+}
+
+static bool openServer(Server *server, const ServerConfig *config) {
+    memset(server, 0, sizeof(*server));
+    server->listenFd = -1;
+    server->epollFd = -1;
+    server->wakeFd = -1;
+    server->signalFd = -1;
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(config->socketPath) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path \"%s\" is too long.\n", config->socketPath);
+        return false;
+    }
+    strcpy(address.sun_path, config->socketPath);
+
+    unlink(config->socketPath);
+    server->listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server->listenFd < 0 ||
+        bind(server->listenFd, (struct sockaddr *) &address, sizeof(address)) != 0 ||
+        listen(server->listenFd, SOMAXCONN) != 0) {
+        fprintf(stderr, "Could not listen on \"%s\": %s\n", config->socketPath, strerror(errno));
+        if (server->listenFd >= 0) close(server->listenFd);
+        return false;
+    }
+
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    server->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    server->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    server->signalFd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = &server->listenFd;
+    epoll_ctl(server->epollFd, EPOLL_CTL_ADD, server->listenFd, &event);
+    event.data.ptr = &server->wakeFd;
+    epoll_ctl(server->epollFd, EPOLL_CTL_ADD, server->wakeFd, &event);
+    event.data.ptr = &server->signalFd;
+    epoll_ctl(server->epollFd, EPOLL_CTL_ADD, server->signalFd, &event);
+
+    pthread_mutex_init(&server->lock, NULL);
+    pthread_cond_init(&server->jobsAvailable, NULL);
+
+    CloxVMConfig vmConfig;
+    initCloxVMConfig(&vmConfig);
+    vmConfig.onError = captureError;
+    vmConfig.registerFormat = config->registerFormat;
+    vmConfig.optimize = config->optimize;
+
+    server->workerCount = config->workers;
+    server->workers = resizeMemory(NULL, sizeof(Worker) * server->workerCount);
+    for (int i = 0; i < server->workerCount; i++) {
+        Worker *worker = &server->workers[i];
+        memset(worker, 0, sizeof(*worker));
+        worker->server = server;
+        vmConfig.errorData = worker;
+        worker->vm = newCloxVM(&vmConfig);
+        pthread_create(&worker->thread, NULL, runWorker, worker);
+    }
+
+    return true;
+}
+
+static void closeServer(Server *server, const ServerConfig *config) {
+    pthread_mutex_lock(&server->lock);
+    server->stopping = true;
+    pthread_cond_broadcast(&server->jobsAvailable);
+    pthread_mutex_unlock(&server->lock);
+
+    for (int i = 0; i < server->workerCount; i++) {
+        Worker *worker = &server->workers[i];
+        pthread_join(worker->thread, NULL);
+
+        for (int j = 0; j < SERVER_SCRIPT_CACHE_SIZE; j++) {
+            CachedScript *entry = &worker->cache[j];
+            if (entry->script == NULL) continue;
+            freeCloxScript(worker->vm, entry->script);
+            free(entry->source);
+        }
+        freeCloxVM(worker->vm);
+    }
+    free(server->workers);
+
+    for (Job *job = server->pending.head; job != NULL;) {
+        Job *next = job->next;
+        freeJob(job);
+        job = next;
+    }
+    for (Job *job = server->done.head; job != NULL;) {
+        Job *next = job->next;
+        freeJob(job);
+        job = next;
+    }
+
+    pthread_cond_destroy(&server->jobsAvailable);
+    pthread_mutex_destroy(&server->lock);
+
+    close(server->signalFd);
+    close(server->wakeFd);
+    close(server->epollFd);
+    close(server->listenFd);
+    unlink(config->socketPath);
+}
+
+static void runEventLoop(Server *server) {
+    struct epoll_event events[EPOLL_BATCH];
+    bool running = true;
+
+    while (running) {
+        const int count = epoll_wait(server->epollFd, events, EPOLL_BATCH, -1);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        for (int i = 0; i < count; i++) {
+            void *source = events[i].data.ptr;
+            if (source == &server->listenFd) {
+                acceptConnections(server);
+            } else if (source == &server->wakeFd) {
+                uint64_t wakeups;
+                while (read(server->wakeFd, &wakeups, sizeof(wakeups)) > 0) {}
+                deliverReplies(server);
+            } else if (source == &server->signalFd) {
+                running = false;
+            } else {
+                handleConnection(server, source, events[i].events);
+            }
+        }
+
+        freeReleasedConnections(server);
+    }
+}
+
+static void acceptConnections(Server *server) {
+    for (;;) {
+        const int fd = accept4(server->listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) return;
+
+        Connection *connection = resizeMemory(NULL, sizeof(Connection));
+        memset(connection, 0, sizeof(*connection));
+        connection->fd = fd;
+        connection->events = EPOLLIN | EPOLLRDHUP;
+
+        struct epoll_event event;
+        event.events = connection->events;
+        event.data.ptr = connection;
+        epoll_ctl(server->epollFd, EPOLL_CTL_ADD, fd, &event);
+    }
+}
+
+static void handleConnection(Server *server, Connection *connection, const uint32_t events) {
+    // Released earlier in the same batch of events.
+    if (connection->fd < 0) return;
+
+    if (events & (EPOLLERR | EPOLLHUP)) connection->failed = true;
+    if (!connection->failed && (events & (EPOLLIN | EPOLLRDHUP))) readRequests(server, connection);
+    if (!connection->failed && (events & EPOLLOUT)) flushConnection(connection);
+    updateInterest(server, connection);
+}
+
+static void readRequests(Server *server, Connection *connection) {
+    for (;;) {
+        if (connection->inputCapacity - connection->inputCount < 4096) {
+            const size_t oldCapacity = connection->inputCapacity;
+            connection->inputCapacity = GROW_CAPACITY(oldCapacity) < 8192 ? 8192 : GROW_CAPACITY(oldCapacity);
+            connection->input = resizeMemory(connection->input, connection->inputCapacity);
+        }
+
+        const ssize_t received = read(connection->fd, connection->input + connection->inputCount,
+                                      connection->inputCapacity - connection->inputCount);
+        if (received > 0) {
+            connection->inputCount += (size_t) received;
+            if (connection->inputCount > SERVER_MAX_REQUEST + FRAME_HEADER_SIZE) break;
+            continue;
+        }
+        if (received == 0) {
+            connection->peerDone = true;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            connection->failed = true;
+        }
+        break;
+    }
+
+    submitRequests(server, connection);
+}
+
+/**
+ * Hands every complete request in the connection's input to the workers, up
+ * to SERVER_MAX_PIPELINE unanswered requests per connection. Whatever is left
+ * stays buffered until replies come back.
+ */
+static void submitRequests(Server *server, Connection *connection) {
+    size_t offset = 0;
+    JobQueue batch = {NULL, NULL};
+
+    while (connection->inFlight < SERVER_MAX_PIPELINE &&
+           connection->inputCount - offset >= FRAME_HEADER_SIZE) {
+        const uint8_t *header = (const uint8_t *) connection->input + offset;
+        const size_t length = (size_t) header[0] << 24 | (size_t) header[1] << 16 |
+                              (size_t) header[2] << 8 | (size_t) header[3];
+        if (length > SERVER_MAX_REQUEST) {
+            connection->failed = true;
+            break;
+        }
+        if (connection->inputCount - offset - FRAME_HEADER_SIZE < length) break;
+
+        Job *job = resizeMemory(NULL, sizeof(Job));
+        job->next = NULL;
+        job->connection = connection;
+        job->sequence = connection->nextSequence++;
+        job->sourceLength = length;
+        job->source = resizeMemory(NULL, length + 1);
+        memcpy(job->source, connection->input + offset + FRAME_HEADER_SIZE, length);
+        job->source[length] = '\0';
+        job->reply = NULL;
+        job->replyLength = 0;
+        pushJob(&batch, job);
+
+        connection->inFlight++;
+        offset += FRAME_HEADER_SIZE + length;
+    }
+
+    if (offset > 0) {
+        memmove(connection->input, connection->input + offset, connection->inputCount - offset);
+        connection->inputCount -= offset;
+    }
+
+    if (batch.head == NULL) return;
+
+    pthread_mutex_lock(&server->lock);
+    if (server->pending.head == NULL) {
+        server->pending = batch;
+    } else {
+        server->pending.tail->next = batch.head;
+        server->pending.tail = batch.tail;
+    }
+    pthread_cond_broadcast(&server->jobsAvailable);
+    pthread_mutex_unlock(&server->lock);
+}
+
+/**
+ * Takes the jobs the workers finished and turns them into replies.
+ */
+static void deliverReplies(Server *server) {
+    pthread_mutex_lock(&server->lock);
+    Job *job = server->done.head;
+    server->done.head = NULL;
+    server->done.tail = NULL;
+    pthread_mutex_unlock(&server->lock);
+
+    while (job != NULL) {
+        Job *next = job->next;
+        Connection *connection = job->connection;
+        connection->inFlight--;
+
+        if (connection->failed) {
+            freeJob(job);
+        } else {
+            queueReply(connection, job);
+            flushConnection(connection);
+            submitRequests(server, connection);
+        }
+
+        updateInterest(server, connection);
+        job = next;
+    }
+}
+
+/**
+ * Files a finished job and appends every reply that is now due, in request
+ * order, to the connection's output.
+ */
+static void queueReply(Connection *connection, Job *job) {
+    Job **link = &connection->finished;
+    while (*link != NULL && (*link)->sequence < job->sequence) link = &(*link)->next;
+    job->next = *link;
+    *link = job;
+
+    while (connection->finished != NULL && connection->finished->sequence == connection->nextReply) {
+        Job *due = connection->finished;
+        connection->finished = due->next;
+        connection->nextReply++;
+
+        const size_t length = due->replyLength + 1;
+        const char header[FRAME_HEADER_SIZE + 1] = {
+            (char) (length >> 24), (char) (length >> 16), (char) (length >> 8), (char) length,
+            (char) due->status,
+        };
+        appendBytes(&connection->output, &connection->outputCount, &connection->outputCapacity,
+                    header, sizeof(header));
+        appendBytes(&connection->output, &connection->outputCount, &connection->outputCapacity,
+                    due->reply, due->replyLength);
+        freeJob(due);
+    }
+}
+
+static void flushConnection(Connection *connection) {
+    while (connection->outputSent < connection->outputCount) {
+        const ssize_t written = write(connection->fd, connection->output + connection->outputSent,
+                                      connection->outputCount - connection->outputSent);
+        if (written > 0) {
+            connection->outputSent += (size_t) written;
+            continue;
+        }
+        if (written < 0 && errno == EINTR) continue;
+        if (written < 0 && errno != EAGAIN && errno != EWOULDBLOCK) connection->failed = true;
+        return;
+    }
+
+    connection->outputSent = 0;
+    connection->outputCount = 0;
+}
+
+/**
+ * Closes a connection that is finished or broken, or otherwise adjusts the
+ * events it waits for: input only while it may submit more requests, output
+ * only while replies are stuck in its buffer and the peer's end of input
+ * only until it came. EPOLLRDHUP is level-triggered, so keeping it after
+ * that would wake the loop again and again until the last reply is out.
+ */
+static void updateInterest(Server *server, Connection *connection) {
+    const bool drained = connection->outputCount == 0;
+    if (connection->failed || (connection->peerDone && connection->inFlight == 0 && drained)) {
+        releaseConnection(server, connection);
+        return;
+    }
+
+    uint32_t events = connection->peerDone ? 0 : EPOLLRDHUP;
+    if (!connection->peerDone && connection->inFlight < SERVER_MAX_PIPELINE) events |= EPOLLIN;
+    if (!drained) events |= EPOLLOUT;
+    if (events == connection->events) return;
+
+    connection->events = events;
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = connection;
+    epoll_ctl(server->epollFd, EPOLL_CTL_MOD, connection->fd, &event);
+}
+
+/**
+ * Closes the connection's socket. The connection itself is freed once no
+ * worker holds a job of it anymore, and only after the current batch of
+ * events, which may still mention it.
+ */
+static void releaseConnection(Server *server, Connection *connection) {
+    if (connection->fd >= 0) {
+        epoll_ctl(server->epollFd, EPOLL_CTL_DEL, connection->fd, NULL);
+        close(connection->fd);
+        connection->fd = -1;
+        connection->failed = true;
+    }
+
+    if (connection->inFlight > 0) return;
+
+    connection->nextReleased = server->released;
+    server->released = connection;
+}
+
+static void freeReleasedConnections(Server *server) {
+    while (server->released != NULL) {
+        Connection *connection = server->released;
+        server->released = connection->nextReleased;
+
+        while (connection->finished != NULL) {
+            Job *job = connection->finished;
+            connection->finished = job->next;
+            freeJob(job);
+        }
+        free(connection->input);
+        free(connection->output);
+        free(connection);
+    }
+}
+
+static void *runWorker(void *argument) {
+    Worker *worker = argument;
+    Server *server = worker->server;
+
+    for (;;) {
+        pthread_mutex_lock(&server->lock);
+        while (server->pending.head == NULL && !server->stopping) {
+            pthread_cond_wait(&server->jobsAvailable, &server->lock);
+        }
+        if (server->stopping) {
+            pthread_mutex_unlock(&server->lock);
+            return NULL;
+        }
+        Job *job = server->pending.head;
+        server->pending.head = job->next;
+        if (server->pending.head == NULL) server->pending.tail = NULL;
+        pthread_mutex_unlock(&server->lock);
+
+        evaluateJob(worker, job);
+
+        pthread_mutex_lock(&server->lock);
+        const bool wasEmpty = server->done.head == NULL;
+        job->next = NULL;
+        pushJob(&server->done, job);
+        pthread_mutex_unlock(&server->lock);
+
+        if (wasEmpty) {
+            const uint64_t wakeup = 1;
+            write(server->wakeFd, &wakeup, sizeof(wakeup));
+        }
+    }
+}
+
+static void evaluateJob(Worker *worker, Job *job) {
+    worker->errorLength = 0;
+
+    CloxScript *script = lookupScript(worker, job->source, job->sourceLength);
+    Value result = NIL_VAL;
+    job->status = script == NULL ? INTERPRET_COMPILE_ERROR : runCloxScript(worker->vm, script, &result);
+
+    if (job->status == INTERPRET_OK) {
+        job->replyLength = (size_t) formatCloxValue(result, NULL, 0);
+        job->reply = resizeMemory(NULL, job->replyLength + 1);
+        formatCloxValue(result, job->reply, job->replyLength + 1);
+    } else {
+        job->replyLength = worker->errorLength;
+        job->reply = resizeMemory(NULL, job->replyLength + 1);
+        memcpy(job->reply, worker->error, job->replyLength);
+    }
+
+    // Requests share the worker's VM but must not see each other's globals.
+    resetCloxGlobals(worker->vm);
+}
+
+/**
+ * Finds the worker's compiled script for a source or compiles and caches it.
+ *
+ * The cache is direct-mapped on the source's hash: a new script replaces
+ * whichever script occupied its slot. Sources that fail to compile are not
+ * cached.
+ */
+static CloxScript *lookupScript(Worker *worker, const char *source, const size_t length) {
+    const uint64_t hash = hashSource(source, length);
+    CachedScript *entry = &worker->cache[hash & (SERVER_SCRIPT_CACHE_SIZE - 1)];
+
+    if (entry->script != NULL && entry->hash == hash && entry->length == length &&
+        memcmp(entry->source, source, length) == 0) {
+        return entry->script;
+    }
+
+    CloxScript *script = compileCloxScript(worker->vm, source);
+    if (script == NULL) return NULL;
+
+    if (entry->script != NULL) {
+        freeCloxScript(worker->vm, entry->script);
+        free(entry->source);
+    }
+    entry->hash = hash;
+    entry->length = length;
+    entry->source = resizeMemory(NULL, length + 1);
+    memcpy(entry->source, source, length + 1);
+    entry->script = script;
+    return script;
+}
+
+/**
+ * Keeps the first error of a request as its reply, prefixed with its line
+ * like the command line interpreter reports it.
+ */
+static void captureError(const InterpretResult kind, const int line, const char *message, void *userData) {
+    (void) kind;
+    Worker *worker = userData;
+    if (worker->errorLength > 0) return;
+
+    const int length = snprintf(worker->error, sizeof(worker->error), "[line %d] %s", line, message);
+    worker->errorLength = length < (int) sizeof(worker->error) ? (size_t) length : sizeof(worker->error) - 1;
+}
+
+static void pushJob(JobQueue *queue, Job *job) {
+    if (queue->tail == NULL) {
+        queue->head = job;
+    } else {
+        queue->tail->next = job;
+    }
+    queue->tail = job;
+}
+
+static void freeJob(Job *job) {
+    free(job->source);
+    free(job->reply);
+    free(job);
+}
+
+static void appendBytes(char **buffer, size_t *count, size_t *capacity, const char *data, const size_t length) {
+    if (*capacity - *count < length) {
+        const size_t oldCapacity = *capacity;
+        size_t newCapacity = GROW_CAPACITY(oldCapacity);
+        while (newCapacity - *count < length) newCapacity *= 2;
+        *buffer = resizeMemory(*buffer, newCapacity);
+        *capacity = newCapacity;
+    }
+
+    memcpy(*buffer + *count, data, length);
+    *count += length;
+}
+
+static uint64_t hashSource(const char *source, const size_t length) {
+    uint64_t hash = 14695981039346656037u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t) source[i];
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+// Server state is allocated with malloc() instead of reallocate(). The
+// threads run with some VM current, which would otherwise be charged for
+// the buffers and could run collection steps in the middle of them.
+static void *resizeMemory(void *pointer, const size_t newSize) {
+    void *result = realloc(pointer, newSize);
+    if (result == NULL) exit(1);
+    return result;
+}
@@ -0,0 +1,19 @@
+#ifndef CLOXVM_SERVER_H
+#define CLOXVM_SERVER_H
+
+#include "../common.h"
+
+#define SERVER_MAX_REQUEST (16 * 1024 * 1024)
+#define SERVER_MAX_PIPELINE 64
+#define SERVER_SCRIPT_CACHE_SIZE 256
+
+typedef struct {
+    const char *socketPath;
+    int workers;
+    bool registerFormat;
+    bool optimize;
+} ServerConfig;
+
+bool serve(const ServerConfig *config);
+
+#endif //CLOXVM_SERVER_H
@@ -0,0 +1,149 @@
+#include "shape.h"
+#include "../memory/memory.h"
+#include "../object/object.h"
+#include "../vm/vm.h"
+
+static Shape *newShape(Shape *parent, ObjString *name);
+
+static void forgetDeadShapes(Chunk *chunk);
+
+/**
+ * Creates the shape of instances without fields, for a new class.
+ *
+ * @return The new shape.
+ */
+Shape *newRootShape() {
+    return newShape(NULL, NULL);
+}
+
+/**
+ * Returns the shape an instance moves to when a field is added to it,
+ * creating it the first time an instance of this shape gets that field.
+ *
+ * @param shape The instance's current shape.
+ * @param name The name of the new field.
+ * @return The shape with the new field as its last one.
+ */
+Shape *addShapeField(Shape *shape, ObjString *name) {
+    for (int i = 0; i < shape->transitionCount; i++) {
+        if (shape->transitions[i]->name == name) return shape->transitions[i];
+    }
+
+    // The class may already have been traced.
+    if (vm->gcPhase == GC_MARKING) markObject(&name->obj);
+    push(OBJ_VAL(name));
+    Shape *child = newShape(shape, name);
+    if (shape->transitionCount == shape->transitionCapacity) {
+        const int oldCapacity = shape->transitionCapacity;
+        shape->transitionCapacity = GROW_CAPACITY(oldCapacity);
+        shape->transitions = GROW_ARRAY(Shape *, shape->transitions, oldCapacity, shape->transitionCapacity);
+    }
+    shape->transitions[shape->transitionCount++] = child;
+    pop();
+    return child;
+}
+
+/**
+ * Finds a field by name. This walks the shape's ancestors; the interpreter
+ * only does it when an inline cache misses.
+ *
+ * @param shape The shape to search.
+ * @param name The field's name.
+ * @return The field's index, or -1 if instances of this shape have no such field.
+ */
+int findShapeField(const Shape *shape, const ObjString *name) {
+    for (; shape->name != NULL; shape = shape->parent) {
+        if (shape->name == name) return shape->fieldCount - 1;
+    }
+    return -1;
+}
+
+/**
+ * Marks the field names of a class's shapes, for the collector tracing the
+ * class.
+ *
+ * @param root The class's root shape.
+ */
+void markShapeTree(const Shape *root) {
+    if (root->name != NULL) markObject(&root->name->obj);
+    for (int i = 0; i < root->transitionCount; i++) {
+        markShapeTree(root->transitions[i]);
+    }
+}
+
+/**
+ * Hands the shapes of a class that is being freed to the list of dead
+ * shapes, which sweepShapes() frees once no inline cache refers to them.
+ *
+ * @param root The class's root shape.
+ */
+void releaseShapeTree(Shape *root) {
+    for (int i = 0; i < root->transitionCount; i++) {
+        releaseShapeTree(root->transitions[i]);
+    }
+    root->isDead = true;
+    root->next = vm->deadShapes;
+    vm->deadShapes = root;
+}
+
+/**
+ * Frees the dead shapes after removing them from the inline caches of
+ * every chunk that is still alive. The collector calls this when it has
+ * swept the heap, so all chunks of freed functions are gone by then.
+ */
+void sweepShapes() {
+    if (vm->deadShapes == NULL) return;
+
+    for (Chunk *chunk = vm->chunks; chunk != NULL; chunk = chunk->nextRoot) {
+        forgetDeadShapes(chunk);
+    }
+    for (Obj *object = vm->objects; object != NULL; object = object->next) {
+        if (object->type == OBJ_FUNCTION) forgetDeadShapes(&((ObjFunction *) object)->chunk);
+    }
+    freeShapes();
+}
+
+/**
+ * Frees the dead shapes of the current VM. Freeing the VM's classes leaves
+ * all of them dead, so this frees every shape once the objects are gone.
+ */
+void freeShapes() {
+    Shape *shape = vm->deadShapes;
+    while (shape != NULL) {
+        Shape *next = shape->next;
+        FREE_ARRAY(Shape *, shape->transitions, shape->transitionCapacity);
+        reallocate(shape, sizeof(Shape), 0);
+        shape = next;
+    }
+    vm->deadShapes = NULL;
+}
+
+static Shape *newShape(Shape *parent, ObjString *name) {
+    Shape *shape = reallocate(NULL, 0, sizeof(Shape));
+    shape->parent = parent;
+    shape->name = name;
+    shape->fieldCount = parent == NULL ? 0 : parent->fieldCount + 1;
+    shape->transitions = NULL;
+    shape->transitionCount = 0;
+    shape->transitionCapacity = 0;
+    shape->isDead = false;
+    shape->next = NULL;
+    return shape;
+}
+
+// Drops the entries for dead shapes from a chunk's inline caches, moving
+// the live ones to the front. A megamorphic cache stays megamorphic.
+static void forgetDeadShapes(Chunk *chunk) {
+    for (int i = 0; i < chunk->cacheCount; i++) {
+        InlineCache *cache = &chunk->caches[i];
+        int live = 0;
+        for (int j = 0; j < INLINE_CACHE_WAYS; j++) {
+            const CacheEntry entry = cache->entries[j];
+            if (entry.shape != NULL && !entry.shape->isDead) cache->entries[live++] = entry;
+        }
+        for (int j = live; j < INLINE_CACHE_WAYS; j++) {
+            cache->entries[j].shape = NULL;
+        }
+        if (cache->count > 0) cache->count = live;
+    }
+}
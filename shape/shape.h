@@ -0,0 +1,48 @@
+#ifndef CLOXVM_SHAPE_H
+#define CLOXVM_SHAPE_H
+
+#include "../common.h"
+#include "../value/value.h"
+
+/**
+ * The layout of an instance's fields, shared by all instances of a class
+ * that got the same fields in the same order. Every class has a root shape
+ * without fields; adding a field moves an instance to the child shape
+ * that has name as its last field, which is field fieldCount - 1. Children
+ * are found again through transitions, so the shapes of a class form a
+ * tree and two instances have the same shape exactly if they have the same
+ * layout.
+ *
+ * Shapes are not heap objects. A class owns the tree of its shapes, which
+ * keeps the field names alive and is freed along with the class: its
+ * shapes become dead and wait in the VM's list of dead shapes, linked
+ * through next, until the collection ends and sweepShapes() has removed
+ * them from the inline caches. Until then a dead shape's address cannot be
+ * reused, so a cached shape pointer never matches a different shape.
+ */
+struct Shape {
+    Shape *parent;
+    ObjString *name;
+    int fieldCount;
+    Shape **transitions;
+    int transitionCount;
+    int transitionCapacity;
+    bool isDead;
+    Shape *next;
+};
+
+Shape *newRootShape();
+
+Shape *addShapeField(Shape *shape, ObjString *name);
+
+int findShapeField(const Shape *shape, const ObjString *name);
+
+void markShapeTree(const Shape *root);
+
+void releaseShapeTree(Shape *root);
+
+void sweepShapes();
+
+void freeShapes();
+
+#endif //CLOXVM_SHAPE_H
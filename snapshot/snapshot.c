@@ -0,0 +1,427 @@
+#include "snapshot.h"
+#include "../memory/memory.h"
+#include "../object/object.h"
+#include "../table/table.h"
+#include "../vm/vm.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SNAPSHOT_MAGIC "CLOXIMG"
+#define SNAPSHOT_VERSION 2
+
+/**
+ * The start of an image, followed by the string table, the strings and then
+ * the functions.
+ *
+ * References inside an image are byte offsets from its start, so an image
+ * works wherever it is mapped. Offset 0 is the header and never a string.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t stringHeaderSize;
+    uint32_t capacity;
+    uint32_t count;
+    uint64_t size;
+} SnapshotHeader;
+
+/**
+ * A slot of the image's string table, which is probed like a Table. type is
+ * the ValueType of the global variable the string names, or VAL_UNDEFINED if
+ * it names none, and payload holds that variable's value. An object value is
+ * stored as the offset of a string or a SnapshotFunction, as objectType says.
+ */
+typedef struct {
+    uint64_t string;
+    uint32_t type;
+    uint32_t objectType;
+    uint64_t payload;
+} SnapshotEntry;
+
+/**
+ * A function in an image, followed by its text. Only the text is kept, so
+ * the function is compiled on its first call after loading just as it was
+ * in the VM that wrote the image.
+ */
+typedef struct {
+    uint64_t name;
+    uint32_t arity;
+    uint32_t line;
+    uint32_t sourceLength;
+    uint32_t padding;
+    char source[];
+} SnapshotFunction;
+
+static void importGlobals();
+
+static void addString(Table *offsets, ObjString *string, uint32_t *count);
+
+static void encodeGlobal(SnapshotEntry *entry, Value value, const Table *offsets, uint64_t functionOffset);
+
+static Value loadFunction(uint64_t offset, ObjString *global);
+
+static const SnapshotEntry *findEntry(const char *chars, int length, uint32_t hash);
+
+static bool isValidImage(const char *base, size_t size);
+
+static bool isStringOffset(const SnapshotHeader *header, uint64_t offset);
+
+static bool isFunctionOffset(const SnapshotHeader *header, uint64_t offset);
+
+/**
+ * Writes the current VM's global variables and the strings and functions
+ * they refer to into an image that loadSnapshot() can map into another VM.
+ *
+ * Strings are laid out in the image as they are in memory, so loading it
+ * copies nothing. The layout is that of this build: an image can only be
+ * loaded by the same version of cloxvm on the same platform. Functions are
+ * stored as their text and compiled again when first called. A function
+ * that two globals refer to comes back as two separate functions. Closures,
+ * classes and instances hold state of the run that made them and are left
+ * out: their globals are undefined in the image.
+ *
+ * @param path The path of the image file.
+ * @return false if the file could not be written.
+ */
+bool writeSnapshot(const char *path) {
+    importGlobals();
+
+    // Maps each string that goes into the image to its offset.
+    Table offsets;
+    initTable(&offsets);
+    uint32_t count = 0;
+    for (int i = 0; i < vm->globalSlots.capacity; i++) {
+        const Entry *slot = &vm->globalSlots.entries[i];
+        if (slot->key == NULL) continue;
+
+        addString(&offsets, slot->key, &count);
+        const Value value = vm->globals.values[AS_INT(slot->value)];
+        if (IS_STRING(value)) addString(&offsets, AS_STRING(value), &count);
+        if (IS_FUNCTION(value)) addString(&offsets, AS_FUNCTION(value)->name, &count);
+    }
+
+    uint32_t capacity = 8;
+    while (capacity < count * 2) capacity *= 2;
+
+    size_t size = sizeof(SnapshotHeader) + sizeof(SnapshotEntry) * capacity;
+    for (int i = 0; i < offsets.capacity; i++) {
+        Entry *entry = &offsets.entries[i];
+        if (entry->key == NULL) continue;
+        entry->value = INT_VAL((int64_t) size);
+        size += ALIGN_OBJECT(sizeof(ObjString) + entry->key->length + 1);
+    }
+
+    // Offsets of the function records, by global slot.
+    uint64_t *functionOffsets = GROW_ARRAY(uint64_t, NULL, 0, vm->globals.count);
+    for (int i = 0; i < vm->globals.count; i++) {
+        functionOffsets[i] = 0;
+        if (!IS_FUNCTION(vm->globals.values[i])) continue;
+        functionOffsets[i] = size;
+        size += ALIGN_OBJECT(sizeof(SnapshotFunction) + AS_FUNCTION(vm->globals.values[i])->sourceLength);
+    }
+
+    char *image = GROW_ARRAY(char, NULL, 0, size);
+    memset(image, 0, size);
+
+    SnapshotHeader *header = (SnapshotHeader *) image;
+    memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+    header->version = SNAPSHOT_VERSION;
+    header->stringHeaderSize = sizeof(ObjString);
+    header->capacity = capacity;
+    header->count = count;
+    header->size = size;
+
+    SnapshotEntry *entries = (SnapshotEntry *) (image + sizeof(SnapshotHeader));
+    for (int i = 0; i < offsets.capacity; i++) {
+        const Entry *entry = &offsets.entries[i];
+        if (entry->key == NULL) continue;
+
+        const ObjString *string = entry->key;
+        ObjString *copy = (ObjString *) (image + AS_INT(entry->value));
+        copy->obj.type = OBJ_STRING;
+        copy->obj.isMarked = false;
+        copy->obj.isRemembered = false;
+        copy->obj.next = NULL;
+        copy->length = string->length;
+        copy->hash = string->hash;
+        memcpy(copy->chars, string->chars, string->length + 1);
+
+        uint32_t index = string->hash & (capacity - 1);
+        while (entries[index].string != 0) index = (index + 1) & (capacity - 1);
+        entries[index].string = (uint64_t) AS_INT(entry->value);
+
+        Value slot;
+        if (tableGet(&vm->globalSlots, string, &slot)) {
+            encodeGlobal(&entries[index], vm->globals.values[AS_INT(slot)], &offsets,
+                         functionOffsets[AS_INT(slot)]);
+        } else {
+            entries[index].type = VAL_UNDEFINED;
+        }
+    }
+
+    for (int i = 0; i < vm->globals.count; i++) {
+        if (functionOffsets[i] == 0) continue;
+
+        const ObjFunction *function = AS_FUNCTION(vm->globals.values[i]);
+        SnapshotFunction *record = (SnapshotFunction *) (image + functionOffsets[i]);
+        Value name;
+        tableGet(&offsets, function->name, &name);
+        record->name = (uint64_t) AS_INT(name);
+        record->arity = (uint32_t) function->arity;
+        record->line = (uint32_t) function->line;
+        record->sourceLength = (uint32_t) function->sourceLength;
+        memcpy(record->source, function->source, function->sourceLength);
+    }
+
+    FILE *file = fopen(path, "wb");
+    bool written = file != NULL && fwrite(image, 1, size, file) == size;
+    if (file != NULL && fclose(file) != 0) written = false;
+
+    FREE_ARRAY(char, image, size);
+    FREE_ARRAY(uint64_t, functionOffsets, vm->globals.count);
+    freeTable(&offsets);
+    return written;
+}
+
+/**
+ * Maps an image written by writeSnapshot() into the current VM.
+ *
+ * Nothing is copied or relocated up front. The mapping is private, so its
+ * pages stay shared with the file until the collector writes a mark bit
+ * into one. A string of the image is found the first time the VM looks for
+ * a string with its contents, and a global variable takes its value from
+ * the image the first time code refers to it; that is when the offsets
+ * involved become pointers, or a function is created from its record.
+ *
+ * The VM must not have made any strings or globals yet, as they could
+ * duplicate the image's.
+ *
+ * @param path The path of the image file.
+ * @return false if the file is not a valid image or the VM is not fresh.
+ */
+bool loadSnapshot(const char *path) {
+    if (vm->snapshot.base != NULL || vm->strings.count > 0 || vm->globals.count > 0) return false;
+
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat status;
+    if (fstat(fd, &status) != 0 || (size_t) status.st_size < sizeof(SnapshotHeader)) {
+        close(fd);
+        return false;
+    }
+
+    const size_t size = (size_t) status.st_size;
+    char *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return false;
+
+    if (!isValidImage(base, size)) {
+        munmap(base, size);
+        return false;
+    }
+
+    vm->snapshot.base = base;
+    vm->snapshot.size = size;
+    return true;
+}
+
+/**
+ * Unmaps the current VM's image, if it has one. Nothing may refer to the
+ * image's strings anymore.
+ */
+void unloadSnapshot() {
+    if (vm->snapshot.base == NULL) return;
+
+    munmap(vm->snapshot.base, vm->snapshot.size);
+    vm->snapshot.base = NULL;
+    vm->snapshot.size = 0;
+}
+
+/**
+ * Finds a string with the given contents among the strings of the current
+ * VM's image. The intern table falls back to this, so the image's strings
+ * stay the canonical ones for their contents.
+ *
+ * @param chars The characters of the string.
+ * @param length The number of characters.
+ * @param hash The string's hash as computed by hashString().
+ * @return The string, or NULL if there is none or no image is loaded.
+ */
+ObjString *findSnapshotString(const char *chars, const int length, const uint32_t hash) {
+    const SnapshotEntry *entry = findEntry(chars, length, hash);
+    return entry != NULL ? (ObjString *) (vm->snapshot.base + entry->string) : NULL;
+}
+
+/**
+ * Returns the value a global variable has in the current VM's image. A
+ * string value comes back as a pointer into the mapped image; a function
+ * value is created on the heap, uncompiled, so the caller must make it
+ * reachable before allocating.
+ *
+ * @param name The variable's name.
+ * @return The value, or the undefined sentinel if the image does not define
+ *         the variable or no image is loaded.
+ */
+Value snapshotGlobal(ObjString *name) {
+    const SnapshotEntry *entry = findEntry(name->chars, name->length, name->hash);
+    if (entry == NULL) return UNDEFINED_VAL(name);
+
+    switch (entry->type) {
+        case VAL_BOOL:
+            return BOOL_VAL(entry->payload != 0);
+        case VAL_NIL:
+            return NIL_VAL;
+        case VAL_NUMBER: {
+            double number;
+            memcpy(&number, &entry->payload, sizeof(number));
+            return NUMBER_VAL(number);
+        }
+        case VAL_INT:
+            return INT_VAL((int64_t) entry->payload);
+        case VAL_OBJ:
+            if (entry->objectType == OBJ_FUNCTION) return loadFunction(entry->payload, name);
+            return OBJ_VAL(vm->snapshot.base + entry->payload);
+        default:
+            return UNDEFINED_VAL(name);
+    }
+}
+
+/**
+ * Gives every global of the loaded image a slot, so that an image written
+ * from this VM also keeps the ones nothing has referred to yet.
+ */
+static void importGlobals() {
+    if (vm->snapshot.base == NULL) return;
+
+    const SnapshotHeader *header = (const SnapshotHeader *) vm->snapshot.base;
+    const SnapshotEntry *entries = (const SnapshotEntry *) (vm->snapshot.base + sizeof(SnapshotHeader));
+    for (uint32_t i = 0; i < header->capacity; i++) {
+        if (entries[i].string == 0 || entries[i].type == VAL_UNDEFINED) continue;
+        resolveGlobal((ObjString *) (vm->snapshot.base + entries[i].string));
+    }
+}
+
+static void addString(Table *offsets, ObjString *string, uint32_t *count) {
+    if (tableSet(offsets, string, NIL_VAL)) (*count)++;
+}
+
+static void encodeGlobal(SnapshotEntry *entry, const Value value, const Table *offsets,
+                         const uint64_t functionOffset) {
+    entry->type = value.type;
+    switch (value.type) {
+        case VAL_BOOL:
+            entry->payload = AS_BOOL(value);
+            break;
+        case VAL_NUMBER:
+            memcpy(&entry->payload, &AS_NUMBER(value), sizeof(entry->payload));
+            break;
+        case VAL_INT:
+            entry->payload = (uint64_t) AS_INT(value);
+            break;
+        case VAL_OBJ: {
+            entry->objectType = OBJ_TYPE(value);
+            if (IS_FUNCTION(value)) {
+                entry->payload = functionOffset;
+                break;
+            }
+            if (!IS_STRING(value)) {
+                entry->type = VAL_UNDEFINED;
+                entry->payload = 0;
+                break;
+            }
+            Value offset;
+            tableGet(offsets, AS_STRING(value), &offset);
+            entry->payload = (uint64_t) AS_INT(offset);
+            break;
+        }
+        default:
+            entry->payload = 0;
+            break;
+    }
+}
+
+/**
+ * Creates a function from its record in the image. Records are only checked
+ * here, when they are used, so that loading touches none of them.
+ */
+static Value loadFunction(const uint64_t offset, ObjString *global) {
+    const SnapshotHeader *header = (const SnapshotHeader *) vm->snapshot.base;
+    const SnapshotFunction *record = (const SnapshotFunction *) (vm->snapshot.base + offset);
+    if (!isStringOffset(header, record->name) ||
+        record->sourceLength > header->size - offset - sizeof(SnapshotFunction)) {
+        return UNDEFINED_VAL(global);
+    }
+
+    ObjString *name = (ObjString *) (vm->snapshot.base + record->name);
+    return OBJ_VAL(newFunction(name, record->source, (int) record->sourceLength, (int) record->line,
+                               (int) record->arity));
+}
+
+static const SnapshotEntry *findEntry(const char *chars, const int length, const uint32_t hash) {
+    if (vm->snapshot.base == NULL) return NULL;
+
+    const char *base = vm->snapshot.base;
+    const SnapshotHeader *header = (const SnapshotHeader *) base;
+    const SnapshotEntry *entries = (const SnapshotEntry *) (base + sizeof(SnapshotHeader));
+    const uint32_t mask = header->capacity - 1;
+
+    for (uint32_t index = hash & mask;; index = (index + 1) & mask) {
+        const SnapshotEntry *entry = &entries[index];
+        if (entry->string == 0) return NULL;
+
+        const ObjString *string = (const ObjString *) (base + entry->string);
+        if (string->hash == hash && string->length == length && memcmp(string->chars, chars, length) == 0) {
+            return entry;
+        }
+    }
+}
+
+/**
+ * Checks an image's header and string table. The strings and functions
+ * themselves are not read, which would touch every page of the image.
+ */
+static bool isValidImage(const char *base, const size_t size) {
+    const SnapshotHeader *header = (const SnapshotHeader *) base;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != SNAPSHOT_VERSION || header->stringHeaderSize != sizeof(ObjString) ||
+        header->size != size) {
+        return false;
+    }
+
+    // A power of two with an empty slot left, so that probing ends.
+    const uint32_t capacity = header->capacity;
+    if (capacity == 0 || (capacity & (capacity - 1)) != 0 || header->count >= capacity ||
+        capacity > (size - sizeof(SnapshotHeader)) / sizeof(SnapshotEntry)) {
+        return false;
+    }
+
+    const SnapshotEntry *entries = (const SnapshotEntry *) (base + sizeof(SnapshotHeader));
+    for (uint32_t i = 0; i < capacity; i++) {
+        const SnapshotEntry *entry = &entries[i];
+        if (entry->string == 0) continue;
+        if (!isStringOffset(header, entry->string) || entry->type > VAL_UNDEFINED) return false;
+        if (entry->type != VAL_OBJ) continue;
+        if (entry->objectType == OBJ_FUNCTION) {
+            if (!isFunctionOffset(header, entry->payload)) return false;
+        } else if (entry->objectType != OBJ_STRING || !isStringOffset(header, entry->payload)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool isStringOffset(const SnapshotHeader *header, const uint64_t offset) {
+    const uint64_t strings = sizeof(SnapshotHeader) + sizeof(SnapshotEntry) * (uint64_t) header->capacity;
+    return offset >= strings && offset % 8 == 0 && offset + sizeof(ObjString) < header->size;
+}
+
+static bool isFunctionOffset(const SnapshotHeader *header, const uint64_t offset) {
+    const uint64_t strings = sizeof(SnapshotHeader) + sizeof(SnapshotEntry) * (uint64_t) header->capacity;
+    return offset >= strings && offset % 8 == 0 && offset + sizeof(SnapshotFunction) <= header->size;
+}
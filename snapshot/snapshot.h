@@ -0,0 +1,26 @@
+#ifndef CLOXVM_SNAPSHOT_H
+#define CLOXVM_SNAPSHOT_H
+
+#include "../common.h"
+#include "../value/value.h"
+
+/**
+ * A heap image mapped into a VM's address space. base is NULL while no
+ * image is loaded.
+ */
+typedef struct {
+    char *base;
+    size_t size;
+} Snapshot;
+
+bool writeSnapshot(const char *path);
+
+bool loadSnapshot(const char *path);
+
+void unloadSnapshot();
+
+ObjString *findSnapshotString(const char *chars, int length, uint32_t hash);
+
+Value snapshotGlobal(ObjString *name);
+
+#endif //CLOXVM_SNAPSHOT_H
@@ -0,0 +1,235 @@
+#include "table.h"
+#include "../memory/memory.h"
+#include "../object/object.h"
+
+#include <string.h>
+
+static Entry *findEntry(Entry *entries, int capacity, const ObjString *key);
+
+static void adjustCapacity(Table *table, int capacity);
+
+static int countLiveEntries(const Table *table);
+
+/**
+ * Initializes an empty table.
+ *
+ * @param table The table to initialize.
+ */
+void initTable(Table *table) {
+    table->count = 0;
+    table->capacity = 0;
+    table->entries = NULL;
+}
+
+/**
+ * Frees the table's entries and leaves it empty. The keys and values are
+ * not freed.
+ *
+ * @param table The table to free.
+ */
+void freeTable(Table *table) {
+    FREE_ARRAY(Entry, table->entries, table->capacity);
+    initTable(table);
+}
+
+/**
+ * Looks up the value stored under a key.
+ *
+ * @param table The table to search.
+ * @param key The key to look up.
+ * @param value Receives the value if the key is present.
+ * @return true if the key is present.
+ */
+bool tableGet(const Table *table, const ObjString *key, Value *value) {
+    if (table->count == 0) return false;
+
+    const Entry *entry = findEntry(table->entries, table->capacity, key);
+    if (entry->key == NULL) return false;
+
+    *value = entry->value;
+    return true;
+}
+
+/**
+ * Stores a value under a key, replacing any value stored there before.
+ *
+ * @param table The table to store into.
+ * @param key The key.
+ * @param value The value.
+ * @return true if the key was not present before.
+ */
+bool tableSet(Table *table, ObjString *key, const Value value) {
+    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
+        // When tombstones fill most of the table, rehashing at the same
+        // capacity reclaims them; the intern table gets many once strings
+        // die.
+        const bool mostlyLive = countLiveEntries(table) + 1 > table->capacity * TABLE_MAX_LOAD / 2;
+        adjustCapacity(table, mostlyLive ? GROW_CAPACITY(table->capacity) : table->capacity);
+    }
+
+    Entry *entry = findEntry(table->entries, table->capacity, key);
+    const bool isNewKey = entry->key == NULL;
+    if (isNewKey && IS_NIL(entry->value)) table->count++;
+
+    entry->key = key;
+    entry->value = value;
+    return isNewKey;
+}
+
+/**
+ * Removes a key, leaving a tombstone in its place.
+ *
+ * @param table The table to remove from.
+ * @param key The key to remove.
+ * @return true if the key was present.
+ */
+bool tableDelete(Table *table, const ObjString *key) {
+    if (table->count == 0) return false;
+
+    Entry *entry = findEntry(table->entries, table->capacity, key);
+    if (entry->key == NULL) return false;
+
+    entry->key = NULL;
+    entry->value = BOOL_VAL(true);
+    return true;
+}
+
+/**
+ * Copies every entry of one table into another.
+ *
+ * @param from The table to copy from.
+ * @param to The table to copy into.
+ */
+void tableAddAll(const Table *from, Table *to) {
+    for (int i = 0; i < from->capacity; i++) {
+        const Entry *entry = &from->entries[i];
+        if (entry->key != NULL) tableSet(to, entry->key, entry->value);
+    }
+}
+
+/**
+ * Finds a string with the given contents among the table's keys.
+ *
+ * This is the one lookup that compares characters instead of pointers; the
+ * intern table uses it to decide whether a string already exists.
+ *
+ * @param table The table to search.
+ * @param chars The characters of the string.
+ * @param length The number of characters.
+ * @param hash The string's hash as computed by hashString().
+ * @return The key with these contents, or NULL.
+ */
+ObjString *tableFindString(const Table *table, const char *chars, const int length, const uint32_t hash) {
+    if (table->count == 0) return NULL;
+
+    const uint32_t mask = (uint32_t) table->capacity - 1;
+    for (uint32_t index = hash & mask;; index = (index + 1) & mask) {
+        const Entry *entry = &table->entries[index];
+        if (entry->key == NULL) {
+            // An empty entry ends the probe sequence; a tombstone does not.
+            if (IS_NIL(entry->value)) return NULL;
+        } else if (entry->key->hash == hash && entry->key->length == length &&
+                   memcmp(entry->key->chars, chars, length) == 0) {
+            return entry->key;
+        }
+    }
+}
+
+/**
+ * Swaps a key for another object with the same contents and hash, keeping
+ * its value. The minor garbage collector uses it when it moves a string.
+ *
+ * @param table The table to update.
+ * @param key The key to replace. Nothing happens if it is not present.
+ * @param replacement The new key.
+ */
+void tableReplaceKey(Table *table, const ObjString *key, ObjString *replacement) {
+    if (table->count == 0) return;
+
+    Entry *entry = findEntry(table->entries, table->capacity, key);
+    if (entry->key == key) entry->key = replacement;
+}
+
+/**
+ * Marks every key and value of a table for the garbage collector.
+ *
+ * @param table The table to mark.
+ */
+void markTable(const Table *table) {
+    for (int i = 0; i < table->capacity; i++) {
+        const Entry *entry = &table->entries[i];
+        if (entry->key == NULL) continue;
+        markObject(&entry->key->obj);
+        markValue(entry->value);
+    }
+}
+
+/**
+ * Deletes the entries whose keys the garbage collector did not reach. This
+ * makes the table a weak reference to its keys, which is what the intern
+ * table needs: a string is not kept alive just because it is interned.
+ *
+ * @param table The table to clean.
+ */
+void tableRemoveWhite(Table *table) {
+    for (int i = 0; i < table->capacity; i++) {
+        const Entry *entry = &table->entries[i];
+        if (entry->key != NULL && !isMarked(&entry->key->obj)) {
+            tableDelete(table, entry->key);
+        }
+    }
+}
+
+/**
+ * Finds the entry for a key: the entry holding it, or else the entry a new
+ * key should go to, which is the first tombstone passed or the empty entry
+ * that ended the probe sequence.
+ */
+static Entry *findEntry(Entry *entries, const int capacity, const ObjString *key) {
+    const uint32_t mask = (uint32_t) capacity - 1;
+    Entry *tombstone = NULL;
+
+    for (uint32_t index = key->hash & mask;; index = (index + 1) & mask) {
+        Entry *entry = &entries[index];
+        if (entry->key == key) return entry;
+        if (entry->key == NULL) {
+            if (IS_NIL(entry->value)) return tombstone != NULL ? tombstone : entry;
+            if (tombstone == NULL) tombstone = entry;
+        }
+    }
+}
+
+/**
+ * Moves all entries into a new array of the given capacity, dropping the
+ * tombstones.
+ */
+static void adjustCapacity(Table *table, const int capacity) {
+    Entry *entries = GROW_ARRAY(Entry, NULL, 0, capacity);
+    for (int i = 0; i < capacity; i++) {
+        entries[i].key = NULL;
+        entries[i].value = NIL_VAL;
+    }
+
+    table->count = 0;
+    for (int i = 0; i < table->capacity; i++) {
+        const Entry *entry = &table->entries[i];
+        if (entry->key == NULL) continue;
+
+        Entry *destination = findEntry(entries, capacity, entry->key);
+        destination->key = entry->key;
+        destination->value = entry->value;
+        table->count++;
+    }
+
+    FREE_ARRAY(Entry, table->entries, table->capacity);
+    table->entries = entries;
+    table->capacity = capacity;
+}
+
+static int countLiveEntries(const Table *table) {
+    int count = 0;
+    for (int i = 0; i < table->capacity; i++) {
+        if (table->entries[i].key != NULL) count++;
+    }
+    return count;
+}
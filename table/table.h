@@ -0,0 +1,48 @@
+#ifndef CLOXVM_TABLE_H
+#define CLOXVM_TABLE_H
+
+#include "../common.h"
+#include "../value/value.h"
+
+#define TABLE_MAX_LOAD 0.75
+
+typedef struct {
+    ObjString *key;
+    Value value;
+} Entry;
+
+/**
+ * A hash table keyed by interned strings.
+ *
+ * Entries live in one flat array whose capacity is a power of two, probed
+ * linearly from the key's hash. Deleted entries leave a tombstone (no key,
+ * value true) so that probe sequences running through them stay intact.
+ * count includes tombstones.
+ */
+typedef struct {
+    int count;
+    int capacity;
+    Entry *entries;
+} Table;
+
+void initTable(Table *table);
+
+void freeTable(Table *table);
+
+bool tableGet(const Table *table, const ObjString *key, Value *value);
+
+bool tableSet(Table *table, ObjString *key, Value value);
+
+bool tableDelete(Table *table, const ObjString *key);
+
+void tableAddAll(const Table *from, Table *to);
+
+ObjString *tableFindString(const Table *table, const char *chars, int length, uint32_t hash);
+
+void tableReplaceKey(Table *table, const ObjString *key, ObjString *replacement);
+
+void markTable(const Table *table);
+
+void tableRemoveWhite(Table *table);
+
+#endif //CLOXVM_TABLE_H
@@ -0,0 +1,17 @@
+# Runs SCRIPT with CLOXVM with and without the optimizing pass and fails if
+# the output, the errors or the exit status differ.
+#
+#   cmake -DCLOXVM=path/to/cloxvm -DSCRIPT=script.lox -P differential.cmake
+
+execute_process(COMMAND ${CLOXVM} ${SCRIPT}
+        OUTPUT_VARIABLE plainOutput ERROR_VARIABLE plainError RESULT_VARIABLE plainResult)
+execute_process(COMMAND ${CLOXVM} --optimize ${SCRIPT}
+        OUTPUT_VARIABLE optimizedOutput ERROR_VARIABLE optimizedError RESULT_VARIABLE optimizedResult)
+
+if (NOT plainOutput STREQUAL optimizedOutput OR NOT plainError STREQUAL optimizedError
+        OR NOT plainResult STREQUAL optimizedResult)
+    message(FATAL_ERROR "${SCRIPT} behaves differently with --optimize.\n"
+            "Without (exit ${plainResult}):\n${plainOutput}${plainError}\n"
+            "With (exit ${optimizedResult}):\n${optimizedOutput}${optimizedError}")
+endif ()
+message(STATUS "exit ${plainResult}: ${plainOutput}${plainError}")
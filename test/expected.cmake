@@ -0,0 +1,18 @@
+# Runs SCRIPT with CLOXVM and fails unless it exits with status 0 and prints
+# exactly what the file next to it with the extension .expected holds.
+#
+#   cmake -DCLOXVM=path/to/cloxvm -DSCRIPT=script.lox -P expected.cmake
+
+get_filename_component(directory ${SCRIPT} DIRECTORY)
+get_filename_component(name ${SCRIPT} NAME_WE)
+file(READ ${directory}/${name}.expected expectedOutput)
+
+execute_process(COMMAND ${CLOXVM} ${SCRIPT}
+        OUTPUT_VARIABLE output ERROR_VARIABLE error RESULT_VARIABLE result)
+
+if (NOT result STREQUAL "0" OR NOT output STREQUAL expectedOutput)
+    message(FATAL_ERROR "${SCRIPT} did not print what ${name}.expected holds.\n"
+            "Expected:\n${expectedOutput}\n"
+            "Got (exit ${result}):\n${output}${error}")
+endif ()
+message(STATUS "exit ${result}: ${output}")
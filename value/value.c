@@ -5,6 +5,32 @@
 #include "../value/value.h"
 #include "../memory/memory.h"
 
+/**
+ * Compares two values for equality.
+ *
+ * Numbers compare by value whether they are stored as doubles or integers.
+ * Objects compare by identity, which for strings is equality of contents
+ * because all strings are interned.
+ *
+ * @param a The first value.
+ * @param b The second value.
+ * @return true if the values are equal.
+ */
+bool valuesEqual(const Value a, const Value b) {
+    if (IS_NUMERIC(a) && IS_NUMERIC(b)) {
+        if (IS_INT(a) && IS_INT(b)) return AS_INT(a) == AS_INT(b);
+        return AS_DOUBLE(a) == AS_DOUBLE(b);
+    }
+    if (a.type != b.type) return false;
+
+    switch (a.type) {
+        case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
+        case VAL_NIL: return true;
+        case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b);
+        default: return false;
+    }
+}
+
 /**
  * Initializes a ValueArray by resetting its count and capacity to zero and
  * setting its values pointer to NULL. This prepares the ValueArray for use,
@@ -7,7 +7,54 @@
 
 #include "../common.h"
 
-typedef double Value;
+typedef struct Obj Obj;
+typedef struct ObjString ObjString;
+typedef struct ObjFunction ObjFunction;
+typedef struct ObjClosure ObjClosure;
+typedef struct ObjUpvalue ObjUpvalue;
+typedef struct Shape Shape;
+
+typedef enum {
+    VAL_BOOL,
+    VAL_NIL,
+    VAL_NUMBER,
+    VAL_INT,
+    VAL_OBJ,
+    // Only ever found in a global variable slot that has not been defined
+    // yet. It carries the variable's name for the error message.
+    VAL_UNDEFINED
+} ValueType;
+
+typedef struct {
+    ValueType type;
+    union {
+        bool boolean;
+        double number;
+        int64_t integer;
+        Obj *obj;
+    } as;
+} Value;
+
+#define IS_BOOL(value)    ((value).type == VAL_BOOL)
+#define IS_NIL(value)     ((value).type == VAL_NIL)
+#define IS_NUMBER(value)  ((value).type == VAL_NUMBER)
+#define IS_INT(value)     ((value).type == VAL_INT)
+#define IS_NUMERIC(value) (IS_NUMBER(value) || IS_INT(value))
+#define IS_OBJ(value)     ((value).type == VAL_OBJ)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
+
+#define AS_BOOL(value)    ((value).as.boolean)
+#define AS_NUMBER(value)  ((value).as.number)
+#define AS_INT(value)     ((value).as.integer)
+#define AS_OBJ(value)     ((value).as.obj)
+#define AS_DOUBLE(value)  (IS_INT(value) ? (double) AS_INT(value) : AS_NUMBER(value))
+
+#define BOOL_VAL(value)   ((Value){VAL_BOOL, {.boolean = value}})
+#define NIL_VAL           ((Value){VAL_NIL, {.number = 0}})
+#define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
+#define INT_VAL(value)    ((Value){VAL_INT, {.integer = value}})
+#define OBJ_VAL(object)   ((Value){VAL_OBJ, {.obj = (Obj *) (object)}})
+#define UNDEFINED_VAL(name) ((Value){VAL_UNDEFINED, {.obj = (Obj *) (name)}})
 
 typedef struct {
     int count;
@@ -15,11 +62,12 @@ typedef struct {
     Value *values;
 } ValueArray;
 
+CLOXVM_API bool valuesEqual(Value a, Value b);
 
-void initValueArray(ValueArray *valueArray);
+CLOXVM_API void initValueArray(ValueArray *valueArray);
 
-void writeValueArray(ValueArray *valueArray, Value value);
+CLOXVM_API void writeValueArray(ValueArray *valueArray, Value value);
 
-void freeValueArray(ValueArray *valueArray);
+CLOXVM_API void freeValueArray(ValueArray *valueArray);
 
 #endif //CLOXVM_VALUE_H
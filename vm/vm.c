@@ -4,23 +4,255 @@
 
 #include "vm.h"
 #include "../enums/opcodes.h"
+#include "../array/array.h"
 #include "../debug/debug.h"
 #include "../compiler/compiler.h"
+#include "../mathlib/mathlib.h"
+#include "../object/object.h"
+#include "../profiler/profiler.h"
+#include "../shape/shape.h"
+#include <limits.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 
 static void resetStack();
 
-VM vm;
+static Value initialGlobal(ObjString *name);
 
+static void growGlobalSlots();
 
-void initVM() {
+static void freeGlobalSlots();
+
+static InterpretResult runRegister();
+
+static Value negateInt(int64_t value);
+
+static bool isFalsey(Value value);
+
+static ObjUpvalue *captureUpvalue(Value *slot);
+
+static void closeUpvalues(const Value *last);
+
+static inline bool arrayIndex(Value value, int64_t *index);
+
+static inline const CacheEntry *probeCache(const InlineCache *cache, const Shape *shape);
+
+static const CacheEntry *missLoad(InlineCache *cache, const ObjInstance *instance, ObjString *name,
+                                  CacheEntry *found);
+
+static const CacheEntry *missStore(InlineCache *cache, const ObjInstance *instance, ObjString *name,
+                                   CacheEntry *found);
+
+static const CacheEntry *updateCache(InlineCache *cache, const CacheEntry *found);
+
+VM_THREAD_LOCAL VM *vm;
+
+
+/**
+ * Initializes a virtual machine and makes it the calling thread's current VM.
+ *
+ * Resets the value stack, sets up the garbage collector with the configured
+ * heap growth and an empty nursery, installs the configured allocator and
+ * error callback, selects the configured bytecode format and optimizing
+ * tier for compiled chunks, lets the compiler pick its front end, points the VM's output
+ * sink at standard output and registers the math and array libraries. No
+ * heap image is loaded.
+ *
+ * @param machine The VM to initialize.
+ * @param config The configuration, or NULL for the defaults.
+ */
+void initVM(VM *machine, const CloxVMConfig *config) {
+    CloxVMConfig defaults;
+    if (config == NULL) {
+        initCloxVMConfig(&defaults);
+        config = &defaults;
+    }
+
+    vm = machine;
+    vm->bytesAllocated = 0;
+    vm->nextGC = GC_INITIAL_THRESHOLD;
+    vm->heapGrowthFactor = config->heapGrowthFactor;
+    vm->gcPhase = GC_IDLE;
+    vm->markBit = false;
+    vm->collecting = false;
+    vm->sweep = NULL;
+    vm->grayCount = 0;
+    vm->grayCapacity = 0;
+    vm->grayStack = NULL;
+    vm->nursery.start = NULL;
+    vm->nursery.top = NULL;
+    vm->nursery.end = NULL;
+    vm->nurseryFull = false;
+    vm->rememberedGlobals = NULL;
+    vm->rememberedCount = 0;
+    vm->globalRemembered = NULL;
+    vm->rememberedObjects = NULL;
+    vm->rememberedObjectCount = 0;
+    vm->rememberedObjectCapacity = 0;
+    vm->deadShapes = NULL;
+    vm->natives = NULL;
+    vm->nativeCount = 0;
+    vm->nativeCapacity = 0;
+    vm->chunk = NULL;
+    vm->ip = NULL;
+    vm->openUpvalues = NULL;
     resetStack();
+    vm->result = NIL_VAL;
+    initTable(&vm->strings);
+    initTable(&vm->globalSlots);
+    initValueArray(&vm->globals);
+    vm->globalRefs = NULL;
+    vm->freeGlobals = NULL;
+    vm->freeGlobalCount = 0;
+    vm->globalCapacity = 0;
+    vm->chunks = NULL;
+    vm->objects = NULL;
+    vm->snapshot.base = NULL;
+    vm->snapshot.size = 0;
+    vm->chunkFormat = config->registerFormat ? CHUNK_REGISTER : CHUNK_STACK;
+    vm->frontEnd = FRONT_END_AUTO;
+    vm->optimize = config->optimize;
+    vm->reallocate = config->reallocate;
+    vm->allocatorData = config->allocatorData;
+    vm->onError = config->onError;
+    vm->errorData = config->errorData;
+    initFdSink(&vm->output, STDOUT_FILENO);
+
+    char *nursery = GROW_ARRAY(char, NULL, 0, NURSERY_SIZE);
+    vm->nursery.start = nursery;
+    vm->nursery.top = nursery;
+    vm->nursery.end = nursery + NURSERY_SIZE;
+
+    defineMathNatives();
+    defineArrayNatives();
 }
 
-void freeVM() {
+/**
+ * Releases the resources held by a virtual machine.
+ *
+ * Flushes any output still buffered in the VM's output sink, frees every
+ * object the VM allocated and unmaps its heap image. If the VM is the
+ * calling thread's current one, the thread is left without a current VM.
+ *
+ * @param machine The VM to free.
+ */
+void freeVM(VM *machine) {
+    VM *previous = useVM(machine);
+    freeOutputSink(&vm->output);
+    freeTable(&vm->strings);
+    freeTable(&vm->globalSlots);
+    freeValueArray(&vm->globals);
+    freeObjects();
+    freeGlobalSlots();
+    freeGrayStack();
+    freeShapes();
+    freeNatives();
+    freeRememberedObjects();
+    freeNursery();
+    unloadSnapshot();
+    vm = previous == machine ? NULL : previous;
+}
 
+/**
+ * Makes a VM the calling thread's current one.
+ *
+ * Everything that works on "the" VM, from the compiler's error reporting to
+ * the allocator and the interpreter loop, uses the current VM, so embedders
+ * switch to their VM before calling in and back afterwards.
+ *
+ * @param machine The VM to switch to, or NULL.
+ * @return The previously current VM.
+ */
+VM *useVM(VM *machine) {
+    VM *previous = vm;
+    vm = machine;
+    return previous;
 }
 
+/**
+ * Reports a compile or runtime error through the current VM's error
+ * callback, or prints it to standard error if there is none.
+ *
+ * @param kind INTERPRET_COMPILE_ERROR or INTERPRET_RUNTIME_ERROR.
+ * @param line The source line the error refers to.
+ * @param message The error message, without the line.
+ */
+void reportError(const InterpretResult kind, const int line, const char *message) {
+    if (vm != NULL && vm->onError != NULL) {
+        vm->onError(kind, line, message, vm->errorData);
+        return;
+    }
+
+    if (kind == INTERPRET_COMPILE_ERROR) {
+        fprintf(stderr, "[line %d] %s\n", line, message);
+    } else {
+        fprintf(stderr, "%s\n[line %d] in script\n", message, line);
+    }
+}
+
+/**
+ * Returns the slot of a global variable, assigning a free one if the name
+ * has no slot in the current VM yet.
+ *
+ * Slots are resolved once at compile time and stay valid as long as code
+ * refers to them, so compiled code reaches a global with an array index
+ * instead of a hash lookup. A new slot holds the variable's value from the
+ * loaded heap image, if the image defines it, else the native registered
+ * under its name, and otherwise the undefined sentinel until the
+ * variable's declaration runs. Slots released by resetGlobals() are reused
+ * before the table grows.
+ *
+ * @param name The variable's name.
+ * @return The slot index, or -1 if the VM has no free slot left.
+ */
+int resolveGlobal(ObjString *name) {
+    Value slot;
+    if (tableGet(&vm->globalSlots, name, &slot)) return (int) AS_INT(slot);
+
+    int index;
+    if (vm->freeGlobalCount > 0) {
+        index = vm->freeGlobals[--vm->freeGlobalCount];
+        push(OBJ_VAL(name));
+    } else {
+        if (vm->globals.count == GLOBALS_MAX) return -1;
+        index = vm->globals.count;
+        push(OBJ_VAL(name));
+        if (index == vm->globalCapacity) growGlobalSlots();
+        writeValueArray(&vm->globals, NIL_VAL);
+        vm->globalRefs[index] = 0;
+        vm->globalRemembered[index] = false;
+    }
+    vm->globals.values[index] = initialGlobal(name);
+    tableSet(&vm->globalSlots, name, INT_VAL(index));
+    pop();
+    return index;
+}
+
+/**
+ * Returns every global variable of the current VM to the value it starts
+ * out with: the loaded image's, the native registered under its name, or
+ * none. Slots that compiled code still refers to keep their indices, so
+ * that code stays valid; the others are released for reuse, which keeps a
+ * VM that runs one script after another from running out of slots.
+ */
+void resetGlobals() {
+    for (int i = 0; i < vm->globalSlots.capacity; i++) {
+        const Entry *entry = &vm->globalSlots.entries[i];
+        if (entry->key == NULL) continue;
+
+        const int slot = (int) AS_INT(entry->value);
+        if (vm->globalRefs[slot] > 0) {
+            vm->globals.values[slot] = initialGlobal(entry->key);
+            continue;
+        }
+        vm->globals.values[slot] = NIL_VAL;
+        vm->freeGlobals[vm->freeGlobalCount++] = slot;
+        tableDelete(&vm->globalSlots, entry->key);
+    }
+}
 
 /**
  * Interprets the given source code.
@@ -28,7 +260,7 @@ void freeVM() {
  * This function compiles the provided source code into a bytecode `Chunk`,
  * sets up the virtual machine (VM) to interpret that chunk, and then runs
  * the VM. If the compilation or execution fails, appropriate error results
- * will be returned.
+ * will be returned. The script's result is written to the VM's output.
  *
  * @param source The source code to interpret.
  * @return The result of the interpretation. It will be INTERPRET_OK if the
@@ -39,22 +271,353 @@ void freeVM() {
 InterpretResult interpret(const char *source) {
     Chunk chunk;
     initChunk(&chunk);
+    chunk.format = vm->chunkFormat;
 
-    if (!compile(source, &chunk)) {
+    if (!compile(source, &chunk, vm->frontEnd)) {
         freeChunk(&chunk);
         return INTERPRET_COMPILE_ERROR;
     }
 
-    vm.chunk = &chunk;
-    vm.ip = chunk.code;
-
-    InterpretResult result = run();
+    InterpretResult result = interpretChunk(&chunk);
+    if (result == INTERPRET_OK) {
+        writeValue(&vm->output, vm->result);
+        writeOutputChar(&vm->output, '\n');
+    }
 
+    resolveProfileSamples("script");
     freeChunk(&chunk);
 
-    return INTERPRET_OK;
+    return result;
 }
 
+/**
+ * Runs an already compiled chunk.
+ *
+ * The chunk is executed by the interpreter loop matching its format. It can
+ * be run any number of times; instructions quickened by an earlier run stay
+ * quickened. On success the value the chunk returned is in vm->result.
+ *
+ * @param chunk The chunk to run.
+ * @return INTERPRET_OK if the chunk ran to completion,
+ *         INTERPRET_RUNTIME_ERROR if execution failed, or
+ *         INTERPRET_COMPILE_ERROR if a function it called did not compile.
+ */
+InterpretResult interpretChunk(Chunk *chunk) {
+    resetStack();
+    vm->ip = chunk->code;
+    vm->chunk = chunk;
+
+    const InterpretResult result = chunk->format == CHUNK_REGISTER ? runRegister() : run();
+
+    // Tells the profiler that no chunk is executing anymore.
+    vm->chunk = NULL;
+    return result;
+}
+
+// Dispatch strategy of the stack interpreter, selected at build time with the
+// CLOXVM_DISPATCH CMake option. The instruction bodies in instructions.def are
+// shared by all strategies; only the glue between instructions differs.
+#if defined(CLOXVM_DISPATCH_TAIL_CALL)
+
+#if defined(__has_attribute)
+#if __has_attribute(musttail)
+#define MUSTTAIL __attribute__((musttail))
+#endif
+#endif
+
+#ifndef MUSTTAIL
+// Without musttail the build relies on sibling call optimization, which
+// CMakeLists.txt forces on for this file.
+#define MUSTTAIL
+#endif
+
+typedef InterpretResult (*InstructionHandler)(uint8_t *ip, Value *sp, const Value *constants,
+                                              Value *slots, VM *machine);
+
+static const InstructionHandler instructionHandlers[UINT8_COUNT];
+
+#endif
+
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t) ((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define READ_STRING() AS_STRING(READ_CONSTANT())
+#define CURRENT_CLOSURE() (machine->frames[machine->frameCount - 1].callee)
+#define PUSH(value) (*sp++ = (value))
+#define POP() (*--sp)
+#define PEEK(distance) (sp[-1 - (distance)])
+#define PUBLISH_IP() (machine->ip = ip)
+#define SAVE_STATE()            \
+    do {                        \
+        machine->ip = ip;       \
+        machine->stackTop = sp; \
+    } while (false)
+#define COLLECT_NURSERY_IF_FULL()   \
+    do {                            \
+        if (machine->nurseryFull) { \
+            SAVE_STATE();           \
+            collectNursery();       \
+        }                           \
+    } while (false)
+#define WRITE_GLOBAL(slot, value)                                       \
+    do {                                                                \
+        Value stored = (value);                                         \
+        machine->globals.values[slot] = stored;                         \
+        if (isYoungValue(machine, stored)) rememberGlobal(slot);        \
+    } while (false)
+#define QUICKEN(opcode) (ip[-1] = (opcode))
+#define DEOPTIMIZE(opcode)      \
+    do {                        \
+        ip[-1] = (opcode);      \
+        ip--;                   \
+        NEXT();                 \
+    } while (false)
+#define RUNTIME_ERROR(...)      \
+    do {                        \
+        SAVE_STATE();           \
+        runtimeError(__VA_ARGS__); \
+        return INTERPRET_RUNTIME_ERROR; \
+    } while (false)
+// A frame is filled in before it is counted, since the profiler's signal
+// handler reads every frame below frameCount.
+#define CALL_FUNCTION(function, closure, argCount)                      \
+    do {                                                                \
+        ObjFunction *calledFunction = (function);                       \
+        if ((argCount) != calledFunction->arity) {                      \
+            RUNTIME_ERROR("Expected %d arguments but got %d.",          \
+                          calledFunction->arity, (argCount));           \
+        }                                                               \
+        if (machine->frameCount == FRAMES_MAX) {                        \
+            RUNTIME_ERROR("Stack overflow.");                           \
+        }                                                               \
+        if (calledFunction->chunk.code == NULL) {                       \
+            SAVE_STATE();                                               \
+            if (!compileFunction(calledFunction)) return INTERPRET_COMPILE_ERROR; \
+        }                                                               \
+        CallFrame *frame = &machine->frames[machine->frameCount];      \
+        frame->chunk = machine->chunk;                                  \
+        frame->ip = ip;                                                 \
+        frame->slots = slots;                                           \
+        frame->callee = (closure);                                      \
+        atomic_signal_fence(memory_order_release);                      \
+        machine->frameCount++;                                          \
+        slots = sp - (argCount) - 1;                                    \
+        machine->chunk = &calledFunction->chunk;                        \
+        constants = calledFunction->chunk.constants.values;             \
+        ip = calledFunction->chunk.code;                                \
+        NEXT();                                                         \
+    } while (false)
+// Natives take their arguments where they are on the stack and leave their
+// result in the callee's slot, so a call pushes no frame and copies nothing.
+#define CALL_NATIVE(native, argCount)                                   \
+    do {                                                                \
+        ObjNative *calledNative = (native);                             \
+        if (calledNative->arity != -1 && (argCount) != calledNative->arity) { \
+            RUNTIME_ERROR("Expected %d arguments but got %d.",          \
+                          calledNative->arity, (argCount));             \
+        }                                                               \
+        SAVE_STATE();                                                   \
+        if (!calledNative->function(machine, (argCount), sp - (argCount))) { \
+            return INTERPRET_RUNTIME_ERROR;                             \
+        }                                                               \
+        sp -= (argCount);                                               \
+        COLLECT_NURSERY_IF_FULL();                                      \
+        NEXT();                                                         \
+    } while (false)
+#define CALL_VALUE(callee, argCount)                                    \
+    do {                                                                \
+        Value calledValue = (callee);                                   \
+        if (IS_BOUND_METHOD(calledValue)) {                             \
+            sp[-(argCount) - 1] = AS_BOUND_METHOD(calledValue)->receiver; \
+            calledValue = AS_BOUND_METHOD(calledValue)->method;         \
+        } else if (IS_CLASS(calledValue)) {                             \
+            ObjClass *klass = AS_CLASS(calledValue);                    \
+            SAVE_STATE();                                               \
+            ObjInstance *instance = newInstance(klass);                 \
+            sp[-(argCount) - 1] = OBJ_VAL(instance);                    \
+            COLLECT_NURSERY_IF_FULL();                                  \
+            if (IS_NIL(klass->initializer)) {                           \
+                if ((argCount) != 0) {                                  \
+                    RUNTIME_ERROR("Expected 0 arguments but got %d.", (argCount)); \
+                }                                                       \
+                NEXT();                                                 \
+            }                                                           \
+            calledValue = klass->initializer;                           \
+        }                                                               \
+        if (IS_CLOSURE(calledValue)) {                                  \
+            CALL_FUNCTION(AS_CLOSURE(calledValue)->function, AS_CLOSURE(calledValue), argCount); \
+        }                                                               \
+        if (IS_FUNCTION(calledValue)) {                                 \
+            CALL_FUNCTION(AS_FUNCTION(calledValue), NULL, argCount);    \
+        }                                                               \
+        if (IS_NATIVE(calledValue)) {                                   \
+            CALL_NATIVE(AS_NATIVE(calledValue), argCount);              \
+        }                                                               \
+        RUNTIME_ERROR("Can only call functions and classes.");          \
+    } while (false)
+#define NUMBER_OP(op)               \
+    do {                            \
+        double b = AS_NUMBER(POP());\
+        double a = AS_NUMBER(POP());\
+        PUSH(NUMBER_VAL(a op b));   \
+    } while (false)
+#define INT_OP(op, checkedOp)                               \
+    do {                                                    \
+        int64_t b = AS_INT(POP());                          \
+        int64_t a = AS_INT(POP());                          \
+        int64_t result;                                     \
+        if (checkedOp(a, b, &result)) {                     \
+            PUSH(NUMBER_VAL((double) a op (double) b));     \
+        } else {                                            \
+            PUSH(INT_VAL(result));                          \
+        }                                                   \
+    } while (false)
+// Integers are compared exactly, anything else as doubles.
+#define COMPARE_NUMBERS(a, op, b) \
+    (IS_INT(a) && IS_INT(b) ? AS_INT(a) op AS_INT(b) : AS_DOUBLE(a) op AS_DOUBLE(b))
+#define COMPARISON_OP(op)                                               \
+    do {                                                                \
+        Value b = PEEK(0);                                              \
+        Value a = PEEK(1);                                              \
+        if (!IS_NUMERIC(a) || !IS_NUMERIC(b)) {                         \
+            RUNTIME_ERROR("Operands must be numbers.");                 \
+        }                                                               \
+        sp -= 2;                                                        \
+        PUSH(BOOL_VAL(COMPARE_NUMBERS(a, op, b)));                      \
+    } while (false)
+#define COMPARE_AND_JUMP(op, jumpIf)                                    \
+    do {                                                                \
+        uint16_t offset = READ_SHORT();                                 \
+        Value b = PEEK(0);                                              \
+        Value a = PEEK(1);                                              \
+        if (!IS_NUMERIC(a) || !IS_NUMERIC(b)) {                         \
+            RUNTIME_ERROR("Operands must be numbers.");                 \
+        }                                                               \
+        sp -= 2;                                                        \
+        if (COMPARE_NUMBERS(a, op, b) == (jumpIf)) ip += offset;        \
+    } while (false)
+#define BINARY_OP(op, checkedOp, numberForm, intForm)                   \
+    do {                                                                \
+        Value b = PEEK(0);                                              \
+        Value a = PEEK(1);                                              \
+        if (IS_INT(a) && IS_INT(b)) {                                   \
+            QUICKEN(intForm);                                           \
+            INT_OP(op, checkedOp);                                      \
+        } else if (IS_NUMBER(a) && IS_NUMBER(b)) {                      \
+            QUICKEN(numberForm);                                        \
+            NUMBER_OP(op);                                              \
+        } else if (IS_NUMERIC(a) && IS_NUMERIC(b)) {                    \
+            sp -= 2;                                                    \
+            PUSH(NUMBER_VAL(AS_DOUBLE(a) op AS_DOUBLE(b)));             \
+        } else {                                                        \
+            RUNTIME_ERROR("Operands must be numbers.");                 \
+        }                                                               \
+    } while (false)
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE()                                                         \
+    do {                                                                \
+        printf("stack: ");                                              \
+        for (Value *slot = machine->stack; slot < sp; slot++) {          \
+            printf("[ ");                                               \
+            printValue(*slot);                                          \
+            printf(" ]");                                               \
+        }                                                               \
+        printf("\n");                                                   \
+        disassembleInstruction(machine->chunk,                          \
+                               (int) (ip - machine->chunk->code));      \
+    } while (false)
+#else
+#define TRACE() do { } while (false)
+#endif
+
+#if defined(CLOXVM_DISPATCH_TAIL_CALL)
+
+#define INSTRUCTION(opcode) \
+    static InterpretResult handle_##opcode(uint8_t *ip, Value *sp, const Value *constants, \
+                                           Value *slots, VM *machine)
+#define NEXT()                                                          \
+    do {                                                                \
+        PUBLISH_IP();                                                   \
+        TRACE();                                                        \
+        MUSTTAIL return instructionHandlers[*ip](ip + 1, sp, constants, slots, machine); \
+    } while (false)
+
+#include "instructions.def"
+
+INSTRUCTION(unknownOpcode) {
+    RUNTIME_ERROR("Unknown opcode %d.", ip[-1]);
+}
+
+static const InstructionHandler instructionHandlers[UINT8_COUNT] = {
+    [0 ... UINT8_COUNT - 1] = handle_unknownOpcode,
+    [OP_RETURN]             = handle_OP_RETURN,
+    [OP_NEGATE]             = handle_OP_NEGATE,
+    [OP_ADD]                = handle_OP_ADD,
+    [OP_SUBTRACT]           = handle_OP_SUBTRACT,
+    [OP_MULTIPLY]           = handle_OP_MULTIPLY,
+    [OP_DIVIDE]             = handle_OP_DIVIDE,
+    [OP_CONSTANT]           = handle_OP_CONSTANT,
+    [OP_NIL]                = handle_OP_NIL,
+    [OP_TRUE]               = handle_OP_TRUE,
+    [OP_FALSE]              = handle_OP_FALSE,
+    [OP_EQUAL]              = handle_OP_EQUAL,
+    [OP_GREATER]            = handle_OP_GREATER,
+    [OP_LESS]               = handle_OP_LESS,
+    [OP_NOT]                = handle_OP_NOT,
+    [OP_POP]                = handle_OP_POP,
+    [OP_POPN]               = handle_OP_POPN,
+    [OP_GET_LOCAL]          = handle_OP_GET_LOCAL,
+    [OP_SET_LOCAL]          = handle_OP_SET_LOCAL,
+    [OP_DEFINE_GLOBAL]      = handle_OP_DEFINE_GLOBAL,
+    [OP_GET_GLOBAL]         = handle_OP_GET_GLOBAL,
+    [OP_SET_GLOBAL]         = handle_OP_SET_GLOBAL,
+    [OP_DEFINE_GLOBAL_LONG] = handle_OP_DEFINE_GLOBAL_LONG,
+    [OP_GET_GLOBAL_LONG]    = handle_OP_GET_GLOBAL_LONG,
+    [OP_SET_GLOBAL_LONG]    = handle_OP_SET_GLOBAL_LONG,
+    [OP_GET_UPVALUE]        = handle_OP_GET_UPVALUE,
+    [OP_SET_UPVALUE]        = handle_OP_SET_UPVALUE,
+    [OP_GET_UPVALUE_STACK]  = handle_OP_GET_UPVALUE_STACK,
+    [OP_SET_UPVALUE_STACK]  = handle_OP_SET_UPVALUE_STACK,
+    [OP_CLOSURE]            = handle_OP_CLOSURE,
+    [OP_CLOSE_UPVALUE]      = handle_OP_CLOSE_UPVALUE,
+    [OP_CALL]               = handle_OP_CALL,
+    [OP_CLASS]              = handle_OP_CLASS,
+    [OP_METHOD]             = handle_OP_METHOD,
+    [OP_GET_PROPERTY]       = handle_OP_GET_PROPERTY,
+    [OP_SET_PROPERTY]       = handle_OP_SET_PROPERTY,
+    [OP_INVOKE]             = handle_OP_INVOKE,
+    [OP_ARRAY]              = handle_OP_ARRAY,
+    [OP_GET_INDEX]          = handle_OP_GET_INDEX,
+    [OP_SET_INDEX]          = handle_OP_SET_INDEX,
+    [OP_JUMP]               = handle_OP_JUMP,
+    [OP_JUMP_IF_FALSE]      = handle_OP_JUMP_IF_FALSE,
+    [OP_LOOP]               = handle_OP_LOOP,
+    [OP_JUMP_IF_LESS]       = handle_OP_JUMP_IF_LESS,
+    [OP_JUMP_IF_NOT_LESS]   = handle_OP_JUMP_IF_NOT_LESS,
+    [OP_JUMP_IF_GREATER]    = handle_OP_JUMP_IF_GREATER,
+    [OP_JUMP_IF_NOT_GREATER]= handle_OP_JUMP_IF_NOT_GREATER,
+    [OP_JUMP_IF_EQUAL]      = handle_OP_JUMP_IF_EQUAL,
+    [OP_JUMP_IF_NOT_EQUAL]  = handle_OP_JUMP_IF_NOT_EQUAL,
+    [OP_JUMP_TABLE]         = handle_OP_JUMP_TABLE,
+    [OP_NEGATE_NUM]         = handle_OP_NEGATE_NUM,
+    [OP_ADD_NUM]            = handle_OP_ADD_NUM,
+    [OP_SUBTRACT_NUM]       = handle_OP_SUBTRACT_NUM,
+    [OP_MULTIPLY_NUM]       = handle_OP_MULTIPLY_NUM,
+    [OP_DIVIDE_NUM]         = handle_OP_DIVIDE_NUM,
+    [OP_NEGATE_INT]         = handle_OP_NEGATE_INT,
+    [OP_ADD_INT]            = handle_OP_ADD_INT,
+    [OP_SUBTRACT_INT]       = handle_OP_SUBTRACT_INT,
+    [OP_MULTIPLY_INT]       = handle_OP_MULTIPLY_INT,
+    [OP_DIVIDE_INT]         = handle_OP_DIVIDE_INT,
+    [OP_CALL_NATIVE]        = handle_OP_CALL_NATIVE,
+};
+
+#undef INSTRUCTION
+#undef NEXT
+
+#endif
+
 /**
  * Executes the bytecode in the virtual machine (VM).
  *
@@ -64,73 +627,288 @@ InterpretResult interpret(const char *source) {
  * constants, and returning results. It also optionally outputs debug
  * information about the stack and instructions being executed.
  *
+ * The instruction pointer, stack top, constant table, the current frame's
+ * first stack slot and the VM are kept in locals (or, for tail-call
+ * dispatch, in handler arguments) while running,
+ * and are written back to the VM whenever code outside the loop needs them.
+ * Caching the VM saves a thread-local load per instruction. The instruction
+ * pointer is additionally published to machine->ip before every
+ * instruction, which is what the sampling profiler reads. How
+ * control passes from one instruction to the next depends on the build:
+ *
+ * - SWITCH: a single switch statement in a loop.
+ * - COMPUTED_GOTO: every instruction jumps straight to the next one through
+ *   a table of label addresses, giving each its own indirect branch.
+ * - TAIL_CALL: every instruction is a small function that tail-calls the
+ *   next instruction's handler, so the compiler allocates registers per
+ *   handler instead of for one huge function.
+ *
+ * Arithmetic instructions quicken themselves: the generic form checks its
+ * operand types, and once it has run with two doubles or two integers it
+ * rewrites its opcode in the chunk to the matching *_NUM or *_INT form. The
+ * quickened form only guards that its operands still have that type and
+ * otherwise deoptimizes back to the generic form, which then handles (or
+ * reports) the other types.
+ *
+ * Integer addition, subtraction, multiplication and negation are exact and
+ * overflow-checked; a result that does not fit into an int64_t is computed
+ * as a double instead. Division always produces a double.
+ *
+ * A call saves the caller's chunk, instruction pointer and slots in a
+ * CallFrame and switches those locals over to the callee, whose slots start
+ * with the function or closure itself, or for a method the receiver,
+ * followed by its arguments. A function's body is compiled by its first
+ * call; if that fails, running stops with INTERPRET_COMPILE_ERROR. Closures
+ * reach their upvalues through the closure the CallFrame records; functions
+ * the compiler proved not to escape read their captures straight from the
+ * caller's slots instead. Calling a class creates an instance and runs the
+ * class's initializer on it.
+ *
+ * Property accesses have an inline cache each, see InlineCache.
+ *
  * @return The result of the interpretation. It will be INTERPRET_OK if the
- *         interpretation completed successfully.
+ *         interpretation completed successfully, INTERPRET_COMPILE_ERROR if
+ *         a called function's body did not compile, or
+ *         INTERPRET_RUNTIME_ERROR if an instruction was applied to operands
+ *         of the wrong type.
  */
 static InterpretResult run() {
-#define READ_BYTE() (*vm.ip++)
-#define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()])
-#define BINARY_OP(op)               \
-    do {                            \
-        Value a = pop();            \
-        Value b = pop();            \
-        Value result = a op b;      \
-        push(result);               \
-                                    \
-    } while(false)
+#if defined(CLOXVM_DISPATCH_TAIL_CALL)
+    VM *machine = vm;
+    uint8_t *ip = machine->ip;
+    Value *sp = machine->stackTop;
+    TRACE();
+    return instructionHandlers[*ip](ip + 1, sp, machine->chunk->constants.values, machine->stack, machine);
+#else
+    VM *const machine = vm;
+    register uint8_t *ip = machine->ip;
+    register Value *sp = machine->stackTop;
+    const Value *constants = machine->chunk->constants.values;
+    Value *slots = machine->stack;
+
+#if defined(CLOXVM_DISPATCH_COMPUTED_GOTO)
+    static void *dispatchTable[UINT8_COUNT] = {
+        [0 ... UINT8_COUNT - 1] = &&label_unknownOpcode,
+        [OP_RETURN]             = &&label_OP_RETURN,
+        [OP_NEGATE]             = &&label_OP_NEGATE,
+        [OP_ADD]                = &&label_OP_ADD,
+        [OP_SUBTRACT]           = &&label_OP_SUBTRACT,
+        [OP_MULTIPLY]           = &&label_OP_MULTIPLY,
+        [OP_DIVIDE]             = &&label_OP_DIVIDE,
+        [OP_CONSTANT]           = &&label_OP_CONSTANT,
+        [OP_NIL]                = &&label_OP_NIL,
+        [OP_TRUE]               = &&label_OP_TRUE,
+        [OP_FALSE]              = &&label_OP_FALSE,
+        [OP_EQUAL]              = &&label_OP_EQUAL,
+        [OP_GREATER]            = &&label_OP_GREATER,
+        [OP_LESS]               = &&label_OP_LESS,
+        [OP_NOT]                = &&label_OP_NOT,
+        [OP_POP]                = &&label_OP_POP,
+        [OP_POPN]               = &&label_OP_POPN,
+        [OP_GET_LOCAL]          = &&label_OP_GET_LOCAL,
+        [OP_SET_LOCAL]          = &&label_OP_SET_LOCAL,
+        [OP_DEFINE_GLOBAL]      = &&label_OP_DEFINE_GLOBAL,
+        [OP_GET_GLOBAL]         = &&label_OP_GET_GLOBAL,
+        [OP_SET_GLOBAL]         = &&label_OP_SET_GLOBAL,
+        [OP_DEFINE_GLOBAL_LONG] = &&label_OP_DEFINE_GLOBAL_LONG,
+        [OP_GET_GLOBAL_LONG]    = &&label_OP_GET_GLOBAL_LONG,
+        [OP_SET_GLOBAL_LONG]    = &&label_OP_SET_GLOBAL_LONG,
+        [OP_GET_UPVALUE]        = &&label_OP_GET_UPVALUE,
+        [OP_SET_UPVALUE]        = &&label_OP_SET_UPVALUE,
+        [OP_GET_UPVALUE_STACK]  = &&label_OP_GET_UPVALUE_STACK,
+        [OP_SET_UPVALUE_STACK]  = &&label_OP_SET_UPVALUE_STACK,
+        [OP_CLOSURE]            = &&label_OP_CLOSURE,
+        [OP_CLOSE_UPVALUE]      = &&label_OP_CLOSE_UPVALUE,
+        [OP_CALL]               = &&label_OP_CALL,
+        [OP_CLASS]              = &&label_OP_CLASS,
+        [OP_METHOD]             = &&label_OP_METHOD,
+        [OP_GET_PROPERTY]       = &&label_OP_GET_PROPERTY,
+        [OP_SET_PROPERTY]       = &&label_OP_SET_PROPERTY,
+        [OP_INVOKE]             = &&label_OP_INVOKE,
+        [OP_ARRAY]              = &&label_OP_ARRAY,
+        [OP_GET_INDEX]          = &&label_OP_GET_INDEX,
+        [OP_SET_INDEX]          = &&label_OP_SET_INDEX,
+        [OP_JUMP]               = &&label_OP_JUMP,
+        [OP_JUMP_IF_FALSE]      = &&label_OP_JUMP_IF_FALSE,
+        [OP_LOOP]               = &&label_OP_LOOP,
+        [OP_JUMP_IF_LESS]       = &&label_OP_JUMP_IF_LESS,
+        [OP_JUMP_IF_NOT_LESS]   = &&label_OP_JUMP_IF_NOT_LESS,
+        [OP_JUMP_IF_GREATER]    = &&label_OP_JUMP_IF_GREATER,
+        [OP_JUMP_IF_NOT_GREATER]= &&label_OP_JUMP_IF_NOT_GREATER,
+        [OP_JUMP_IF_EQUAL]      = &&label_OP_JUMP_IF_EQUAL,
+        [OP_JUMP_IF_NOT_EQUAL]  = &&label_OP_JUMP_IF_NOT_EQUAL,
+        [OP_JUMP_TABLE]         = &&label_OP_JUMP_TABLE,
+        [OP_NEGATE_NUM]         = &&label_OP_NEGATE_NUM,
+        [OP_ADD_NUM]            = &&label_OP_ADD_NUM,
+        [OP_SUBTRACT_NUM]       = &&label_OP_SUBTRACT_NUM,
+        [OP_MULTIPLY_NUM]       = &&label_OP_MULTIPLY_NUM,
+        [OP_DIVIDE_NUM]         = &&label_OP_DIVIDE_NUM,
+        [OP_NEGATE_INT]         = &&label_OP_NEGATE_INT,
+        [OP_ADD_INT]            = &&label_OP_ADD_INT,
+        [OP_SUBTRACT_INT]       = &&label_OP_SUBTRACT_INT,
+        [OP_MULTIPLY_INT]       = &&label_OP_MULTIPLY_INT,
+        [OP_DIVIDE_INT]         = &&label_OP_DIVIDE_INT,
+        [OP_CALL_NATIVE]        = &&label_OP_CALL_NATIVE,
+    };
+
+#define INSTRUCTION(opcode) label_##opcode:
+#define NEXT()                                  \
+    do {                                        \
+        PUBLISH_IP();                           \
+        TRACE();                                \
+        goto *dispatchTable[READ_BYTE()];       \
+    } while (false)
+
+    NEXT();
+
+#include "instructions.def"
+
+    INSTRUCTION(unknownOpcode) {
+        RUNTIME_ERROR("Unknown opcode %d.", ip[-1]);
+    }
+#else
+#define INSTRUCTION(opcode) case opcode:
+#define NEXT() goto dispatch
+
+dispatch:
+    PUBLISH_IP();
+    TRACE();
+    switch (READ_BYTE()) {
+#include "instructions.def"
+
+        default:
+            RUNTIME_ERROR("Unknown opcode %d.", ip[-1]);
+    }
+#endif
+
+#undef INSTRUCTION
+#undef NEXT
+#endif
+}
+
+/**
+ * Executes a register-format chunk.
+ *
+ * Registers live in the VM stack array, starting at its base. Each
+ * instruction names its destination register and reads its sources as RK
+ * operands, either a register or a constant, so an arithmetic expression
+ * runs as one instruction per operator with no pushes or pops.
+ *
+ * The registers the chunk uses are cleared on entry and count as the used
+ * part of the stack, so the garbage collector sees the objects in them and
+ * no stale values from an earlier run.
+ *
+ * @return The result of the interpretation. It will be INTERPRET_OK if the
+ *         interpretation completed successfully, or INTERPRET_RUNTIME_ERROR
+ *         if an instruction was applied to operands of the wrong type.
+ */
+static InterpretResult runRegister() {
+    VM *const machine = vm;
+    register uint8_t *ip = machine->ip;
+    Value *registers = machine->stack;
+    const Value *constants = machine->chunk->constants.values;
+
+    for (int i = 0; i < machine->chunk->registerCount; i++) {
+        registers[i] = NIL_VAL;
+    }
+    Value *sp = registers + machine->chunk->registerCount;
+
+#define READ_RK() (rk = READ_BYTE(), (rk & RK_CONSTANT) ? constants[rk & ~RK_CONSTANT] : registers[rk])
+#define REGISTER_BINARY_OP(op, checkedOp)                               \
+    do {                                                                \
+        uint8_t destination = READ_BYTE();                              \
+        Value a = READ_RK();                                            \
+        Value b = READ_RK();                                            \
+        REGISTER_ARITHMETIC(destination, a, b, op, checkedOp);          \
+    } while (false)
+#define REGISTER_ARITHMETIC(destination, a, b, op, checkedOp)           \
+    do {                                                                \
+        int64_t result;                                                 \
+        if (IS_INT(a) && IS_INT(b)) {                                   \
+            if (checkedOp(AS_INT(a), AS_INT(b), &result)) {             \
+                registers[destination] =                                \
+                    NUMBER_VAL((double) AS_INT(a) op (double) AS_INT(b));\
+            } else {                                                    \
+                registers[destination] = INT_VAL(result);               \
+            }                                                           \
+        } else if (IS_NUMERIC(a) && IS_NUMERIC(b)) {                    \
+            registers[destination] = NUMBER_VAL(AS_DOUBLE(a) op AS_DOUBLE(b));\
+        } else {                                                        \
+            RUNTIME_ERROR("Operands must be numbers.");                 \
+        }                                                               \
+    } while (false)
 
     for (;;) {
-        uint8_t ins;
+        uint8_t rk;
+        PUBLISH_IP();
 
 #ifdef DEBUG_TRACE_EXECUTION
-        printf("stack: ");
-        for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        disassembleInstruction(vm.chunk, (int) (vm.ip - vm.chunk->code));
+        disassembleInstruction(machine->chunk, (int) (ip - machine->chunk->code));
 #endif
 
-        switch (ins = READ_BYTE()) {
-            case OP_CONSTANT: {
-                Value constant = READ_CONSTANT();
-                push(constant);
-                break;
-            }
-            case OP_NEGATE: {
-                push(-pop());
+        switch (READ_BYTE()) {
+            case OP_R_NEGATE: {
+                uint8_t destination = READ_BYTE();
+                Value operand = READ_RK();
+                if (IS_INT(operand)) {
+                    registers[destination] = negateInt(AS_INT(operand));
+                } else if (IS_NUMBER(operand)) {
+                    registers[destination] = NUMBER_VAL(-AS_NUMBER(operand));
+                } else {
+                    RUNTIME_ERROR("Operand must be a number.");
+                }
                 break;
             }
-            case OP_ADD: {
-                BINARY_OP(+);
+            case OP_R_ADD: {
+                uint8_t destination = READ_BYTE();
+                Value a = READ_RK();
+                Value b = READ_RK();
+                if (IS_STRING(a) && IS_STRING(b)) {
+                    if (AS_STRING(a)->length > INT_MAX - AS_STRING(b)->length) {
+                        RUNTIME_ERROR("String too long.");
+                    }
+                    SAVE_STATE();
+                    registers[destination] = OBJ_VAL(concatenateStrings(AS_STRING(a), AS_STRING(b)));
+                    COLLECT_NURSERY_IF_FULL();
+                    break;
+                }
+                if (IS_STRING(a) || IS_STRING(b)) {
+                    RUNTIME_ERROR("Operands must be two numbers or two strings.");
+                }
+                REGISTER_ARITHMETIC(destination, a, b, +, __builtin_add_overflow);
                 break;
             }
-            case OP_SUBTRACT: {
-                BINARY_OP(-);
+            case OP_R_SUBTRACT: {
+                REGISTER_BINARY_OP(-, __builtin_sub_overflow);
                 break;
             }
-            case OP_MULTIPLY: {
-                BINARY_OP(*);
+            case OP_R_MULTIPLY: {
+                REGISTER_BINARY_OP(*, __builtin_mul_overflow);
                 break;
             }
-            case OP_DIVIDE: {
-                BINARY_OP(/);
+            case OP_R_DIVIDE: {
+                uint8_t destination = READ_BYTE();
+                Value a = READ_RK();
+                Value b = READ_RK();
+                if (!IS_NUMERIC(a) || !IS_NUMERIC(b)) {
+                    RUNTIME_ERROR("Operands must be numbers.");
+                }
+                registers[destination] = NUMBER_VAL(AS_DOUBLE(a) / AS_DOUBLE(b));
                 break;
             }
-            case OP_RETURN: {
-                printValue(pop());
-                printf("\n");
+            case OP_R_RETURN: {
+                machine->result = READ_RK();
+                SAVE_STATE();
                 return INTERPRET_OK;
             }
-            default: break;
+            default:
+                RUNTIME_ERROR("Unknown opcode %d.", ip[-1]);
         }
     }
 
-#undef READ_BYTE
-#undef READ_CONSTANT
-#undef BINARY_OP
+#undef READ_RK
+#undef REGISTER_BINARY_OP
+#undef REGISTER_ARITHMETIC
 }
 
 /**
@@ -143,8 +921,8 @@ static InterpretResult run() {
  */
 void push(Value value) {
 
-    *vm.stackTop = value;
-    vm.stackTop++;
+    *vm->stackTop = value;
+    vm->stackTop++;
 }
 
 /**
@@ -155,18 +933,218 @@ void push(Value value) {
  * @return The value that was at the top of the stack before decrementing the stack pointer.
  */
 Value pop() {
-    vm.stackTop--;
-    return *vm.stackTop;
+    vm->stackTop--;
+    return *vm->stackTop;
 }
 
 /**
  * Resets the VM stack pointers.
  *
- * This function sets the `stackTop` pointer of the VM to the base of the stack.
+ * This function sets the `stackTop` pointer of the VM to the base of the stack
+ * and drops any suspended call frames. Upvalues still open are closed first,
+ * so closures that outlive an aborted run keep the values they captured.
  * It effectively clears the stack by resetting the top to the bottom of the stack array.
  * This function is typically called to initialize or reset the state of the virtual machine.
  */
 static void resetStack() {
-    vm.stackTop = vm.stack;
+    closeUpvalues(vm->stack);
+    vm->stackTop = vm->stack;
+    vm->frameCount = 0;
+}
+
+// What a global holds before its declaration runs. The name must be
+// reachable.
+static Value initialGlobal(ObjString *name) {
+    const Value value = snapshotGlobal(name);
+    return IS_UNDEFINED(value) ? nativeGlobal(name) : value;
+}
+
+// Grows the arrays kept per global slot alongside the globals themselves.
+static void growGlobalSlots() {
+    const int oldCapacity = vm->globalCapacity;
+    vm->globalCapacity = GROW_CAPACITY(oldCapacity);
+    vm->globalRefs = GROW_ARRAY(int, vm->globalRefs, oldCapacity, vm->globalCapacity);
+    vm->freeGlobals = GROW_ARRAY(int, vm->freeGlobals, oldCapacity, vm->globalCapacity);
+    vm->rememberedGlobals = GROW_ARRAY(int, vm->rememberedGlobals, oldCapacity, vm->globalCapacity);
+    vm->globalRemembered = GROW_ARRAY(bool, vm->globalRemembered, oldCapacity, vm->globalCapacity);
+}
+
+// Runs after the VM's objects are freed, since freeing a function's chunk
+// drops its references to global slots.
+static void freeGlobalSlots() {
+    FREE_ARRAY(int, vm->globalRefs, vm->globalCapacity);
+    FREE_ARRAY(int, vm->freeGlobals, vm->globalCapacity);
+    FREE_ARRAY(int, vm->rememberedGlobals, vm->globalCapacity);
+    FREE_ARRAY(bool, vm->globalRemembered, vm->globalCapacity);
+    vm->globalCapacity = 0;
+}
+
+/**
+ * Returns the upvalue for a stack slot, reusing an open one if a closure
+ * has captured the slot before, so that all closures share the variable.
+ * The open upvalues are kept sorted by slot, highest first.
+ */
+static ObjUpvalue *captureUpvalue(Value *slot) {
+    ObjUpvalue *previous = NULL;
+    ObjUpvalue *upvalue = vm->openUpvalues;
+    while (upvalue != NULL && upvalue->location > slot) {
+        previous = upvalue;
+        upvalue = upvalue->next;
+    }
+    if (upvalue != NULL && upvalue->location == slot) return upvalue;
+
+    ObjUpvalue *created = newUpvalue(slot);
+    created->next = upvalue;
+    if (previous == NULL) {
+        vm->openUpvalues = created;
+    } else {
+        previous->next = created;
+    }
+    return created;
+}
+
+/**
+ * Closes every open upvalue of a stack slot at or above last, moving the
+ * variables off the stack before their slots are reused.
+ */
+static void closeUpvalues(const Value *last) {
+    while (vm->openUpvalues != NULL && vm->openUpvalues->location >= last) {
+        ObjUpvalue *upvalue = vm->openUpvalues;
+        upvalue->closed = *upvalue->location;
+        upvalue->location = &upvalue->closed;
+        vm->openUpvalues = upvalue->next;
+        writeBarrier(&upvalue->obj, upvalue->closed);
+    }
+}
+
+/**
+ * Converts an array index or a switch value to an integer. Doubles with an integral value
+ * are accepted as well, since division always produces one.
+ *
+ * @return false if the value is not an integral number.
+ */
+static inline bool arrayIndex(const Value value, int64_t *index) {
+    if (IS_INT(value)) {
+        *index = AS_INT(value);
+        return true;
+    }
+    if (!IS_NUMBER(value)) return false;
+
+    const double number = AS_NUMBER(value);
+    if (!(number >= -9007199254740992.0 && number <= 9007199254740992.0)) return false;
+    *index = (int64_t) number;
+    return (double) *index == number;
+}
+
+/**
+ * Looks for an instance's shape in an inline cache. The first entry is
+ * checked before the rest, which is all a monomorphic call site needs. A
+ * megamorphic cache keeps the entries it had.
+ *
+ * @return The entry for the shape, or NULL on a miss.
+ */
+static inline const CacheEntry *probeCache(const InlineCache *cache, const Shape *shape) {
+    if (cache->entries[0].shape == shape) return &cache->entries[0];
+
+    const int count = cache->count < 0 ? INLINE_CACHE_WAYS : cache->count;
+    for (int i = 1; i < count; i++) {
+        if (cache->entries[i].shape == shape) return &cache->entries[i];
+    }
+    return NULL;
+}
+
+/**
+ * Looks a property up after a cache miss: a field of the instance, or else
+ * a method of its class. What it finds is cached for the instance's shape.
+ *
+ * @return The entry describing the property, or NULL if there is none.
+ */
+static const CacheEntry *missLoad(InlineCache *cache, const ObjInstance *instance, ObjString *name,
+                                  CacheEntry *found) {
+    found->shape = instance->shape;
+    found->field = findShapeField(instance->shape, name);
+    found->method = NIL_VAL;
+    found->next = NULL;
+    if (found->field < 0 && !tableGet(&instance->klass->methods, name, &found->method)) return NULL;
+    return updateCache(cache, found);
+}
+
+/**
+ * Finds the field a store goes to after a cache miss, adding it to the
+ * instance's shape if it does not have it yet. The instance must be
+ * reachable, as adding a field may allocate a shape.
+ *
+ * @return The entry describing the store.
+ */
+static const CacheEntry *missStore(InlineCache *cache, const ObjInstance *instance, ObjString *name,
+                                   CacheEntry *found) {
+    found->shape = instance->shape;
+    found->field = findShapeField(instance->shape, name);
+    found->method = NIL_VAL;
+    found->next = NULL;
+    if (found->field < 0) {
+        found->next = addShapeField(instance->shape, name);
+        found->field = found->next->fieldCount - 1;
+    }
+    return updateCache(cache, found);
 }
 
+/**
+ * Adds an entry to an inline cache that has room for it. A full cache
+ * turns megamorphic instead.
+ *
+ * @return The cached entry, or found itself if it was not cached.
+ */
+static const CacheEntry *updateCache(InlineCache *cache, const CacheEntry *found) {
+    if (cache->count >= 0 && cache->count < INLINE_CACHE_WAYS) {
+        cache->entries[cache->count] = *found;
+        return &cache->entries[cache->count++];
+    }
+    cache->count = -1;
+    return found;
+}
+
+/**
+ * Negates an integer, falling back to a double for the one value whose
+ * negation does not fit into an int64_t.
+ *
+ * @param value The integer to negate.
+ * @return The negated value.
+ */
+static Value negateInt(const int64_t value) {
+    if (value == INT64_MIN) return NUMBER_VAL(-(double) value);
+    return INT_VAL(-value);
+}
+
+/**
+ * Tells whether a value counts as false in a condition: nil and false do,
+ * everything else does not.
+ *
+ * @param value The value to test.
+ * @return true if the value is falsey.
+ */
+static bool isFalsey(const Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+/**
+ * Reports a runtime error along with the source line of the failing instruction.
+ *
+ * The message is passed to reportError() with the line of the instruction
+ * that was executing, and the stack is reset.
+ *
+ * @param format A printf-style format string for the message.
+ * @param ... Arguments for the format string.
+ */
+void runtimeError(const char *format, ...) {
+    char message[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+
+    const size_t instruction = vm->ip - vm->chunk->code - 1;
+    const int line = getLine(vm->chunk, (int) instruction);
+    reportError(INTERPRET_RUNTIME_ERROR, line, message);
+    resetStack();
+}
@@ -6,25 +6,129 @@
 #define CLOXVM_VM_H
 
 #include "../common.h"
+#include "../api/cloxvm.h"
 #include "../chunk/chunk.h"
+#include "../compiler/compiler.h"
 #include "../enums/interpretresult.h"
+#include "../memory/memory.h"
+#include "../native/native.h"
 #include "../value/value.h"
+#include "../output/output.h"
+#include "../snapshot/snapshot.h"
+#include "../table/table.h"
 
-#define STACK_MAX 256
+#define FRAMES_MAX 64
+#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+#define GLOBALS_MAX UINT16_COUNT
 
+#if defined(CLOXVM_DISPATCH_TAIL_CALL)
+#define DISPATCH_STRATEGY "tail-call"
+#elif defined(CLOXVM_DISPATCH_COMPUTED_GOTO)
+#define DISPATCH_STRATEGY "computed-goto"
+#else
+#define DISPATCH_STRATEGY "switch"
+#endif
+
+// The VM the calling thread is working with. Signal handlers read it too,
+// so it uses a TLS model that does not need a function call to resolve.
+#if defined(__GNUC__)
+#define VM_THREAD_LOCAL _Thread_local __attribute__((tls_model("initial-exec")))
+#else
+#define VM_THREAD_LOCAL _Thread_local
+#endif
+
+/**
+ * A suspended caller: the chunk it was running, where it continues once the
+ * call returns and the stack slot its locals start at. callee is the
+ * closure the caller called, whose upvalues the running code uses, or NULL
+ * if it called a plain function.
+ */
 typedef struct {
+    Chunk *chunk;
+    uint8_t *ip;
+    Value *slots;
+    ObjClosure *callee;
+} CallFrame;
+
+typedef struct CloxVM {
     Chunk *chunk;
     uint8_t *ip;
     Value stack[STACK_MAX];
     Value *stackTop;
+    CallFrame frames[FRAMES_MAX];
+    int frameCount;
+    ObjUpvalue *openUpvalues;
+    Value result;
+    Table strings;
+    Table globalSlots;
+    ValueArray globals;
+    int *globalRefs;
+    int *freeGlobals;
+    int freeGlobalCount;
+    int globalCapacity;
+    Chunk *chunks;
+    Obj *objects;
+    size_t bytesAllocated;
+    size_t nextGC;
+    double heapGrowthFactor;
+    GCPhase gcPhase;
+    bool markBit;
+    bool collecting;
+    Obj **sweep;
+    int grayCount;
+    int grayCapacity;
+    Obj **grayStack;
+    Nursery nursery;
+    bool nurseryFull;
+    int *rememberedGlobals;
+    int rememberedCount;
+    bool *globalRemembered;
+    Obj **rememberedObjects;
+    int rememberedObjectCount;
+    int rememberedObjectCapacity;
+    Shape *deadShapes;
+    NativeEntry *natives;
+    int nativeCount;
+    int nativeCapacity;
+    Snapshot snapshot;
+    OutputSink output;
+    ChunkFormat chunkFormat;
+    FrontEnd frontEnd;
+    bool optimize;
+    CloxReallocateFn reallocate;
+    void *allocatorData;
+    CloxErrorFn onError;
+    void *errorData;
 } VM;
 
-void initVM();
+extern VM_THREAD_LOCAL VM *vm;
+
+static inline bool isYoungObject(const VM *machine, const Obj *object) {
+    return (uintptr_t) object - (uintptr_t) machine->nursery.start < NURSERY_SIZE;
+}
+
+static inline bool isYoungValue(const VM *machine, const Value value) {
+    return IS_OBJ(value) && isYoungObject(machine, AS_OBJ(value));
+}
 
-void freeVM();
+void initVM(VM *machine, const CloxVMConfig *config);
+
+void freeVM(VM *machine);
+
+VM *useVM(VM *machine);
+
+void reportError(InterpretResult kind, int line, const char *message);
+
+void runtimeError(const char *format, ...);
+
+int resolveGlobal(ObjString *name);
+
+void resetGlobals();
 
 InterpretResult interpret(const char *source);
 
+InterpretResult interpretChunk(Chunk *chunk);
+
 static InterpretResult run();
 
 void push(Value value);